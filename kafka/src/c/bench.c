@@ -0,0 +1,517 @@
+/*
+** Throughput/latency benchmark of the C producer and consumer paths
+**
+** Runs against librdkafka's in-process mock cluster, no broker needed.
+** Every scenario of the grid (payload size x partitions x compression codec
+** x linger) is run as:
+**   - produce: C producer (producer.c), "single" (publish_message_timed) and
+**     "batch" (publish_batch) API, latency = delivery report latency
+**   - consume: consume pre-produced messages with rd_kafka_consumer_poll()
+**   - e2e: produce and consume concurrently, latency = consume time - send
+**     time stamped into the payload
+** followed by the payload inspection kernels (printable, classify, hex dump)
+** of the debugging consumers on a BENCH_INSPECT_MB (default 8, 0 skips) MB
+** payload, once per SIMD level the CPU supports.
+**
+** One JSON object per scenario is written to stdout, progress to stderr.
+** CPU time is the whole process, including the mock brokers.
+**
+** Grid and size can be changed with the environment variables
+** BENCH_MSGS, BENCH_PAYLOADS, BENCH_PARTITIONS, BENCH_CODECS, BENCH_LINGER_MS
+** (comma separated lists) and BENCH_FETCH_WAIT_MS (consumer fetch.wait.max.ms,
+** the mock brokers answer a fetch without data only after this wait).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka_mock.h"
+#endif
+
+#include "producer.c"
+#include "../common/payload_inspect.c"
+
+#define BENCH_MAX_LIST 16
+#define BENCH_BATCH_CNT 1000
+#define BENCH_TIMEOUT_US (120LL * 1000 * 1000)
+
+typedef struct bench_params_s {
+    const char *bootstraps;
+    const char *topic;
+    const char *codec;
+    size_t payload_size;
+    int partitions;
+    int linger_ms;
+    long msgs;
+    const char *fetch_wait_ms;
+} bench_params_t;
+
+typedef struct bench_samples_s {
+    int64_t *v;
+    long cnt;
+    long cap;
+} bench_samples_t;
+
+typedef struct bench_result_s {
+    long msgs;
+    int64_t bytes;
+    int64_t elapsed_us;
+    int64_t cpu_us;
+    bench_samples_t *latency; // NULL: no latency for this scenario
+} bench_result_t;
+
+static rd_kafka_mock_cluster_t *mcluster;
+static int topic_seq = 0;
+
+static void samples_add(bench_samples_t *s, int64_t v) {
+    if (s->cnt < s->cap) {
+        s->v[s->cnt++] = v;
+    }
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// samples must be sorted
+static int64_t samples_percentile(const bench_samples_t *s, double p) {
+    if (s->cnt == 0) {
+        return 0;
+    }
+    return s->v[(long)((s->cnt - 1) * p)];
+}
+
+static int64_t cpu_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int parse_list(const char *env, const char *def, const char **out, char *buf, size_t size) {
+    const char *val = getenv(env);
+    int cnt = 0;
+
+    snprintf(buf, size, "%s", val && *val ? val : def);
+    for (char *tok = strtok(buf, ","); tok && cnt < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        out[cnt++] = tok;
+    }
+    return cnt;
+}
+
+static char *make_payload(size_t size) {
+    char *buf = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = 'a' + rand() % 26;
+    }
+    return buf;
+}
+
+static const char *new_topic(const bench_params_t *p, char *buf, size_t size) {
+    snprintf(buf, size, "bench-%d", ++topic_seq);
+    if (rd_kafka_mock_topic_create(mcluster, buf, p->partitions, 1)) {
+        fprintf(stderr, "%% Failed to create mock topic %s\n", buf);
+        exit(1);
+    }
+    return buf;
+}
+
+static void conf_set(rd_kafka_conf_t *conf, const char *name, const char *value) {
+    char errstr[512];
+    if (rd_kafka_conf_set(conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%% %s\n", errstr);
+        exit(1);
+    }
+}
+
+static rd_kafka_t *bench_producer_new(const bench_params_t *p) {
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char linger[16];
+
+    snprintf(linger, sizeof(linger), "%d", p->linger_ms);
+    conf_set(conf, "bootstrap.servers", p->bootstraps);
+    conf_set(conf, "compression.codec", p->codec);
+    conf_set(conf, "linger.ms", linger);
+    conf_set(conf, "queue.buffering.max.messages", "1000000");
+    conf_set(conf, "queue.buffering.max.kbytes", "1048576");
+
+    rd_kafka_t *rk = new_kafka_producer(conf);
+    if (!rk) {
+        exit(1);
+    }
+    return rk;
+}
+
+static rd_kafka_t *bench_consumer_new(const bench_params_t *p) {
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char errstr[512];
+
+    conf_set(conf, "bootstrap.servers", p->bootstraps);
+    conf_set(conf, "group.id", "bench");
+    conf_set(conf, "enable.auto.commit", "false");
+    conf_set(conf, "enable.partition.eof", "true");
+    // resume from the log start if the mock broker dropped the fetch offset
+    conf_set(conf, "auto.offset.reset", "earliest");
+    conf_set(conf, "fetch.wait.max.ms", p->fetch_wait_ms);
+    if (getenv("BENCH_DEBUG")) {
+        conf_set(conf, "debug", getenv("BENCH_DEBUG"));
+    }
+
+    rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+    if (!rk) {
+        fprintf(stderr, "%% Failed to create consumer: %s\n", errstr);
+        exit(1);
+    }
+    rd_kafka_poll_set_consumer(rk);
+
+    // manual assignment of all partitions, no group rebalance to wait for
+    rd_kafka_topic_partition_list_t *parts = rd_kafka_topic_partition_list_new(p->partitions);
+    for (int i = 0; i < p->partitions; i++) {
+        rd_kafka_topic_partition_list_add(parts, p->topic, i)->offset = RD_KAFKA_OFFSET_BEGINNING;
+    }
+    rd_kafka_assign(rk, parts);
+    rd_kafka_topic_partition_list_destroy(parts);
+    return rk;
+}
+
+static void dr_latency_cb(const rd_kafka_message_t *rkmessage, void *dr_opaque) {
+    if (!rkmessage->err) {
+        samples_add(dr_opaque, rd_kafka_message_latency(rkmessage));
+    }
+}
+
+/*
+** Produce p->msgs messages, stamping the send time into the first 8 bytes
+** res: bytes enqueued
+ */
+static int64_t produce_all(rd_kafka_t *rk, const bench_params_t *p, int batch_api) {
+    char *payload = make_payload(p->payload_size);
+    publish_msg_t msgs[BENCH_BATCH_CNT];
+    int64_t bytes = 0;
+
+    for (long sent = 0; sent < p->msgs;) {
+        int64_t ts = now_us();
+        memcpy(payload, &ts, sizeof(ts));
+
+        if (!batch_api) {
+            if (publish_message_timed(rk, payload, p->payload_size, p->topic, 1000) == 0) {
+                sent++;
+                bytes += p->payload_size;
+            }
+            continue;
+        }
+
+        int cnt = p->msgs - sent < BENCH_BATCH_CNT ? (int)(p->msgs - sent) : BENCH_BATCH_CNT;
+        for (int i = 0; i < cnt; i++) {
+            msgs[i].payload = payload;
+            msgs[i].len = p->payload_size;
+        }
+        int enqueued = publish_batch(rk, p->topic, msgs, cnt, NULL, NULL);
+        // retry the ones that did not fit one by one
+        for (int i = 0; i < cnt; i++) {
+            if (msgs[i].err) {
+                publish_message_timed(rk, payload, p->payload_size, p->topic, 1000);
+            }
+        }
+        sent += cnt;
+        bytes += (int64_t)enqueued * p->payload_size;
+    }
+
+    rd_kafka_flush(rk, 60 * 1000);
+    free(payload);
+    return bytes;
+}
+
+/*
+** Consume until p->msgs messages are read or all partitions are at EOF
+** (and producing is done). The mock brokers only retain the last few MB
+** of each partition, so fewer than p->msgs may be left to read.
+** first_us is set to the time the first message was read, ready (optional)
+** is set once all partitions reached EOF.
+** e2e != NULL: record now - send time of every message
+ */
+static long consume_all(rd_kafka_t *rk, const bench_params_t *p, bench_samples_t *e2e, int64_t *bytes,
+                        int64_t *first_us, atomic_int *producing, atomic_int *ready) {
+    long cnt = 0;
+    int64_t deadline = now_us() + BENCH_TIMEOUT_US;
+    char *eof = calloc(p->partitions, 1);
+    int eof_cnt = 0;
+
+    *bytes = 0;
+    while (cnt < p->msgs && now_us() < deadline) {
+        rd_kafka_message_t *rkm = rd_kafka_consumer_poll(rk, 100);
+        if (!rkm) {
+            continue;
+        }
+        if (rkm->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+            if (!eof[rkm->partition]) {
+                eof[rkm->partition] = 1;
+                eof_cnt++;
+            }
+            rd_kafka_message_destroy(rkm);
+            if (eof_cnt == p->partitions) {
+                if (ready) {
+                    atomic_store(ready, 1); // caught up: fetching from all partitions
+                }
+                if (!producing || !atomic_load(producing)) {
+                    break;
+                }
+            }
+            continue;
+        }
+        if (!rkm->err) {
+            if (eof[rkm->partition]) {
+                eof[rkm->partition] = 0;
+                eof_cnt--;
+            }
+            if (cnt++ == 0) {
+                *first_us = now_us();
+            }
+            *bytes += rkm->len;
+            if (e2e && rkm->len >= sizeof(int64_t)) {
+                int64_t ts;
+                memcpy(&ts, rkm->payload, sizeof(ts));
+                samples_add(e2e, now_us() - ts);
+            }
+        }
+        rd_kafka_message_destroy(rkm);
+    }
+    free(eof);
+    return cnt;
+}
+
+static void bench_produce(const bench_params_t *p, int batch_api, bench_result_t *res) {
+    rd_kafka_t *rk = bench_producer_new(p);
+    producer_set_dr_cb(rk, dr_latency_cb, res->latency);
+
+    int64_t cpu_start = cpu_us(), start = now_us();
+    res->bytes = produce_all(rk, p, batch_api);
+    res->elapsed_us = now_us() - start;
+    res->cpu_us = cpu_us() - cpu_start;
+    res->msgs = p->msgs - rd_kafka_outq_len(rk);
+
+    destroy_kafka_producer(rk);
+}
+
+static void bench_consume(const bench_params_t *p, bench_result_t *res) {
+    rd_kafka_t *prk = bench_producer_new(p);
+    produce_all(prk, p, 1);
+    destroy_kafka_producer(prk);
+
+    // measured from the first message, excluding connection setup
+    rd_kafka_t *rk = bench_consumer_new(p);
+    int64_t cpu_start = cpu_us(), first = now_us();
+    res->msgs = consume_all(rk, p, NULL, &res->bytes, &first, NULL, NULL);
+    res->elapsed_us = now_us() - first;
+    res->cpu_us = cpu_us() - cpu_start;
+
+    rd_kafka_consumer_close(rk);
+    rd_kafka_destroy(rk);
+}
+
+typedef struct e2e_consumer_s {
+    rd_kafka_t *rk;
+    const bench_params_t *p;
+    bench_result_t *res;
+    atomic_int producing;
+    atomic_int ready;
+} e2e_consumer_t;
+
+static void *e2e_consumer_main(void *arg) {
+    e2e_consumer_t *c = arg;
+    int64_t first;
+    c->res->msgs = consume_all(c->rk, c->p, c->res->latency, &c->res->bytes, &first, &c->producing,
+                               &c->ready);
+    return NULL;
+}
+
+static void bench_e2e(const bench_params_t *p, bench_result_t *res) {
+    rd_kafka_t *rk = bench_consumer_new(p);
+    rd_kafka_t *prk = bench_producer_new(p);
+    e2e_consumer_t c;
+    pthread_t thr;
+
+    c.rk = rk;
+    c.p = p;
+    c.res = res;
+    atomic_init(&c.producing, 1);
+    atomic_init(&c.ready, 0);
+
+    // start producing once the consumer is fetching, so connection setup
+    // does not show up as latency
+    pthread_create(&thr, NULL, e2e_consumer_main, &c);
+    for (int i = 0; i < 10000 && !atomic_load(&c.ready); i++) {
+        usleep(1000);
+    }
+
+    int64_t cpu_start = cpu_us(), start = now_us();
+    produce_all(prk, p, 1);
+    atomic_store(&c.producing, 0);
+    pthread_join(thr, NULL);
+    res->elapsed_us = now_us() - start;
+    res->cpu_us = cpu_us() - cpu_start;
+
+    destroy_kafka_producer(prk);
+    rd_kafka_consumer_close(rk);
+    rd_kafka_destroy(rk);
+}
+
+static void print_result(const char *scenario, const char *api, const bench_params_t *p,
+                         bench_result_t *res) {
+    double secs = res->elapsed_us > 0 ? res->elapsed_us / 1e6 : 1e-6;
+
+    printf("{\"path\":\"c\",\"scenario\":\"%s\",\"api\":\"%s\",\"payload_size\":%zu,"
+           "\"partitions\":%d,\"codec\":\"%s\",\"linger_ms\":%d,\"msgs\":%ld,"
+           "\"msg_per_s\":%.0f,\"mb_per_s\":%.2f,\"cpu_s\":%.3f,\"cpu_us_per_msg\":%.3f",
+           scenario, api, p->payload_size, p->partitions, p->codec, p->linger_ms,
+           res->msgs, res->msgs / secs, res->bytes / secs / (1024 * 1024),
+           res->cpu_us / 1e6, res->msgs > 0 ? (double)res->cpu_us / res->msgs : 0.0);
+
+    if (res->latency && res->latency->cnt > 0) {
+        qsort(res->latency->v, res->latency->cnt, sizeof(int64_t), cmp_int64);
+        printf(",\"p50_us\":%" PRId64 ",\"p99_us\":%" PRId64 ",\"p999_us\":%" PRId64,
+               samples_percentile(res->latency, 0.50),
+               samples_percentile(res->latency, 0.99),
+               samples_percentile(res->latency, 0.999));
+    } else {
+        printf(",\"p50_us\":null,\"p99_us\":null,\"p999_us\":null");
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    fprintf(stderr, "%% %-8s %-6s payload=%-6zu partitions=%-3d codec=%-7s linger=%-3d: %.0f msg/s\n",
+            scenario, api, p->payload_size, p->partitions, p->codec, p->linger_ms,
+            res->msgs / secs);
+}
+
+static void bench_inspect(size_t size) {
+    char *payload = make_payload(size);
+    size_t dump_size = (size + 15) / 16 * PAYLOAD_HEXDUMP_LINE;
+    char *dump = malloc(dump_size);
+    const char *ops[] = {"printable", "classify", "hexdump"};
+    int best = payload_set_simd_level(PAYLOAD_SIMD_AVX2);
+
+    for (int level = PAYLOAD_SIMD_SCALAR; level <= best; level++) {
+        payload_set_simd_level(level);
+        for (int op = 0; op < 3; op++) {
+            int64_t cpu_start = cpu_us(), start = now_us();
+            long rounds = 0;
+            volatile size_t sink = 0; // keeps the calls from being optimized out
+            while (rounds < 5 || now_us() - start < 500000) {
+                if (op == 0) {
+                    sink += payload_is_printable(payload, size);
+                } else if (op == 1) {
+                    sink += payload_classify(payload, size);
+                } else {
+                    sink += payload_hexdump(payload, size, dump, dump_size);
+                }
+                rounds++;
+            }
+            double secs = (now_us() - start) / 1e6;
+            printf("{\"path\":\"c\",\"scenario\":\"inspect\",\"api\":\"%s\",\"simd\":\"%s\","
+                   "\"payload_size\":%zu,\"rounds\":%ld,\"mb_per_s\":%.2f,\"cpu_s\":%.3f}\n",
+                   ops[op], payload_simd_name(), size, rounds,
+                   rounds * (double)size / secs / (1024 * 1024), (cpu_us() - cpu_start) / 1e6);
+            fflush(stdout);
+            fprintf(stderr, "%% inspect  %-9s %-6s payload=%zu: %.0f MB/s\n", ops[op],
+                    payload_simd_name(), size, rounds * (double)size / secs / (1024 * 1024));
+        }
+    }
+    payload_set_simd_level(best);
+    free(dump);
+    free(payload);
+}
+
+int main(int argc, char **argv) {
+    const char *payloads[BENCH_MAX_LIST], *partitions[BENCH_MAX_LIST];
+    const char *codecs[BENCH_MAX_LIST], *lingers[BENCH_MAX_LIST];
+    char payloads_buf[256], partitions_buf[256], codecs_buf[256], lingers_buf[256];
+    char errstr[512], topic[64];
+    const char *msgs_env = getenv("BENCH_MSGS");
+    long msgs = msgs_env ? atol(msgs_env) : 50000;
+    const char *fetch_wait_ms = getenv("BENCH_FETCH_WAIT_MS");
+
+    int payload_cnt = parse_list("BENCH_PAYLOADS", "100,1024,4096", payloads, payloads_buf, sizeof(payloads_buf));
+    int partition_cnt = parse_list("BENCH_PARTITIONS", "1,8", partitions, partitions_buf, sizeof(partitions_buf));
+    int codec_cnt = parse_list("BENCH_CODECS", "none,lz4,snappy", codecs, codecs_buf, sizeof(codecs_buf));
+    int linger_cnt = parse_list("BENCH_LINGER_MS", "0,5", lingers, lingers_buf, sizeof(lingers_buf));
+
+    // the mock cluster lives in its own (otherwise unused) client instance
+    rd_kafka_t *mrk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+    if (!mrk) {
+        fprintf(stderr, "%% Failed to create mock cluster client: %s\n", errstr);
+        return 1;
+    }
+    mcluster = rd_kafka_mock_cluster_new(mrk, 3);
+    if (!mcluster) {
+        fprintf(stderr, "%% Failed to create mock cluster\n");
+        return 1;
+    }
+    fprintf(stderr, "%% librdkafka %s, mock cluster %s, %ld msgs per scenario\n",
+            rd_kafka_version_str(), rd_kafka_mock_cluster_bootstraps(mcluster), msgs);
+
+    bench_samples_t latency;
+    latency.cap = msgs;
+    latency.v = malloc(sizeof(int64_t) * msgs);
+
+    for (int a = 0; a < payload_cnt; a++)
+    for (int b = 0; b < partition_cnt; b++)
+    for (int c = 0; c < codec_cnt; c++)
+    for (int d = 0; d < linger_cnt; d++) {
+        bench_params_t p;
+        bench_result_t res;
+
+        p.bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+        p.payload_size = (size_t)atol(payloads[a]);
+        if (p.payload_size < sizeof(int64_t)) {
+            p.payload_size = sizeof(int64_t); // room for the send timestamp
+        }
+        p.partitions = atoi(partitions[b]);
+        p.codec = codecs[c];
+        p.linger_ms = atoi(lingers[d]);
+        p.msgs = msgs;
+        p.fetch_wait_ms = fetch_wait_ms ? fetch_wait_ms : "10";
+
+        for (int batch_api = 0; batch_api <= 1; batch_api++) {
+            memset(&res, 0, sizeof(res));
+            latency.cnt = 0;
+            res.latency = &latency;
+            p.topic = new_topic(&p, topic, sizeof(topic));
+            bench_produce(&p, batch_api, &res);
+            print_result("produce", batch_api ? "batch" : "single", &p, &res);
+        }
+
+        memset(&res, 0, sizeof(res));
+        p.topic = new_topic(&p, topic, sizeof(topic));
+        bench_consume(&p, &res);
+        print_result("consume", "poll", &p, &res);
+
+        memset(&res, 0, sizeof(res));
+        latency.cnt = 0;
+        res.latency = &latency;
+        p.topic = new_topic(&p, topic, sizeof(topic));
+        bench_e2e(&p, &res);
+        print_result("e2e", "batch", &p, &res);
+    }
+
+    const char *inspect_mb = getenv("BENCH_INSPECT_MB");
+    long mb = inspect_mb ? atol(inspect_mb) : 8;
+    if (mb > 0) {
+        bench_inspect((size_t)mb * 1024 * 1024);
+    }
+
+    free(latency.v);
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mrk);
+    return 0;
+}
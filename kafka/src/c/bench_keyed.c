@@ -0,0 +1,340 @@
+/*
+** Keyed producing: the client-side murmur2 partitioner of the keyed API
+** against librdkafka's partitioners
+**
+** Runs against librdkafka's in-process mock cluster, no broker needed.
+** For every partition count BENCH_MSGS messages with keys drawn at random
+** from BENCH_KEYED_KEYS distinct keys are produced with each API:
+**   - keyed_batch: publish_keyed_batch(), partitions computed in the
+**     producer, one rd_kafka_produce_batch() call per partition
+**   - keyed: publish_keyed_timed(), one message per call
+**   - default_batch: rd_kafka_produce_batch() with keys to
+**     RD_KAFKA_PARTITION_UA, librdkafka's default partitioner
+**     (consistent_random, CRC32 of the key)
+**   - default: rd_kafka_producev() per message, the same partitioner
+**   - murmur2_random: rd_kafka_producev() per message, librdkafka's Java
+**     compatible partitioner
+** and the producer is flushed. Delivery reports are checked against the
+** partition the Java client picks for the key (java_partition_pct).
+**
+** One JSON object per scenario is written to stdout, progress to stderr.
+** CPU time is the whole process, including the mock brokers.
+**
+** BENCH_MSGS (default 500000), BENCH_PAYLOAD (bytes, default 100),
+** BENCH_PARTITIONS, BENCH_KEYED_KEYS (comma separated lists, default 16,128
+** and 1000000) and BENCH_KEYED_IMPLS (default all of the above).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka_mock.h"
+#endif
+
+#include "producer.c"
+
+#define BENCH_MAX_LIST 16
+#define BENCH_BATCH_CNT 1000
+#define BENCH_KEY_SIZE 24
+
+typedef struct bench_keyed_s {
+    const char *impl;
+    const char *topic;
+    int partitions;
+    long msgs;
+    long key_cnt;           // distinct keys
+    char *keys;             // msgs keys of BENCH_KEY_SIZE bytes
+    unsigned char *key_lens;
+    char *payload;
+    size_t payload_size;
+    // delivery reports
+    int64_t *latency;
+    atomic_long delivered;
+    atomic_long java_partition; // on the partition the Java client picks
+    atomic_long failed;
+} bench_keyed_t;
+
+static rd_kafka_mock_cluster_t *mcluster;
+static int topic_seq = 0;
+
+static int64_t cpu_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int parse_list(const char *env, const char *def, const char **out, char *buf, size_t size) {
+    const char *val = getenv(env);
+    int cnt = 0;
+
+    snprintf(buf, size, "%s", val && *val ? val : def);
+    for (char *tok = strtok(buf, ","); tok && cnt < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        out[cnt++] = tok;
+    }
+    return cnt;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void conf_set(rd_kafka_conf_t *conf, const char *name, const char *value) {
+    char errstr[512];
+    if (rd_kafka_conf_set(conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%% %s\n", errstr);
+        exit(1);
+    }
+}
+
+static void dr_keyed_cb(const rd_kafka_message_t *rkmessage, void *dr_opaque) {
+    bench_keyed_t *b = dr_opaque;
+
+    if (rkmessage->err) {
+        atomic_fetch_add(&b->failed, 1);
+        return;
+    }
+    long i = atomic_fetch_add(&b->delivered, 1);
+    if (i < b->msgs) {
+        b->latency[i] = rd_kafka_message_latency(rkmessage);
+    }
+    if (rkmessage->partition ==
+        producer_key_partition(rkmessage->key, rkmessage->key_len, b->partitions)) {
+        atomic_fetch_add(&b->java_partition, 1);
+    }
+}
+
+/*
+** librdkafka's partitioner: one message, retried until it fits the queue
+** (the delivery report thread frees up room)
+ */
+static void produce_default(rd_kafka_t *rk, bench_keyed_t *b, long i) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    rd_kafka_resp_err_t err;
+
+    inflight_reserve(st, 1, (long)b->payload_size);
+    while ((err = rd_kafka_producev(
+                rk,
+                RD_KAFKA_V_TOPIC(b->topic),
+                RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+                RD_KAFKA_V_KEY(b->keys + i * BENCH_KEY_SIZE, b->key_lens[i]),
+                RD_KAFKA_V_VALUE(b->payload, b->payload_size),
+                RD_KAFKA_V_OPAQUE(NULL),
+                RD_KAFKA_V_END)) == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+        usleep(100);
+    }
+    if (err) {
+        inflight_release(st, 1, (long)b->payload_size);
+        atomic_fetch_add(&b->failed, 1);
+    }
+}
+
+static void produce_all(rd_kafka_t *rk, bench_keyed_t *b) {
+    publish_keyed_msg_t msgs[BENCH_BATCH_CNT];
+    rd_kafka_message_t rkmessages[BENCH_BATCH_CNT];
+    rd_kafka_topic_t *rkt = rd_kafka_topic_new(rk, b->topic, NULL);
+    producer_state_t *st = rd_kafka_opaque(rk);
+    int keyed_batch = !strcmp(b->impl, "keyed_batch");
+    int default_batch = !strcmp(b->impl, "default_batch");
+    int keyed = !strcmp(b->impl, "keyed");
+
+    for (long sent = 0; sent < b->msgs;) {
+        int cnt = b->msgs - sent < BENCH_BATCH_CNT ? (int)(b->msgs - sent) : BENCH_BATCH_CNT;
+
+        if (keyed_batch) {
+            for (int i = 0; i < cnt; i++) {
+                memset(&msgs[i], 0, sizeof(msgs[i]));
+                msgs[i].key = b->keys + (sent + i) * BENCH_KEY_SIZE;
+                msgs[i].key_len = b->key_lens[sent + i];
+                msgs[i].payload = b->payload;
+                msgs[i].len = b->payload_size;
+            }
+            publish_keyed_batch(rk, b->topic, msgs, cnt);
+            // retry the ones that did not fit one by one
+            for (int i = 0; i < cnt; i++) {
+                if (msgs[i].err && publish_keyed_timed(rk, b->topic, msgs[i].key, msgs[i].key_len,
+                                                       b->payload, b->payload_size, NULL, 0,
+                                                       10 * 1000)) {
+                    atomic_fetch_add(&b->failed, 1);
+                }
+            }
+        } else if (default_batch) {
+            memset(rkmessages, 0, sizeof(rkmessages[0]) * cnt);
+            for (int i = 0; i < cnt; i++) {
+                rkmessages[i].key = b->keys + (sent + i) * BENCH_KEY_SIZE;
+                rkmessages[i].key_len = b->key_lens[sent + i];
+                rkmessages[i].payload = b->payload;
+                rkmessages[i].len = b->payload_size;
+            }
+            atomic_fetch_add(&st->inflight_msgs, cnt);
+            atomic_fetch_add(&st->inflight_bytes, (long)(cnt * b->payload_size));
+            rd_kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY, rkmessages, cnt);
+            for (int i = 0; i < cnt; i++) {
+                if (rkmessages[i].err) {
+                    inflight_release(st, 1, (long)b->payload_size);
+                    produce_default(rk, b, sent + i);
+                }
+            }
+        } else {
+            for (int i = 0; i < cnt; i++) {
+                if (!keyed) {
+                    produce_default(rk, b, sent + i);
+                } else if (publish_keyed_timed(rk, b->topic, b->keys + (sent + i) * BENCH_KEY_SIZE,
+                                               b->key_lens[sent + i], b->payload, b->payload_size,
+                                               NULL, 0, 10 * 1000)) {
+                    atomic_fetch_add(&b->failed, 1);
+                }
+            }
+        }
+        sent += cnt;
+    }
+    rd_kafka_topic_destroy(rkt);
+}
+
+static void bench_keyed(bench_keyed_t *b, const char *bootstraps) {
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char topic[64];
+
+    snprintf(topic, sizeof(topic), "bench-keyed-%d", ++topic_seq);
+    if (rd_kafka_mock_topic_create(mcluster, topic, b->partitions, 1)) {
+        fprintf(stderr, "%% Failed to create mock topic %s\n", topic);
+        exit(1);
+    }
+    b->topic = topic;
+    atomic_store(&b->delivered, 0);
+    atomic_store(&b->java_partition, 0);
+    atomic_store(&b->failed, 0);
+
+    conf_set(conf, "bootstrap.servers", bootstraps);
+    conf_set(conf, "queue.buffering.max.messages", "1000000");
+    conf_set(conf, "queue.buffering.max.kbytes", "1048576");
+    if (!strcmp(b->impl, "murmur2_random")) {
+        conf_set(conf, "partitioner", "murmur2_random");
+    }
+    rd_kafka_t *rk = new_kafka_producer(conf);
+    if (!rk) {
+        exit(1);
+    }
+    producer_set_dr_cb(rk, dr_keyed_cb, b);
+    // partition counts are known to all APIs before the clock starts
+    rd_kafka_topic_t *rkt = rd_kafka_topic_new(rk, topic, NULL);
+    const struct rd_kafka_metadata *md;
+    if (!rd_kafka_metadata(rk, 0, rkt, &md, 5000)) {
+        rd_kafka_metadata_destroy(md);
+    }
+    rd_kafka_topic_destroy(rkt);
+    if (!strncmp(b->impl, "keyed", 5)) {
+        topic_partition_cnt(rk, rd_kafka_opaque(rk), topic_cache_get(rk, rd_kafka_opaque(rk), topic));
+    }
+
+    int64_t cpu_start = cpu_us(), start = now_us();
+    produce_all(rk, b);
+    int64_t enqueue_us = now_us() - start;
+    producer_flush(rk, 60 * 1000);
+    int64_t elapsed_us = now_us() - start;
+    int64_t cpu = cpu_us() - cpu_start;
+    destroy_kafka_producer(rk);
+
+    long delivered = atomic_load(&b->delivered);
+    long samples = delivered < b->msgs ? delivered : b->msgs;
+    qsort(b->latency, samples, sizeof(int64_t), cmp_int64);
+    double secs = elapsed_us > 0 ? elapsed_us / 1e6 : 1e-6;
+
+    printf("{\"path\":\"c\",\"scenario\":\"keyed\",\"impl\":\"%s\",\"partitions\":%d,"
+           "\"keys\":%ld,\"payload_size\":%zu,\"msgs\":%ld,\"delivered\":%ld,\"failed\":%ld,"
+           "\"msg_per_s\":%.0f,\"enqueue_ns_per_msg\":%.1f,\"cpu_us_per_msg\":%.3f,"
+           "\"p50_us\":%" PRId64 ",\"p99_us\":%" PRId64 ",\"p999_us\":%" PRId64 ","
+           "\"java_partition_pct\":%.2f}\n",
+           b->impl, b->partitions, b->key_cnt, b->payload_size, b->msgs, delivered, atomic_load(&b->failed),
+           delivered / secs, enqueue_us * 1000.0 / b->msgs,
+           delivered > 0 ? (double)cpu / delivered : 0.0,
+           samples ? b->latency[(long)((samples - 1) * 0.50)] : 0,
+           samples ? b->latency[(long)((samples - 1) * 0.99)] : 0,
+           samples ? b->latency[(long)((samples - 1) * 0.999)] : 0,
+           delivered > 0 ? atomic_load(&b->java_partition) * 100.0 / delivered : 0.0);
+    fflush(stdout);
+
+    fprintf(stderr, "%% %-14s partitions=%-4d: %.0f msg/s, enqueue %.0fns/msg\n",
+            b->impl, b->partitions, delivered / secs, enqueue_us * 1000.0 / b->msgs);
+}
+
+int main(int argc, char **argv) {
+    const char *partitions[BENCH_MAX_LIST], *key_cnts[BENCH_MAX_LIST], *impls[BENCH_MAX_LIST];
+    char partitions_buf[256], keys_buf[256], impls_buf[256];
+    char errstr[512];
+    const char *msgs_env = getenv("BENCH_MSGS");
+    const char *payload_env = getenv("BENCH_PAYLOAD");
+    bench_keyed_t b;
+
+    memset(&b, 0, sizeof(b));
+    b.msgs = msgs_env ? atol(msgs_env) : 500000;
+    b.payload_size = payload_env ? (size_t)atol(payload_env) : 100;
+
+    int partition_cnt = parse_list("BENCH_PARTITIONS", "16,128", partitions, partitions_buf,
+                                   sizeof(partitions_buf));
+    int key_cnt = parse_list("BENCH_KEYED_KEYS", "1000000", key_cnts, keys_buf, sizeof(keys_buf));
+    int impl_cnt = parse_list("BENCH_KEYED_IMPLS", "keyed_batch,keyed,default_batch,default,murmur2_random",
+                              impls, impls_buf, sizeof(impls_buf));
+
+    // the mock cluster lives in its own (otherwise unused) client instance
+    rd_kafka_t *mrk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+    if (!mrk) {
+        fprintf(stderr, "%% Failed to create mock cluster client: %s\n", errstr);
+        return 1;
+    }
+    mcluster = rd_kafka_mock_cluster_new(mrk, 3);
+    if (!mcluster) {
+        fprintf(stderr, "%% Failed to create mock cluster\n");
+        return 1;
+    }
+    fprintf(stderr, "%% librdkafka %s, mock cluster %s, %ld msgs per scenario\n",
+            rd_kafka_version_str(), rd_kafka_mock_cluster_bootstraps(mcluster), b.msgs);
+
+    b.keys = malloc((size_t)b.msgs * BENCH_KEY_SIZE);
+    b.key_lens = malloc(b.msgs);
+    b.latency = malloc(sizeof(int64_t) * b.msgs);
+    b.payload = malloc(b.payload_size);
+    for (size_t i = 0; i < b.payload_size; i++) {
+        b.payload[i] = 'a' + rand() % 26;
+    }
+
+    for (int k = 0; k < key_cnt; k++) {
+        long keys = atol(key_cnts[k]) > 0 ? atol(key_cnts[k]) : 1;
+        b.key_cnt = keys;
+        uint64_t state = 0x2545f4914f6cdd1dULL;
+        // the same random keys for every scenario
+        for (long i = 0; i < b.msgs; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            b.key_lens[i] = (unsigned char)snprintf(b.keys + i * BENCH_KEY_SIZE, BENCH_KEY_SIZE,
+                                                    "user-%lu", (unsigned long)(state % keys));
+        }
+        fprintf(stderr, "%% %ld distinct keys\n", keys);
+
+        for (int p = 0; p < partition_cnt; p++) {
+            for (int i = 0; i < impl_cnt; i++) {
+                b.impl = impls[i];
+                b.partitions = atoi(partitions[p]);
+                bench_keyed(&b, rd_kafka_mock_cluster_bootstraps(mcluster));
+            }
+        }
+    }
+
+    free(b.keys);
+    free(b.key_lens);
+    free(b.latency);
+    free(b.payload);
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mrk);
+    return 0;
+}
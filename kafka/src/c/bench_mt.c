@@ -0,0 +1,337 @@
+/*
+** Multi-threaded producer benchmark of libproducer.so (shared_producer.h)
+**
+** Runs against librdkafka's in-process mock cluster, no broker needed.
+** For every thread count, all threads publish BENCH_MT_MSGS (default 200000)
+** messages each of BENCH_MT_PAYLOAD (default 100) bytes to one topic
+** through:
+**   - "shared": one shared_producer_t, BENCH_MT_FLUSHERS (default 2)
+**     flusher threads
+**   - "handle": the baseline, all threads call rd_kafka_producev() on one
+**     rd_kafka_t, delivery reports are served by a poll thread
+** until the last message is delivered. A full queue/ring is retried.
+**
+** One JSON object per run is written to stdout (msg/s, publish call
+** p50/p99/p999 latency, CPU time), progress to stderr. The thread counts
+** are BENCH_MT_THREADS (default 1,2,4,8,16,32, comma separated).
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka_mock.h"
+#endif
+
+#include "shared_producer.h"
+
+#define BENCH_MAX_LIST 16
+#define BENCH_SAMPLE_EVERY 16   // publish calls timed per thread: 1 in N
+#define BENCH_TIMEOUT_MS (120 * 1000)
+
+typedef struct bench_mt_s {
+    const char *bootstraps;
+    const char *topic;
+    size_t payload_size;
+    long msgs;              // per thread
+    int threads;
+    int flushers;
+    int shared_api;
+
+    shared_producer_t *sp;
+    rd_kafka_t *rk;
+    atomic_int poll_running;
+
+    pthread_barrier_t start;
+    int64_t *samples;       // threads * sample_cap
+    long sample_cap;
+    long *sample_cnt;
+    atomic_long retries;
+} bench_mt_t;
+
+typedef struct bench_worker_s {
+    bench_mt_t *b;
+    int id;
+} bench_worker_t;
+
+static rd_kafka_mock_cluster_t *mcluster;
+static int topic_seq = 0;
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t cpu_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int parse_list(const char *env, const char *def, const char **out, char *buf, size_t size) {
+    const char *val = getenv(env);
+    int cnt = 0;
+
+    snprintf(buf, size, "%s", val && *val ? val : def);
+    for (char *tok = strtok(buf, ","); tok && cnt < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        out[cnt++] = tok;
+    }
+    return cnt;
+}
+
+static long env_long(const char *name, long def) {
+    const char *v = getenv(name);
+    return v && *v ? atol(v) : def;
+}
+
+static void *poll_main(void *arg) {
+    bench_mt_t *b = arg;
+    while (atomic_load(&b->poll_running)) {
+        rd_kafka_poll(b->rk, 100);
+    }
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    bench_worker_t *w = arg;
+    bench_mt_t *b = w->b;
+    int64_t *samples = b->samples + (long)w->id * b->sample_cap;
+    long sample_cnt = 0, retries = 0;
+    char *payload = malloc(b->payload_size);
+    char key[16];
+
+    memset(payload, 'a' + w->id % 26, b->payload_size);
+    pthread_barrier_wait(&b->start);
+
+    for (long i = 0; i < b->msgs; i++) {
+        int key_len = snprintf(key, sizeof(key), "%d-%ld", w->id, i & 1023);
+        int timed = i % BENCH_SAMPLE_EVERY == 0;
+        int64_t t0 = timed ? now_us() : 0;
+        int err;
+
+        while (1) {
+            if (b->shared_api) {
+                err = shared_producer_publish(b->sp, b->topic, key, key_len, payload, b->payload_size);
+                if (err != EAGAIN) {
+                    break;
+                }
+            } else {
+                err = rd_kafka_producev(b->rk, RD_KAFKA_V_TOPIC(b->topic),
+                                        RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+                                        RD_KAFKA_V_KEY(key, key_len),
+                                        RD_KAFKA_V_VALUE(payload, b->payload_size), RD_KAFKA_V_END);
+                if (err != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+                    break;
+                }
+            }
+            retries++;
+            usleep(100);
+        }
+        if (err) {
+            fprintf(stderr, "%% Publish failed: %d\n", err);
+            exit(1);
+        }
+        if (timed && sample_cnt < b->sample_cap) {
+            samples[sample_cnt++] = now_us() - t0;
+        }
+    }
+
+    b->sample_cnt[w->id] = sample_cnt;
+    atomic_fetch_add(&b->retries, retries);
+    free(payload);
+    return NULL;
+}
+
+static void new_topic(char *buf, size_t size) {
+    snprintf(buf, size, "bench-mt-%d", ++topic_seq);
+    if (rd_kafka_mock_topic_create(mcluster, buf, 8, 1)) {
+        fprintf(stderr, "%% Failed to create mock topic %s\n", buf);
+        exit(1);
+    }
+}
+
+static void bench_start(bench_mt_t *b) {
+    char errstr[512];
+
+    if (b->shared_api) {
+        shared_producer_conf_t *conf = shared_producer_conf_new();
+        char flushers[16];
+        snprintf(flushers, sizeof(flushers), "%d", b->flushers);
+        if (shared_producer_conf_set(conf, "bootstrap.servers", b->bootstraps, errstr, sizeof(errstr)) ||
+            shared_producer_conf_set(conf, "flusher.threads", flushers, errstr, sizeof(errstr)) ||
+            shared_producer_conf_set(conf, "linger.ms", "5", errstr, sizeof(errstr)) ||
+            shared_producer_conf_set(conf, "queue.buffering.max.messages", "1000000", errstr, sizeof(errstr))) {
+            fprintf(stderr, "%% %s\n", errstr);
+            exit(1);
+        }
+        b->sp = shared_producer_new(conf, errstr, sizeof(errstr));
+        if (!b->sp) {
+            fprintf(stderr, "%% Failed to create shared producer: %s\n", errstr);
+            exit(1);
+        }
+        return;
+    }
+
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    if (rd_kafka_conf_set(conf, "bootstrap.servers", b->bootstraps, errstr, sizeof(errstr)) ||
+        rd_kafka_conf_set(conf, "linger.ms", "5", errstr, sizeof(errstr)) ||
+        rd_kafka_conf_set(conf, "queue.buffering.max.messages", "1000000", errstr, sizeof(errstr))) {
+        fprintf(stderr, "%% %s\n", errstr);
+        exit(1);
+    }
+    b->rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (!b->rk) {
+        fprintf(stderr, "%% Failed to create producer: %s\n", errstr);
+        exit(1);
+    }
+}
+
+static int bench_flush(bench_mt_t *b) {
+    if (b->shared_api) {
+        return shared_producer_flush(b->sp, BENCH_TIMEOUT_MS);
+    }
+    return rd_kafka_flush(b->rk, BENCH_TIMEOUT_MS);
+}
+
+static void bench_run(bench_mt_t *b) {
+    pthread_t *threads = malloc(sizeof(*threads) * b->threads);
+    bench_worker_t *workers = malloc(sizeof(*workers) * b->threads);
+    pthread_t poll_thread;
+    char topic[64];
+
+    new_topic(topic, sizeof(topic));
+    b->topic = topic;
+    b->sample_cap = b->msgs / BENCH_SAMPLE_EVERY + 1;
+    b->samples = malloc(sizeof(int64_t) * b->sample_cap * b->threads);
+    b->sample_cnt = calloc(b->threads, sizeof(long));
+    atomic_init(&b->retries, 0);
+    bench_start(b);
+    if (!b->shared_api) {
+        atomic_init(&b->poll_running, 1);
+        pthread_create(&poll_thread, NULL, poll_main, b);
+    }
+
+    pthread_barrier_init(&b->start, NULL, b->threads + 1);
+    for (int i = 0; i < b->threads; i++) {
+        workers[i].b = b;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+    }
+    int64_t cpu_start = cpu_us();
+    pthread_barrier_wait(&b->start);
+    int64_t start = now_us();
+    for (int i = 0; i < b->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int64_t publish_us = now_us() - start;
+    int err = bench_flush(b);
+    int64_t elapsed_us = now_us() - start;
+    int64_t cpu = cpu_us() - cpu_start;
+    if (b->shared_api) {
+        shared_producer_destroy(b->sp);
+    } else {
+        atomic_store(&b->poll_running, 0);
+        pthread_join(poll_thread, NULL);
+        rd_kafka_destroy(b->rk);
+    }
+    pthread_barrier_destroy(&b->start);
+    if (err) {
+        fprintf(stderr, "%% Flush timed out\n");
+        exit(1);
+    }
+
+    // merge the per-thread samples
+    long cnt = 0;
+    for (int i = 0; i < b->threads; i++) {
+        memmove(b->samples + cnt, b->samples + (long)i * b->sample_cap, sizeof(int64_t) * b->sample_cnt[i]);
+        cnt += b->sample_cnt[i];
+    }
+    qsort(b->samples, cnt, sizeof(int64_t), cmp_int64);
+
+    long msgs = b->msgs * b->threads;
+    double secs = elapsed_us > 0 ? elapsed_us / 1e6 : 1e-6;
+    const char *api = b->shared_api ? "shared" : "handle";
+    printf("{\"path\":\"c\",\"scenario\":\"produce_mt\",\"api\":\"%s\",\"threads\":%d,\"flushers\":%d,"
+           "\"payload_size\":%zu,\"msgs\":%ld,\"msg_per_s\":%.0f,\"publish_msg_per_s\":%.0f,"
+           "\"mb_per_s\":%.2f,\"cpu_s\":%.3f,\"cpu_us_per_msg\":%.3f,\"retries\":%ld,"
+           "\"p50_us\":%" PRId64 ",\"p99_us\":%" PRId64 ",\"p999_us\":%" PRId64 "}\n",
+           api, b->threads, b->shared_api ? b->flushers : 0, b->payload_size, msgs, msgs / secs,
+           msgs / (publish_us > 0 ? publish_us / 1e6 : 1e-6),
+           msgs * (double)b->payload_size / secs / (1024 * 1024), cpu / 1e6, (double)cpu / msgs,
+           atomic_load(&b->retries), cnt ? b->samples[(long)((cnt - 1) * 0.50)] : 0,
+           cnt ? b->samples[(long)((cnt - 1) * 0.99)] : 0, cnt ? b->samples[(long)((cnt - 1) * 0.999)] : 0);
+    fflush(stdout);
+    fprintf(stderr, "%% produce_mt %-6s threads=%-3d: %.0f msg/s, publish p99 %" PRId64 "us\n",
+            api, b->threads, msgs / secs, cnt ? b->samples[(long)((cnt - 1) * 0.99)] : 0);
+
+    free(b->samples);
+    free(b->sample_cnt);
+    free(workers);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    const char *threads[BENCH_MAX_LIST];
+    char threads_buf[256], errstr[512];
+    long msgs = env_long("BENCH_MT_MSGS", 200000);
+    size_t payload_size = (size_t)env_long("BENCH_MT_PAYLOAD", 100);
+    int flushers = (int)env_long("BENCH_MT_FLUSHERS", 2);
+    int thread_cnt = parse_list("BENCH_MT_THREADS", "1,2,4,8,16,32", threads, threads_buf, sizeof(threads_buf));
+
+    if (shared_producer_api_version() != SHARED_PRODUCER_API_VERSION) {
+        fprintf(stderr, "%% libproducer.so API version %d, built against %d\n",
+                shared_producer_api_version(), SHARED_PRODUCER_API_VERSION);
+        return 1;
+    }
+
+    // the mock cluster lives in its own (otherwise unused) client instance
+    rd_kafka_t *mrk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+    if (!mrk) {
+        fprintf(stderr, "%% Failed to create mock cluster client: %s\n", errstr);
+        return 1;
+    }
+    mcluster = rd_kafka_mock_cluster_new(mrk, 3);
+    if (!mcluster) {
+        fprintf(stderr, "%% Failed to create mock cluster\n");
+        return 1;
+    }
+    fprintf(stderr, "%% librdkafka %s, mock cluster %s, %ld msgs per thread\n",
+            rd_kafka_version_str(), rd_kafka_mock_cluster_bootstraps(mcluster), msgs);
+
+    for (int i = 0; i < thread_cnt; i++) {
+        for (int shared_api = 1; shared_api >= 0; shared_api--) {
+            bench_mt_t b;
+            memset(&b, 0, sizeof(b));
+            b.bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+            b.payload_size = payload_size;
+            b.msgs = msgs;
+            b.threads = atoi(threads[i]);
+            b.flushers = flushers;
+            b.shared_api = shared_api;
+            bench_run(&b);
+        }
+    }
+
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mrk);
+    return 0;
+}
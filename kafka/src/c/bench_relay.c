@@ -0,0 +1,234 @@
+/*
+** Throughput of the exactly-once relay (relay.c) by transaction batch size
+**
+** Runs against librdkafka's in-process mock cluster, no broker needed.
+** For every batch size BENCH_MSGS pre-produced messages are relayed from a
+** fresh input topic to a fresh output topic in transactions of that many
+** messages (BENCH_RELAY_BATCH_MS bounds each one in time), then the output
+** is read back read_committed and counted.
+**
+** One JSON object per batch size is written to stdout, progress to stderr.
+** Elapsed time is from the first relayed message to the last commit, the
+** group join before it is excluded.
+**
+** BENCH_MSGS (default 20000), BENCH_PAYLOAD (bytes, default 256),
+** BENCH_PARTITIONS (default 4), BENCH_RELAY_BATCHES (comma separated list,
+** default 1,10,100,1000,10000) and BENCH_RELAY_BATCH_MS (default 1000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka_mock.h"
+#endif
+
+#include "relay.c"
+
+#define BENCH_MAX_LIST 16
+
+typedef struct bench_relay_s {
+    long msgs;              // stop once this many were handled
+    long handled;
+    int64_t first_us;       // first message handled
+    volatile sig_atomic_t run;
+} bench_relay_t;
+
+static rd_kafka_mock_cluster_t *mcluster;
+
+static int64_t cpu_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void conf_set(rd_kafka_conf_t *conf, const char *name, const char *value) {
+    char errstr[512];
+    if (rd_kafka_conf_set(conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%% %s\n", errstr);
+        exit(1);
+    }
+}
+
+static int forward_handler(relay_t *relay, const rd_kafka_message_t *rkm, void *opaque) {
+    bench_relay_t *b = opaque;
+    if (b->handled++ == 0) {
+        b->first_us = now_us();
+    }
+    // the open transaction is committed when relay_run() returns
+    if (b->handled >= b->msgs) {
+        b->run = 0;
+    }
+    return relay_emit(relay, rkm->key, rkm->key_len, rkm->payload, rkm->len);
+}
+
+static void produce_input(const char *bootstraps, const char *topic, long msgs, size_t size) {
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char errstr[512];
+    char *payload = malloc(size);
+
+    memset(payload, 'r', size);
+    conf_set(conf, "bootstrap.servers", bootstraps);
+    conf_set(conf, "linger.ms", "5");
+    rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (!rk) {
+        fprintf(stderr, "%% Failed to create producer: %s\n", errstr);
+        exit(1);
+    }
+    for (long i = 0; i < msgs; i++) {
+        char key[32];
+        int key_len = snprintf(key, sizeof(key), "%ld", i);
+        while (rd_kafka_producev(rk, RD_KAFKA_V_TOPIC(topic), RD_KAFKA_V_KEY(key, (size_t)key_len),
+                                 RD_KAFKA_V_VALUE(payload, size),
+                                 RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+                                 RD_KAFKA_V_END) == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            rd_kafka_poll(rk, 10);
+        }
+    }
+    rd_kafka_flush(rk, 60 * 1000);
+    rd_kafka_destroy(rk);
+    free(payload);
+}
+
+/*
+** Count the committed messages of topic
+ */
+static long count_output(const char *bootstraps, const char *topic, int partitions) {
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+    char errstr[512];
+    long cnt = 0;
+    int eof_cnt = 0;
+
+    conf_set(conf, "bootstrap.servers", bootstraps);
+    conf_set(conf, "group.id", "bench-relay-verify");
+    conf_set(conf, "isolation.level", "read_committed");
+    conf_set(conf, "enable.partition.eof", "true");
+    conf_set(conf, "fetch.wait.max.ms", "10");
+    rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+    if (!rk) {
+        fprintf(stderr, "%% Failed to create consumer: %s\n", errstr);
+        exit(1);
+    }
+    rd_kafka_poll_set_consumer(rk);
+    rd_kafka_topic_partition_list_t *parts = rd_kafka_topic_partition_list_new(partitions);
+    for (int i = 0; i < partitions; i++) {
+        rd_kafka_topic_partition_list_add(parts, topic, i)->offset = RD_KAFKA_OFFSET_BEGINNING;
+    }
+    rd_kafka_assign(rk, parts);
+    rd_kafka_topic_partition_list_destroy(parts);
+
+    int64_t deadline = now_us() + 60LL * 1000 * 1000;
+    while (eof_cnt < partitions && now_us() < deadline) {
+        rd_kafka_message_t *rkm = rd_kafka_consumer_poll(rk, 100);
+        if (!rkm) {
+            continue;
+        }
+        if (rkm->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+            eof_cnt++;
+        } else if (!rkm->err) {
+            cnt++;
+        }
+        rd_kafka_message_destroy(rkm);
+    }
+    rd_kafka_consumer_close(rk);
+    rd_kafka_destroy(rk);
+    return cnt;
+}
+
+int main(int argc, char **argv) {
+    const char *batches[BENCH_MAX_LIST];
+    char batches_buf[256], errstr[512];
+    long msgs = env_long("BENCH_MSGS", 20000);
+    size_t payload_size = (size_t)env_long("BENCH_PAYLOAD", 256);
+    int partitions = (int)env_long("BENCH_PARTITIONS", 4);
+    int batch_ms = (int)env_long("BENCH_RELAY_BATCH_MS", 1000);
+    const char *val = getenv("BENCH_RELAY_BATCHES");
+    int batch_cnt = 0;
+
+    snprintf(batches_buf, sizeof(batches_buf), "%s", val && *val ? val : "1,10,100,1000,10000");
+    for (char *tok = strtok(batches_buf, ","); tok && batch_cnt < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        batches[batch_cnt++] = tok;
+    }
+
+    // the mock cluster lives in its own (otherwise unused) client instance
+    rd_kafka_t *mrk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+    if (!mrk) {
+        fprintf(stderr, "%% Failed to create mock cluster client: %s\n", errstr);
+        return 1;
+    }
+    mcluster = rd_kafka_mock_cluster_new(mrk, 3);
+    if (!mcluster) {
+        fprintf(stderr, "%% Failed to create mock cluster\n");
+        return 1;
+    }
+    const char *bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+    fprintf(stderr, "%% librdkafka %s, mock cluster %s, %ld msgs per batch size\n",
+            rd_kafka_version_str(), bootstraps, msgs);
+
+    for (int i = 0; i < batch_cnt; i++) {
+        char input[64], output[64], group[64];
+        relay_conf_t conf;
+        relay_stats_t stats;
+        bench_relay_t b;
+
+        snprintf(input, sizeof(input), "relay-in-%d", i);
+        snprintf(output, sizeof(output), "relay-out-%d", i);
+        snprintf(group, sizeof(group), "relay-%d", i);
+        rd_kafka_mock_topic_create(mcluster, input, partitions, 1);
+        rd_kafka_mock_topic_create(mcluster, output, partitions, 1);
+        produce_input(bootstraps, input, msgs, payload_size);
+
+        conf.brokers = bootstraps;
+        conf.group_id = group;
+        conf.transactional_id = group;
+        conf.output_topic = output;
+        conf.max_msgs = atol(batches[i]);
+        conf.max_bytes = 0;
+        conf.max_ms = batch_ms;
+
+        relay_t *relay = relay_new(&conf, errstr, sizeof(errstr));
+        if (!relay) {
+            fprintf(stderr, "%% Failed to create relay: %s\n", errstr);
+            return 1;
+        }
+        memset(&b, 0, sizeof(b));
+        b.msgs = msgs;
+        b.run = 1;
+        const char *topics[1] = {input};
+        int64_t cpu_start = cpu_us();
+        int res = relay_run(relay, topics, 1, forward_handler, &b, &b.run);
+        int64_t elapsed_us = now_us() - b.first_us;
+        int64_t cpu = cpu_us() - cpu_start;
+        relay_get_stats(relay, &stats);
+        relay_destroy(relay);
+
+        long committed = count_output(bootstraps, output, partitions);
+        double secs = elapsed_us > 0 ? elapsed_us / 1e6 : 1e-6;
+        double commit_avg_ms = stats.txn_cnt > 0 ? stats.commit_us / 1000.0 / stats.txn_cnt : 0;
+
+        printf("{\"path\":\"c\",\"scenario\":\"relay\",\"batch_msgs\":%ld,\"payload_size\":%zu,"
+               "\"partitions\":%d,\"msgs\":%ld,\"msg_per_s\":%.0f,\"mb_per_s\":%.2f,"
+               "\"txns\":%ld,\"aborts\":%ld,\"commit_avg_ms\":%.3f,\"commit_max_ms\":%.3f,"
+               "\"cpu_s\":%.3f,\"committed_output\":%ld,\"ok\":%s}\n",
+               conf.max_msgs, payload_size, partitions, stats.msgs_in, stats.msgs_in / secs,
+               stats.bytes_out / secs / (1024 * 1024), stats.txn_cnt, stats.abort_cnt,
+               commit_avg_ms, stats.commit_max_us / 1000.0, cpu / 1e6, committed,
+               res == 0 && committed == msgs ? "true" : "false");
+        fflush(stdout);
+        fprintf(stderr, "%% relay batch=%-6ld: %.0f msg/s, %ld txn(s), commit %.3fms avg, "
+                "%ld/%ld committed\n", conf.max_msgs, stats.msgs_in / secs, stats.txn_cnt,
+                commit_avg_ms, committed, msgs);
+    }
+
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mrk);
+    return 0;
+}
@@ -25,7 +25,6 @@
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
-#include <ctype.h>
 
 #ifdef ENV_PRODUCT
 #include <librdkafka/rdkafka.h>
@@ -33,6 +32,11 @@
 #include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
 #endif
 
+#include "../common/payload_inspect.c"
+
+/* binary keys and values are hex dumped up to this many bytes */
+#define DUMP_MAX 256
+
 static volatile sig_atomic_t run = 1;
 
 // signal termination of program
@@ -41,19 +45,6 @@ static void stop(int sig) {
 }
 
 
-/*
-** return 1 if all bytes are printable, else 0
-*/
-static int is_printable(const char* buf, size_t size) {
-    for (size_t i =0; i < size; i++) {
-        if (!isprint((int)buf[i])) {
-            return 0;
-        }
-
-        return 1;
-    }
-}
-
 int main(int argc, char **argv) {
     rd_kafka_t *rk; // consumer instance handle
     rd_kafka_conf_t *conf; // temporary configuration object
@@ -138,6 +129,7 @@ int main(int argc, char **argv) {
       fprintf(stderr, "%% Subscribed to %d topic(s), "
               "waiting for rebalance and message ... \n",
               subscription->cnt);
+      fprintf(stderr, "%% Inspecting payloads with %s kernels\n", payload_simd_name());
 
       rd_kafka_topic_partition_list_destroy(subscription);
 
@@ -179,18 +171,28 @@ int main(int argc, char **argv) {
                  rkm->offset,
                  rd_kafka_message_leader_epoch(rkm));
 
-          // print the message key
-          if (rkm->key && is_printable(rkm->key, rkm->key_len)) {
+          // print the message key, binary keys as hex
+          if (rkm->key && payload_is_printable(rkm->key, rkm->key_len)) {
               printf("key: %.*s\n", (int)rkm->key_len, (const char*) rkm->key);
           } else if (rkm->key) {
-              printf("key: (%d bytes)\n", (int) rkm->len, (const char*) rkm->payload);
+              char hex[2 * DUMP_MAX];
+              size_t n = rkm->key_len < DUMP_MAX ? rkm->key_len : DUMP_MAX;
+              payload_hex(rkm->key, n, hex);
+              printf("key: (%zu bytes) %.*s%s\n", rkm->key_len, (int)(2 * n), hex,
+                     n < rkm->key_len ? "..." : "");
           }
 
-          // printf message value/payload
-          if (rkm->payload && is_printable(rkm->payload, rkm->len)) {
-              printf("value: %.*s\n", (int)rkm->len, (const char *)rkm->payload);
-          } else if (rkm->payload) {
-              printf("Value: (%d bytes)\n", (int) rkm->len);
+          // printf message value/payload, binary values as hex dump
+          if (rkm->payload) {
+              payload_class_t cls = payload_classify(rkm->payload, rkm->len);
+              if (cls == PAYLOAD_BINARY) {
+                  char dump[DUMP_MAX / 16 * PAYLOAD_HEXDUMP_LINE];
+                  size_t n = payload_hexdump(rkm->payload, rkm->len, dump, sizeof(dump));
+                  printf("value: (%zu bytes, %s)\n%.*s", rkm->len, payload_class_name(cls), (int)n, dump);
+              } else {
+                  printf("value: (%s) %.*s\n", payload_class_name(cls), (int)rkm->len,
+                         (const char *)rkm->payload);
+              }
           }
 
           rd_kafka_message_destroy(rkm);
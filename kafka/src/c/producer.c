@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef ENV_PRODUCT
 #include <librdkafka/rdkafka.h>
@@ -8,16 +13,353 @@
 #include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
 #endif
 
-static volatile sig_atomic_t run = 1;
+#include "../common/stats_metrics.c"
 
-// signal termination of program
-static void stop(int sig) {
-    run = 0;
-    fclose(stdin); // abort fgets()
+/*
+** Called once librdkafka no longer references a payload handed over with
+** publish_batch(): after its delivery report, successful or not
+ */
+typedef void (publish_release_cb_t)(void *payload, size_t len, void *release_opaque);
+
+/*
+** Message for publish_batch(): explicit payload pointer and length,
+** err is set per message on return
+ */
+typedef struct publish_msg_s {
+    void *payload;
+    size_t len;
+    rd_kafka_resp_err_t err; // out: RD_KAFKA_RESP_ERR_NO_ERROR if enqueued
+} publish_msg_t;
+
+/*
+** Shared by all messages of one publish_batch() call that were handed over
+** without a copy, freed when the last one has been released
+ */
+typedef struct publish_release_s {
+    publish_release_cb_t *release_cb;
+    void *release_opaque;
+    atomic_int refcnt;
+} publish_release_t;
+
+static void publish_release_unref(publish_release_t *rel, int cnt) {
+    if (atomic_fetch_sub(&rel->refcnt, cnt) == cnt) {
+        free(rel);
+    }
 }
 
-static void stats_callback(rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
-    printf("Statistics: %.*s\n\n\n", (int)json_len, json);
+/*
+** Message header for publish_keyed_try() and publish_keyed_batch(),
+** value may be NULL
+ */
+typedef struct publish_header_s {
+    const char *name;
+    const void *value;
+    size_t size;
+} publish_header_t;
+
+/*
+** Message for publish_keyed_batch(): key (NULL: no key, partitioned by
+** librdkafka), copied payload and headers. partition and err are set per
+** message on return.
+ */
+typedef struct publish_keyed_msg_s {
+    const void *key;
+    size_t key_len;
+    const void *payload;
+    size_t len;
+    const publish_header_t *headers;
+    int header_cnt;
+    int32_t partition;       // out: RD_KAFKA_PARTITION_UA if no key
+    rd_kafka_resp_err_t err; // out: RD_KAFKA_RESP_ERR_NO_ERROR if enqueued
+} publish_keyed_msg_t;
+
+/*
+** Optional application delivery report callback, see producer_set_dr_cb()
+ */
+typedef void (publish_dr_cb_t)(const rd_kafka_message_t *rkmessage, void *dr_opaque);
+
+/*
+** Backpressure counters, see producer_get_stats()
+ */
+typedef struct producer_stats_s {
+    long inflight_msgs;     // enqueued, delivery report not served yet
+    long inflight_bytes;
+    long queue_full_cnt;    // librdkafka returned RD_KAFKA_RESP_ERR__QUEUE_FULL
+    long budget_full_cnt;   // in-flight budget exhausted
+    long blocked_cnt;       // publish_message_timed() calls that had to wait
+    long timeout_cnt;       // publish_message_timed() calls that gave up
+    long blocked_us;        // total time spent waiting for room
+    // adaptive batching, see producer_set_batching()
+    long linger_us;         // current linger
+    long latency_us;        // avg delivery latency (incl. linger) of the last tick
+    long queue_fill_pm;     // producer queue fill of the last tick, per mille
+    long rtt_us;            // max broker rtt of the last statistics
+    long batch_cnt;         // batches handed to librdkafka
+    long batch_msgs;        // messages in those batches
+    long linger_up_cnt;     // linger increases
+    long linger_down_cnt;   // linger decreases
+    // keyed publishing, see publish_keyed_try()
+    long partition_lookup_cnt; // partition count metadata requests
+} producer_stats_t;
+
+/*
+** Adaptive batching, see producer_set_batching()
+ */
+typedef enum {
+    PRODUCER_BATCHING_OFF,
+    PRODUCER_BATCHING_LATENCY,    // batch as much as target_latency_ms allows
+    PRODUCER_BATCHING_THROUGHPUT, // fill batches, wait at most linger_max_ms
+} producer_batching_mode_t;
+
+typedef struct producer_batching_s {
+    producer_batching_mode_t mode;
+    int target_latency_ms;  // latency mode: delivery latency to stay below
+    int linger_min_ms;      // bounds of the linger
+    int linger_max_ms;
+    long batch_max_bytes;   // a batch is sent once it holds this many bytes
+} producer_batching_t;
+
+#define BATCH_MSGS_MAX 10000             // librdkafka's default batch.num.messages
+#define BATCHING_TICK_US (100 * 1000)    // controller interval
+#define BATCHING_RETRY_US 1000           // retry of messages that did not fit the queue
+
+#define PARTITION_CNT_TTL_US (30LL * 1000 * 1000)  // cached partition counts are looked up again after
+#define PARTITION_CNT_RETRY_US (1000 * 1000)       // retry of a failed lookup
+#define PARTITION_CNT_TIMEOUT_MS 5000
+
+/*
+** Topic of the keyed API: its handle and partition count, created on the
+** first publish and kept until the producer is destroyed
+ */
+typedef struct topic_cache_s {
+    struct topic_cache_s *next;
+    rd_kafka_topic_t *rkt;
+    atomic_int partition_cnt;   // 0: not known yet
+    atomic_llong looked_up_us;
+    atomic_int looking_up;      // one caller looks up, the others use the old count
+    char name[];
+} topic_cache_t;
+
+/*
+** Per producer state, registered as the rd_kafka_t opaque
+ */
+typedef struct producer_state_s {
+    // in-flight budget, 0: unlimited
+    long max_inflight_msgs;
+    long max_inflight_bytes;
+    // default wait of publish_message() when there is no room
+    int block_timeout_ms;
+
+    atomic_long inflight_msgs;
+    atomic_long inflight_bytes;
+    atomic_long queue_full_cnt;
+    atomic_long budget_full_cnt;
+    atomic_long blocked_cnt;
+    atomic_long timeout_cnt;
+    atomic_long blocked_us;
+
+    // woken up from dr_msg_cb() when room frees up
+    pthread_mutex_t lock;
+    pthread_cond_t room_cond;
+    atomic_int waiters;
+
+    publish_dr_cb_t *app_dr_cb;
+    void *app_dr_opaque;
+
+    // parsed statistics are served here, see producer_start_metrics()
+    _Atomic(metrics_server_t *) metrics;
+
+    // adaptive batching: messages are held here for up to linger_us and
+    // handed to librdkafka in one rd_kafka_produce_batch() call
+    producer_batching_t batching;
+    long queue_max_msgs;            // queue.buffering.max.messages
+    pthread_mutex_t batch_lock;
+    pthread_cond_t batch_cond;      // first message of a batch, or stop
+    char batch_topic[256];
+    rd_kafka_topic_t *batch_rkt;
+    char *batch_buf;                // batch_max_bytes
+    size_t batch_bytes;
+    rd_kafka_message_t *batch_msgs; // BATCH_MSGS_MAX
+    int64_t *batch_enq_us;
+    int batch_cnt;
+    int64_t batch_due_us;           // when the batch is sent at the latest
+    pthread_t batch_thread;
+    atomic_int batch_running;
+    int batch_thread_started;
+
+    // controller inputs since the last tick
+    atomic_long dr_latency_us;      // sum of the librdkafka latencies
+    atomic_long dr_latency_cnt;
+    atomic_long hold_us;            // sum of the time messages were held
+    atomic_long hold_cnt;
+    atomic_long batched_bytes;
+    atomic_long batched_msgs;
+    atomic_long rtt_us;             // from the statistics
+    atomic_long stats_fill_pm;
+    stats_snapshot_t *stats_snap;   // statistics parsed for the controller
+    int64_t last_tick_us;
+
+    // controller decisions, see producer_get_stats()
+    atomic_long linger_us;
+    atomic_long latency_us;
+    atomic_long queue_fill_pm;
+    atomic_long batch_total;
+    atomic_long batch_msgs_total;
+    atomic_long linger_up_cnt;
+    atomic_long linger_down_cnt;
+
+    // keyed publishing: topics are only ever added, read without a lock
+    _Atomic(topic_cache_t *) topics;
+    pthread_mutex_t topic_lock;
+    atomic_long partition_lookup_cnt;
+
+    // delivery report thread
+    pthread_t dr_thread;
+    atomic_int dr_running;
+    int dr_thread_started;
+} producer_state_t;
+
+static producer_state_t *producer_state_new() {
+    producer_state_t *st = calloc(1, sizeof(*st));
+    pthread_condattr_t attr;
+
+    if (!st) {
+        return NULL;
+    }
+    st->block_timeout_ms = 1000;
+    atomic_init(&st->inflight_msgs, 0);
+    atomic_init(&st->inflight_bytes, 0);
+    atomic_init(&st->queue_full_cnt, 0);
+    atomic_init(&st->budget_full_cnt, 0);
+    atomic_init(&st->blocked_cnt, 0);
+    atomic_init(&st->timeout_cnt, 0);
+    atomic_init(&st->blocked_us, 0);
+    atomic_init(&st->waiters, 0);
+    atomic_init(&st->dr_running, 0);
+    atomic_init(&st->metrics, NULL);
+    atomic_init(&st->batch_running, 0);
+    atomic_init(&st->dr_latency_us, 0);
+    atomic_init(&st->dr_latency_cnt, 0);
+    atomic_init(&st->hold_us, 0);
+    atomic_init(&st->hold_cnt, 0);
+    atomic_init(&st->batched_bytes, 0);
+    atomic_init(&st->batched_msgs, 0);
+    atomic_init(&st->rtt_us, 0);
+    atomic_init(&st->stats_fill_pm, 0);
+    atomic_init(&st->linger_us, 0);
+    atomic_init(&st->latency_us, 0);
+    atomic_init(&st->queue_fill_pm, 0);
+    atomic_init(&st->batch_total, 0);
+    atomic_init(&st->batch_msgs_total, 0);
+    atomic_init(&st->linger_up_cnt, 0);
+    atomic_init(&st->linger_down_cnt, 0);
+    atomic_init(&st->topics, NULL);
+    atomic_init(&st->partition_lookup_cnt, 0);
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_mutex_init(&st->batch_lock, NULL);
+    pthread_mutex_init(&st->topic_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->room_cond, &attr);
+    pthread_cond_init(&st->batch_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return st;
+}
+
+static void producer_state_destroy(producer_state_t *st) {
+    pthread_cond_destroy(&st->batch_cond);
+    pthread_cond_destroy(&st->room_cond);
+    pthread_mutex_destroy(&st->topic_lock);
+    pthread_mutex_destroy(&st->batch_lock);
+    pthread_mutex_destroy(&st->lock);
+    free(st->batch_buf);
+    free(st->batch_msgs);
+    free(st->batch_enq_us);
+    if (st->stats_snap) {
+        stats_snapshot_free(st->stats_snap);
+        free(st->stats_snap);
+    }
+    free(st);
+}
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Reserve room for one message in the in-flight budget
+** res: 1 on success, 0 if the budget is exhausted
+ */
+static int inflight_reserve(producer_state_t *st, long msgs, long bytes) {
+    long m = atomic_fetch_add(&st->inflight_msgs, msgs) + msgs;
+    long b = atomic_fetch_add(&st->inflight_bytes, bytes) + bytes;
+
+    if ((st->max_inflight_msgs > 0 && m > st->max_inflight_msgs) ||
+        (st->max_inflight_bytes > 0 && b > st->max_inflight_bytes)) {
+        atomic_fetch_sub(&st->inflight_msgs, msgs);
+        atomic_fetch_sub(&st->inflight_bytes, bytes);
+        return 0;
+    }
+    return 1;
+}
+
+static void inflight_release(producer_state_t *st, long msgs, long bytes) {
+    atomic_fetch_sub(&st->inflight_msgs, msgs);
+    atomic_fetch_sub(&st->inflight_bytes, bytes);
+
+    if (atomic_load(&st->waiters) > 0) {
+        pthread_mutex_lock(&st->lock);
+        pthread_cond_broadcast(&st->room_cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+/*
+** Delivery report thread: the only place delivery reports (and stats)
+** are served once it is started
+ */
+static void *dr_thread_main(void *arg) {
+    rd_kafka_t *rk = arg;
+    producer_state_t *st = rd_kafka_opaque(rk);
+
+    while (atomic_load(&st->dr_running)) {
+        rd_kafka_poll(rk, 100 /* block for max 100ms */);
+    }
+    return NULL;
+}
+
+/*
+** Statistics are parsed into the metrics endpoint if one is started,
+** printed otherwise
+** res: 0, librdkafka frees json
+ */
+static int stats_callback(rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
+    producer_state_t *st = opaque;
+    metrics_server_t *metrics = atomic_load(&st->metrics);
+
+    // broker rtt and queue fill for the batching controller
+    if (st->stats_snap && stats_parse(json, json_len, st->stats_snap) == 0) {
+        stats_snapshot_t *snap = st->stats_snap;
+        int64_t rtt = 0;
+        for (int i = 0; i < snap->broker_cnt; i++) {
+            if (snap->brokers[i].rtt_avg > rtt) {
+                rtt = snap->brokers[i].rtt_avg;
+            }
+        }
+        atomic_store(&st->rtt_us, (long)rtt);
+        atomic_store(&st->stats_fill_pm,
+                     snap->msg_size_max > 0 ? (long)(snap->msg_size * 1000 / snap->msg_size_max) : 0);
+    }
+
+    if (!metrics) {
+        printf("Statistics: %.*s\n\n\n", (int)json_len, json);
+    } else if (metrics_server_update_stats(metrics, json, json_len) == -1) {
+        fprintf(stderr, "%% Failed to parse statistics\n");
+    }
+    return 0;
 }
 
 
@@ -30,12 +372,36 @@ static void stats_callback(rd_kafka_t *rk, char *json, size_t json_len, void *op
  * failed delivery (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR).
  *
  * The callback is triggered from rd_kafka_poll() and executes on
- * the application's thread.
+ * the delivery report thread (or the application's thread if it is not
+ * started).
  */
 static void dr_msg_cb(rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
+    producer_state_t *st = opaque;
+
+    inflight_release(st, 1, (long)rkmessage->len);
+
+    if (st->batching.mode != PRODUCER_BATCHING_OFF && !rkmessage->err) {
+        int64_t latency = rd_kafka_message_latency(rkmessage);
+        if (latency >= 0) {
+            atomic_fetch_add(&st->dr_latency_us, (long)latency);
+            atomic_fetch_add(&st->dr_latency_cnt, 1);
+        }
+    }
+
     if (rkmessage->err) {
         fprintf(stderr, "%% Message delivery failed: %s\n", rd_kafka_err2str(rkmessage->err));
     }
+
+    // payload handed over by publish_batch(): give it back to its owner
+    if (rkmessage->_private) {
+        publish_release_t *rel = (publish_release_t *)rkmessage->_private;
+        rel->release_cb(rkmessage->payload, rkmessage->len, rel->release_opaque);
+        publish_release_unref(rel, 1);
+    }
+
+    if (st->app_dr_cb) {
+        st->app_dr_cb(rkmessage, st->app_dr_opaque);
+    }
     // else {
     //     fprintf(stderr,
     //                     "%% Message delivered (%zd bytes, partition %" PRId32 ")\n",
@@ -44,13 +410,344 @@ static void dr_msg_cb(rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void
     // }
 }
 
-rd_kafka_t* init_kafka_producer() {
+/*
+** Hand the held messages to librdkafka in one call. Messages that did not
+** fit the queue stay held and are retried BATCHING_RETRY_US later, the
+** others are gone (failures are released like in publish_batch()).
+** batch_lock must be held.
+ */
+static void batch_flush_locked(producer_state_t *st, int64_t now) {
+    int cnt = st->batch_cnt;
+    int kept = 0, failed = 0;
+    size_t kept_bytes = 0;
+    long hold = 0, failed_bytes = 0;
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+    if (cnt == 0) {
+        return;
+    }
+    rd_kafka_produce_batch(st->batch_rkt, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+                           st->batch_msgs, cnt);
+
+    for (int i = 0; i < cnt; i++) {
+        rd_kafka_message_t *m = &st->batch_msgs[i];
+        if (!m->err) {
+            hold += (long)(now - st->batch_enq_us[i]);
+            continue;
+        }
+        if (m->err != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            // never enqueued: no delivery report will release it
+            err = m->err;
+            failed++;
+            failed_bytes += (long)m->len;
+            continue;
+        }
+        // payloads only move towards the start of the buffer
+        memmove(st->batch_buf + kept_bytes, m->payload, m->len);
+        m->payload = st->batch_buf + kept_bytes;
+        m->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+        kept_bytes += m->len;
+        st->batch_enq_us[kept] = st->batch_enq_us[i];
+        st->batch_msgs[kept++] = *m;
+    }
+
+    if (failed) {
+        inflight_release(st, failed, failed_bytes);
+        fprintf(stderr, "%% Failed to produce %d/%d message(s) to topic %s: %s\n",
+                failed, cnt, st->batch_topic, rd_kafka_err2str(err));
+    }
+    if (kept) {
+        atomic_fetch_add(&st->queue_full_cnt, 1);
+        st->batch_due_us = now + BATCHING_RETRY_US;
+    }
+    if (kept < cnt) {
+        atomic_fetch_add(&st->batch_total, 1);
+        atomic_fetch_add(&st->batch_msgs_total, cnt - kept - failed);
+        atomic_fetch_add(&st->hold_us, hold);
+        atomic_fetch_add(&st->hold_cnt, cnt - kept - failed);
+    }
+    st->batch_cnt = kept;
+    st->batch_bytes = kept_bytes;
+}
+
+/*
+** Hold one (budget reserved) message for the current batch
+** res: 0 if held, EAGAIN if the held messages do not fit the queue,
+**      -1 if the message is larger than a batch (held ones are sent first)
+ */
+static int batch_add(rd_kafka_t *rk, producer_state_t *st, const void *buf, size_t len,
+                     const char *topic) {
+    int64_t now = now_us();
+    long linger = atomic_load(&st->linger_us);
+
+    pthread_mutex_lock(&st->batch_lock);
+    if (st->batch_rkt && strcmp(st->batch_topic, topic)) {
+        batch_flush_locked(st, now);
+        if (st->batch_cnt) {
+            pthread_mutex_unlock(&st->batch_lock);
+            return EAGAIN;
+        }
+        rd_kafka_topic_destroy(st->batch_rkt);
+        st->batch_rkt = NULL;
+    }
+    if (!st->batch_rkt) {
+        if (strlen(topic) >= sizeof(st->batch_topic) ||
+            !(st->batch_rkt = rd_kafka_topic_new(rk, topic, NULL))) {
+            pthread_mutex_unlock(&st->batch_lock);
+            return -1;
+        }
+        snprintf(st->batch_topic, sizeof(st->batch_topic), "%s", topic);
+    }
+
+    if (st->batch_cnt == BATCH_MSGS_MAX || st->batch_bytes + len > (size_t)st->batching.batch_max_bytes) {
+        batch_flush_locked(st, now);
+    }
+    if (len > (size_t)st->batching.batch_max_bytes) {
+        pthread_mutex_unlock(&st->batch_lock);
+        return st->batch_cnt ? EAGAIN : -1;
+    }
+    if (st->batch_cnt == BATCH_MSGS_MAX || st->batch_bytes + len > (size_t)st->batching.batch_max_bytes) {
+        pthread_mutex_unlock(&st->batch_lock);
+        return EAGAIN;
+    }
+
+    rd_kafka_message_t *m = &st->batch_msgs[st->batch_cnt];
+    memset(m, 0, sizeof(*m));
+    m->payload = st->batch_buf + st->batch_bytes;
+    m->len = len;
+    memcpy(m->payload, buf, len);
+    st->batch_enq_us[st->batch_cnt] = now;
+    st->batch_bytes += len;
+    if (st->batch_cnt++ == 0) {
+        st->batch_due_us = now + linger;
+        pthread_cond_signal(&st->batch_cond);
+    }
+    atomic_fetch_add(&st->batched_bytes, (long)len);
+    atomic_fetch_add(&st->batched_msgs, 1);
+
+    if (linger == 0) {
+        batch_flush_locked(st, now);
+    }
+    pthread_mutex_unlock(&st->batch_lock);
+    return 0;
+}
+
+/*
+** Linger to aim for, from the measurements of the last tick:
+**  - the queue (or in-flight budget) is filling up: the brokers are the
+**    bottleneck, send fewer, larger requests (linger_max)
+**  - throughput mode: the time a batch takes to fill at the current rate
+**  - latency mode: the same, but no longer than the target leaves after the
+**    librdkafka/broker part of the latency (at least the broker rtt), and
+**    not at all if no other message is expected within the linger
+ */
+static long batching_target_linger(const producer_batching_t *b, double msgs_per_s, double bytes_per_s,
+                                   long dr_latency_us, long rtt_us, long fill_pm) {
+    double fill_us = bytes_per_s > 0 ? b->batch_max_bytes * 1e6 / bytes_per_s : 1e12;
+    double target = fill_us;
+
+    if (fill_pm >= 800) {
+        return (long)b->linger_max_ms * 1000;
+    }
+    if (b->mode == PRODUCER_BATCHING_LATENCY) {
+        long network_us = dr_latency_us > rtt_us ? dr_latency_us : rtt_us;
+        double headroom = (double)b->target_latency_ms * 1000 - network_us;
+        if (headroom < target) {
+            target = headroom;
+        }
+        if (msgs_per_s * target / 1e6 < 2) {
+            target = 0;
+        }
+    }
+    if (target < (double)b->linger_min_ms * 1000) {
+        return (long)b->linger_min_ms * 1000;
+    }
+    if (target > (double)b->linger_max_ms * 1000) {
+        return (long)b->linger_max_ms * 1000;
+    }
+    return (long)target;
+}
+
+/*
+** One controller step: measure the last tick and move the linger halfway
+** towards the target
+ */
+static void batching_tick(rd_kafka_t *rk, producer_state_t *st, int64_t now) {
+    double elapsed_s = (now - st->last_tick_us) / 1e6;
+    long dr_sum = atomic_exchange(&st->dr_latency_us, 0);
+    long dr_cnt = atomic_exchange(&st->dr_latency_cnt, 0);
+    long hold_sum = atomic_exchange(&st->hold_us, 0);
+    long hold_cnt = atomic_exchange(&st->hold_cnt, 0);
+    long bytes = atomic_exchange(&st->batched_bytes, 0);
+    long msgs = atomic_exchange(&st->batched_msgs, 0);
+    long dr_latency = dr_cnt ? dr_sum / dr_cnt : 0;
+    long fill_pm = atomic_load(&st->stats_fill_pm);
+    long linger = atomic_load(&st->linger_us);
+
+    st->last_tick_us = now;
+    if (st->queue_max_msgs > 0) {
+        long outq_pm = (long)rd_kafka_outq_len(rk) * 1000 / st->queue_max_msgs;
+        fill_pm = outq_pm > fill_pm ? outq_pm : fill_pm;
+    }
+    if (st->max_inflight_msgs > 0) {
+        long budget_pm = atomic_load(&st->inflight_msgs) * 1000 / st->max_inflight_msgs;
+        fill_pm = budget_pm > fill_pm ? budget_pm : fill_pm;
+    }
+    if (st->max_inflight_bytes > 0) {
+        long budget_pm = atomic_load(&st->inflight_bytes) * 1000 / st->max_inflight_bytes;
+        fill_pm = budget_pm > fill_pm ? budget_pm : fill_pm;
+    }
+    atomic_store(&st->queue_fill_pm, fill_pm);
+    if (dr_cnt) {
+        atomic_store(&st->latency_us, dr_latency + (hold_cnt ? hold_sum / hold_cnt : 0));
+    }
+    if (msgs == 0) {
+        return; // idle: nothing to learn from
+    }
+
+    long target = batching_target_linger(&st->batching, msgs / elapsed_s, bytes / elapsed_s,
+                                         dr_latency, atomic_load(&st->rtt_us), fill_pm);
+    long next = linger + (target - linger) / 2;
+    if (labs(target - next) < 100) {
+        next = target;
+    }
+    if (next != linger) {
+        atomic_fetch_add(next > linger ? &st->linger_up_cnt : &st->linger_down_cnt, 1);
+        atomic_store(&st->linger_us, next);
+    }
+}
+
+/*
+** Batch thread: sends every batch when its linger is up and runs the
+** controller every BATCHING_TICK_US
+ */
+static void *batch_thread_main(void *arg) {
+    rd_kafka_t *rk = arg;
+    producer_state_t *st = rd_kafka_opaque(rk);
+
+    pthread_mutex_lock(&st->batch_lock);
+    while (atomic_load(&st->batch_running)) {
+        int64_t now = now_us();
+        int64_t wake = st->last_tick_us + BATCHING_TICK_US;
+
+        if (now >= wake) {
+            pthread_mutex_unlock(&st->batch_lock);
+            batching_tick(rk, st, now);
+            pthread_mutex_lock(&st->batch_lock);
+            continue;
+        }
+        if (st->batch_cnt) {
+            if (now >= st->batch_due_us) {
+                batch_flush_locked(st, now);
+                continue;
+            }
+            wake = st->batch_due_us < wake ? st->batch_due_us : wake;
+        }
+
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000;
+        ts.tv_nsec = (wake % 1000000) * 1000;
+        pthread_cond_timedwait(&st->batch_cond, &st->batch_lock, &ts);
+    }
+    batch_flush_locked(st, now_us());
+    pthread_mutex_unlock(&st->batch_lock);
+    return NULL;
+}
+
+/*
+** Create a producer from conf (the producer takes ownership of conf):
+** installs the delivery report and statistics callbacks and starts the
+** delivery report thread
+ */
+rd_kafka_t* new_kafka_producer(rd_kafka_conf_t *conf) {
     rd_kafka_t *rk; // producer instance handle
+    char errstr[512]; // librdkafka API error reporting buffer
+    producer_state_t *st; // backpressure state, passed to the callbacks as opaque
+
+    // set the delivery report callback
+    // this callback will be called once per message to inform the application
+    // if delivery succeeded or failed
+    // See dr_msg_cb() above
+    // The callback is only trigger from rd_kafka_pool() and rd_kafka_flush()
+    rd_kafka_conf_set_dr_msg_cb(conf, dr_msg_cb);
+
+    rd_kafka_conf_set_stats_cb(conf, stats_callback);
+
+    st = producer_state_new();
+    if (!st) {
+        rd_kafka_conf_destroy(conf);
+        return NULL;
+    }
+    rd_kafka_conf_set_opaque(conf, st);
+
+    // create producer instance
+    // NOTE: rd_kafka_new() takes ownership of the conf object
+    // and the application must not reference it again after this call
+    rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (!rk) {
+        fprintf(stderr, "%% Failed to create new producer: %s\n", errstr);
+        producer_state_destroy(st);
+        return NULL;
+    }
+
+    // serve delivery reports from a dedicated thread so producing
+    // never has to poll
+    atomic_store(&st->dr_running, 1);
+    if (pthread_create(&st->dr_thread, NULL, dr_thread_main, rk) != 0) {
+        fprintf(stderr, "%% Failed to start delivery report thread, "
+                "delivery reports are served from publish calls\n");
+        atomic_store(&st->dr_running, 0);
+    } else {
+        st->dr_thread_started = 1;
+    }
+
+    return rk;
+}
+
+int producer_set_batching(rd_kafka_t *rk, const producer_batching_t *batching,
+                          char *errstr, size_t errstr_size);
+void destroy_kafka_producer(rd_kafka_t *rk);
+
+static long env_long(const char *name, long def) {
+    const char *v = getenv(name);
+    return v && *v ? atol(v) : def;
+}
+
+/*
+** Create the producer, batching is configured from the environment:
+** KAFKA_PRODUCER_BATCHING (latency, throughput or off (default)),
+** KAFKA_PRODUCER_TARGET_LATENCY_MS, KAFKA_PRODUCER_LINGER_MIN_MS,
+** KAFKA_PRODUCER_LINGER_MAX_MS, KAFKA_PRODUCER_BATCH_BYTES and
+** KAFKA_PRODUCER_COMPRESSION (compression.codec)
+ */
+rd_kafka_t* init_kafka_producer() {
     rd_kafka_conf_t *conf; // temporary configuration object
     char errstr[512]; // librdkafka API error reporting buffer
+    char value[32];
+    rd_kafka_t *rk;
 
     const char *brokers = "172.17.0.1:9092"; // argument broker list
 
+    producer_batching_t batching;
+    const char *mode = getenv("KAFKA_PRODUCER_BATCHING");
+    const char *compression = getenv("KAFKA_PRODUCER_COMPRESSION");
+
+    // off by default: linger.ms, batch.size and publish_message() stay as they were
+    if (!mode || !*mode || !strcmp(mode, "off")) {
+        batching.mode = PRODUCER_BATCHING_OFF;
+    } else if (!strcmp(mode, "latency")) {
+        batching.mode = PRODUCER_BATCHING_LATENCY;
+    } else if (!strcmp(mode, "throughput")) {
+        batching.mode = PRODUCER_BATCHING_THROUGHPUT;
+    } else {
+        fprintf(stderr, "%% Invalid KAFKA_PRODUCER_BATCHING: %s\n", mode);
+        return NULL;
+    }
+    batching.target_latency_ms = (int)env_long("KAFKA_PRODUCER_TARGET_LATENCY_MS", 20);
+    batching.linger_min_ms = (int)env_long("KAFKA_PRODUCER_LINGER_MIN_MS", 0);
+    batching.linger_max_ms = (int)env_long("KAFKA_PRODUCER_LINGER_MAX_MS", 100);
+    batching.batch_max_bytes = env_long("KAFKA_PRODUCER_BATCH_BYTES", 1000000);
+
     // create kafka client configuration place-holder
     conf = rd_kafka_conf_new();
 
@@ -72,6 +769,29 @@ rd_kafka_t* init_kafka_producer() {
             return NULL;
     }
 
+    // batches are formed by the batching controller: librdkafka only
+    // waits for the lower bound and must fit a whole batch
+    if (batching.mode != PRODUCER_BATCHING_OFF) {
+        snprintf(value, sizeof(value), "%d", batching.linger_min_ms);
+        if (rd_kafka_conf_set(conf, "linger.ms", value, errstr,
+                              sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+                fprintf(stderr, "%s\n", errstr);
+                return NULL;
+        }
+        snprintf(value, sizeof(value), "%ld", batching.batch_max_bytes);
+        if (rd_kafka_conf_set(conf, "batch.size", value, errstr,
+                              sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+                fprintf(stderr, "%s\n", errstr);
+                return NULL;
+        }
+    }
+    if (compression && *compression &&
+        rd_kafka_conf_set(conf, "compression.codec", compression, errstr,
+                          sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            fprintf(stderr, "%s\n", errstr);
+            return NULL;
+    }
+
     size_t cntp;
     const char** conf_dump = rd_kafka_conf_dump(conf, &cntp);
     for (size_t i = 0; i < cntp; i+=2) {
@@ -80,26 +800,366 @@ rd_kafka_t* init_kafka_producer() {
 
     rd_kafka_conf_dump_free(conf_dump, cntp);
 
+    rk = new_kafka_producer(conf);
+    if (rk && producer_set_batching(rk, &batching, errstr, sizeof(errstr)) == -1) {
+        fprintf(stderr, "%% Failed to set up batching: %s\n", errstr);
+        destroy_kafka_producer(rk);
+        return NULL;
+    }
+    return rk;
+}
 
-    // set the delivery report callback
-    // this callback will be called once per message to inform the application
-    // if delivery succeeded or failed
-    // See dr_msg_cb() above
-    // The callback is only trigger from rd_kafka_pool() and rd_kafka_flush()
-    rd_kafka_conf_set_dr_msg_cb(conf, dr_msg_cb);
+/*
+** Limit the messages/bytes that may be in flight (enqueued but delivery
+** report not served yet), 0: unlimited. Publishing beyond the budget
+** returns EAGAIN (or waits in publish_message_timed()).
+ */
+void producer_set_inflight_limits(rd_kafka_t *rk, long max_msgs, long max_bytes) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    st->max_inflight_msgs = max_msgs;
+    st->max_inflight_bytes = max_bytes;
+}
 
-    rd_kafka_conf_set_stats_cb(conf, stats_callback);
+/*
+** Max time publish_message() waits for room
+ */
+void producer_set_block_timeout(rd_kafka_t *rk, int timeout_ms) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    st->block_timeout_ms = timeout_ms;
+}
 
-    // create producer instance
-    // NOTE: rd_kafka_new() takes ownership of the conf object
-    // and the application must not reference it again after this call
-    rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
-    if (!rk) {
-        fprintf(stderr, "%% Failed to create new producer: %s\n", errstr);
-        return NULL;
+/*
+** Called from dr_msg_cb() for every message, after the producer's own
+** bookkeeping. Set it before producing.
+ */
+void producer_set_dr_cb(rd_kafka_t *rk, publish_dr_cb_t *dr_cb, void *dr_opaque) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    st->app_dr_opaque = dr_opaque;
+    st->app_dr_cb = dr_cb;
+}
+
+/*
+** Hold messages published with publish_message*() for a linger that a
+** controller keeps adjusting, within [linger_min_ms, linger_max_ms], to the
+** measured delivery latency, queue fill, message rate and broker rtt (from
+** the statistics, statistics.interval.ms should be set). Batches are handed
+** to librdkafka in one call, librdkafka's own linger.ms should be at most
+** linger_min_ms and batch.size at least batch_max_bytes.
+** Call once, before producing. Use producer_flush() instead of rd_kafka_flush().
+** res: 0 on success, -1 on invalid bounds or if the batch thread could not be
+**      started (errstr is set)
+ */
+int producer_set_batching(rd_kafka_t *rk, const producer_batching_t *batching,
+                          char *errstr, size_t errstr_size) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    char value[32];
+    size_t value_size = sizeof(value);
+
+    if (batching->mode == PRODUCER_BATCHING_OFF) {
+        return 0;
+    }
+    if (st->batching.mode != PRODUCER_BATCHING_OFF) {
+        snprintf(errstr, errstr_size, "batching already set");
+        return -1;
+    }
+    if (batching->linger_min_ms < 0 || batching->linger_max_ms < batching->linger_min_ms ||
+        batching->batch_max_bytes <= 0 ||
+        (batching->mode == PRODUCER_BATCHING_LATENCY && batching->target_latency_ms <= 0)) {
+        snprintf(errstr, errstr_size, "invalid batching bounds");
+        return -1;
     }
 
-    return rk;
+    st->batch_buf = malloc(batching->batch_max_bytes);
+    st->batch_msgs = calloc(BATCH_MSGS_MAX, sizeof(*st->batch_msgs));
+    st->batch_enq_us = calloc(BATCH_MSGS_MAX, sizeof(*st->batch_enq_us));
+    st->stats_snap = calloc(1, sizeof(*st->stats_snap));
+    if (!st->batch_buf || !st->batch_msgs || !st->batch_enq_us || !st->stats_snap) {
+        snprintf(errstr, errstr_size, "failed to allocate the batch buffer");
+        return -1;
+    }
+    if (rd_kafka_conf_get(rd_kafka_conf(rk), "queue.buffering.max.messages", value,
+                          &value_size) == RD_KAFKA_CONF_OK) {
+        st->queue_max_msgs = atol(value);
+    }
+    st->last_tick_us = now_us();
+    atomic_store(&st->linger_us, (long)batching->linger_min_ms * 1000);
+    st->batching = *batching;
+
+    atomic_store(&st->batch_running, 1);
+    if (pthread_create(&st->batch_thread, NULL, batch_thread_main, rk) != 0) {
+        snprintf(errstr, errstr_size, "failed to start the batch thread");
+        atomic_store(&st->batch_running, 0);
+        st->batching.mode = PRODUCER_BATCHING_OFF;
+        return -1;
+    }
+    st->batch_thread_started = 1;
+    return 0;
+}
+
+/*
+** Send the held messages, then rd_kafka_flush()
+** res: rd_kafka_flush() result
+ */
+rd_kafka_resp_err_t producer_flush(rd_kafka_t *rk, int timeout_ms) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    int64_t deadline = now_us() + (int64_t)timeout_ms * 1000;
+    int held = 0;
+
+    if (st->batching.mode == PRODUCER_BATCHING_OFF) {
+        return rd_kafka_flush(rk, timeout_ms);
+    }
+    do {
+        pthread_mutex_lock(&st->batch_lock);
+        batch_flush_locked(st, now_us());
+        held = st->batch_cnt;
+        pthread_mutex_unlock(&st->batch_lock);
+        if (held) {
+            // wait for room in the queue
+            rd_kafka_flush(rk, 100);
+        }
+    } while (held && now_us() < deadline);
+
+    int64_t left_ms = (deadline - now_us()) / 1000;
+    return rd_kafka_flush(rk, left_ms > 0 ? (int)left_ms : 0);
+}
+
+void producer_get_stats(rd_kafka_t *rk, producer_stats_t *stats);
+
+/*
+** Backpressure counters appended to the librdkafka statistics on /metrics
+ */
+static void producer_metrics(metrics_buf_t *buf, void *opaque) {
+    producer_stats_t stats;
+
+    producer_get_stats((rd_kafka_t *)opaque, &stats);
+    metrics_buf_printf(buf,
+        "# TYPE producer_inflight_msgs gauge\nproducer_inflight_msgs %ld\n"
+        "# TYPE producer_inflight_bytes gauge\nproducer_inflight_bytes %ld\n"
+        "# TYPE producer_queue_full_total counter\nproducer_queue_full_total %ld\n"
+        "# TYPE producer_budget_full_total counter\nproducer_budget_full_total %ld\n"
+        "# TYPE producer_blocked_total counter\nproducer_blocked_total %ld\n"
+        "# TYPE producer_blocked_us_total counter\nproducer_blocked_us_total %ld\n"
+        "# TYPE producer_timeout_total counter\nproducer_timeout_total %ld\n"
+        "# TYPE producer_partition_lookups_total counter\nproducer_partition_lookups_total %ld\n",
+        stats.inflight_msgs, stats.inflight_bytes, stats.queue_full_cnt, stats.budget_full_cnt,
+        stats.blocked_cnt, stats.blocked_us, stats.timeout_cnt, stats.partition_lookup_cnt);
+
+    if (((producer_state_t *)rd_kafka_opaque((rd_kafka_t *)opaque))->batching.mode !=
+        PRODUCER_BATCHING_OFF) {
+        metrics_buf_printf(buf,
+            "# TYPE producer_batching_linger_us gauge\nproducer_batching_linger_us %ld\n"
+            "# TYPE producer_batching_latency_us gauge\nproducer_batching_latency_us %ld\n"
+            "# TYPE producer_batching_queue_fill gauge\nproducer_batching_queue_fill %.3f\n"
+            "# TYPE producer_batching_rtt_us gauge\nproducer_batching_rtt_us %ld\n"
+            "# TYPE producer_batches_total counter\nproducer_batches_total %ld\n"
+            "# TYPE producer_batch_msgs_total counter\nproducer_batch_msgs_total %ld\n"
+            "# TYPE producer_batching_adjustments_total counter\n"
+            "producer_batching_adjustments_total{direction=\"up\"} %ld\n"
+            "producer_batching_adjustments_total{direction=\"down\"} %ld\n",
+            stats.linger_us, stats.latency_us, stats.queue_fill_pm / 1000.0, stats.rtt_us,
+            stats.batch_cnt, stats.batch_msgs, stats.linger_up_cnt, stats.linger_down_cnt);
+    }
+}
+
+/*
+** Serve the parsed statistics (statistics.interval.ms must be set) and the
+** backpressure counters in Prometheus format on http://<host>:<port>/metrics
+** res: 0 on success, -1 if the server could not be started (errstr is set)
+ */
+int producer_start_metrics(rd_kafka_t *rk, int port, char *errstr, size_t errstr_size) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    metrics_server_t *metrics;
+
+    if (atomic_load(&st->metrics)) {
+        snprintf(errstr, errstr_size, "metrics server already started");
+        return -1;
+    }
+    metrics = metrics_server_start(port, errstr, errstr_size);
+    if (!metrics) {
+        return -1;
+    }
+    metrics_server_set_extra_cb(metrics, producer_metrics, rk);
+    atomic_store(&st->metrics, metrics);
+    return 0;
+}
+
+void producer_get_stats(rd_kafka_t *rk, producer_stats_t *stats) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    stats->inflight_msgs = atomic_load(&st->inflight_msgs);
+    stats->inflight_bytes = atomic_load(&st->inflight_bytes);
+    stats->queue_full_cnt = atomic_load(&st->queue_full_cnt);
+    stats->budget_full_cnt = atomic_load(&st->budget_full_cnt);
+    stats->blocked_cnt = atomic_load(&st->blocked_cnt);
+    stats->timeout_cnt = atomic_load(&st->timeout_cnt);
+    stats->blocked_us = atomic_load(&st->blocked_us);
+    stats->linger_us = atomic_load(&st->linger_us);
+    stats->latency_us = atomic_load(&st->latency_us);
+    stats->queue_fill_pm = atomic_load(&st->queue_fill_pm);
+    stats->rtt_us = atomic_load(&st->rtt_us);
+    stats->batch_cnt = atomic_load(&st->batch_total);
+    stats->batch_msgs = atomic_load(&st->batch_msgs_total);
+    stats->linger_up_cnt = atomic_load(&st->linger_up_cnt);
+    stats->linger_down_cnt = atomic_load(&st->linger_down_cnt);
+    stats->partition_lookup_cnt = atomic_load(&st->partition_lookup_cnt);
+}
+
+/*
+** Stop the delivery report thread and destroy the producer,
+** call producer_flush() first to wait for outstanding messages
+ */
+void destroy_kafka_producer(rd_kafka_t *rk) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+
+    if (st->batch_thread_started) {
+        pthread_mutex_lock(&st->batch_lock);
+        atomic_store(&st->batch_running, 0);
+        pthread_cond_signal(&st->batch_cond);
+        pthread_mutex_unlock(&st->batch_lock);
+        pthread_join(st->batch_thread, NULL);
+        st->batch_thread_started = 0;
+    }
+    if (st->batch_cnt) {
+        fprintf(stderr, "%% Dropped %d held message(s): no room in the queue\n", st->batch_cnt);
+        inflight_release(st, st->batch_cnt, (long)st->batch_bytes);
+        st->batch_cnt = 0;
+    }
+    if (st->batch_rkt) {
+        rd_kafka_topic_destroy(st->batch_rkt);
+        st->batch_rkt = NULL;
+    }
+    for (topic_cache_t *tc = atomic_load(&st->topics), *next; tc; tc = next) {
+        next = tc->next;
+        rd_kafka_topic_destroy(tc->rkt);
+        free(tc);
+    }
+    atomic_store(&st->topics, NULL);
+
+    if (st->dr_thread_started) {
+        atomic_store(&st->dr_running, 0);
+        pthread_join(st->dr_thread, NULL);
+        st->dr_thread_started = 0;
+    }
+    rd_kafka_destroy(rk);
+    if (atomic_load(&st->metrics)) {
+        metrics_server_stop(atomic_load(&st->metrics));
+    }
+    producer_state_destroy(st);
+}
+
+/*
+** Enqueue one copied message without waiting
+** res: 0 on success, EAGAIN if there is no room (retry later), EIO on other errors
+ */
+int publish_message_try(rd_kafka_t *rk, const void *buf, size_t len, const char *topic) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    rd_kafka_resp_err_t err;
+
+    if (!inflight_reserve(st, 1, (long)len)) {
+        atomic_fetch_add(&st->budget_full_cnt, 1);
+        return EAGAIN;
+    }
+
+    if (st->batching.mode != PRODUCER_BATCHING_OFF) {
+        int res = batch_add(rk, st, buf, len, topic);
+        if (res == EAGAIN) {
+            // the QUEUE_FULL result was counted by batch_flush_locked()
+            atomic_fetch_sub(&st->inflight_msgs, 1);
+            atomic_fetch_sub(&st->inflight_bytes, (long)len);
+            return EAGAIN;
+        }
+        if (res == 0) {
+            return 0;
+        }
+        // larger than a batch: enqueued on its own
+    }
+
+    err = rd_kafka_producev(
+        rk,
+        RD_KAFKA_V_TOPIC(topic),
+        RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+        RD_KAFKA_V_VALUE((void *)buf, len),
+        RD_KAFKA_V_OPAQUE(NULL),
+        RD_KAFKA_V_END);
+
+    if (err) {
+        // never enqueued: no delivery report will release it
+        atomic_fetch_sub(&st->inflight_msgs, 1);
+        atomic_fetch_sub(&st->inflight_bytes, (long)len);
+
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            /* The internal queue is limited by the configuration property
+             * queue.buffering.max.messages and
+             * queue.buffering.max.kbytes
+             */
+            atomic_fetch_add(&st->queue_full_cnt, 1);
+            return EAGAIN;
+        }
+        fprintf(stderr, "%%Failed to produce to topic: %s: %s\n", topic, rd_kafka_err2str(err));
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+** Wait for room after a publish call returned EAGAIN, *start is 0 before
+** the first wait of a publish
+** res: 0 to retry, ETIMEDOUT once timeout_ms have passed since the first wait
+ */
+static int publish_wait_room(rd_kafka_t *rk, producer_state_t *st, int64_t *start,
+                             int timeout_ms) {
+    int64_t now = now_us();
+    int64_t deadline;
+
+    if (!*start) {
+        *start = now;
+        atomic_fetch_add(&st->blocked_cnt, 1);
+    }
+    deadline = *start + (int64_t)timeout_ms * 1000;
+    if (now >= deadline) {
+        atomic_fetch_add(&st->timeout_cnt, 1);
+        return ETIMEDOUT;
+    }
+
+    if (!st->dr_thread_started) {
+        // nobody else serves delivery reports: free up room ourselves
+        rd_kafka_poll(rk, (int)((deadline - now) / 1000) + 1);
+        return 0;
+    }
+
+    // wait until a delivery report frees up room (or the deadline)
+    struct timespec ts;
+    int64_t wake = now + 10 * 1000 < deadline ? now + 10 * 1000 : deadline;
+    ts.tv_sec = wake / 1000000;
+    ts.tv_nsec = (wake % 1000000) * 1000;
+
+    atomic_fetch_add(&st->waiters, 1);
+    pthread_mutex_lock(&st->lock);
+    pthread_cond_timedwait(&st->room_cond, &st->lock, &ts);
+    pthread_mutex_unlock(&st->lock);
+    atomic_fetch_sub(&st->waiters, 1);
+    return 0;
+}
+
+/*
+** Enqueue one copied message, waiting at most timeout_ms for room
+** res: 0 on success, ETIMEDOUT if there was no room in time, EIO on other errors
+ */
+int publish_message_timed(rd_kafka_t *rk, const void *buf, size_t len, const char *topic,
+                          int timeout_ms) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    int64_t start = 0;
+    int res;
+
+    while ((res = publish_message_try(rk, buf, len, topic)) == EAGAIN) {
+        if ((res = publish_wait_room(rk, st, &start, timeout_ms)) != 0) {
+            break;
+        }
+    }
+
+    if (start) {
+        atomic_fetch_add(&st->blocked_us, (long)(now_us() - start));
+    }
+    return res;
 }
 
 /*
@@ -107,12 +1167,14 @@ rd_kafka_t* init_kafka_producer() {
 ** 1: queue is empty
  */
 int publish_message(rd_kafka_t* rk, char* buf, const char* topic) {
-    rd_kafka_resp_err_t err;
+    producer_state_t *st = rd_kafka_opaque(rk);
     size_t len = strlen(buf);
 
     if (len == 0) {
         // empty line: only serve delivery reports
-        rd_kafka_poll(rk, 0 /*non blocking*/);
+        if (!st->dr_thread_started) {
+            rd_kafka_poll(rk, 0 /*non blocking*/);
+        }
         return 1;
     }
 
@@ -124,50 +1186,541 @@ int publish_message(rd_kafka_t* rk, char* buf, const char* topic) {
         ** The previously registered delivery report callback
         ** (dr_msg_cb) is used to signal back to the application
         ** when the message has been delivery (or failed)
+        **
+        ** If the internal queue (or the in-flight budget) is full, wait for
+        ** delivery reports to free up room, but no longer than block_timeout_ms
          */
-retry:
-     err = rd_kafka_producev(
-         /* Producer handle */
-         rk,
-         /* Topic name */
-         RD_KAFKA_V_TOPIC(topic),
-         /* Make a copy of the payload */
-         RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-         /* Message value and length */
-         RD_KAFKA_V_VALUE(buf, len),
-         /*
-         ** Per-Message opaque, provided in delivery report callback
-         ** as msg_opaque
-          */
-          RD_KAFKA_V_OPAQUE(NULL),
-         /* End sentinel */
-         RD_KAFKA_V_END);
-
-     if (err) {
-         // failed to enqueue message for producing
-         fprintf(stderr, "%%Failed to produce to topic: %s: %s\n", topic, rd_kafka_err2str(err));
-
-         if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
-             /* if the internal queue is full, wait for messages to be delivery and retry
-              * The internal queue represent both messages to be sent and messages that have been sent or failed
-              * awaiting their delivery report callback to be called
-              *
-              * The internal queue is limited by the configuration property
-              * queue.buffering.max.messages and
-              * queue.buffering.max.kbytes
-              */
-             rd_kafka_poll(rk, 1000 /* block for max 1000ms */);
-             goto retry;
-         }
-     }
-     // else {
-     //    fprintf(stderr, "%% Enqueued message (%zd bytes)"
-     //                "for topic %s\n",
-     //                len, topic);
-     // }
-
-    rd_kafka_poll(rk, 0 /*non-blocking*/);
+    if (publish_message_timed(rk, buf, len, topic, st->block_timeout_ms) == ETIMEDOUT) {
+        fprintf(stderr, "%%Failed to produce to topic: %s: no room within %dms\n",
+                topic, st->block_timeout_ms);
+    }
+
+    if (!st->dr_thread_started) {
+        rd_kafka_poll(rk, 0 /*non-blocking*/);
+    }
+    return 0;
+}
+
+/*
+** Publish a batch of messages with a single rd_kafka_produce_batch() call
+**
+** release_cb == NULL: payloads are copied, the caller keeps ownership.
+** release_cb != NULL: payloads are not copied, ownership of every enqueued
+**   payload passes to librdkafka and release_cb is called (from the delivery
+**   report) once it is no longer referenced. Payloads that failed to enqueue
+**   stay owned by the caller.
+**
+** Per message results are returned in msgs[i].err, the caller can retry the
+** ones that failed with RD_KAFKA_RESP_ERR__QUEUE_FULL.
+**
+** res: number of messages enqueued, -1 on error
+ */
+int publish_batch(rd_kafka_t *rk, const char *topic, publish_msg_t *msgs, int cnt,
+                  publish_release_cb_t *release_cb, void *release_opaque) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    rd_kafka_topic_t *rkt;
+    rd_kafka_message_t *rkmessages;
+    publish_release_t *rel = NULL;
+    int msgflags = RD_KAFKA_MSG_F_COPY;
+    int enqueued;
+
+    if (cnt <= 0) {
+        return 0;
+    }
+
+    // held messages go first
+    if (st->batching.mode != PRODUCER_BATCHING_OFF) {
+        pthread_mutex_lock(&st->batch_lock);
+        batch_flush_locked(st, now_us());
+        pthread_mutex_unlock(&st->batch_lock);
+    }
+
+    rkt = rd_kafka_topic_new(rk, topic, NULL);
+    if (!rkt) {
+        fprintf(stderr, "%% Failed to create topic object: %s: %s\n", topic,
+                rd_kafka_err2str(rd_kafka_last_error()));
+        return -1;
+    }
+
+    rkmessages = calloc(cnt, sizeof(*rkmessages));
+    if (!rkmessages) {
+        rd_kafka_topic_destroy(rkt);
+        return -1;
+    }
+
+    if (release_cb) {
+        rel = malloc(sizeof(*rel));
+        if (!rel) {
+            free(rkmessages);
+            rd_kafka_topic_destroy(rkt);
+            return -1;
+        }
+        rel->release_cb = release_cb;
+        rel->release_opaque = release_opaque;
+        // one reference per message plus one held by this call
+        atomic_init(&rel->refcnt, cnt + 1);
+        msgflags = 0;
+    }
+
+    long batch_bytes = 0;
+    for (int i = 0; i < cnt; i++) {
+        rkmessages[i].payload = msgs[i].payload;
+        rkmessages[i].len = msgs[i].len;
+        rkmessages[i]._private = rel; // per-message opaque, see dr_msg_cb()
+        batch_bytes += (long)msgs[i].len;
+    }
+
+    // released from dr_msg_cb(), publish_batch() does not wait for budget
+    atomic_fetch_add(&st->inflight_msgs, cnt);
+    atomic_fetch_add(&st->inflight_bytes, batch_bytes);
+
+    rd_kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA, msgflags, rkmessages, cnt);
+
+    enqueued = 0;
+    long failed_bytes = 0;
+    for (int i = 0; i < cnt; i++) {
+        msgs[i].err = rkmessages[i].err;
+        if (!rkmessages[i].err) {
+            enqueued++;
+            continue;
+        }
+        failed_bytes += (long)msgs[i].len;
+        if (rkmessages[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            atomic_fetch_add(&st->queue_full_cnt, 1);
+        }
+    }
+    // no delivery report for the messages that were not enqueued
+    inflight_release(st, cnt - enqueued, failed_bytes);
+
+    if (rel) {
+        // drop the references of the messages that were not enqueued and our own
+        publish_release_unref(rel, cnt - enqueued + 1);
+    }
+
+    if (enqueued < cnt) {
+        fprintf(stderr, "%% Failed to produce %d/%d message(s) to topic %s\n",
+                cnt - enqueued, cnt, topic);
+    }
+
+    free(rkmessages);
+    rd_kafka_topic_destroy(rkt);
+
+    // serve delivery reports
+    if (!st->dr_thread_started) {
+        rd_kafka_poll(rk, 0 /*non-blocking*/);
+    }
+    return enqueued;
+}
+
+/*
+** murmur2 of the Java client (Utils.murmur2()), bit for bit
+ */
+static uint32_t murmur2(const void *key, size_t len) {
+    const uint32_t m = 0x5bd1e995;
+    const unsigned char *data = key;
+    uint32_t h = 0x9747b28c ^ (uint32_t)len;
+    size_t end = len & ~(size_t)3;
+
+    for (size_t i = 0; i < end; i += 4) {
+        uint32_t k = (uint32_t)data[i] | (uint32_t)data[i + 1] << 8 |
+                     (uint32_t)data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+        k *= m;
+        k ^= k >> 24;
+        k *= m;
+        h *= m;
+        h ^= k;
+    }
+    switch (len & 3) {
+    case 3:
+        h ^= (uint32_t)data[end + 2] << 16;
+        // fall through
+    case 2:
+        h ^= (uint32_t)data[end + 1] << 8;
+        // fall through
+    case 1:
+        h ^= data[end];
+        h *= m;
+    }
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+/*
+** Partition of a key: the positive murmur2 hash modulo the partition count,
+** the same mapping as the Java producer's default partitioner (and
+** librdkafka's murmur2 partitioners)
+ */
+int32_t producer_key_partition(const void *key, size_t key_len, int partition_cnt) {
+    return (int32_t)((murmur2(key, key_len) & 0x7fffffff) % (uint32_t)partition_cnt);
+}
+
+/*
+** Topic of the keyed API, created on its first use
+** res: NULL if the topic object could not be created
+ */
+static topic_cache_t *topic_cache_get(rd_kafka_t *rk, producer_state_t *st, const char *topic) {
+    topic_cache_t *tc;
+
+    for (tc = atomic_load(&st->topics); tc; tc = tc->next) {
+        if (!strcmp(tc->name, topic)) {
+            return tc;
+        }
+    }
+
+    pthread_mutex_lock(&st->topic_lock);
+    // may have been added meanwhile
+    for (tc = atomic_load(&st->topics); tc; tc = tc->next) {
+        if (!strcmp(tc->name, topic)) {
+            break;
+        }
+    }
+    if (!tc) {
+        size_t size = strlen(topic) + 1;
+        tc = malloc(sizeof(*tc) + size);
+        if (tc && !(tc->rkt = rd_kafka_topic_new(rk, topic, NULL))) {
+            free(tc);
+            tc = NULL;
+        }
+        if (tc) {
+            memcpy(tc->name, topic, size);
+            atomic_init(&tc->partition_cnt, 0);
+            atomic_init(&tc->looked_up_us, -PARTITION_CNT_TTL_US);
+            atomic_init(&tc->looking_up, 0);
+            tc->next = atomic_load(&st->topics);
+            atomic_store(&st->topics, tc);
+        }
+    }
+    pthread_mutex_unlock(&st->topic_lock);
+
+    if (!tc) {
+        fprintf(stderr, "%% Failed to create topic object: %s: %s\n", topic,
+                rd_kafka_err2str(rd_kafka_last_error()));
+    }
+    return tc;
+}
+
+/*
+** Partition count of a topic, looked up with a metadata request on the first
+** use and PARTITION_CNT_TTL_US after every lookup (partitions may be added).
+** While one caller looks up the others go on with the known count, a failed
+** lookup is retried PARTITION_CNT_RETRY_US later.
+** res: partition count, 0 if not known
+ */
+static int topic_partition_cnt(rd_kafka_t *rk, producer_state_t *st, topic_cache_t *tc) {
+    const struct rd_kafka_metadata *md = NULL;
+    rd_kafka_resp_err_t err;
+    int cnt = atomic_load(&tc->partition_cnt);
+    int owner;
+
+    if (now_us() - atomic_load(&tc->looked_up_us) < PARTITION_CNT_TTL_US) {
+        return cnt;
+    }
+    owner = !atomic_exchange(&tc->looking_up, 1);
+    if (!owner && cnt > 0) {
+        return cnt;
+    }
+
+    atomic_fetch_add(&st->partition_lookup_cnt, 1);
+    err = rd_kafka_metadata(rk, 0, tc->rkt, &md, PARTITION_CNT_TIMEOUT_MS);
+    if (!err && md->topic_cnt == 1 && !md->topics[0].err && md->topics[0].partition_cnt > 0) {
+        cnt = md->topics[0].partition_cnt;
+        atomic_store(&tc->partition_cnt, cnt);
+        atomic_store(&tc->looked_up_us, now_us());
+    } else {
+        if (!err) {
+            err = md->topic_cnt == 1 && md->topics[0].err ? md->topics[0].err
+                                                          : RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION;
+        }
+        fprintf(stderr, "%% Failed to look up the partitions of topic %s: %s\n", tc->name,
+                rd_kafka_err2str(err));
+        atomic_store(&tc->looked_up_us, now_us() - PARTITION_CNT_TTL_US + PARTITION_CNT_RETRY_US);
+    }
+    if (md) {
+        rd_kafka_metadata_destroy(md);
+    }
+    if (owner) {
+        atomic_store(&tc->looking_up, 0);
+    }
+    return cnt;
+}
+
+/*
+** Partition of a keyed message, RD_KAFKA_PARTITION_UA if it has no key
+** res: 0 on success, EIO if the partition count is not known
+ */
+static int keyed_partition(rd_kafka_t *rk, producer_state_t *st, topic_cache_t *tc,
+                           const void *key, size_t key_len, int32_t *partition) {
+    int cnt;
+
+    *partition = RD_KAFKA_PARTITION_UA;
+    if (!key) {
+        return 0;
+    }
+    if ((cnt = topic_partition_cnt(rk, st, tc)) <= 0) {
+        return EIO;
+    }
+    *partition = producer_key_partition(key, key_len, cnt);
+    return 0;
+}
+
+/*
+** Enqueue one copied message to a partition with rd_kafka_producev(),
+** the budget must be reserved
+ */
+static rd_kafka_resp_err_t keyed_produce(rd_kafka_t *rk, topic_cache_t *tc, int32_t partition,
+                                         const void *key, size_t key_len, const void *buf,
+                                         size_t len, const publish_header_t *headers,
+                                         int header_cnt) {
+    rd_kafka_headers_t *hdrs = NULL;
+    rd_kafka_resp_err_t err;
+
+    if (header_cnt > 0) {
+        hdrs = rd_kafka_headers_new(header_cnt);
+        for (int i = 0; i < header_cnt; i++) {
+            rd_kafka_header_add(hdrs, headers[i].name, -1, headers[i].value,
+                                headers[i].value ? (ssize_t)headers[i].size : 0);
+        }
+    }
+
+    err = rd_kafka_producev(
+        rk,
+        RD_KAFKA_V_RKT(tc->rkt),
+        RD_KAFKA_V_PARTITION(partition),
+        RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+        RD_KAFKA_V_KEY((void *)key, key_len),
+        RD_KAFKA_V_VALUE((void *)buf, len),
+        RD_KAFKA_V_HEADERS(hdrs),
+        RD_KAFKA_V_OPAQUE(NULL),
+        RD_KAFKA_V_END);
+
+    // on success the headers are owned by the message
+    if (err && hdrs) {
+        rd_kafka_headers_destroy(hdrs);
+    }
+    return err;
+}
+
+static int keyed_try(rd_kafka_t *rk, producer_state_t *st, topic_cache_t *tc, int32_t partition,
+                     const void *key, size_t key_len, const void *buf, size_t len,
+                     const publish_header_t *headers, int header_cnt) {
+    rd_kafka_resp_err_t err;
+
+    if (!inflight_reserve(st, 1, (long)len)) {
+        atomic_fetch_add(&st->budget_full_cnt, 1);
+        return EAGAIN;
+    }
+
+    err = keyed_produce(rk, tc, partition, key, key_len, buf, len, headers, header_cnt);
+    if (err) {
+        // never enqueued: no delivery report will release it
+        atomic_fetch_sub(&st->inflight_msgs, 1);
+        atomic_fetch_sub(&st->inflight_bytes, (long)len);
+
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            atomic_fetch_add(&st->queue_full_cnt, 1);
+            return EAGAIN;
+        }
+        fprintf(stderr, "%%Failed to produce to topic: %s: %s\n", tc->name, rd_kafka_err2str(err));
+        return EIO;
+    }
     return 0;
 }
 
+/*
+** Enqueue one copied message with a key and headers without waiting
+**
+** A keyed message goes to the partition the Java producer would pick for
+** its key (see producer_key_partition()), computed here from the cached
+** partition count of the topic: the first message to a topic waits for a
+** metadata request. key == NULL: no key, librdkafka's partitioner picks the
+** partition. Keyed messages are not held by the adaptive batching, use
+** publish_keyed_batch() to enqueue many at once.
+**
+** res: 0 on success, EAGAIN if there is no room (retry later), EIO on other errors
+ */
+int publish_keyed_try(rd_kafka_t *rk, const char *topic, const void *key, size_t key_len,
+                      const void *buf, size_t len, const publish_header_t *headers,
+                      int header_cnt) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    topic_cache_t *tc = topic_cache_get(rk, st, topic);
+    int32_t partition;
+
+    if (!tc || keyed_partition(rk, st, tc, key, key_len, &partition)) {
+        return EIO;
+    }
+    return keyed_try(rk, st, tc, partition, key, key_len, buf, len, headers, header_cnt);
+}
+
+/*
+** publish_keyed_try(), waiting at most timeout_ms for room
+** res: 0 on success, ETIMEDOUT if there was no room in time, EIO on other errors
+ */
+int publish_keyed_timed(rd_kafka_t *rk, const char *topic, const void *key, size_t key_len,
+                        const void *buf, size_t len, const publish_header_t *headers,
+                        int header_cnt, int timeout_ms) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    topic_cache_t *tc = topic_cache_get(rk, st, topic);
+    int32_t partition;
+    int64_t start = 0;
+    int res;
+
+    if (!tc || keyed_partition(rk, st, tc, key, key_len, &partition)) {
+        return EIO;
+    }
+    // the key is hashed once, retries only wait for room
+    while ((res = keyed_try(rk, st, tc, partition, key, key_len, buf, len, headers,
+                            header_cnt)) == EAGAIN) {
+        if ((res = publish_wait_room(rk, st, &start, timeout_ms)) != 0) {
+            break;
+        }
+    }
+
+    if (start) {
+        atomic_fetch_add(&st->blocked_us, (long)(now_us() - start));
+    }
+    if (!st->dr_thread_started) {
+        rd_kafka_poll(rk, 0 /*non-blocking*/);
+    }
+    return res;
+}
+
+/*
+** Publish a batch of keyed messages, payloads are copied
+**
+** The partition of every message is computed once, then the messages are
+** grouped by partition (keeping their order within a partition) and every
+** group is enqueued with one rd_kafka_produce_batch() call to its partition:
+** librdkafka appends it to the partition queue at once instead of message by
+** message, so its batches fill with fewer calls and wakeups. Groups with
+** headers are enqueued message by message, rd_kafka_produce_batch() does not
+** take headers. Unkeyed messages form one group left to librdkafka's
+** partitioner.
+**
+** Per message results are returned in msgs[i].partition and msgs[i].err, the
+** caller can retry the ones that failed with RD_KAFKA_RESP_ERR__QUEUE_FULL.
+**
+** res: number of messages enqueued, -1 on error
+ */
+int publish_keyed_batch(rd_kafka_t *rk, const char *topic, publish_keyed_msg_t *msgs, int cnt) {
+    producer_state_t *st = rd_kafka_opaque(rk);
+    topic_cache_t *tc;
+    rd_kafka_message_t *rkmessages;
+    int *order, *group_end;
+    int partition_cnt = 0;
+    int enqueued = 0;
+
+    if (cnt <= 0) {
+        return 0;
+    }
+    if (!(tc = topic_cache_get(rk, st, topic))) {
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++) {
+        if (msgs[i].key) {
+            if ((partition_cnt = topic_partition_cnt(rk, st, tc)) <= 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    // held messages go first
+    if (st->batching.mode != PRODUCER_BATCHING_OFF) {
+        pthread_mutex_lock(&st->batch_lock);
+        batch_flush_locked(st, now_us());
+        pthread_mutex_unlock(&st->batch_lock);
+    }
 
+    // group p < partition_cnt: partition p, group partition_cnt: no key
+    rkmessages = calloc(cnt, sizeof(*rkmessages));
+    order = malloc(cnt * sizeof(*order));
+    group_end = calloc(partition_cnt + 2, sizeof(*group_end));
+    if (!rkmessages || !order || !group_end) {
+        free(rkmessages);
+        free(order);
+        free(group_end);
+        return -1;
+    }
+
+    long batch_bytes = 0;
+    for (int i = 0; i < cnt; i++) {
+        publish_keyed_msg_t *m = &msgs[i];
+        m->partition = m->key ? producer_key_partition(m->key, m->key_len, partition_cnt)
+                              : RD_KAFKA_PARTITION_UA;
+        group_end[(m->key ? m->partition : partition_cnt) + 1]++;
+        batch_bytes += (long)m->len;
+    }
+    for (int g = 0; g <= partition_cnt; g++) {
+        group_end[g + 1] += group_end[g];
+    }
+    // counting sort, stable: messages with the same key keep their order.
+    // group_end[g] moves from the start to the end of group g
+    for (int i = 0; i < cnt; i++) {
+        publish_keyed_msg_t *m = &msgs[i];
+        int j = group_end[m->key ? m->partition : partition_cnt]++;
+        order[j] = i;
+        rkmessages[j].payload = (void *)m->payload;
+        rkmessages[j].len = m->len;
+        rkmessages[j].key = (void *)m->key;
+        rkmessages[j].key_len = m->key_len;
+    }
+
+    // released from dr_msg_cb(), publish_keyed_batch() does not wait for budget
+    atomic_fetch_add(&st->inflight_msgs, cnt);
+    atomic_fetch_add(&st->inflight_bytes, batch_bytes);
+
+    for (int g = 0, begin = 0; g <= partition_cnt; begin = group_end[g++]) {
+        int32_t partition = g < partition_cnt ? g : RD_KAFKA_PARTITION_UA;
+        int headers = 0;
+
+        for (int j = begin; j < group_end[g] && !headers; j++) {
+            headers = msgs[order[j]].header_cnt > 0;
+        }
+        if (!headers) {
+            if (group_end[g] > begin) {
+                rd_kafka_produce_batch(tc->rkt, partition, RD_KAFKA_MSG_F_COPY,
+                                       rkmessages + begin, group_end[g] - begin);
+            }
+            continue;
+        }
+        for (int j = begin; j < group_end[g]; j++) {
+            publish_keyed_msg_t *m = &msgs[order[j]];
+            rkmessages[j].err = keyed_produce(rk, tc, partition, m->key, m->key_len, m->payload,
+                                              m->len, m->headers, m->header_cnt);
+        }
+    }
+
+    long failed_bytes = 0;
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    for (int j = 0; j < cnt; j++) {
+        msgs[order[j]].err = rkmessages[j].err;
+        if (!rkmessages[j].err) {
+            enqueued++;
+            continue;
+        }
+        err = rkmessages[j].err;
+        failed_bytes += (long)rkmessages[j].len;
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            atomic_fetch_add(&st->queue_full_cnt, 1);
+        }
+    }
+    // no delivery report for the messages that were not enqueued
+    inflight_release(st, cnt - enqueued, failed_bytes);
+
+    if (enqueued < cnt) {
+        fprintf(stderr, "%% Failed to produce %d/%d message(s) to topic %s: %s\n",
+                cnt - enqueued, cnt, topic, rd_kafka_err2str(err));
+    }
+
+    free(rkmessages);
+    free(order);
+    free(group_end);
+
+    // serve delivery reports
+    if (!st->dr_thread_started) {
+        rd_kafka_poll(rk, 0 /*non-blocking*/);
+    }
+    return enqueued;
+}
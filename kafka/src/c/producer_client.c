@@ -11,8 +11,55 @@
 
 #include "producer.c"
 
+#define MAX_HEADERS 16
+
+static volatile sig_atomic_t run = 1;
+
+// signal termination of program
+static void stop(int sig) {
+    run = 0;
+    fclose(stdin); // abort fgets()
+}
+
+/*
+** Parse KAFKA_PRODUCER_HEADERS ("name=value,name=value") into headers,
+** buf holds the names and values
+** res: number of headers
+ */
+static int parse_headers(const char *env, char *buf, size_t size, publish_header_t *headers) {
+    int cnt = 0;
+
+    if (!env || !*env) {
+        return 0;
+    }
+    snprintf(buf, size, "%s", env);
+    for (char *tok = strtok(buf, ","); tok && cnt < MAX_HEADERS; tok = strtok(NULL, ",")) {
+        char *value = strchr(tok, '=');
+        if (value) {
+            *value++ = '\0';
+        }
+        headers[cnt].name = tok;
+        headers[cnt].value = value;
+        headers[cnt].size = value ? strlen(value) : 0;
+        cnt++;
+    }
+    return cnt;
+}
+
 int main(int argc, char **argv) {
     rd_kafka_t *rk = init_kafka_producer();
+    if (!rk) {
+        return 1;
+    }
+
+    // optional Prometheus endpoint for the producer statistics
+    const char *metrics_port = getenv("KAFKA_METRICS_PORT");
+    if (metrics_port && atoi(metrics_port) > 0) {
+        char errstr[256];
+        if (producer_start_metrics(rk, atoi(metrics_port), errstr, sizeof(errstr)) == -1) {
+            fprintf(stderr, "%% Failed to start metrics server: %s\n", errstr);
+        }
+    }
     sleep(10);
     char buf[] = "Lorem Ipsum is simply dummy text of the printing and typesetting industry. \
                  Lorem Ipsum has been the industry's standard dummy text ever since the 1500s, \
@@ -29,10 +76,27 @@ int main(int argc, char **argv) {
 
     const char *topic = "sample_topic"; // argument topic to produce to
 
+    // keyed messages: KAFKA_PRODUCER_KEYS distinct keys in turn, with the
+    // KAFKA_PRODUCER_HEADERS headers
+    long key_cnt = env_long("KAFKA_PRODUCER_KEYS", 0);
+    char headers_buf[1024];
+    publish_header_t headers[MAX_HEADERS];
+    int header_cnt = parse_headers(getenv("KAFKA_PRODUCER_HEADERS"), headers_buf,
+                                   sizeof(headers_buf), headers);
+
     // signal handler for clean shutdown
     signal(SIGINT, stop);
 
-    while (run) {
+    for (long seq = 0; run; seq++) {
+        if (key_cnt > 0 || header_cnt > 0) {
+            char key[32];
+            int key_len = snprintf(key, sizeof(key), "key-%ld", key_cnt > 0 ? seq % key_cnt : 0);
+            if (publish_keyed_timed(rk, topic, key_cnt > 0 ? key : NULL, (size_t)key_len, buf,
+                                    strlen(buf), headers, header_cnt, 1000) == ETIMEDOUT) {
+                fprintf(stderr, "%%Failed to produce to topic: %s: no room within 1000ms\n", topic);
+            }
+            continue;
+        }
         int res_code = publish_message(rk, buf, topic);
         if (res_code == 1) {
             continue;
@@ -41,11 +105,12 @@ int main(int argc, char **argv) {
     }
 
     /* wait for final message to be delivered or fail.
-     * rd_kafka_flush() is an abstraction over rd_kafka_poll() which
-     * waits for all messages to be delivered
+     * producer_flush() sends the held batch, then rd_kafka_flush()
+     * (an abstraction over rd_kafka_poll()) waits for all messages
+     * to be delivered
      */
      fprintf(stderr, "%% Flushing final message...\n");
-     rd_kafka_flush(rk, 10 * 1000); // wait for max 10 seconds
+     producer_flush(rk, 10 * 1000); // wait for max 10 seconds
 
      /*
      ** If the output queue is still not empty there is an issue with producing messages
@@ -55,8 +120,24 @@ int main(int argc, char **argv) {
          fprintf(stderr, "%% %d message(s) were not delivered\n", rd_kafka_outq_len(rk));
      }
 
-     // destroy producer instance
-     rd_kafka_destroy(rk);
+     producer_stats_t stats;
+     producer_get_stats(rk, &stats);
+     fprintf(stderr, "%% Queue full %ld time(s), budget full %ld time(s), "
+             "blocked %ld time(s) for %ldms, %ld timeout(s)\n",
+             stats.queue_full_cnt, stats.budget_full_cnt, stats.blocked_cnt,
+             stats.blocked_us / 1000, stats.timeout_cnt);
+     if (stats.partition_lookup_cnt > 0) {
+         fprintf(stderr, "%% %ld partition count lookup(s)\n", stats.partition_lookup_cnt);
+     }
+     if (stats.batch_cnt > 0) {
+         fprintf(stderr, "%% %ld batch(es) of %.1f message(s) on average, linger %ldus "
+                 "(%ld increase(s), %ld decrease(s)), latency %ldus\n",
+                 stats.batch_cnt, (double)stats.batch_msgs / stats.batch_cnt, stats.linger_us,
+                 stats.linger_up_cnt, stats.linger_down_cnt, stats.latency_us);
+     }
+
+     // stop the delivery report thread and destroy producer instance
+     destroy_kafka_producer(rk);
 
      return 0;
 }
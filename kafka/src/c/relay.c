@@ -0,0 +1,513 @@
+/*
+** Exactly-once consume-transform-produce relay
+**
+** One process consumes the input topics, hands every message to a handler
+** which emits zero or more output messages with relay_emit(), and produces
+** them together with the consumer offsets in one Kafka transaction:
+** downstream read_committed consumers see the output of an input message
+** exactly once, and the input is committed exactly when its output is.
+**
+** A transaction covers a batch of input messages, begun by the first one
+** and committed once it holds max_msgs messages or max_bytes output bytes,
+** or max_ms after it was begun, so the per-transaction cost (offsets,
+** commit markers, round trips to the transaction coordinator) is amortized
+** over the batch.
+**
+** On an abortable error the transaction is aborted and the consumer is
+** rewound to the committed offsets, the batch is consumed again. Fatal
+** errors (e.g. fenced by a newer instance with the same transactional.id)
+** stop the relay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#endif
+
+#include "producer.c"
+
+// retriable transaction errors: attempts, and the first backoff (doubled per retry)
+#define RELAY_RETRY_MAX 5
+#define RELAY_RETRY_BACKOFF_MS 100
+
+typedef struct relay_s relay_t;
+
+/*
+** Called once per input message, emits the output with relay_emit()
+** res: 0 on success, -1 aborts the transaction and stops the relay, unless
+** relay_emit() failed for lack of in-flight budget: then the transaction is
+** aborted and its input consumed again
+ */
+typedef int (relay_handler_t)(relay_t *relay, const rd_kafka_message_t *rkm, void *opaque);
+
+typedef struct relay_conf_s {
+    const char *brokers;
+    const char *group_id;
+    const char *transactional_id;
+    const char *output_topic;
+    // batch bounds, a transaction is committed once one is reached
+    long max_msgs;
+    long max_bytes;
+    int max_ms;
+} relay_conf_t;
+
+/*
+** Counters, see relay_get_stats()
+ */
+typedef struct relay_stats_s {
+    long msgs_in;           // input messages of committed transactions
+    long msgs_out;
+    long bytes_out;
+    long txn_cnt;           // committed transactions
+    long abort_cnt;         // aborted transactions
+    long commit_us;         // total commit latency (offsets and commit)
+    long commit_max_us;
+} relay_stats_t;
+
+struct relay_s {
+    relay_conf_t conf;
+    rd_kafka_t *consumer;
+    rd_kafka_t *producer;   // transactional, see new_kafka_producer()
+    volatile sig_atomic_t *run;
+
+    // the open transaction
+    int txn_open;
+    int64_t txn_begin_us;
+    long txn_msgs_in;
+    long txn_msgs_out;
+    long txn_bytes;
+    rd_kafka_topic_partition_list_t *offsets; // next offset per input partition
+    int emit_full;          // relay_emit() ran out of in-flight budget
+    int fatal;
+
+    relay_stats_t stats;
+};
+
+static void relay_error(const char *what, rd_kafka_error_t *error) {
+    fprintf(stderr, "%% %s failed: %s\n", what, rd_kafka_error_string(error));
+}
+
+/*
+** Rewind the consumer to the committed offsets of its assignment: what was
+** consumed into the aborted transaction is consumed again
+ */
+static int relay_rewind(relay_t *relay) {
+    rd_kafka_topic_partition_list_t *assignment;
+    rd_kafka_resp_err_t err;
+    rd_kafka_error_t *error;
+
+    err = rd_kafka_assignment(relay->consumer, &assignment);
+    if (err) {
+        fprintf(stderr, "%% Failed to get the assignment: %s\n", rd_kafka_err2str(err));
+        return -1;
+    }
+    if (assignment->cnt == 0) {
+        rd_kafka_topic_partition_list_destroy(assignment);
+        return 0;
+    }
+    err = rd_kafka_committed(relay->consumer, assignment, -1);
+    if (err) {
+        fprintf(stderr, "%% Failed to get the committed offsets: %s\n", rd_kafka_err2str(err));
+        rd_kafka_topic_partition_list_destroy(assignment);
+        return -1;
+    }
+    // nothing committed yet: start over at the beginning
+    for (int i = 0; i < assignment->cnt; i++) {
+        if (assignment->elems[i].offset < 0) {
+            assignment->elems[i].offset = RD_KAFKA_OFFSET_BEGINNING;
+        }
+    }
+    error = rd_kafka_seek_partitions(relay->consumer, assignment, -1);
+    rd_kafka_topic_partition_list_destroy(assignment);
+    if (error) {
+        relay_error("Rewind", error);
+        rd_kafka_error_destroy(error);
+        return -1;
+    }
+    return 0;
+}
+
+static void relay_txn_reset(relay_t *relay) {
+    relay->txn_open = 0;
+    relay->txn_msgs_in = 0;
+    relay->txn_msgs_out = 0;
+    relay->txn_bytes = 0;
+    rd_kafka_topic_partition_list_destroy(relay->offsets);
+    relay->offsets = rd_kafka_topic_partition_list_new(16);
+}
+
+/*
+** Abort the open transaction, rewinding the consumer unless its partitions
+** are gone anyway (revoked or lost)
+ */
+static int relay_abort(relay_t *relay, int rewind) {
+    rd_kafka_error_t *error;
+
+    if (!relay->txn_open) {
+        return 0;
+    }
+    error = rd_kafka_abort_transaction(relay->producer, -1);
+    relay_txn_reset(relay);
+    relay->stats.abort_cnt++;
+    if (error) {
+        relay_error("Abort transaction", error);
+        rd_kafka_error_destroy(error);
+        relay->fatal = 1;
+        return -1;
+    }
+    return rewind ? relay_rewind(relay) : 0;
+}
+
+/*
+** Wait before retry attempt (1..) of a retriable error, serving the
+** producer's delivery reports meanwhile
+** res: 0 to retry, -1 once the retries are used up
+ */
+static int relay_retry_backoff(relay_t *relay, int attempt) {
+    if (attempt >= RELAY_RETRY_MAX) {
+        return -1;
+    }
+    rd_kafka_poll(relay->producer, RELAY_RETRY_BACKOFF_MS << (attempt - 1));
+    return 0;
+}
+
+/*
+** Commit the open transaction with the offsets of its input, retrying
+** retriable errors with a backoff up to RELAY_RETRY_MAX times
+** res: 0 if committed or aborted (and rewound), -1 on fatal errors
+ */
+static int relay_commit(relay_t *relay) {
+    rd_kafka_consumer_group_metadata_t *cgmd;
+    rd_kafka_error_t *error;
+    int64_t start = now_us();
+    int attempt = 0;
+
+    if (!relay->txn_open) {
+        return 0;
+    }
+
+    cgmd = rd_kafka_consumer_group_metadata(relay->consumer);
+    while (1) {
+        error = rd_kafka_send_offsets_to_transaction(relay->producer, relay->offsets, cgmd, -1);
+        if (!error || !rd_kafka_error_is_retriable(error) || relay_retry_backoff(relay, ++attempt) == -1) {
+            break;
+        }
+        rd_kafka_error_destroy(error);
+    }
+    rd_kafka_consumer_group_metadata_destroy(cgmd);
+
+    // flushes the produced messages, then writes the commit markers
+    attempt = 0;
+    while (!error) {
+        error = rd_kafka_commit_transaction(relay->producer, -1);
+        if (!error || !rd_kafka_error_is_retriable(error) || relay_retry_backoff(relay, ++attempt) == -1) {
+            break;
+        }
+        rd_kafka_error_destroy(error);
+        error = NULL;
+    }
+
+    if (error) {
+        relay_error("Commit transaction", error);
+        // a retriable error whose retries are used up aborts as well
+        if (rd_kafka_error_txn_requires_abort(error) || rd_kafka_error_is_retriable(error)) {
+            rd_kafka_error_destroy(error);
+            return relay_abort(relay, 1);
+        }
+        rd_kafka_error_destroy(error);
+        relay->fatal = 1;
+        return -1;
+    }
+
+    long us = (long)(now_us() - start);
+    relay->stats.txn_cnt++;
+    relay->stats.commit_us += us;
+    if (us > relay->stats.commit_max_us) {
+        relay->stats.commit_max_us = us;
+    }
+    relay->stats.msgs_in += relay->txn_msgs_in;
+    relay->stats.msgs_out += relay->txn_msgs_out;
+    relay->stats.bytes_out += relay->txn_bytes;
+    relay_txn_reset(relay);
+    return 0;
+}
+
+/*
+** The open transaction ends before partitions are revoked: committed if
+** they are still ours, aborted if they were lost (the new owner starts at
+** the committed offsets)
+ */
+static void relay_rebalance_cb(rd_kafka_t *rk, rd_kafka_resp_err_t err,
+                               rd_kafka_topic_partition_list_t *partitions, void *opaque) {
+    relay_t *relay = opaque;
+    rd_kafka_error_t *error = NULL;
+    rd_kafka_resp_err_t ret_err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    int cooperative = !strcmp(rd_kafka_rebalance_protocol(rk), "COOPERATIVE");
+
+    if (err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS) {
+        if (cooperative) {
+            error = rd_kafka_incremental_assign(rk, partitions);
+        } else {
+            ret_err = rd_kafka_assign(rk, partitions);
+        }
+    } else {
+        if (rd_kafka_assignment_lost(rk)) {
+            relay_abort(relay, 0);
+        } else if (relay_commit(relay) == -1) {
+            *relay->run = 0;
+        }
+        if (cooperative) {
+            error = rd_kafka_incremental_unassign(rk, partitions);
+        } else {
+            ret_err = rd_kafka_assign(rk, NULL);
+        }
+    }
+
+    if (error) {
+        relay_error("Incremental assign", error);
+        rd_kafka_error_destroy(error);
+    } else if (ret_err) {
+        fprintf(stderr, "%% Assign failed: %s\n", rd_kafka_err2str(ret_err));
+    }
+}
+
+static int relay_conf_set(rd_kafka_conf_t *conf, const char *name, const char *value,
+                          char *errstr, size_t errstr_size) {
+    return rd_kafka_conf_set(conf, name, value, errstr, errstr_size) == RD_KAFKA_CONF_OK ? 0 : -1;
+}
+
+/*
+** Create the relay's consumer and transactional producer, and register the
+** producer's transactional.id with the coordinator (fencing older instances)
+** res: the relay, NULL with errstr set on failure
+ */
+relay_t *relay_new(const relay_conf_t *conf, char *errstr, size_t errstr_size) {
+    rd_kafka_conf_t *cconf = rd_kafka_conf_new();
+    rd_kafka_conf_t *pconf = rd_kafka_conf_new();
+    rd_kafka_error_t *error;
+    relay_t *relay;
+
+    relay = calloc(1, sizeof(*relay));
+    relay->conf = *conf;
+    relay->offsets = rd_kafka_topic_partition_list_new(16);
+
+    // offsets are only committed through the transactions, and only
+    // committed input is read
+    if (relay_conf_set(cconf, "bootstrap.servers", conf->brokers, errstr, errstr_size) == -1 ||
+        relay_conf_set(cconf, "group.id", conf->group_id, errstr, errstr_size) == -1 ||
+        relay_conf_set(cconf, "enable.auto.commit", "false", errstr, errstr_size) == -1 ||
+        relay_conf_set(cconf, "isolation.level", "read_committed", errstr, errstr_size) == -1 ||
+        relay_conf_set(cconf, "auto.offset.reset", "earliest", errstr, errstr_size) == -1 ||
+        relay_conf_set(pconf, "bootstrap.servers", conf->brokers, errstr, errstr_size) == -1 ||
+        relay_conf_set(pconf, "transactional.id", conf->transactional_id, errstr, errstr_size) == -1) {
+        rd_kafka_conf_destroy(cconf);
+        rd_kafka_conf_destroy(pconf);
+        rd_kafka_topic_partition_list_destroy(relay->offsets);
+        free(relay);
+        return NULL;
+    }
+    rd_kafka_conf_set_rebalance_cb(cconf, relay_rebalance_cb);
+    rd_kafka_conf_set_opaque(cconf, relay);
+
+    relay->consumer = rd_kafka_new(RD_KAFKA_CONSUMER, cconf, errstr, errstr_size);
+    if (!relay->consumer) {
+        rd_kafka_conf_destroy(cconf);
+        rd_kafka_conf_destroy(pconf);
+        rd_kafka_topic_partition_list_destroy(relay->offsets);
+        free(relay);
+        return NULL;
+    }
+    rd_kafka_poll_set_consumer(relay->consumer);
+
+    relay->producer = new_kafka_producer(pconf);
+    if (!relay->producer) {
+        snprintf(errstr, errstr_size, "failed to create transactional producer");
+        rd_kafka_destroy(relay->consumer);
+        rd_kafka_topic_partition_list_destroy(relay->offsets);
+        free(relay);
+        return NULL;
+    }
+
+    error = rd_kafka_init_transactions(relay->producer, 30 * 1000);
+    if (error) {
+        snprintf(errstr, errstr_size, "init transactions: %s", rd_kafka_error_string(error));
+        rd_kafka_error_destroy(error);
+        destroy_kafka_producer(relay->producer);
+        rd_kafka_destroy(relay->consumer);
+        rd_kafka_topic_partition_list_destroy(relay->offsets);
+        free(relay);
+        return NULL;
+    }
+    return relay;
+}
+
+/*
+** Produce one output message in the open transaction, from the handler.
+** key and value are copied. Waits for in-flight budget with a backoff up to
+** RELAY_RETRY_MAX times.
+** res: 0 on success, -1 if it could not be enqueued
+ */
+int relay_emit(relay_t *relay, const void *key, size_t key_len, const void *value, size_t len) {
+    producer_state_t *st = rd_kafka_opaque(relay->producer);
+    rd_kafka_resp_err_t err;
+    int attempt = 0;
+
+    while (!inflight_reserve(st, 1, (long)len)) {
+        // the delivery reports served by the backoff release the budget
+        atomic_fetch_add(&st->budget_full_cnt, 1);
+        if (relay_retry_backoff(relay, ++attempt) == -1) {
+            fprintf(stderr, "%% No in-flight budget to produce to %s\n", relay->conf.output_topic);
+            relay->emit_full = 1;
+            return -1;
+        }
+    }
+    do {
+        err = rd_kafka_producev(relay->producer,
+                                RD_KAFKA_V_TOPIC(relay->conf.output_topic),
+                                RD_KAFKA_V_KEY(key, key_len),
+                                RD_KAFKA_V_VALUE((void *)value, len),
+                                RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+                                RD_KAFKA_V_END);
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            // the delivery report thread makes room
+            atomic_fetch_add(&st->queue_full_cnt, 1);
+            rd_kafka_poll(relay->producer, 10);
+        }
+    } while (err == RD_KAFKA_RESP_ERR__QUEUE_FULL);
+
+    if (err) {
+        inflight_release(st, 1, (long)len);
+        fprintf(stderr, "%% Failed to produce to %s: %s\n", relay->conf.output_topic,
+                rd_kafka_err2str(err));
+        return -1;
+    }
+    relay->txn_msgs_out++;
+    relay->txn_bytes += (long)(key_len + len);
+    return 0;
+}
+
+/*
+** Record the input message's offset in the open transaction
+ */
+static void relay_track_offset(relay_t *relay, const rd_kafka_message_t *rkm) {
+    const char *topic = rd_kafka_topic_name(rkm->rkt);
+    rd_kafka_topic_partition_t *tp;
+
+    tp = rd_kafka_topic_partition_list_find(relay->offsets, topic, rkm->partition);
+    if (!tp) {
+        tp = rd_kafka_topic_partition_list_add(relay->offsets, topic, rkm->partition);
+    }
+    tp->offset = rkm->offset + 1;
+}
+
+/*
+** Relay topic_cnt topics until *run is cleared (also cleared by the relay on
+** fatal errors), the open transaction is committed before returning
+** res: 0 on a clean stop, -1 on fatal errors
+ */
+int relay_run(relay_t *relay, const char **topics, int topic_cnt,
+              relay_handler_t *handler, void *opaque, volatile sig_atomic_t *run) {
+    rd_kafka_topic_partition_list_t *subscription;
+    rd_kafka_resp_err_t err;
+    rd_kafka_error_t *error;
+
+    relay->run = run;
+    subscription = rd_kafka_topic_partition_list_new(topic_cnt);
+    for (int i = 0; i < topic_cnt; i++) {
+        rd_kafka_topic_partition_list_add(subscription, topics[i], RD_KAFKA_PARTITION_UA);
+    }
+    err = rd_kafka_subscribe(relay->consumer, subscription);
+    rd_kafka_topic_partition_list_destroy(subscription);
+    if (err) {
+        fprintf(stderr, "%% Failed to subscribe to %d topics: %s\n", topic_cnt, rd_kafka_err2str(err));
+        return -1;
+    }
+
+    while (*run && !relay->fatal) {
+        int timeout_ms = 100;
+        if (relay->txn_open) {
+            int64_t left = relay->txn_begin_us + (int64_t)relay->conf.max_ms * 1000 - now_us();
+            timeout_ms = left > 0 ? (int)((left + 999) / 1000) : 0;
+        }
+
+        rd_kafka_message_t *rkm = rd_kafka_consumer_poll(relay->consumer, timeout_ms);
+        if (rkm && rkm->err) {
+            if (rkm->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                fprintf(stderr, "%% Consumer error: %s\n", rd_kafka_message_errstr(rkm));
+            }
+            rd_kafka_message_destroy(rkm);
+            rkm = NULL;
+        }
+
+        if (rkm) {
+            if (!relay->txn_open) {
+                error = rd_kafka_begin_transaction(relay->producer);
+                if (error) {
+                    relay_error("Begin transaction", error);
+                    rd_kafka_error_destroy(error);
+                    rd_kafka_message_destroy(rkm);
+                    relay->fatal = 1;
+                    break;
+                }
+                relay->txn_open = 1;
+                relay->txn_begin_us = now_us();
+            }
+            int res = handler(relay, rkm, opaque);
+            if (res == -1 && relay->emit_full) {
+                // the abort purges the transaction's messages, releasing the budget
+                relay->emit_full = 0;
+                rd_kafka_message_destroy(rkm);
+                relay_abort(relay, 1);
+                continue;
+            }
+            relay->emit_full = 0;
+            if (res == -1) {
+                fprintf(stderr, "%% Handler failed at %s [%" PRId32 "] offset %" PRId64 "\n",
+                        rd_kafka_topic_name(rkm->rkt), rkm->partition, rkm->offset);
+                rd_kafka_message_destroy(rkm);
+                relay_abort(relay, 0);
+                relay->fatal = 1;
+                break;
+            }
+            relay_track_offset(relay, rkm);
+            relay->txn_msgs_in++;
+            rd_kafka_message_destroy(rkm);
+        }
+
+        if (relay->txn_open &&
+            ((relay->conf.max_msgs > 0 && relay->txn_msgs_in >= relay->conf.max_msgs) ||
+             (relay->conf.max_bytes > 0 && relay->txn_bytes >= relay->conf.max_bytes) ||
+             now_us() - relay->txn_begin_us >= (int64_t)relay->conf.max_ms * 1000)) {
+            relay_commit(relay);
+        }
+    }
+
+    if (!relay->fatal) {
+        relay_commit(relay);
+    }
+    return relay->fatal ? -1 : 0;
+}
+
+void relay_get_stats(relay_t *relay, relay_stats_t *stats) {
+    *stats = relay->stats;
+}
+
+/*
+** Leave the group and destroy the relay, after relay_run() returned
+ */
+void relay_destroy(relay_t *relay) {
+    if (relay->txn_open) {
+        relay_abort(relay, 0);
+    }
+    rd_kafka_consumer_close(relay->consumer);
+    rd_kafka_destroy(relay->consumer);
+    destroy_kafka_producer(relay->producer);
+    rd_kafka_topic_partition_list_destroy(relay->offsets);
+    free(relay);
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+
+#ifdef ENV_PRODUCT
+#include <librdkafka/rdkafka.h>
+#else
+#include "../../vcpkg_installed/x64-linux/include/librdkafka/rdkafka.h"
+#endif
+
+#include "relay.c"
+
+#define RELAY_MAX_TOPICS 64
+
+static volatile sig_atomic_t run = 1;
+
+// signal termination of program
+static void stop(int sig) {
+    run = 0;
+}
+
+// forwards every message as it is, a transforming relay replaces this
+static int forward_handler(relay_t *relay, const rd_kafka_message_t *rkm, void *opaque) {
+    return relay_emit(relay, rkm->key, rkm->key_len, rkm->payload, rkm->len);
+}
+
+/*
+** Exactly-once relay of KAFKA_TOPIC (comma separated) to
+** KAFKA_RELAY_OUTPUT_TOPIC, configured from the environment:
+** KAFKA_BROKERS, KAFKA_CONSUMER_GROUP, KAFKA_RELAY_TRANSACTIONAL_ID
+** (default relay-<group>), KAFKA_RELAY_BATCH_MSGS (1000),
+** KAFKA_RELAY_BATCH_BYTES (1048576) and KAFKA_RELAY_BATCH_MS (100)
+ */
+int main(int argc, char **argv) {
+    char errstr[512];
+    char txn_id[256];
+    char topic_buf[1024];
+    const char *topics[RELAY_MAX_TOPICS];
+    int topic_cnt = 0;
+    relay_conf_t conf;
+    relay_stats_t stats;
+
+    conf.brokers = getenv("KAFKA_BROKERS");
+    conf.group_id = getenv("KAFKA_CONSUMER_GROUP");
+    conf.output_topic = getenv("KAFKA_RELAY_OUTPUT_TOPIC");
+    const char *topic = getenv("KAFKA_TOPIC");
+    if (!conf.brokers || !conf.group_id || !conf.output_topic || !topic) {
+        fprintf(stderr, "%% KAFKA_BROKERS, KAFKA_CONSUMER_GROUP, KAFKA_TOPIC and "
+                "KAFKA_RELAY_OUTPUT_TOPIC are required\n");
+        return 1;
+    }
+    conf.transactional_id = getenv("KAFKA_RELAY_TRANSACTIONAL_ID");
+    if (!conf.transactional_id || !*conf.transactional_id) {
+        snprintf(txn_id, sizeof(txn_id), "relay-%s", conf.group_id);
+        conf.transactional_id = txn_id;
+    }
+    conf.max_msgs = env_long("KAFKA_RELAY_BATCH_MSGS", 1000);
+    conf.max_bytes = env_long("KAFKA_RELAY_BATCH_BYTES", 1048576);
+    conf.max_ms = (int)env_long("KAFKA_RELAY_BATCH_MS", 100);
+    if (conf.max_msgs < 0 || conf.max_bytes < 0 || conf.max_ms < 1) {
+        fprintf(stderr, "%% Invalid KAFKA_RELAY_BATCH_* settings\n");
+        return 1;
+    }
+
+    snprintf(topic_buf, sizeof(topic_buf), "%s", topic);
+    for (char *tok = strtok(topic_buf, ","); tok && topic_cnt < RELAY_MAX_TOPICS; tok = strtok(NULL, ",")) {
+        topics[topic_cnt++] = tok;
+    }
+
+    relay_t *relay = relay_new(&conf, errstr, sizeof(errstr));
+    if (!relay) {
+        fprintf(stderr, "%% Failed to create relay: %s\n", errstr);
+        return 1;
+    }
+    fprintf(stderr, "%% Relaying %s to %s as %s, transactions of up to %ld message(s), "
+            "%ld byte(s), %dms\n", topic, conf.output_topic, conf.transactional_id,
+            conf.max_msgs, conf.max_bytes, conf.max_ms);
+
+    // signal handler for clean shutdown
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    int res = relay_run(relay, topics, topic_cnt, forward_handler, NULL, &run);
+
+    relay_get_stats(relay, &stats);
+    fprintf(stderr, "%% Relayed %ld message(s) as %ld message(s) (%ld bytes) in %ld "
+            "transaction(s), %ld aborted\n",
+            stats.msgs_in, stats.msgs_out, stats.bytes_out, stats.txn_cnt, stats.abort_cnt);
+    if (stats.txn_cnt > 0) {
+        fprintf(stderr, "%% Commit latency %.3fms avg, %.3fms max\n",
+                stats.commit_us / 1000.0 / stats.txn_cnt, stats.commit_max_us / 1000.0);
+    }
+
+    relay_destroy(relay);
+    return res == -1 ? 1 : 0;
+}
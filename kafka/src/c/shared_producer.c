@@ -0,0 +1,711 @@
+/*
+** Thread-safe producer shared library, see shared_producer.h
+**
+** Every producing thread gets its own single-producer/single-consumer
+** staging ring (registered through a pthread key on its first publish),
+** owned by one of the flusher threads. Records are appended with a release
+** store of the ring head, the owning flusher reads them up to the head and
+** hands them to librdkafka with rd_kafka_produce_batch() (copied), then
+** releases them with a store of the ring tail.
+**
+** A flusher with nothing to do sleeps on its condition variable; producing
+** threads only signal it if it announced that it is sleeping.
+**
+** Built as libproducer.so with -fvisibility=hidden: only the
+** shared_producer_*() functions are exported.
+ */
+
+#include <stdint.h>
+
+#include "shared_producer.h"
+#include "producer.c"
+
+#define RING_REC_HDR 16
+#define RING_REC_WRAP 0xffffffffu // rest of the ring is unused, continue at 0
+#define RING_REC_SENT 1           // enqueued out of order, skip it
+
+/*
+** Record in a staging ring, padded to 8 bytes:
+** [u32 len][u16 topic_len][u8 flags][u8 pad][u32 key_len][u32 payload_len]
+** [topic][key][payload]
+ */
+typedef struct ring_rec_s {
+    uint32_t len;
+    uint16_t topic_len;
+    uint8_t flags;
+    uint8_t pad;
+    uint32_t key_len;
+    uint32_t payload_len;
+} ring_rec_t;
+
+typedef struct staging_ring_s {
+    // written by the producing thread
+    atomic_size_t head;
+    atomic_long published_msgs; // relaxed, read by shared_producer_get_stats()
+    atomic_long published_bytes;
+    atomic_long full_cnt;
+    char pad1[64 - sizeof(atomic_size_t) - 3 * sizeof(atomic_long)];
+    // written by the flusher
+    atomic_size_t tail;
+    char pad2[64 - sizeof(atomic_size_t)];
+
+    char *buf;
+    size_t mask;
+    atomic_int closed;      // the producing thread exited
+    struct flusher_s *flusher;
+    struct staging_ring_s *next;
+} staging_ring_t;
+
+typedef struct topic_handle_s {
+    char name[256];
+    size_t len;
+    rd_kafka_topic_t *rkt;
+} topic_handle_t;
+
+typedef struct flusher_s {
+    shared_producer_t *sp;
+    pthread_t thread;
+
+    pthread_mutex_t lock;   // rings list, sleeping
+    pthread_cond_t cond;
+    staging_ring_t *rings;
+    atomic_int sleeping;
+
+    rd_kafka_message_t *batch;
+    ring_rec_t **batch_rec; // record of each message of the batch
+    size_t *batch_end;      // ring position after each record of the batch
+    topic_handle_t *topics;
+    int topic_cnt;
+
+    atomic_long batches;
+    atomic_long enqueued_msgs;
+    atomic_long queue_full_cnt;
+    atomic_long failed_msgs;
+} flusher_t;
+
+struct shared_producer_conf_s {
+    rd_kafka_conf_t *conf;
+    int flusher_cnt;
+    size_t ring_bytes;
+    int batch_msgs;
+    int idle_wait_us;
+};
+
+struct shared_producer_s {
+    rd_kafka_t *rk;
+    int flusher_cnt;
+    size_t ring_bytes;
+    int batch_msgs;
+    int idle_wait_us;
+
+    pthread_key_t ring_key;
+    flusher_t *flushers;
+    atomic_int next_flusher;
+    atomic_int running;
+
+    pthread_mutex_t lock;   // ring_list, retired counters
+    staging_ring_t **ring_list; // all rings, for the stats, flush and destroy
+    int ring_cnt;
+    int ring_size;
+    long retired_msgs;      // counters of the freed rings
+    long retired_bytes;
+    long retired_full_cnt;
+
+    atomic_long delivered_msgs;
+    atomic_long delivery_failed_msgs;
+};
+
+
+static size_t rec_size(size_t topic_len, size_t key_len, size_t len) {
+    return (RING_REC_HDR + topic_len + key_len + len + 7) & ~(size_t)7;
+}
+
+/* the producing thread is a ring counter's only writer: no atomic add needed */
+static void ring_count(atomic_long *cnt, long n) {
+    atomic_store_explicit(cnt, atomic_load_explicit(cnt, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/* pthread key destructor: the flusher frees the ring once it is drained */
+static void ring_thread_exit(void *arg) {
+    staging_ring_t *ring = arg;
+    atomic_store(&ring->closed, 1);
+}
+
+/*
+** The calling thread's ring, created and handed to a flusher on first use
+ */
+static staging_ring_t *ring_get(shared_producer_t *sp) {
+    staging_ring_t *ring = pthread_getspecific(sp->ring_key);
+    if (ring) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring || !(ring->buf = malloc(sp->ring_bytes))) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = sp->ring_bytes - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->published_msgs, 0);
+    atomic_init(&ring->published_bytes, 0);
+    atomic_init(&ring->full_cnt, 0);
+
+    // every ring is also kept in ring_list until it is freed
+    pthread_mutex_lock(&sp->lock);
+    if (sp->ring_cnt == sp->ring_size) {
+        int size = sp->ring_size ? sp->ring_size * 2 : 64;
+        staging_ring_t **list = realloc(sp->ring_list, size * sizeof(*list));
+        if (!list) {
+            pthread_mutex_unlock(&sp->lock);
+            free(ring->buf);
+            free(ring);
+            return NULL;
+        }
+        sp->ring_list = list;
+        sp->ring_size = size;
+    }
+    sp->ring_list[sp->ring_cnt++] = ring;
+    pthread_mutex_unlock(&sp->lock);
+
+    flusher_t *fl = &sp->flushers[atomic_fetch_add(&sp->next_flusher, 1) % sp->flusher_cnt];
+    ring->flusher = fl;
+    pthread_mutex_lock(&fl->lock);
+    ring->next = fl->rings;
+    fl->rings = ring;
+    pthread_mutex_unlock(&fl->lock);
+
+    pthread_setspecific(sp->ring_key, ring);
+    return ring;
+}
+
+static void flusher_wake(flusher_t *fl) {
+    if (atomic_load(&fl->sleeping)) {
+        pthread_mutex_lock(&fl->lock);
+        pthread_cond_signal(&fl->cond);
+        pthread_mutex_unlock(&fl->lock);
+    }
+}
+
+static rd_kafka_topic_t *flusher_topic(flusher_t *fl, const char *name, size_t len) {
+    for (int i = 0; i < fl->topic_cnt; i++) {
+        if (fl->topics[i].len == len && !memcmp(fl->topics[i].name, name, len)) {
+            return fl->topics[i].rkt;
+        }
+    }
+    topic_handle_t *topics = realloc(fl->topics, (fl->topic_cnt + 1) * sizeof(*topics));
+    if (!topics) {
+        return NULL;
+    }
+    fl->topics = topics;
+    topic_handle_t *t = &fl->topics[fl->topic_cnt];
+    memcpy(t->name, name, len);
+    t->name[len] = '\0';
+    t->len = len;
+    t->rkt = rd_kafka_topic_new(fl->sp->rk, t->name, NULL);
+    if (!t->rkt) {
+        return NULL;
+    }
+    fl->topic_cnt++;
+    return t->rkt;
+}
+
+/*
+** Hand the records of one topic at the start of the ring to librdkafka
+** res: records consumed, -1 if librdkafka's queue is full
+ */
+static int flusher_produce(flusher_t *fl, staging_ring_t *ring) {
+    producer_state_t *st = rd_kafka_opaque(fl->sp->rk);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    const char *topic = NULL;
+    size_t topic_len = 0;
+    long bytes = 0;
+    int cnt = 0;
+
+    while (tail != head && cnt < fl->sp->batch_msgs) {
+        size_t pos = tail & ring->mask;
+        ring_rec_t *rec = (ring_rec_t *)(ring->buf + pos);
+
+        if (rec->len == RING_REC_WRAP) {
+            tail += ring->mask + 1 - pos;
+            if (cnt == 0) {
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            }
+            continue;
+        }
+        const char *name = (const char *)(rec + 1);
+        if (cnt > 0 && (rec->topic_len != topic_len || memcmp(name, topic, topic_len))) {
+            break;
+        }
+        tail += rec->len;
+        if (rec->flags & RING_REC_SENT) {
+            if (cnt == 0) {
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            }
+            continue;
+        }
+        topic = name;
+        topic_len = rec->topic_len;
+
+        rd_kafka_message_t *m = &fl->batch[cnt];
+        memset(m, 0, sizeof(*m));
+        m->key = rec->key_len ? (void *)(name + rec->topic_len) : NULL;
+        m->key_len = rec->key_len;
+        m->payload = (void *)(name + rec->topic_len + rec->key_len);
+        m->len = rec->payload_len;
+        fl->batch_rec[cnt] = rec;
+        fl->batch_end[cnt++] = tail;
+        bytes += rec->payload_len;
+    }
+    if (cnt == 0) {
+        return 0;
+    }
+
+    rd_kafka_topic_t *rkt = flusher_topic(fl, topic, topic_len);
+    if (!rkt) {
+        fprintf(stderr, "%% Failed to create topic object: %.*s: %s\n", (int)topic_len, topic,
+                rd_kafka_err2str(rd_kafka_last_error()));
+        atomic_fetch_add(&fl->failed_msgs, cnt);
+        atomic_store_explicit(&ring->tail, fl->batch_end[cnt - 1], memory_order_release);
+        return cnt;
+    }
+
+    // released from dr_msg_cb()
+    atomic_fetch_add(&st->inflight_msgs, cnt);
+    atomic_fetch_add(&st->inflight_bytes, bytes);
+    rd_kafka_produce_batch(rkt, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY, fl->batch, cnt);
+    atomic_fetch_add(&fl->batches, 1);
+
+    // records up to the first one that did not fit the queue are consumed,
+    // the enqueued ones after it are marked to be skipped on the retry
+    int consumed = cnt, failed = 0, enqueued = 0;
+    long failed_bytes = 0;
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    for (int i = 0; i < cnt; i++) {
+        rd_kafka_message_t *m = &fl->batch[i];
+        if (m->err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            failed_bytes += (long)m->len;
+            failed++;
+            if (consumed == cnt) {
+                consumed = i;
+            }
+            continue;
+        }
+        if (m->err) {
+            // dropped: no delivery report will release it
+            err = m->err;
+            failed_bytes += (long)m->len;
+            failed++;
+            atomic_fetch_add(&fl->failed_msgs, 1);
+        } else {
+            enqueued++;
+        }
+        if (consumed < cnt) {
+            fl->batch_rec[i]->flags |= RING_REC_SENT;
+        }
+    }
+    inflight_release(st, failed, failed_bytes);
+    atomic_fetch_add(&fl->enqueued_msgs, enqueued);
+    if (err) {
+        fprintf(stderr, "%% Failed to produce message(s) to topic %.*s: %s\n", (int)topic_len, topic,
+                rd_kafka_err2str(err));
+    }
+
+    if (consumed > 0) {
+        atomic_store_explicit(&ring->tail, fl->batch_end[consumed - 1], memory_order_release);
+    }
+    if (consumed < cnt) {
+        atomic_fetch_add(&fl->queue_full_cnt, 1);
+        return -1;
+    }
+    return cnt;
+}
+
+static int ring_empty(staging_ring_t *ring) {
+    return atomic_load(&ring->tail) == atomic_load(&ring->head);
+}
+
+/*
+** Free the ring of an exited thread, its counters are kept
+ */
+static void ring_free(shared_producer_t *sp, staging_ring_t *ring) {
+    pthread_mutex_lock(&sp->lock);
+    for (int i = 0; i < sp->ring_cnt; i++) {
+        if (sp->ring_list[i] == ring) {
+            sp->ring_list[i] = sp->ring_list[--sp->ring_cnt];
+            break;
+        }
+    }
+    sp->retired_msgs += atomic_load_explicit(&ring->published_msgs, memory_order_relaxed);
+    sp->retired_bytes += atomic_load_explicit(&ring->published_bytes, memory_order_relaxed);
+    sp->retired_full_cnt += atomic_load_explicit(&ring->full_cnt, memory_order_relaxed);
+    pthread_mutex_unlock(&sp->lock);
+    free(ring->buf);
+    free(ring);
+}
+
+static void *flusher_main(void *arg) {
+    flusher_t *fl = arg;
+    shared_producer_t *sp = fl->sp;
+
+    while (1) {
+        int running = atomic_load(&sp->running);
+        int produced = 0, queue_full = 0;
+
+        pthread_mutex_lock(&fl->lock);
+        staging_ring_t **prev = &fl->rings;
+        while (*prev) {
+            staging_ring_t *ring = *prev;
+            int res = flusher_produce(fl, ring);
+            if (res < 0) {
+                queue_full = 1;
+            } else {
+                produced += res;
+            }
+            // the thread exited and everything it published is enqueued
+            if (atomic_load(&ring->closed) && ring_empty(ring)) {
+                *prev = ring->next;
+                ring_free(sp, ring);
+                continue;
+            }
+            prev = &ring->next;
+        }
+
+        if (!running && !produced && !queue_full) {
+            pthread_mutex_unlock(&fl->lock);
+            break;
+        }
+        if (produced && !queue_full) {
+            pthread_mutex_unlock(&fl->lock);
+            continue;
+        }
+
+        // nothing to do (or no room in librdkafka's queue): sleep, unless a
+        // producing thread published before it could see the sleeping flag
+        atomic_store(&fl->sleeping, 1);
+        int pending = 0;
+        for (staging_ring_t *ring = fl->rings; ring; ring = ring->next) {
+            pending |= !ring_empty(ring);
+        }
+        if (queue_full || (!pending && atomic_load(&sp->running))) {
+            struct timespec ts;
+            int64_t wake = now_us() + sp->idle_wait_us;
+            ts.tv_sec = wake / 1000000;
+            ts.tv_nsec = (wake % 1000000) * 1000;
+            pthread_cond_timedwait(&fl->cond, &fl->lock, &ts);
+        }
+        atomic_store(&fl->sleeping, 0);
+        pthread_mutex_unlock(&fl->lock);
+    }
+    return NULL;
+}
+
+static void shared_dr_cb(const rd_kafka_message_t *rkmessage, void *dr_opaque) {
+    shared_producer_t *sp = dr_opaque;
+    atomic_fetch_add(rkmessage->err ? &sp->delivery_failed_msgs : &sp->delivered_msgs, 1);
+}
+
+
+SHARED_PRODUCER_EXPORT int shared_producer_api_version(void) {
+    return SHARED_PRODUCER_API_VERSION;
+}
+
+SHARED_PRODUCER_EXPORT shared_producer_conf_t *shared_producer_conf_new(void) {
+    shared_producer_conf_t *conf = calloc(1, sizeof(*conf));
+    if (!conf) {
+        return NULL;
+    }
+    conf->conf = rd_kafka_conf_new();
+    conf->flusher_cnt = 1;
+    conf->ring_bytes = 4 * 1024 * 1024;
+    conf->batch_msgs = 1000;
+    conf->idle_wait_us = 1000;
+    return conf;
+}
+
+SHARED_PRODUCER_EXPORT void shared_producer_conf_destroy(shared_producer_conf_t *conf) {
+    if (conf->conf) {
+        rd_kafka_conf_destroy(conf->conf);
+    }
+    free(conf);
+}
+
+SHARED_PRODUCER_EXPORT int shared_producer_conf_set(shared_producer_conf_t *conf, const char *name,
+                                                    const char *value, char *errstr, size_t errstr_size) {
+    long v = atol(value);
+
+    if (!strcmp(name, "flusher.threads")) {
+        if (v < 1 || v > 64) {
+            snprintf(errstr, errstr_size, "flusher.threads must be 1..64");
+            return -1;
+        }
+        conf->flusher_cnt = (int)v;
+    } else if (!strcmp(name, "ring.bytes")) {
+        if (v < 4096) {
+            snprintf(errstr, errstr_size, "ring.bytes must be at least 4096");
+            return -1;
+        }
+        size_t size = 4096;
+        while (size < (size_t)v) {
+            size *= 2;
+        }
+        conf->ring_bytes = size;
+    } else if (!strcmp(name, "batch.messages")) {
+        if (v < 1) {
+            snprintf(errstr, errstr_size, "batch.messages must be at least 1");
+            return -1;
+        }
+        conf->batch_msgs = (int)v;
+    } else if (!strcmp(name, "idle.wait.us")) {
+        if (v < 1) {
+            snprintf(errstr, errstr_size, "idle.wait.us must be at least 1");
+            return -1;
+        }
+        conf->idle_wait_us = (int)v;
+    } else if (rd_kafka_conf_set(conf->conf, name, value, errstr, errstr_size) != RD_KAFKA_CONF_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+SHARED_PRODUCER_EXPORT shared_producer_t *shared_producer_new(shared_producer_conf_t *conf, char *errstr,
+                                                              size_t errstr_size) {
+    shared_producer_t *sp = calloc(1, sizeof(*sp));
+    if (!sp) {
+        snprintf(errstr, errstr_size, "out of memory");
+        shared_producer_conf_destroy(conf);
+        return NULL;
+    }
+    sp->flusher_cnt = conf->flusher_cnt;
+    sp->ring_bytes = conf->ring_bytes;
+    sp->batch_msgs = conf->batch_msgs;
+    sp->idle_wait_us = conf->idle_wait_us;
+    atomic_init(&sp->next_flusher, 0);
+    atomic_init(&sp->running, 1);
+    atomic_init(&sp->delivered_msgs, 0);
+    atomic_init(&sp->delivery_failed_msgs, 0);
+    pthread_mutex_init(&sp->lock, NULL);
+
+    // new_kafka_producer() takes ownership of the librdkafka conf
+    sp->rk = new_kafka_producer(conf->conf);
+    conf->conf = NULL;
+    shared_producer_conf_destroy(conf);
+    if (!sp->rk) {
+        snprintf(errstr, errstr_size, "failed to create producer");
+        pthread_mutex_destroy(&sp->lock);
+        free(sp);
+        return NULL;
+    }
+    producer_set_dr_cb(sp->rk, shared_dr_cb, sp);
+    if (pthread_key_create(&sp->ring_key, ring_thread_exit) != 0) {
+        snprintf(errstr, errstr_size, "failed to create thread key");
+        destroy_kafka_producer(sp->rk);
+        pthread_mutex_destroy(&sp->lock);
+        free(sp);
+        return NULL;
+    }
+
+    sp->flushers = calloc(sp->flusher_cnt, sizeof(*sp->flushers));
+    for (int i = 0; sp->flushers && i < sp->flusher_cnt; i++) {
+        flusher_t *fl = &sp->flushers[i];
+        pthread_condattr_t attr;
+
+        fl->sp = sp;
+        fl->batch = calloc(sp->batch_msgs, sizeof(*fl->batch));
+        fl->batch_rec = calloc(sp->batch_msgs, sizeof(*fl->batch_rec));
+        fl->batch_end = calloc(sp->batch_msgs, sizeof(*fl->batch_end));
+        atomic_init(&fl->sleeping, 0);
+        atomic_init(&fl->batches, 0);
+        atomic_init(&fl->enqueued_msgs, 0);
+        atomic_init(&fl->queue_full_cnt, 0);
+        atomic_init(&fl->failed_msgs, 0);
+        pthread_mutex_init(&fl->lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&fl->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (!fl->batch || !fl->batch_rec || !fl->batch_end || pthread_create(&fl->thread, NULL, flusher_main, fl) != 0) {
+            snprintf(errstr, errstr_size, "failed to start flusher thread");
+            sp->flusher_cnt = i;
+            free(fl->batch);
+            free(fl->batch_rec);
+            free(fl->batch_end);
+            pthread_cond_destroy(&fl->cond);
+            pthread_mutex_destroy(&fl->lock);
+            shared_producer_destroy(sp);
+            return NULL;
+        }
+    }
+    if (!sp->flushers) {
+        snprintf(errstr, errstr_size, "out of memory");
+        sp->flusher_cnt = 0;
+        shared_producer_destroy(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+SHARED_PRODUCER_EXPORT int shared_producer_publish(shared_producer_t *sp, const char *topic,
+                                                   const void *key, size_t key_len,
+                                                   const void *payload, size_t len) {
+    size_t topic_len = strlen(topic);
+    size_t size = rec_size(topic_len, key_len, len);
+    staging_ring_t *ring;
+
+    if (size > sp->ring_bytes / 2 || topic_len >= sizeof(((topic_handle_t *)0)->name)) {
+        return EMSGSIZE;
+    }
+    if (!(ring = ring_get(sp))) {
+        return ENOMEM;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t pos = head & ring->mask;
+    size_t contiguous = ring->mask + 1 - pos;
+    size_t need = size + (contiguous < size ? contiguous : 0);
+
+    if (head + need - tail > ring->mask + 1) {
+        ring_count(&ring->full_cnt, 1);
+        flusher_wake(ring->flusher);
+        return EAGAIN;
+    }
+    if (contiguous < size) {
+        ((ring_rec_t *)(ring->buf + pos))->len = RING_REC_WRAP;
+        head += contiguous;
+        pos = 0;
+    }
+
+    ring_rec_t *rec = (ring_rec_t *)(ring->buf + pos);
+    char *p = (char *)(rec + 1);
+    rec->len = (uint32_t)size;
+    rec->topic_len = (uint16_t)topic_len;
+    rec->flags = 0;
+    rec->pad = 0;
+    rec->key_len = (uint32_t)key_len;
+    rec->payload_len = (uint32_t)len;
+    memcpy(p, topic, topic_len);
+    if (key_len) {
+        memcpy(p + topic_len, key, key_len);
+    }
+    memcpy(p + topic_len + key_len, payload, len);
+
+    ring_count(&ring->published_msgs, 1);
+    ring_count(&ring->published_bytes, (long)len);
+    // seq_cst: ordered before the load of the flusher's sleeping flag
+    atomic_store(&ring->head, head + size);
+    flusher_wake(ring->flusher);
+    return 0;
+}
+
+SHARED_PRODUCER_EXPORT int shared_producer_flush(shared_producer_t *sp, int timeout_ms) {
+    int64_t deadline = now_us() + (int64_t)timeout_ms * 1000;
+    int staged = 1;
+
+    while (staged && now_us() < deadline) {
+        staged = 0;
+        pthread_mutex_lock(&sp->lock);
+        for (int i = 0; i < sp->ring_cnt && !staged; i++) {
+            staged = !ring_empty(sp->ring_list[i]);
+        }
+        pthread_mutex_unlock(&sp->lock);
+        if (staged) {
+            // not under sp->lock: a flusher takes it while holding its own
+            for (int i = 0; i < sp->flusher_cnt; i++) {
+                flusher_wake(&sp->flushers[i]);
+            }
+            usleep(1000);
+        }
+    }
+
+    int64_t left_ms = (deadline - now_us()) / 1000;
+    if (staged || rd_kafka_flush(sp->rk, left_ms > 0 ? (int)left_ms : 0)) {
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+SHARED_PRODUCER_EXPORT void shared_producer_get_stats(shared_producer_t *sp, shared_producer_stats_t *stats,
+                                                      size_t size) {
+    shared_producer_stats_t s;
+
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_lock(&sp->lock);
+    s.threads = sp->ring_cnt;
+    s.published_msgs = sp->retired_msgs;
+    s.published_bytes = sp->retired_bytes;
+    s.ring_full_cnt = sp->retired_full_cnt;
+    for (int i = 0; i < sp->ring_cnt; i++) {
+        staging_ring_t *ring = sp->ring_list[i];
+        s.published_msgs += atomic_load_explicit(&ring->published_msgs, memory_order_relaxed);
+        s.published_bytes += atomic_load_explicit(&ring->published_bytes, memory_order_relaxed);
+        s.ring_full_cnt += atomic_load_explicit(&ring->full_cnt, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    for (int i = 0; i < sp->flusher_cnt; i++) {
+        flusher_t *fl = &sp->flushers[i];
+        s.batches += atomic_load(&fl->batches);
+        s.enqueued_msgs += atomic_load(&fl->enqueued_msgs);
+        s.queue_full_cnt += atomic_load(&fl->queue_full_cnt);
+        s.failed_msgs += atomic_load(&fl->failed_msgs);
+    }
+    s.staged_msgs = s.published_msgs - s.enqueued_msgs - s.failed_msgs;
+    s.delivered_msgs = atomic_load(&sp->delivered_msgs);
+    s.delivery_failed_msgs = atomic_load(&sp->delivery_failed_msgs);
+
+    memcpy(stats, &s, size < sizeof(s) ? size : sizeof(s));
+}
+
+SHARED_PRODUCER_EXPORT int shared_producer_start_metrics(shared_producer_t *sp, int port, char *errstr,
+                                                         size_t errstr_size) {
+    return producer_start_metrics(sp->rk, port, errstr, errstr_size);
+}
+
+SHARED_PRODUCER_EXPORT void shared_producer_destroy(shared_producer_t *sp) {
+    atomic_store(&sp->running, 0);
+    for (int i = 0; i < sp->flusher_cnt; i++) {
+        flusher_t *fl = &sp->flushers[i];
+        pthread_mutex_lock(&fl->lock);
+        pthread_cond_signal(&fl->cond);
+        pthread_mutex_unlock(&fl->lock);
+        pthread_join(fl->thread, NULL);
+    }
+
+    // no more thread exit callbacks into the rings
+    pthread_key_delete(sp->ring_key);
+    long dropped = 0;
+    for (int i = 0; i < sp->ring_cnt; i++) {
+        staging_ring_t *ring = sp->ring_list[i];
+        if (!ring_empty(ring)) {
+            dropped++;
+        }
+        free(ring->buf);
+        free(ring);
+    }
+    if (dropped) {
+        fprintf(stderr, "%% Dropped the staged messages of %ld thread(s)\n", dropped);
+    }
+    free(sp->ring_list);
+
+    for (int i = 0; i < sp->flusher_cnt; i++) {
+        flusher_t *fl = &sp->flushers[i];
+        for (int t = 0; t < fl->topic_cnt; t++) {
+            rd_kafka_topic_destroy(fl->topics[t].rkt);
+        }
+        free(fl->topics);
+        free(fl->batch);
+        free(fl->batch_rec);
+        free(fl->batch_end);
+        pthread_cond_destroy(&fl->cond);
+        pthread_mutex_destroy(&fl->lock);
+    }
+    free(sp->flushers);
+
+    destroy_kafka_producer(sp->rk);
+    pthread_mutex_destroy(&sp->lock);
+    free(sp);
+}
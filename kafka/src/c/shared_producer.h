@@ -0,0 +1,131 @@
+/*
+** Thread-safe producer shared library (libproducer.so)
+**
+** One shared_producer_t is meant to be used by many threads at once, e.g.
+** by all request threads of a server. Every calling thread appends its
+** messages to its own staging ring, without locks or syscalls on the
+** producing path: a call never waits for another thread. Flusher threads
+** drain the rings into librdkafka in batches.
+**
+** Messages of one thread (and topic/key) keep their order. Delivery
+** reports are served by the library, see shared_producer_get_stats().
+**
+** The API and ABI only grow: functions and configuration properties are
+** added, structs get new fields at the end only.
+ */
+
+#ifndef SHARED_PRODUCER_H
+#define SHARED_PRODUCER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHARED_PRODUCER_API_VERSION 1
+
+#if defined(__GNUC__)
+#define SHARED_PRODUCER_EXPORT __attribute__((visibility("default")))
+#else
+#define SHARED_PRODUCER_EXPORT
+#endif
+
+typedef struct shared_producer_s shared_producer_t;
+typedef struct shared_producer_conf_s shared_producer_conf_t;
+
+/*
+** Counters of a producer, see shared_producer_get_stats()
+ */
+typedef struct shared_producer_stats_s {
+    long threads;           // staging rings, one per producing thread
+    long published_msgs;    // appended to the staging rings
+    long published_bytes;
+    long ring_full_cnt;     // shared_producer_publish() returned EAGAIN
+    long staged_msgs;       // in the staging rings now
+    long batches;           // produce calls of the flushers
+    long enqueued_msgs;     // handed to librdkafka
+    long queue_full_cnt;    // librdkafka's queue was full, retried
+    long failed_msgs;       // could not be enqueued, dropped
+    long delivered_msgs;    // delivery reports
+    long delivery_failed_msgs;
+} shared_producer_stats_t;
+
+/*
+** res: SHARED_PRODUCER_API_VERSION of the library
+ */
+SHARED_PRODUCER_EXPORT int shared_producer_api_version(void);
+
+/*
+** Configuration, owned by the caller until passed to shared_producer_new()
+ */
+SHARED_PRODUCER_EXPORT shared_producer_conf_t *shared_producer_conf_new(void);
+
+SHARED_PRODUCER_EXPORT void shared_producer_conf_destroy(shared_producer_conf_t *conf);
+
+/*
+** Set a property:
+**   flusher.threads  flusher threads, default 1
+**   ring.bytes       staging ring per producing thread, rounded up to a
+**                    power of two, default 4194304; messages may take up to
+**                    half of it
+**   batch.messages   max messages per produce call, default 1000
+**   idle.wait.us     flusher sleep when its rings are empty, default 1000
+** all other properties are librdkafka's (bootstrap.servers, linger.ms, ...)
+** res: 0 on success, -1 on error (errstr is set)
+ */
+SHARED_PRODUCER_EXPORT int shared_producer_conf_set(shared_producer_conf_t *conf, const char *name,
+                                                    const char *value, char *errstr, size_t errstr_size);
+
+/*
+** Create a producer, takes ownership of conf (also on failure)
+** res: NULL on error (errstr is set)
+ */
+SHARED_PRODUCER_EXPORT shared_producer_t *shared_producer_new(shared_producer_conf_t *conf, char *errstr,
+                                                              size_t errstr_size);
+
+/*
+** Copy a message into the calling thread's staging ring. Never blocks.
+** key may be NULL, partitioning is librdkafka's (by key).
+** res: 0 on success,
+**      EAGAIN if the ring is full (the flushers are behind, retry later),
+**      EMSGSIZE if the message is larger than half a ring,
+**      ENOMEM if the thread's ring could not be allocated
+ */
+SHARED_PRODUCER_EXPORT int shared_producer_publish(shared_producer_t *sp, const char *topic,
+                                                   const void *key, size_t key_len,
+                                                   const void *payload, size_t len);
+
+/*
+** Wait until the staging rings are drained and all messages are delivered
+** (or failed)
+** res: 0 on success, ETIMEDOUT
+ */
+SHARED_PRODUCER_EXPORT int shared_producer_flush(shared_producer_t *sp, int timeout_ms);
+
+/*
+** Copy the counters into stats, size: sizeof(*stats) of the caller
+ */
+SHARED_PRODUCER_EXPORT void shared_producer_get_stats(shared_producer_t *sp, shared_producer_stats_t *stats,
+                                                      size_t size);
+
+/*
+** Serve the librdkafka statistics (statistics.interval.ms must be set) and
+** the producer counters on http://<host>:<port>/metrics
+** res: 0 on success, -1 on error (errstr is set)
+ */
+SHARED_PRODUCER_EXPORT int shared_producer_start_metrics(shared_producer_t *sp, int port, char *errstr,
+                                                         size_t errstr_size);
+
+/*
+** Stop the flushers and destroy the producer. Call shared_producer_flush()
+** first, messages still staged are dropped. No thread may publish
+** concurrently or afterwards.
+ */
+SHARED_PRODUCER_EXPORT void shared_producer_destroy(shared_producer_t *sp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
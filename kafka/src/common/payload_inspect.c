@@ -0,0 +1,438 @@
+/*
+** Payload inspection: printable/UTF-8 checks, classification and hex dumps
+**
+** The byte scans have an AVX2, an SSE2 and a scalar kernel; the best one the
+** CPU supports is selected at runtime, on first use. UTF-8 validation skips
+** ASCII runs with the vector kernels and only decodes the multi-byte
+** sequences, so mostly-ASCII payloads (JSON, logs) are checked at memory
+** speed.
+**
+** Shared by the C and C++ consumers: written in the common subset of C and
+** C++. The payload_*() API is static inline, so a file may include this one
+** for a part of it.
+ */
+#ifndef PAYLOAD_INSPECT_C
+#define PAYLOAD_INSPECT_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define PAYLOAD_X86 1
+#include <immintrin.h>
+#endif
+
+#define PAYLOAD_SIMD_SCALAR 0
+#define PAYLOAD_SIMD_SSE2   1
+#define PAYLOAD_SIMD_AVX2   2
+
+/* one `hexdump -C` line: offset, 16 hex bytes, ASCII column and newline */
+#define PAYLOAD_HEXDUMP_LINE 79
+
+typedef enum {
+    PAYLOAD_EMPTY,
+    PAYLOAD_TEXT,   /* valid UTF-8 without control characters but \t \n \r */
+    PAYLOAD_JSON,   /* text that is a JSON object or array */
+    PAYLOAD_BINARY,
+} payload_class_t;
+
+
+/*
+** Scalar kernels
+ */
+static int printable_scalar(const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] < 0x20 || s[i] > 0x7e) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_ctrl(unsigned char c) {
+    return (c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7f;
+}
+
+static int has_ctrl_scalar(const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (is_ctrl(s[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t ascii_prefix_scalar(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && s[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void hex_scalar(const unsigned char *s, size_t len, char *out) {
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = hex_digits[s[i] >> 4];
+        out[2 * i + 1] = hex_digits[s[i] & 0xf];
+    }
+}
+
+
+#ifdef PAYLOAD_X86
+/*
+** SSE2 kernels, 16 bytes per step. Bytes are compared as signed: 0x80-0xff
+** are negative, i.e. below every ASCII character.
+ */
+static int printable_sse2(const unsigned char *s, size_t len) {
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmplt_epi8(x, hi));
+        if (_mm_movemask_epi8(ok) != 0xffff) {
+            return 0;
+        }
+    }
+    return printable_scalar(s + i, len - i);
+}
+
+static int has_ctrl_sse2(const unsigned char *s, size_t len) {
+    const __m128i space = _mm_set1_epi8(0x20), neg = _mm_set1_epi8(-1);
+    const __m128i tab = _mm_set1_epi8('\t'), lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r'), del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i ctrl = _mm_and_si128(_mm_cmplt_epi8(x, space), _mm_cmpgt_epi8(x, neg));
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(x, tab),
+                                  _mm_or_si128(_mm_cmpeq_epi8(x, lf), _mm_cmpeq_epi8(x, cr)));
+        ctrl = _mm_or_si128(_mm_andnot_si128(ws, ctrl), _mm_cmpeq_epi8(x, del));
+        if (_mm_movemask_epi8(ctrl)) {
+            return 1;
+        }
+    }
+    return has_ctrl_scalar(s + i, len - i);
+}
+
+static size_t ascii_prefix_sse2(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + ascii_prefix_scalar(s + i, len - i);
+}
+
+/* nibbles 0-15 to '0'-'9', 'a'-'f' */
+static __m128i hex_nibbles_sse2(__m128i n) {
+    __m128i digit = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(digit, alpha);
+}
+
+static void hex_sse2(const unsigned char *s, size_t len, char *out) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hi = hex_nibbles_sse2(_mm_and_si128(_mm_srli_epi16(x, 4), mask));
+        __m128i lo = hex_nibbles_sse2(_mm_and_si128(x, mask));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hex_scalar(s + i, len - i, out + 2 * i);
+}
+
+
+/*
+** AVX2 kernels, 32 bytes per step, compiled for AVX2 regardless of the
+** build's target and only called if the CPU supports it
+ */
+#define PAYLOAD_AVX2 __attribute__((target("avx2")))
+
+PAYLOAD_AVX2 static int printable_avx2(const unsigned char *s, size_t len) {
+    const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(x, lo), _mm256_cmpgt_epi8(hi, x));
+        if ((uint32_t)_mm256_movemask_epi8(ok) != 0xffffffffu) {
+            return 0;
+        }
+    }
+    return printable_sse2(s + i, len - i);
+}
+
+PAYLOAD_AVX2 static int has_ctrl_avx2(const unsigned char *s, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x20), neg = _mm256_set1_epi8(-1);
+    const __m256i tab = _mm256_set1_epi8('\t'), lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r'), del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(space, x), _mm256_cmpgt_epi8(x, neg));
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(x, tab),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(x, lf), _mm256_cmpeq_epi8(x, cr)));
+        ctrl = _mm256_or_si256(_mm256_andnot_si256(ws, ctrl), _mm256_cmpeq_epi8(x, del));
+        if (_mm256_movemask_epi8(ctrl)) {
+            return 1;
+        }
+    }
+    return has_ctrl_sse2(s + i, len - i);
+}
+
+PAYLOAD_AVX2 static size_t ascii_prefix_avx2(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + ascii_prefix_sse2(s + i, len - i);
+}
+
+PAYLOAD_AVX2 static __m256i hex_nibbles_avx2(__m256i n) {
+    const __m256i table = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c',
+                                           'd', 'e', 'f', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+                                           'a', 'b', 'c', 'd', 'e', 'f');
+    return _mm256_shuffle_epi8(table, n);
+}
+
+PAYLOAD_AVX2 static void hex_avx2(const unsigned char *s, size_t len, char *out) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i hi = hex_nibbles_avx2(_mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+        __m256i lo = hex_nibbles_avx2(_mm256_and_si256(x, mask));
+        /* unpack interleaves within 128-bit lanes: a = bytes 0-7 | 16-23,
+         * b = 8-15 | 24-31 */
+        __m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    hex_sse2(s + i, len - i, out + 2 * i);
+}
+#endif
+
+
+/*
+** Runtime kernel selection
+ */
+static int payload_simd_level = -1;
+
+static int payload_simd_detect(void) {
+#ifdef PAYLOAD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return PAYLOAD_SIMD_AVX2;
+    }
+    return PAYLOAD_SIMD_SSE2;
+#else
+    return PAYLOAD_SIMD_SCALAR;
+#endif
+}
+
+static int payload_simd(void) {
+    int level = __atomic_load_n(&payload_simd_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        level = payload_simd_detect();
+        __atomic_store_n(&payload_simd_level, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+
+/*
+** Force a kernel level, e.g. to compare them in benchmarks.
+** Levels the CPU does not support are lowered to the best supported one.
+** Returns the level in use.
+ */
+__attribute__((unused)) static int payload_set_simd_level(int level) {
+    int best = payload_simd_detect();
+    if (level < 0 || level > best) {
+        level = best;
+    }
+    __atomic_store_n(&payload_simd_level, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+static inline const char *payload_simd_name(void) {
+    int level = payload_simd();
+    switch (level) {
+    case PAYLOAD_SIMD_AVX2:
+        return "avx2";
+    case PAYLOAD_SIMD_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+#ifdef PAYLOAD_X86
+#define PAYLOAD_DISPATCH(kernel, ...)                                                \
+    (payload_simd() == PAYLOAD_SIMD_AVX2   ? kernel##_avx2(__VA_ARGS__)              \
+     : payload_simd() == PAYLOAD_SIMD_SSE2 ? kernel##_sse2(__VA_ARGS__)              \
+                                           : kernel##_scalar(__VA_ARGS__))
+#else
+#define PAYLOAD_DISPATCH(kernel, ...) kernel##_scalar(__VA_ARGS__)
+#endif
+
+
+/*
+** Length of the valid UTF-8 sequence at s (RFC 3629: no overlongs, no
+** surrogates, max U+10FFFF), 0 if invalid
+ */
+static size_t utf8_seq_len(const unsigned char *s, size_t len) {
+    unsigned char c = s[0];
+    if (c < 0x80) {
+        return 1;
+    }
+    if (c >= 0xc2 && c <= 0xdf) {
+        return len >= 2 && (s[1] & 0xc0) == 0x80 ? 2 : 0;
+    }
+    if (c >= 0xe0 && c <= 0xef) {
+        if (len < 3 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80) {
+            return 0;
+        }
+        if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] > 0x9f)) {
+            return 0;
+        }
+        return 3;
+    }
+    if (c >= 0xf0 && c <= 0xf4) {
+        if (len < 4 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80) {
+            return 0;
+        }
+        if ((c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] > 0x8f)) {
+            return 0;
+        }
+        return 4;
+    }
+    return 0;
+}
+
+
+/*
+** return 1 if all bytes are printable ASCII (isprint() in the C locale)
+ */
+static inline int payload_is_printable(const void *buf, size_t len) {
+    return PAYLOAD_DISPATCH(printable, (const unsigned char *)buf, len);
+}
+
+/*
+** return 1 if the bytes are valid UTF-8
+ */
+static inline int payload_is_utf8(const void *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    size_t i = 0;
+    while (1) {
+        i += PAYLOAD_DISPATCH(ascii_prefix, s + i, len - i);
+        if (i >= len) {
+            return 1;
+        }
+        size_t n = utf8_seq_len(s + i, len - i);
+        if (!n) {
+            return 0;
+        }
+        i += n;
+    }
+}
+
+static int is_json_ws(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+** Classify a payload. JSON is recognized by its outer brackets only, the
+** document is not parsed.
+ */
+static inline payload_class_t payload_classify(const void *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    if (len == 0) {
+        return PAYLOAD_EMPTY;
+    }
+    if (PAYLOAD_DISPATCH(has_ctrl, s, len) || !payload_is_utf8(s, len)) {
+        return PAYLOAD_BINARY;
+    }
+
+    size_t first = 0, last = len - 1;
+    while (first < len && is_json_ws(s[first])) {
+        first++;
+    }
+    while (last > first && is_json_ws(s[last])) {
+        last--;
+    }
+    if (first < last && ((s[first] == '{' && s[last] == '}') || (s[first] == '[' && s[last] == ']'))) {
+        return PAYLOAD_JSON;
+    }
+    return PAYLOAD_TEXT;
+}
+
+__attribute__((unused)) static const char *payload_class_name(payload_class_t cls) {
+    switch (cls) {
+    case PAYLOAD_EMPTY:
+        return "empty";
+    case PAYLOAD_TEXT:
+        return "text";
+    case PAYLOAD_JSON:
+        return "json";
+    default:
+        return "binary";
+    }
+}
+
+/*
+** Write len bytes as 2 * len lowercase hex digits (not terminated)
+ */
+static inline void payload_hex(const void *buf, size_t len, char *out) {
+    PAYLOAD_DISPATCH(hex, (const unsigned char *)buf, len, out);
+}
+
+/*
+** Format buf as `hexdump -C` lines, as many whole lines as fit in size
+** (PAYLOAD_HEXDUMP_LINE per 16 bytes). Returns the bytes written, not
+** terminated.
+ */
+static inline size_t payload_hexdump(const void *buf, size_t len, char *out, size_t size) {
+    const unsigned char *s = (const unsigned char *)buf;
+    char hex[2 * 1024];
+    size_t o = 0;
+    for (size_t off = 0; off < len && o + PAYLOAD_HEXDUMP_LINE <= size; off += 16) {
+        size_t n = len - off < 16 ? len - off : 16;
+        char *line = out + o;
+
+        /* the hex digits of 64 lines at once, in the vector kernel */
+        if (off % (sizeof(hex) / 2) == 0) {
+            size_t chunk = len - off < sizeof(hex) / 2 ? len - off : sizeof(hex) / 2;
+            payload_hex(s + off, chunk, hex);
+        }
+        const char *h = hex + 2 * (off % (sizeof(hex) / 2));
+
+        for (int k = 0; k < 8; k++) {
+            line[k] = hex_digits[(off >> (28 - 4 * k)) & 0xf];
+        }
+        memset(line + 8, ' ', 52);
+        for (size_t k = 0; k < n; k++) {
+            char *p = line + 10 + 3 * k + (k >= 8);
+            p[0] = h[2 * k];
+            p[1] = h[2 * k + 1];
+        }
+        line[60] = '|';
+        for (size_t k = 0; k < n; k++) {
+            unsigned char c = s[off + k];
+            line[61 + k] = c >= 0x20 && c <= 0x7e ? (char)c : '.';
+        }
+        line[61 + n] = '|';
+        line[62 + n] = '\n';
+        o += 63 + n;
+    }
+    return o;
+}
+
+#endif
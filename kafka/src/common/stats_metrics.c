@@ -0,0 +1,725 @@
+/*
+** librdkafka statistics to Prometheus metrics
+**
+** The EVENT_STATS / stats_cb JSON is parsed in a single pass, without
+** building a document, into typed per-client, per-broker and per-partition
+** metrics, which are rendered in Prometheus text format and served on
+** http://<host>:<port>/metrics by a small HTTP server thread.
+**
+** Shared by the C producer and the C++ consumer: written in the common
+** subset of C and C++.
+ */
+#ifndef STATS_METRICS_C
+#define STATS_METRICS_C
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define STATS_NAME_MAX 128
+#define STATS_PATH_MAX 8
+
+
+/*
+** Growable text buffer
+ */
+typedef struct metrics_buf_s {
+    char *data;
+    size_t len;
+    size_t size;
+} metrics_buf_t;
+
+static void metrics_buf_printf(metrics_buf_t *buf, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        size_t avail = buf->size - buf->len;
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data ? buf->data + buf->len : NULL, avail, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < avail) {
+            buf->len += n;
+            return;
+        }
+        size_t size = buf->size ? buf->size * 2 : 4096;
+        while (size - buf->len <= (size_t)n) {
+            size *= 2;
+        }
+        char *data = (char *)realloc(buf->data, size);
+        if (!data) {
+            return;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+}
+
+static void metrics_buf_free(metrics_buf_t *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+}
+
+
+/*
+** Typed metrics of one statistics event
+ */
+typedef struct stats_broker_s {
+    char name[STATS_NAME_MAX];
+    int64_t rtt_avg;        // us
+    int64_t rtt_p99;        // us
+    int64_t throttle_avg;   // ms
+    int64_t outbuf_cnt;
+    int64_t waitresp_cnt;
+    int64_t tx;
+    int64_t rx;
+} stats_broker_t;
+
+typedef struct stats_partition_s {
+    char topic[STATS_NAME_MAX];
+    int32_t partition;
+    int64_t consumer_lag;
+    int64_t fetchq_cnt;
+    int64_t fetchq_size;
+    int64_t msgq_cnt;
+    int64_t xmit_msgq_cnt;
+    int64_t txmsgs;
+    int64_t rxmsgs;
+} stats_partition_t;
+
+typedef struct stats_snapshot_s {
+    char name[STATS_NAME_MAX];
+    char type[16];
+    int64_t txmsgs;
+    int64_t rxmsgs;
+    int64_t msg_cnt;        // producer queue (outq) messages
+    int64_t msg_size;       // producer queue (outq) bytes
+    int64_t msg_size_max;   // queue.buffering.max.kbytes in bytes
+    int64_t replyq;
+
+    stats_broker_t *brokers;
+    int broker_cnt;
+    int broker_size;
+
+    stats_partition_t *partitions;
+    int partition_cnt;
+    int partition_size;
+} stats_snapshot_t;
+
+static void stats_snapshot_free(stats_snapshot_t *snap) {
+    free(snap->brokers);
+    free(snap->partitions);
+    memset(snap, 0, sizeof(*snap));
+}
+
+static stats_broker_t *stats_broker_get(stats_snapshot_t *snap, const char *name) {
+    for (int i = 0; i < snap->broker_cnt; i++) {
+        if (!strcmp(snap->brokers[i].name, name)) {
+            return &snap->brokers[i];
+        }
+    }
+    if (snap->broker_cnt == snap->broker_size) {
+        int size = snap->broker_size ? snap->broker_size * 2 : 8;
+        stats_broker_t *b = (stats_broker_t *)realloc(snap->brokers, size * sizeof(*b));
+        if (!b) {
+            return NULL;
+        }
+        snap->brokers = b;
+        snap->broker_size = size;
+    }
+    stats_broker_t *b = &snap->brokers[snap->broker_cnt++];
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    return b;
+}
+
+static stats_partition_t *stats_partition_get(stats_snapshot_t *snap, const char *topic, int32_t partition) {
+    // partitions of a topic are consecutive in the JSON: check the last one first
+    for (int i = snap->partition_cnt - 1; i >= 0; i--) {
+        if (snap->partitions[i].partition == partition && !strcmp(snap->partitions[i].topic, topic)) {
+            return &snap->partitions[i];
+        }
+    }
+    if (snap->partition_cnt == snap->partition_size) {
+        int size = snap->partition_size ? snap->partition_size * 2 : 64;
+        stats_partition_t *p = (stats_partition_t *)realloc(snap->partitions, size * sizeof(*p));
+        if (!p) {
+            return NULL;
+        }
+        snap->partitions = p;
+        snap->partition_size = size;
+    }
+    stats_partition_t *p = &snap->partitions[snap->partition_cnt++];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->topic, sizeof(p->topic), "%s", topic);
+    p->partition = partition;
+    return p;
+}
+
+
+/*
+** Single pass JSON parser, keeps only the path of object keys leading to
+** the current value and dispatches the values of interest by path
+ */
+typedef struct stats_parser_s {
+    const char *p;
+    const char *end;
+    char path[STATS_PATH_MAX][STATS_NAME_MAX];
+    int depth;
+    stats_snapshot_t *snap;
+} stats_parser_t;
+
+static void stats_skip_ws(stats_parser_t *ps) {
+    while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\t')) {
+        ps->p++;
+    }
+}
+
+/* parse a string into out (truncated to size), escapes are kept as is */
+static int stats_parse_string(stats_parser_t *ps, char *out, size_t size) {
+    size_t n = 0;
+
+    if (ps->p >= ps->end || *ps->p != '"') {
+        return -1;
+    }
+    ps->p++;
+    while (ps->p < ps->end && *ps->p != '"') {
+        char ch = *ps->p;
+        if (ch == '\\' && ps->p + 1 < ps->end) {
+            // decode the single character escapes, \uXXXX is kept as is
+            switch (ps->p[1]) {
+            case '"':
+            case '\\':
+            case '/':
+                ch = ps->p[1];
+                break;
+            case 'b':
+                ch = '\b';
+                break;
+            case 'f':
+                ch = '\f';
+                break;
+            case 'n':
+                ch = '\n';
+                break;
+            case 'r':
+                ch = '\r';
+                break;
+            case 't':
+                ch = '\t';
+                break;
+            default:
+                if (out && n + 1 < size) {
+                    out[n++] = ch;
+                }
+                ch = ps->p[1];
+                break;
+            }
+            ps->p++;
+        }
+        if (out && n + 1 < size) {
+            out[n++] = ch;
+        }
+        ps->p++;
+    }
+    if (ps->p >= ps->end) {
+        return -1;
+    }
+    ps->p++;
+    if (out) {
+        out[n] = '\0';
+    }
+    return 0;
+}
+
+static const char *stats_path(stats_parser_t *ps, int i) {
+    return i < ps->depth && i < STATS_PATH_MAX ? ps->path[i] : "";
+}
+
+/* called for every numeric value with its key path */
+static void stats_on_number(stats_parser_t *ps, int64_t v) {
+    stats_snapshot_t *snap = ps->snap;
+    const char *k0 = stats_path(ps, 0);
+
+    if (ps->depth == 1) {
+        if (!strcmp(k0, "txmsgs")) snap->txmsgs = v;
+        else if (!strcmp(k0, "rxmsgs")) snap->rxmsgs = v;
+        else if (!strcmp(k0, "msg_cnt")) snap->msg_cnt = v;
+        else if (!strcmp(k0, "msg_size")) snap->msg_size = v;
+        else if (!strcmp(k0, "msg_size_max")) snap->msg_size_max = v;
+        else if (!strcmp(k0, "replyq")) snap->replyq = v;
+        return;
+    }
+
+    if (!strcmp(k0, "brokers") && ps->depth >= 3) {
+        const char *k2 = stats_path(ps, 2);
+        const char *k3 = stats_path(ps, 3);
+        stats_broker_t *b;
+
+        if (ps->depth == 3 && strcmp(k2, "outbuf_cnt") && strcmp(k2, "waitresp_cnt") &&
+            strcmp(k2, "tx") && strcmp(k2, "rx")) {
+            return;
+        }
+        if (ps->depth == 4 && strcmp(k2, "rtt") && strcmp(k2, "throttle")) {
+            return;
+        }
+        if (ps->depth > 4 || !(b = stats_broker_get(snap, stats_path(ps, 1)))) {
+            return;
+        }
+        if (ps->depth == 3) {
+            if (!strcmp(k2, "outbuf_cnt")) b->outbuf_cnt = v;
+            else if (!strcmp(k2, "waitresp_cnt")) b->waitresp_cnt = v;
+            else if (!strcmp(k2, "tx")) b->tx = v;
+            else b->rx = v;
+        } else if (!strcmp(k2, "rtt")) {
+            if (!strcmp(k3, "avg")) b->rtt_avg = v;
+            else if (!strcmp(k3, "p99")) b->rtt_p99 = v;
+        } else if (!strcmp(k3, "avg")) {
+            b->throttle_avg = v;
+        }
+        return;
+    }
+
+    // topics.<topic>.partitions.<partition>.<field>
+    if (!strcmp(k0, "topics") && ps->depth == 5 && !strcmp(stats_path(ps, 2), "partitions")) {
+        const char *k4 = stats_path(ps, 4);
+        int32_t partition = (int32_t)atoi(stats_path(ps, 3));
+        int64_t *field = NULL;
+        stats_partition_t *p;
+
+        if (partition < 0) {
+            return; // internal UA partition
+        }
+        if (strcmp(k4, "consumer_lag") && strcmp(k4, "fetchq_cnt") && strcmp(k4, "fetchq_size") &&
+            strcmp(k4, "msgq_cnt") && strcmp(k4, "xmit_msgq_cnt") && strcmp(k4, "txmsgs") &&
+            strcmp(k4, "rxmsgs")) {
+            return;
+        }
+        if (!(p = stats_partition_get(snap, stats_path(ps, 1), partition))) {
+            return;
+        }
+        if (!strcmp(k4, "consumer_lag")) field = &p->consumer_lag;
+        else if (!strcmp(k4, "fetchq_cnt")) field = &p->fetchq_cnt;
+        else if (!strcmp(k4, "fetchq_size")) field = &p->fetchq_size;
+        else if (!strcmp(k4, "msgq_cnt")) field = &p->msgq_cnt;
+        else if (!strcmp(k4, "xmit_msgq_cnt")) field = &p->xmit_msgq_cnt;
+        else if (!strcmp(k4, "txmsgs")) field = &p->txmsgs;
+        else field = &p->rxmsgs;
+        *field = v;
+    }
+}
+
+static int stats_parse_value(stats_parser_t *ps);
+
+static int stats_parse_object(stats_parser_t *ps) {
+    ps->p++; // '{'
+    stats_skip_ws(ps);
+    if (ps->p < ps->end && *ps->p == '}') {
+        ps->p++;
+        return 0;
+    }
+    while (ps->p < ps->end) {
+        char *key = ps->depth < STATS_PATH_MAX ? ps->path[ps->depth] : NULL;
+
+        stats_skip_ws(ps);
+        if (stats_parse_string(ps, key, STATS_NAME_MAX) == -1) {
+            return -1;
+        }
+        stats_skip_ws(ps);
+        if (ps->p >= ps->end || *ps->p != ':') {
+            return -1;
+        }
+        ps->p++;
+
+        ps->depth++;
+        int r = stats_parse_value(ps);
+        ps->depth--;
+        if (r == -1) {
+            return -1;
+        }
+
+        stats_skip_ws(ps);
+        if (ps->p < ps->end && *ps->p == ',') {
+            ps->p++;
+            continue;
+        }
+        if (ps->p < ps->end && *ps->p == '}') {
+            ps->p++;
+            return 0;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+static int stats_parse_array(stats_parser_t *ps) {
+    ps->p++; // '['
+    stats_skip_ws(ps);
+    if (ps->p < ps->end && *ps->p == ']') {
+        ps->p++;
+        return 0;
+    }
+    while (ps->p < ps->end) {
+        // array elements are not indexed: nothing of interest lives in arrays
+        if (ps->depth < STATS_PATH_MAX) {
+            ps->path[ps->depth][0] = '\0';
+        }
+        ps->depth++;
+        int r = stats_parse_value(ps);
+        ps->depth--;
+        if (r == -1) {
+            return -1;
+        }
+        stats_skip_ws(ps);
+        if (ps->p < ps->end && *ps->p == ',') {
+            ps->p++;
+            continue;
+        }
+        if (ps->p < ps->end && *ps->p == ']') {
+            ps->p++;
+            return 0;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+static int stats_parse_value(stats_parser_t *ps) {
+    stats_skip_ws(ps);
+    if (ps->p >= ps->end) {
+        return -1;
+    }
+
+    switch (*ps->p) {
+    case '{':
+        return stats_parse_object(ps);
+    case '[':
+        return stats_parse_array(ps);
+    case '"':
+        if (ps->depth == 1 && !strcmp(ps->path[0], "name")) {
+            return stats_parse_string(ps, ps->snap->name, sizeof(ps->snap->name));
+        }
+        if (ps->depth == 1 && !strcmp(ps->path[0], "type")) {
+            return stats_parse_string(ps, ps->snap->type, sizeof(ps->snap->type));
+        }
+        return stats_parse_string(ps, NULL, 0);
+    default: {
+        // number, true, false, null
+        const char *start = ps->p;
+        while (ps->p < ps->end && *ps->p != ',' && *ps->p != '}' && *ps->p != ']' &&
+               *ps->p != ' ' && *ps->p != '\n') {
+            ps->p++;
+        }
+        if (*start == '-' || (*start >= '0' && *start <= '9')) {
+            stats_on_number(ps, strtoll(start, NULL, 10));
+        }
+        return 0;
+    }
+    }
+}
+
+/*
+** Parse a statistics JSON document into snap (which is reset first)
+** res: 0 on success, -1 on malformed JSON
+ */
+static int stats_parse(const char *json, size_t len, stats_snapshot_t *snap) {
+    stats_parser_t ps;
+
+    snap->name[0] = snap->type[0] = '\0';
+    snap->txmsgs = snap->rxmsgs = snap->msg_cnt = snap->msg_size = snap->replyq = 0;
+    snap->msg_size_max = 0;
+    snap->broker_cnt = 0;
+    snap->partition_cnt = 0;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.p = json;
+    ps.end = json + len;
+    ps.snap = snap;
+    return stats_parse_value(&ps);
+}
+
+
+/*
+** Prometheus text format
+ */
+/*
+** Escape a label value for the Prometheus text format: \\, \" and \n.
+** out must hold STATS_LABEL_MAX bytes, enough for a fully escaped name.
+ */
+#define STATS_LABEL_MAX (2 * STATS_NAME_MAX)
+
+static const char *stats_label_escape(const char *in, char *out) {
+    size_t len = 0;
+    for (; *in; in++) {
+        if (*in == '\\' || *in == '"' || *in == '\n') {
+            out[len++] = '\\';
+            out[len++] = *in == '\n' ? 'n' : *in;
+        } else {
+            out[len++] = *in;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+static void stats_render(const stats_snapshot_t *snap, metrics_buf_t *buf) {
+    char client[STATS_LABEL_MAX];
+    char label[STATS_LABEL_MAX];
+    const char *c = stats_label_escape(snap->name, client);
+
+    metrics_buf_printf(buf,
+        "# TYPE kafka_txmsgs_total counter\n"
+        "kafka_txmsgs_total{client=\"%s\"} %lld\n"
+        "# TYPE kafka_rxmsgs_total counter\n"
+        "kafka_rxmsgs_total{client=\"%s\"} %lld\n"
+        "# TYPE kafka_replyq gauge\n"
+        "kafka_replyq{client=\"%s\"} %lld\n",
+        c, (long long)snap->txmsgs, c, (long long)snap->rxmsgs, c, (long long)snap->replyq);
+
+    if (!strcmp(snap->type, "producer")) {
+        metrics_buf_printf(buf,
+            "# TYPE kafka_producer_outq_msgs gauge\n"
+            "kafka_producer_outq_msgs{client=\"%s\"} %lld\n"
+            "# TYPE kafka_producer_outq_bytes gauge\n"
+            "kafka_producer_outq_bytes{client=\"%s\"} %lld\n",
+            c, (long long)snap->msg_cnt, c, (long long)snap->msg_size);
+    }
+
+#define BROKER_METRIC(metric, type, field)                                             \
+    metrics_buf_printf(buf, "# TYPE " metric " " type "\n");                          \
+    for (int i = 0; i < snap->broker_cnt; i++) {                                       \
+        metrics_buf_printf(buf, metric "{client=\"%s\",broker=\"%s\"} %lld\n", c,      \
+                           stats_label_escape(snap->brokers[i].name, label),         \
+                           (long long)snap->brokers[i].field);                        \
+    }
+    BROKER_METRIC("kafka_broker_rtt_avg_us", "gauge", rtt_avg)
+    BROKER_METRIC("kafka_broker_rtt_p99_us", "gauge", rtt_p99)
+    BROKER_METRIC("kafka_broker_throttle_avg_ms", "gauge", throttle_avg)
+    BROKER_METRIC("kafka_broker_outbuf_msgs", "gauge", outbuf_cnt)
+    BROKER_METRIC("kafka_broker_waitresp_msgs", "gauge", waitresp_cnt)
+    BROKER_METRIC("kafka_broker_tx_total", "counter", tx)
+    BROKER_METRIC("kafka_broker_rx_total", "counter", rx)
+#undef BROKER_METRIC
+
+#define PARTITION_METRIC(metric, type, field)                                              \
+    metrics_buf_printf(buf, "# TYPE " metric " " type "\n");                              \
+    for (int i = 0; i < snap->partition_cnt; i++) {                                        \
+        metrics_buf_printf(buf, metric "{client=\"%s\",topic=\"%s\",partition=\"%d\"} %lld\n", \
+                           c, stats_label_escape(snap->partitions[i].topic, label),     \
+                           (int)snap->partitions[i].partition,                             \
+                           (long long)snap->partitions[i].field);                         \
+    }
+    if (!strcmp(snap->type, "consumer")) {
+        PARTITION_METRIC("kafka_partition_consumer_lag", "gauge", consumer_lag)
+        PARTITION_METRIC("kafka_partition_fetchq_msgs", "gauge", fetchq_cnt)
+        PARTITION_METRIC("kafka_partition_fetchq_bytes", "gauge", fetchq_size)
+        PARTITION_METRIC("kafka_partition_rxmsgs_total", "counter", rxmsgs)
+    } else {
+        PARTITION_METRIC("kafka_partition_msgq_msgs", "gauge", msgq_cnt)
+        PARTITION_METRIC("kafka_partition_xmit_msgq_msgs", "gauge", xmit_msgq_cnt)
+        PARTITION_METRIC("kafka_partition_txmsgs_total", "counter", txmsgs)
+    }
+#undef PARTITION_METRIC
+}
+
+
+/*
+** Application metrics appended to every /metrics response
+ */
+typedef void (metrics_extra_cb_t)(metrics_buf_t *buf, void *opaque);
+
+typedef struct metrics_server_s {
+    int listen_fd;
+    pthread_t thread;
+    volatile int running;
+
+    pthread_mutex_t lock;
+    stats_snapshot_t snap;   // only used by metrics_server_update_stats()
+    metrics_buf_t stats_text;
+    long stats_cnt;
+    long stats_errors;
+
+    metrics_extra_cb_t *extra_cb;
+    void *extra_opaque;
+} metrics_server_t;
+
+static void metrics_server_respond(metrics_server_t *srv, int fd) {
+    char req[1024];
+    ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+    metrics_buf_t body;
+    metrics_buf_t resp;
+
+    if (n <= 0) {
+        return;
+    }
+    req[n] = '\0';
+
+    memset(&body, 0, sizeof(body));
+    memset(&resp, 0, sizeof(resp));
+
+    if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET /metrics?", 13)) {
+        metrics_buf_printf(&resp, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    } else {
+        pthread_mutex_lock(&srv->lock);
+        if (srv->stats_text.len) {
+            metrics_buf_printf(&body, "%.*s", (int)srv->stats_text.len, srv->stats_text.data);
+        }
+        metrics_buf_printf(&body,
+            "# TYPE kafka_stats_events_total counter\nkafka_stats_events_total %ld\n"
+            "# TYPE kafka_stats_parse_errors_total counter\nkafka_stats_parse_errors_total %ld\n",
+            srv->stats_cnt, srv->stats_errors);
+        pthread_mutex_unlock(&srv->lock);
+
+        if (srv->extra_cb) {
+            srv->extra_cb(&body, srv->extra_opaque);
+        }
+
+        metrics_buf_printf(&resp,
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    }
+
+    // send header and body
+    const char *parts[2] = { resp.data, body.data };
+    size_t lens[2] = { resp.len, body.len };
+    for (int i = 0; i < 2; i++) {
+        size_t off = 0;
+        while (off < lens[i]) {
+            ssize_t w = send(fd, parts[i] + off, lens[i] - off, MSG_NOSIGNAL);
+            if (w <= 0) {
+                break;
+            }
+            off += (size_t)w;
+        }
+    }
+    metrics_buf_free(&body);
+    metrics_buf_free(&resp);
+}
+
+static void *metrics_server_main(void *arg) {
+    metrics_server_t *srv = (metrics_server_t *)arg;
+
+    while (srv->running) {
+        struct pollfd pfd;
+        pfd.fd = srv->listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        int fd = accept(srv->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        struct timeval tv;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        metrics_server_respond(srv, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+** Start serving /metrics on port (all interfaces)
+** res: NULL on error, errstr is set
+ */
+static metrics_server_t *metrics_server_start(int port, char *errstr, size_t errstr_size) {
+    metrics_server_t *srv = (metrics_server_t *)calloc(1, sizeof(*srv));
+    struct sockaddr_in addr;
+    int one = 1;
+
+    if (!srv) {
+        snprintf(errstr, errstr_size, "out of memory");
+        return NULL;
+    }
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv->listen_fd == -1) {
+        snprintf(errstr, errstr_size, "socket: %s", strerror(errno));
+        free(srv);
+        return NULL;
+    }
+    setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(srv->listen_fd, 16) == -1) {
+        snprintf(errstr, errstr_size, "bind/listen on port %d: %s", port, strerror(errno));
+        close(srv->listen_fd);
+        free(srv);
+        return NULL;
+    }
+
+    pthread_mutex_init(&srv->lock, NULL);
+    srv->running = 1;
+    if (pthread_create(&srv->thread, NULL, metrics_server_main, srv) != 0) {
+        snprintf(errstr, errstr_size, "failed to start metrics thread");
+        close(srv->listen_fd);
+        pthread_mutex_destroy(&srv->lock);
+        free(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+/*
+** Set before the first scrape
+ */
+static void metrics_server_set_extra_cb(metrics_server_t *srv, metrics_extra_cb_t *cb, void *opaque) {
+    srv->extra_opaque = opaque;
+    srv->extra_cb = cb;
+}
+
+/*
+** Parse a statistics event and publish its metrics.
+** Called from the stats callback, one caller at a time.
+** res: 0 on success, -1 on malformed JSON (previous metrics are kept)
+ */
+static int metrics_server_update_stats(metrics_server_t *srv, const char *json, size_t len) {
+    metrics_buf_t text;
+
+    memset(&text, 0, sizeof(text));
+    if (stats_parse(json, len, &srv->snap) == -1) {
+        pthread_mutex_lock(&srv->lock);
+        srv->stats_errors++;
+        pthread_mutex_unlock(&srv->lock);
+        return -1;
+    }
+    stats_render(&srv->snap, &text);
+
+    pthread_mutex_lock(&srv->lock);
+    metrics_buf_t old = srv->stats_text;
+    srv->stats_text = text;
+    srv->stats_cnt++;
+    pthread_mutex_unlock(&srv->lock);
+
+    metrics_buf_free(&old);
+    return 0;
+}
+
+static void metrics_server_stop(metrics_server_t *srv) {
+    srv->running = 0;
+    pthread_join(srv->thread, NULL);
+    close(srv->listen_fd);
+    pthread_mutex_destroy(&srv->lock);
+    metrics_buf_free(&srv->stats_text);
+    stats_snapshot_free(&srv->snap);
+    free(srv);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef ALLOC_COUNTER_CPP
+#define ALLOC_COUNTER_CPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+/**
+ * Heap allocation counter, to keep the consume path allocation-free.
+ *
+ * Built with CONSUMER_ALLOC_COUNT (make ALLOC_COUNT=1), the global
+ * operator new is replaced by one that counts every call, including those
+ * of librdkafka's C++ API. librdkafka's own (C) allocations are not
+ * counted. Without it the count stays 0.
+ */
+static std::atomic<uint64_t> heap_alloc_cnt(0);
+
+#ifdef CONSUMER_ALLOC_COUNT
+/* not inlined: gcc would take the free() for a mismatched delete */
+__attribute__((noinline)) void *operator new(size_t size) {
+  heap_alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept {
+  free(p);
+}
+#endif
+
+static inline bool alloc_count_enabled() {
+#ifdef CONSUMER_ALLOC_COUNT
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @returns the number of operator new calls so far
+ */
+static inline uint64_t get_heap_alloc_cnt() {
+  return heap_alloc_cnt.load(std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef ARENA_CPP
+#define ARENA_CPP
+
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * @brief bump allocator for scratch data that is freed all at once
+ *
+ * Allocations are carved from chunks of chunk_size bytes (or one chunk of
+ * its own for larger allocations). reset() frees everything by rewinding,
+ * the chunks are kept: once the arena has grown to what a batch needs,
+ * it does not allocate anymore. Not thread-safe.
+ */
+class Arena {
+ private:
+  struct Chunk {
+    char *buf;
+    size_t size;
+  };
+
+  std::vector<Chunk> chunks;
+  size_t chunk_size;
+  size_t current; /* chunk allocated from */
+  size_t used;    /* bytes used of the current chunk */
+  size_t bytes;   /* bytes allocated since reset() */
+
+ public:
+  explicit Arena(size_t chunk_size = 64 * 1024)
+      : chunk_size(chunk_size), current(0), used(0), bytes(0) {
+    chunks.reserve(16);
+  }
+
+  ~Arena() {
+    for (size_t i = 0; i < chunks.size(); i++)
+      delete[] chunks[i].buf;
+  }
+
+  /**
+   * @returns size bytes, 8-byte aligned, valid until reset()
+   */
+  void *alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    bytes += size;
+    for (; current < chunks.size(); current++, used = 0) {
+      if (chunks[current].size - used >= size) {
+        void *p = chunks[current].buf + used;
+        used += size;
+        return p;
+      }
+    }
+    Chunk c;
+    c.size = size > chunk_size ? size : chunk_size;
+    c.buf  = new char[c.size];
+    chunks.push_back(c);
+    current = chunks.size() - 1;
+    used    = size;
+    return c.buf;
+  }
+
+  void reset() {
+    current = 0;
+    used    = 0;
+    bytes   = 0;
+  }
+
+  size_t get_bytes() const {
+    return bytes;
+  }
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef ASYNC_LOG_CPP
+#define ASYNC_LOG_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+/* syslog severities, as used by librdkafka log events */
+#define ALOG_LEVEL_ERROR   3
+#define ALOG_LEVEL_WARNING 4
+#define ALOG_LEVEL_NOTICE  5
+#define ALOG_LEVEL_INFO    6
+#define ALOG_LEVEL_DEBUG   7
+
+/* levels above ALOG_LEVEL_MAX are compiled out, arguments are not evaluated */
+#ifndef ALOG_LEVEL_MAX
+#define ALOG_LEVEL_MAX ALOG_LEVEL_DEBUG
+#endif
+
+
+/**
+ * @brief Asynchronous logger
+ *
+ * Callers format their record into a slot of a bounded lock-free ring
+ * (multi-producer, single-consumer) and return; a flusher thread prefixes
+ * the records with their timestamp, formatted once per second, and writes
+ * them to the file descriptor in as few writes as possible.
+ * When the ring is full records are dropped and counted, callers never
+ * block. Records longer than a slot are truncated.
+ */
+class AsyncLog {
+ private:
+  static const size_t slot_cnt      = 8192; /* power of two */
+  static const size_t slot_msg_size = 232;
+
+  struct Slot {
+    std::atomic<size_t> seq;
+    int64_t ts_ms;
+    int level;
+    size_t len;
+    char msg[slot_msg_size];
+  };
+
+  Slot *slots;
+  std::atomic<size_t> enqueue_pos;
+  size_t dequeue_pos; /* flusher only */
+
+  int fd;
+  std::atomic<int> level;
+  std::atomic<long> drop_cnt;
+  long reported_drop_cnt; /* flusher only */
+
+  std::atomic<bool> running;
+  std::thread flusher;
+
+  /* flusher only: cached "YYYY-mm-dd HH:MM:SS" of cached_sec */
+  time_t cached_sec;
+  char cached_prefix[32];
+
+  static int64_t now_ms() {
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  /* claim a slot, NULL if the ring is full */
+  Slot *claim(size_t &pos) {
+    pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      Slot *slot = &slots[pos & (slot_cnt - 1)];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+          return slot;
+      } else if (diff < 0) {
+        return NULL;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void append_prefix(std::string &out, int64_t ts_ms, int lvl) {
+    time_t sec = (time_t)(ts_ms / 1000);
+    if (sec != cached_sec) {
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+      cached_sec = sec;
+    }
+    static const char *names[] = {"EMERG", "ALERT", "CRIT",  "ERROR",
+                                  "WARN",  "NOTICE", "INFO", "DEBUG"};
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%s.%03d %s: ", cached_prefix,
+                     (int)(ts_ms % 1000), names[lvl & 7]);
+    out.append(buf, (size_t)n);
+  }
+
+  /* drain the ring into out, returns the number of records */
+  size_t drain(std::string &out) {
+    size_t cnt = 0;
+    while (true) {
+      Slot *slot = &slots[dequeue_pos & (slot_cnt - 1)];
+      if (slot->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+        break;
+      append_prefix(out, slot->ts_ms, slot->level);
+      out.append(slot->msg, slot->len);
+      out += '\n';
+      slot->seq.store(dequeue_pos + slot_cnt, std::memory_order_release);
+      dequeue_pos++;
+      cnt++;
+    }
+
+    long drops = drop_cnt.load(std::memory_order_relaxed);
+    if (drops != reported_drop_cnt) {
+      append_prefix(out, now_ms(), ALOG_LEVEL_WARNING);
+      out += "log ring full: " + std::to_string(drops - reported_drop_cnt) +
+             " record(s) dropped\n";
+      reported_drop_cnt = drops;
+    }
+    return cnt;
+  }
+
+  void write_all(const std::string &out) {
+    size_t off = 0;
+    while (off < out.size()) {
+      ssize_t r = ::write(fd, out.data() + off, out.size() - off);
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+        return;
+      }
+      off += (size_t)r;
+    }
+  }
+
+  void flusher_loop() {
+    std::string out;
+    out.reserve(64 * 1024);
+    while (true) {
+      bool stopping = !running.load(std::memory_order_acquire);
+      out.clear();
+      drain(out);
+      if (!out.empty())
+        write_all(out);
+      else if (stopping)
+        break;
+      else
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+ public:
+  AsyncLog()
+      : enqueue_pos(0),
+        dequeue_pos(0),
+        fd(STDERR_FILENO),
+        level(ALOG_LEVEL_INFO),
+        drop_cnt(0),
+        reported_drop_cnt(0),
+        running(false),
+        cached_sec(0) {
+    slots = new Slot[slot_cnt];
+    for (size_t i = 0; i < slot_cnt; i++)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    cached_prefix[0] = '\0';
+  }
+
+  ~AsyncLog() {
+    stop();
+    delete[] slots;
+  }
+
+  /**
+   * @brief start the flusher thread writing to fd.
+   *        Records logged before are kept (as far as they fit).
+   */
+  void start(int log_fd) {
+    if (running.exchange(true))
+      return;
+    fd      = log_fd;
+    flusher = std::thread(&AsyncLog::flusher_loop, this);
+  }
+
+  /**
+   * @brief write all pending records and stop the flusher thread
+   */
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    flusher.join();
+  }
+
+  /**
+   * @brief runtime level, records above it are discarded by the caller
+   */
+  void set_level(int lvl) {
+    level.store(lvl, std::memory_order_relaxed);
+  }
+
+  bool enabled(int lvl) {
+    return lvl <= level.load(std::memory_order_relaxed);
+  }
+
+  long get_drop_cnt() {
+    return drop_cnt.load();
+  }
+
+  void vwrite(int lvl, const char *fmt, va_list ap) {
+    size_t pos;
+    Slot *slot = claim(pos);
+    if (!slot) {
+      drop_cnt.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    slot->ts_ms = now_ms();
+    slot->level = lvl;
+    int n       = vsnprintf(slot->msg, slot_msg_size, fmt, ap);
+    slot->len   = n < 0 ? 0 : std::min((size_t)n, slot_msg_size - 1);
+    /* strip the trailing newline, the flusher adds one */
+    if (slot->len > 0 && slot->msg[slot->len - 1] == '\n')
+      slot->len--;
+    slot->seq.store(pos + 1, std::memory_order_release);
+  }
+
+  __attribute__((format(printf, 3, 4))) void write(int lvl,
+                                                   const char *fmt,
+                                                   ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vwrite(lvl, fmt, ap);
+    va_end(ap);
+  }
+};
+
+static AsyncLog app_log;
+
+/* log with a level only known at runtime, e.g. librdkafka log events */
+#define ALOG(lvl, ...)                                                         \
+  do {                                                                         \
+    if ((lvl) <= ALOG_LEVEL_MAX && app_log.enabled(lvl))                       \
+      app_log.write((lvl), __VA_ARGS__);                                       \
+  } while (0)
+
+#if ALOG_LEVEL_MAX >= ALOG_LEVEL_ERROR
+#define ALOG_ERROR(...) ALOG(ALOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define ALOG_ERROR(...) do { } while (0)
+#endif
+
+#if ALOG_LEVEL_MAX >= ALOG_LEVEL_WARNING
+#define ALOG_WARNING(...) ALOG(ALOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define ALOG_WARNING(...) do { } while (0)
+#endif
+
+#if ALOG_LEVEL_MAX >= ALOG_LEVEL_INFO
+#define ALOG_INFO(...) ALOG(ALOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define ALOG_INFO(...) do { } while (0)
+#endif
+
+#if ALOG_LEVEL_MAX >= ALOG_LEVEL_DEBUG
+#define ALOG_DEBUG(...) ALOG(ALOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define ALOG_DEBUG(...) do { } while (0)
+#endif
+
+#endif
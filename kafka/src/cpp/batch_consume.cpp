@@ -0,0 +1,43 @@
+#ifndef BATCH_CONSUME_CPP
+#define BATCH_CONSUME_CPP
+
+#include <cstddef>
+
+#include <librdkafka/rdkafka.h>
+
+
+/**
+ * @brief batch handler: receives a contiguous span of messages.
+ *        The messages are owned (and destroyed) by the caller.
+ *
+ * Messages are handled as librdkafka C messages: the C++ API's consume()
+ * allocates a Message wrapper per message, the C API does not.
+ */
+typedef void (*batch_handler_t)(rd_kafka_message_t **messages, size_t cnt,
+                                void *opaque);
+
+
+/**
+ * @brief collect up to batch_size messages from rkqu (the consumer queue or
+ *        a partition / worker queue) into batch, waiting at most linger_ms
+ *        for the whole batch.
+ *
+ * Errors and EOF events are added to the batch, so the handler sees them in
+ * order. Rebalance and other callbacks are served while waiting.
+ *
+ * @returns the number of messages in batch
+ */
+static size_t consume_batch(rd_kafka_queue_t *rkqu,
+                            size_t batch_size,
+                            int linger_ms,
+                            rd_kafka_message_t **batch) {
+  ssize_t cnt = rd_kafka_consume_batch_queue(rkqu, linger_ms, batch, batch_size);
+  return cnt < 0 ? 0 : (size_t)cnt;
+}
+
+static void release_batch(rd_kafka_message_t **batch, size_t cnt) {
+  for (size_t i = 0; i < cnt; i++)
+    rd_kafka_message_destroy(batch[i]);
+}
+
+#endif
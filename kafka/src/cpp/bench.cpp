@@ -0,0 +1,357 @@
+/*
+ * Throughput benchmark of the C++ consumer paths
+ *
+ * Runs against librdkafka's in-process mock cluster, no broker needed.
+ * Messages are pre-produced with the C API, then consumed with the consume
+ * paths of consumer.cpp: the single-message loop, the batched loop and the
+ * partition worker engine, for every payload size x partition count x
+ * codec x workers x batch size of the grid. The spill log's append and
+ * defer_offset() path is measured on its own, without a broker.
+ *
+ * One JSON object per scenario is written to stdout, progress to stderr.
+ * CPU time is the whole process, including the mock brokers. Built with
+ * CONSUMER_ALLOC_COUNT, the heap allocations per message are reported too.
+ *
+ * Grid and size can be changed with the environment variables
+ * BENCH_MSGS, BENCH_PAYLOADS, BENCH_PARTITIONS, BENCH_CODECS, BENCH_WORKERS,
+ * BENCH_BATCH (comma separated lists).
+ */
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./alloc_counter.cpp"
+#include "./batch_consume.cpp"
+#include "./partition_engine.cpp"
+#include "./spill_log.cpp"
+
+
+static std::atomic<long> bench_cnt(0);
+static std::atomic<int64_t> bench_bytes(0);
+
+
+static void bench_msg_consume(rd_kafka_message_t *message, void *opaque) {
+  if (!message->err) {
+    bench_cnt++;
+    bench_bytes += message->len;
+  }
+}
+
+static void bench_msg_consume_batch(rd_kafka_message_t **messages,
+                                    size_t cnt,
+                                    void *opaque) {
+  for (size_t i = 0; i < cnt; i++)
+    bench_msg_consume(messages[i], opaque);
+}
+
+static std::atomic<long> bench_durable_cnt(0);
+
+static void bench_durable_cb(const std::string &topic,
+                             int32_t partition,
+                             int64_t offset,
+                             void *opaque) {
+  bench_durable_cnt++;
+}
+
+static int64_t cpu_time_us() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static std::vector<std::string> env_list(const char *name, const char *def) {
+  const char *val = getenv(name);
+  std::stringstream ss(val && *val ? val : def);
+  std::vector<std::string> out;
+  std::string item;
+  while (std::getline(ss, item, ','))
+    out.push_back(item);
+  return out;
+}
+
+
+/**
+ * @brief append cnt records of payload_size to a spill log in a temporary
+ *        directory, deferring each record's offset like the consumer does
+ */
+static void bench_spill(size_t payload_size, int partition_cnt, long cnt) {
+  char dir[] = "/tmp/bench-spill-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::cerr << "Failed to create spill dir: " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  std::string err;
+  OutputSink *sink = OutputSink::create("file", "/dev/null", 1 << 20, 0, err);
+  SpillLog *log    = sink ? SpillLog::create(dir, 64 << 20, 1000, 256 << 20, 5,
+                                             sink, bench_durable_cb, NULL, err)
+                          : NULL;
+  if (!log) {
+    std::cerr << "Failed to create spill log: " << err << std::endl;
+    exit(1);
+  }
+
+  std::vector<std::string> topics;
+  for (int p = 0; p < partition_cnt; p++)
+    topics.push_back("bench-spill-" + std::to_string(p % 4));
+  std::string payload(payload_size, 'x');
+  struct iovec iov;
+  iov.iov_base = (void *)payload.data();
+  iov.iov_len  = payload.size();
+
+  bench_durable_cnt    = 0;
+  int64_t cpu_start    = cpu_time_us();
+  uint64_t alloc_start = get_heap_alloc_cnt();
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (long i = 0; i < cnt; i++) {
+    int p = (int)(i % partition_cnt);
+    if (!log->append(&iov, 1)) {
+      std::cerr << "Failed to append to spill log" << std::endl;
+      exit(1);
+    }
+    log->defer_offset(topics[p], p, i / partition_cnt);
+  }
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  int64_t cpu_us  = cpu_time_us() - cpu_start;
+  uint64_t allocs = get_heap_alloc_cnt() - alloc_start;
+
+  log->sync();
+  long durable = bench_durable_cnt;
+  log->close(5000);
+  delete log;
+  sink->close();
+  delete sink;
+  DIR *d = opendir(dir);
+  if (d) {
+    struct dirent *de;
+    while ((de = readdir(d)))
+      if (de->d_name[0] != '.')
+        unlink((std::string(dir) + "/" + de->d_name).c_str());
+    closedir(d);
+  }
+  rmdir(dir);
+
+  printf("{\"path\":\"cpp\",\"scenario\":\"spill\",\"payload_size\":%zu,"
+         "\"partitions\":%d,\"msgs\":%ld,\"durable\":%ld,\"msg_per_s\":%.0f,"
+         "\"cpu_us_per_msg\":%.3f,\"allocs_per_msg\":%.4f}\n",
+         payload_size, partition_cnt, cnt, durable, secs > 0 ? cnt / secs : 0.0,
+         cnt > 0 ? (double)cpu_us / cnt : 0.0,
+         cnt > 0 && alloc_count_enabled() ? (double)allocs / cnt : 0.0);
+  fflush(stdout);
+  fprintf(stderr, "%% spill payload=%-6zu partitions=%-3d: %.0f msg/s\n",
+          payload_size, partition_cnt, secs > 0 ? cnt / secs : 0.0);
+}
+
+
+/**
+ * @brief produce cnt messages of payload_size to topic with the C API
+ */
+static void pre_produce(const std::string &bootstraps,
+                        const std::string &topic,
+                        const std::string &codec,
+                        size_t payload_size,
+                        long cnt) {
+  char errstr[512];
+  rd_kafka_conf_t *conf = rd_kafka_conf_new();
+  rd_kafka_conf_set(conf, "bootstrap.servers", bootstraps.c_str(), errstr,
+                    sizeof(errstr));
+  rd_kafka_conf_set(conf, "compression.codec", codec.c_str(), errstr,
+                    sizeof(errstr));
+  rd_kafka_conf_set(conf, "linger.ms", "5", errstr, sizeof(errstr));
+  rd_kafka_t *rk =
+      rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+  if (!rk) {
+    std::cerr << "Failed to create producer: " << errstr << std::endl;
+    exit(1);
+  }
+
+  std::string payload(payload_size, 'x');
+  for (long i = 0; i < cnt;) {
+    rd_kafka_resp_err_t err = rd_kafka_producev(
+        rk, RD_KAFKA_V_TOPIC(topic.c_str()),
+        RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+        RD_KAFKA_V_VALUE((void *)payload.data(), payload.size()),
+        RD_KAFKA_V_END);
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+      rd_kafka_poll(rk, 10);
+      continue;
+    }
+    i++;
+  }
+  rd_kafka_flush(rk, 60 * 1000);
+  rd_kafka_destroy(rk);
+}
+
+
+int main(int argc, char **argv) {
+  char errstr[512];
+  const char *msgs_env = getenv("BENCH_MSGS");
+  long msgs            = msgs_env ? atol(msgs_env) : 50000;
+
+  std::vector<std::string> payloads =
+      env_list("BENCH_PAYLOADS", "100,1024,4096");
+  std::vector<std::string> partitions = env_list("BENCH_PARTITIONS", "1,8");
+  std::vector<std::string> codecs     = env_list("BENCH_CODECS", "none,lz4");
+  std::vector<std::string> workers    = env_list("BENCH_WORKERS", "0,1,4");
+  std::vector<std::string> batches    = env_list("BENCH_BATCH", "1,64");
+
+  rd_kafka_t *mrk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(),
+                                 errstr, sizeof(errstr));
+  rd_kafka_mock_cluster_t *mcluster = mrk ? rd_kafka_mock_cluster_new(mrk, 3) : NULL;
+  if (!mcluster) {
+    std::cerr << "Failed to create mock cluster" << std::endl;
+    return 1;
+  }
+  std::string bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+  std::cerr << "% librdkafka " << RdKafka::version_str() << ", mock cluster "
+            << bootstraps << ", " << msgs << " msgs per scenario" << std::endl;
+
+  int topic_seq = 0;
+  for (size_t a = 0; a < payloads.size(); a++)
+  for (size_t b = 0; b < partitions.size(); b++)
+  for (size_t c = 0; c < codecs.size(); c++) {
+    size_t payload_size = (size_t)atol(payloads[a].c_str());
+    int partition_cnt   = atoi(partitions[b].c_str());
+
+    std::string topic = "bench-cpp-" + std::to_string(++topic_seq);
+    rd_kafka_mock_topic_create(mcluster, topic.c_str(), partition_cnt, 1);
+    pre_produce(bootstraps, topic, codecs[c], payload_size, msgs);
+
+    for (size_t d = 0; d < workers.size(); d++)
+    for (size_t e = 0; e < batches.size(); e++) {
+      int worker_cnt    = atoi(workers[d].c_str());
+      size_t batch_size = (size_t)atol(batches[e].c_str());
+
+      RdKafka::Conf *conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
+      std::string err;
+      conf->set("bootstrap.servers", bootstraps, err);
+      conf->set("group.id", "bench-cpp", err);
+      conf->set("enable.auto.commit", "false", err);
+      conf->set("auto.offset.reset", "earliest", err);
+      RdKafka::KafkaConsumer *consumer =
+          RdKafka::KafkaConsumer::create(conf, err);
+      delete conf;
+      if (!consumer) {
+        std::cerr << "Failed to create consumer: " << err << std::endl;
+        return 1;
+      }
+
+      /* the mock brokers only retain the last few MB of each partition:
+       * consume what is left between the watermarks */
+      long expected = 0;
+      std::vector<RdKafka::TopicPartition *> parts;
+      for (int p = 0; p < partition_cnt; p++) {
+        int64_t low = 0, high = 0;
+        consumer->query_watermark_offsets(topic, p, &low, &high, 5000);
+        expected += (long)(high - low);
+        parts.push_back(RdKafka::TopicPartition::create(
+            topic, p, RdKafka::OFFSET_BEGINNING));
+      }
+
+      bench_cnt   = 0;
+      bench_bytes = 0;
+
+      PartitionEngine *engine = NULL;
+      if (worker_cnt > 0) {
+        engine = new PartitionEngine(worker_cnt, bench_msg_consume, NULL);
+        if (batch_size > 1)
+          engine->set_batch_handler(bench_msg_consume_batch, batch_size, 100);
+        if (!engine->start(consumer, err)) {
+          std::cerr << "Failed to start engine: " << err << std::endl;
+          return 1;
+        }
+      }
+      consumer->assign(parts);
+      if (engine)
+        engine->add_partitions(consumer, parts);
+
+      rd_kafka_queue_t *consumer_queue =
+          rd_kafka_queue_get_consumer(consumer->c_ptr());
+      std::vector<rd_kafka_message_t *> batch(batch_size);
+      int64_t cpu_start = cpu_time_us();
+      uint64_t alloc_start = get_heap_alloc_cnt();
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      std::chrono::steady_clock::time_point deadline =
+          start + std::chrono::seconds(120);
+
+      while (bench_cnt < expected &&
+             std::chrono::steady_clock::now() < deadline) {
+        if (!engine && batch_size > 1) {
+          size_t n = consume_batch(consumer_queue, batch_size, 100, &batch[0]);
+          if (n > 0)
+            bench_msg_consume_batch(&batch[0], n, NULL);
+          release_batch(&batch[0], n);
+        } else {
+          rd_kafka_message_t *msg =
+              rd_kafka_consumer_poll(consumer->c_ptr(), engine ? 10 : 100);
+          if (msg) {
+            bench_msg_consume(msg, NULL);
+            rd_kafka_message_destroy(msg);
+          }
+        }
+      }
+
+      double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+      int64_t cpu_us  = cpu_time_us() - cpu_start;
+      uint64_t allocs = get_heap_alloc_cnt() - alloc_start;
+      long cnt        = bench_cnt;
+      rd_kafka_queue_destroy(consumer_queue);
+
+      if (engine) {
+        engine->stop();
+        engine->remove_all_partitions();
+      }
+      consumer->unassign();
+      consumer->close();
+      delete engine;
+      delete consumer;
+      RdKafka::TopicPartition::destroy(parts);
+
+      printf("{\"path\":\"cpp\",\"scenario\":\"consume\",\"workers\":%d,"
+             "\"batch_size\":%zu,\"payload_size\":%zu,\"partitions\":%d,"
+             "\"codec\":\"%s\",\"msgs\":%ld,\"msg_per_s\":%.0f,"
+             "\"mb_per_s\":%.2f,\"cpu_s\":%.3f,\"cpu_us_per_msg\":%.3f,"
+             "\"allocs_per_msg\":%.4f}\n",
+             worker_cnt, batch_size, payload_size, partition_cnt,
+             codecs[c].c_str(), cnt, secs > 0 ? cnt / secs : 0.0,
+             secs > 0 ? bench_bytes / secs / (1024 * 1024) : 0.0,
+             cpu_us / 1e6, cnt > 0 ? (double)cpu_us / cnt : 0.0,
+             cnt > 0 && alloc_count_enabled() ? (double)allocs / cnt : 0.0);
+      fflush(stdout);
+      fprintf(stderr,
+              "%% consume workers=%-2d batch=%-4zu payload=%-6zu "
+              "partitions=%-3d codec=%-7s: %.0f msg/s\n",
+              worker_cnt, batch_size, payload_size, partition_cnt,
+              codecs[c].c_str(), secs > 0 ? cnt / secs : 0.0);
+    }
+  }
+
+  for (size_t a = 0; a < payloads.size(); a++)
+    for (size_t b = 0; b < partitions.size(); b++)
+      bench_spill((size_t)atol(payloads[a].c_str()),
+                  atoi(partitions[b].c_str()), msgs);
+
+  rd_kafka_mock_cluster_destroy(mcluster);
+  rd_kafka_destroy(mrk);
+  RdKafka::wait_destroyed(5000);
+  return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * Benchmark of the windowed aggregation tables (window_agg.cpp)
+ *
+ * Aggregates msgs_per_key x keys messages with uniformly random keys into
+ * one tumbling window, then closes it, once with the flat tables of
+ * WindowAggregator and once with a std::unordered_map<std::string, ...>
+ * baseline, for every key count x value field x implementation of the grid.
+ * Message keys and JSON payloads are formatted in the loop, the time that
+ * takes alone is measured first and subtracted (agg_ns_per_msg).
+ *
+ * One JSON object per scenario is written to stdout, progress to stderr.
+ * Memory is the resident set size growth while aggregating. The largest
+ * default key count needs about 2GB with the baseline.
+ *
+ * Grid and size can be changed with the environment variables
+ * BENCH_AGG_KEYS, BENCH_AGG_FIELDS (count: no value field, v: the "v"
+ * field), BENCH_AGG_IMPLS (flat, unordered_map) as comma separated lists
+ * and BENCH_AGG_MSGS_PER_KEY.
+ *
+ * The aggregator's output is checked first ("scenario":"check_*", with
+ * "ok"), the exit code is 1 if a check failed.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include "./window_agg.cpp"
+
+
+static uint64_t bench_emit_bytes = 0;
+static std::string *check_rows  = NULL; /* the emitted rows, for the checks */
+
+
+static void bench_emit(const struct iovec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    bench_emit_bytes += iov[i].iov_len;
+    if (check_rows)
+      check_rows->append((const char *)iov[i].iov_base, iov[i].iov_len);
+  }
+}
+
+static int64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int64_t rss_bytes() {
+  long pages = 0, rss = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp)
+    return 0;
+  if (fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+    rss = 0;
+  fclose(fp);
+  return (int64_t)rss * sysconf(_SC_PAGESIZE);
+}
+
+static std::vector<std::string> env_list(const char *name, const char *def) {
+  const char *val = getenv(name);
+  std::stringstream ss(val && *val ? val : def);
+  std::vector<std::string> out;
+  std::string item;
+  while (std::getline(ss, item, ','))
+    out.push_back(item);
+  return out;
+}
+
+
+/**
+ * @brief formats the messages: a random key of keys, a JSON payload with
+ *        the value, and a timestamp within the first minute
+ */
+struct MsgGen {
+  uint64_t state;
+  uint64_t keys;
+  uint64_t msgs;
+  uint64_t i;
+  char key[32];
+  size_t key_len;
+  char payload[64];
+  size_t len;
+  int64_t ts;
+
+  MsgGen(uint64_t keys, uint64_t msgs)
+      : state(0x2545f4914f6cdd1dull), keys(keys), msgs(msgs), i(0) {
+  }
+
+  void next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    uint64_t k = state % keys;
+    key_len    = snprintf(key, sizeof(key), "user-%" PRIu64, k);
+    len = snprintf(payload, sizeof(payload), "{\"id\":%" PRIu64 ",\"v\":%d}",
+                   i, (int)(state >> 40) % 1000);
+    ts = 1700000000000ll + (int64_t)(i * 60000 / msgs);
+    i++;
+  }
+};
+
+
+/* the baseline: node-based map keyed by std::string */
+struct BaselineAcc {
+  int64_t count;
+  double sum;
+  double min;
+  double max;
+};
+
+static bool baseline_value(const char *payload, size_t len, double *value) {
+  const char *p = (const char *)memmem(payload, len, "\"v\":", 4);
+  if (!p)
+    return false;
+  char buf[64];
+  size_t n = std::min((size_t)(payload + len - (p + 4)), sizeof(buf) - 1);
+  memcpy(buf, p + 4, n);
+  buf[n] = '\0';
+  char *end;
+  *value = strtod(buf, &end);
+  return end != buf;
+}
+
+
+static void run_scenario(uint64_t keys,
+                         uint64_t msgs_per_key,
+                         const std::string &field,
+                         const std::string &impl) {
+  uint64_t msgs  = keys * msgs_per_key;
+  bool has_value = field != "count";
+
+  /* formatting the messages alone */
+  MsgGen gen(keys, msgs);
+  int64_t t0        = now_us();
+  uint64_t checksum = 0;
+  for (uint64_t i = 0; i < msgs; i++) {
+    gen.next();
+    checksum += gen.key_len + gen.len;
+  }
+  int64_t gen_us = now_us() - t0;
+
+  gen = MsgGen(keys, msgs);
+  /* the previous scenario's memory back to the system */
+  malloc_trim(0);
+  int64_t rss_start = rss_bytes();
+  int64_t rss_peak  = rss_start;
+  int64_t add_us, close_us;
+  uint64_t rows;
+  bench_emit_bytes = 0;
+
+  if (impl == "flat") {
+    WindowAggregator::Options opts;
+    opts.size_ms  = 3600000;
+    opts.hop_ms   = 3600000;
+    opts.grace_ms = 0;
+    opts.idle_ms  = 3600000;
+    opts.field    = has_value ? field : "";
+    WindowAggregator *agg = new WindowAggregator(opts, bench_emit, NULL);
+    t0 = now_us();
+    for (uint64_t i = 0; i < msgs; i++) {
+      gen.next();
+      agg->add("bench", 0, (int64_t)i, gen.ts, gen.key, gen.key_len,
+               gen.payload, gen.len);
+    }
+    add_us   = now_us() - t0;
+    rss_peak = rss_bytes();
+    t0       = now_us();
+    agg->flush();
+    close_us = now_us() - t0;
+    rows     = agg->get_row_cnt();
+    delete agg;
+  } else {
+    std::unordered_map<std::string, BaselineAcc> *map =
+        new std::unordered_map<std::string, BaselineAcc>();
+    t0 = now_us();
+    for (uint64_t i = 0; i < msgs; i++) {
+      gen.next();
+      double value = 0;
+      bool valid   = has_value && baseline_value(gen.payload, gen.len, &value);
+      std::pair<std::unordered_map<std::string, BaselineAcc>::iterator, bool>
+          r = map->insert(std::make_pair(std::string(gen.key, gen.key_len),
+                                         BaselineAcc()));
+      BaselineAcc &acc = r.first->second;
+      if (r.second) {
+        acc.count = 0;
+        acc.sum   = 0;
+        acc.min   = 1e308;
+        acc.max   = -1e308;
+      }
+      acc.count++;
+      if (valid) {
+        acc.sum += value;
+        acc.min = std::min(acc.min, value);
+        acc.max = std::max(acc.max, value);
+      }
+    }
+    add_us   = now_us() - t0;
+    rss_peak = rss_bytes();
+    /* the same rows as the aggregator writes */
+    t0 = now_us();
+    std::string out;
+    char num[192];
+    for (std::unordered_map<std::string, BaselineAcc>::iterator it =
+             map->begin();
+         it != map->end(); ++it) {
+      int n = snprintf(num, sizeof(num),
+                       "{\"window_start\":0,\"window_end\":3600000,\"key\":\"");
+      out.append(num, n);
+      out += it->first;
+      if (has_value)
+        n = snprintf(num, sizeof(num),
+                     "\",\"count\":%" PRId64
+                     ",\"sum\":%.17g,\"min\":%.17g,\"max\":%.17g}\n",
+                     it->second.count, it->second.sum, it->second.min,
+                     it->second.max);
+      else
+        n = snprintf(num, sizeof(num), "\",\"count\":%" PRId64 "}\n",
+                     it->second.count);
+      out.append(num, n);
+      if (out.size() >= 64 * 1024) {
+        struct iovec iov = {(void *)out.data(), out.size()};
+        bench_emit(&iov, 1);
+        out.clear();
+      }
+    }
+    struct iovec iov = {(void *)out.data(), out.size()};
+    bench_emit(&iov, 1);
+    close_us = now_us() - t0;
+    rows     = map->size();
+    delete map;
+  }
+
+  double ns     = (double)add_us * 1000 / msgs;
+  double gen_ns = (double)gen_us * 1000 / msgs;
+  printf("{\"scenario\":\"window_agg\",\"impl\":\"%s\",\"keys\":%" PRIu64
+         ",\"msgs\":%" PRIu64 ",\"field\":\"%s\",\"ns_per_msg\":%.1f,"
+         "\"agg_ns_per_msg\":%.1f,\"msgs_per_sec\":%.0f,\"rss_mb\":%.1f,"
+         "\"bytes_per_key\":%.1f,\"rows\":%" PRIu64 ",\"close_ms\":%.1f,"
+         "\"emit_mb\":%.1f,\"checksum\":%" PRIu64 "}\n",
+         impl.c_str(), keys, msgs, field.c_str(), ns, ns - gen_ns,
+         add_us > 0 ? msgs * 1e6 / add_us : 0.0,
+         (rss_peak - rss_start) / 1048576.0,
+         (double)(rss_peak - rss_start) / keys, rows, close_us / 1000.0,
+         bench_emit_bytes / 1048576.0, checksum);
+  fflush(stdout);
+}
+
+
+/**
+ * @brief the sum of the "count" of all rows
+ */
+static int64_t check_row_count(const std::string &rows) {
+  int64_t n = 0;
+  for (size_t p = rows.find("\"count\":"); p != std::string::npos;
+       p = rows.find("\"count\":", p + 1))
+    n += strtoll(rows.c_str() + p + 8, NULL, 10);
+  return n;
+}
+
+static bool check_result(const char *name, bool ok, const std::string &rows) {
+  printf("{\"scenario\":\"check_%s\",\"ok\":%s}\n", name,
+         ok ? "true" : "false");
+  fflush(stdout);
+  if (!ok)
+    fprintf(stderr, "%% check %s failed, rows:\n%s", name, rows.c_str());
+  return ok;
+}
+
+/**
+ * @brief partition 1 is 10 windows behind partition 0 in event time: none
+ *        of its messages may be late, every message is in a row
+ */
+static bool check_partition_watermarks() {
+  std::string rows;
+  check_rows = &rows;
+  WindowAggregator::Options opts;
+  opts.size_ms  = 1000;
+  opts.hop_ms   = 1000;
+  opts.grace_ms = 0;
+  opts.idle_ms  = 3600000;
+  WindowAggregator agg(opts, bench_emit, NULL);
+  agg.assign_partition("check", 0);
+  agg.assign_partition("check", 1);
+  int64_t msgs = 0;
+  for (int64_t i = 0; i < 100; i++) {
+    /* partition 0 at ten times the rate of partition 1 */
+    for (int64_t j = 0; j < 10; j++, msgs++)
+      agg.add("check", 0, i * 10 + j, 10000 + (i * 10 + j) * 100, "k", 1,
+              NULL, 0);
+    agg.add("check", 1, i, i * 100, "k", 1, NULL, 0);
+    msgs++;
+  }
+  bool closed = agg.get_window_cnt() > 0; /* both are past the first window */
+  agg.revoke_partition("check", 1);
+  bool released = agg.get_open_window_cnt() <= 2; /* partition 0's last */
+  agg.flush();
+  check_rows = NULL;
+  return check_result("partition_watermarks",
+                      closed && released && agg.get_late_cnt() == 0 &&
+                          check_row_count(rows) == msgs,
+                      rows);
+}
+
+/**
+ * @brief UTF-8 keys are written as they are, control characters escaped
+ *        and invalid bytes replaced
+ */
+static bool check_utf8_keys() {
+  std::string rows;
+  check_rows = &rows;
+  WindowAggregator::Options opts;
+  opts.size_ms  = 1000;
+  opts.hop_ms   = 1000;
+  opts.grace_ms = 0;
+  opts.idle_ms  = 3600000;
+  WindowAggregator agg(opts, bench_emit, NULL);
+  const char *keys[] = {"caf\xc3\xa9", "\xe2\x82\xac \xf0\x9f\x98\x80",
+                        "a\"b\\c\n", "bad\xff\xc3"};
+  for (int i = 0; i < 4; i++)
+    agg.add("check", 0, i, 0, keys[i], strlen(keys[i]), NULL, 0);
+  agg.flush();
+  check_rows = NULL;
+  return check_result(
+      "utf8_keys",
+      rows.find("\"key\":\"caf\xc3\xa9\"") != std::string::npos &&
+          rows.find("\"key\":\"\xe2\x82\xac \xf0\x9f\x98\x80\"") !=
+              std::string::npos &&
+          rows.find("\"key\":\"a\\\"b\\\\c\\u000a\"") != std::string::npos &&
+          rows.find("\"key\":\"bad\\ufffd\\ufffd\"") != std::string::npos,
+      rows);
+}
+
+
+int main() {
+  std::vector<std::string> keys =
+      env_list("BENCH_AGG_KEYS", "1000000,10000000,20000000");
+  std::vector<std::string> fields = env_list("BENCH_AGG_FIELDS", "count,v");
+  std::vector<std::string> impls =
+      env_list("BENCH_AGG_IMPLS", "flat,unordered_map");
+  const char *per_key     = getenv("BENCH_AGG_MSGS_PER_KEY");
+  uint64_t msgs_per_key   = per_key ? strtoull(per_key, NULL, 10) : 2;
+  if (msgs_per_key < 1)
+    msgs_per_key = 1;
+
+  bool ok = check_partition_watermarks();
+  ok       = check_utf8_keys() && ok;
+
+  for (size_t k = 0; k < keys.size(); k++)
+    for (size_t f = 0; f < fields.size(); f++)
+      for (size_t i = 0; i < impls.size(); i++) {
+        fprintf(stderr, "%% %s keys, %s, %s\n", keys[k].c_str(),
+                fields[f].c_str(), impls[i].c_str());
+        run_scenario(strtoull(keys[k].c_str(), NULL, 10), msgs_per_key,
+                     fields[f], impls[i]);
+      }
+  return ok ? 0 : 1;
+}
@@ -1,9 +1,101 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <err.h>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
+extern char **environ;
+
+/*
+** A librdkafka property passed through to RdKafka::Conf, source is where it
+** was set: "profile <name>", "<config file>:<line>" or the env var
+ */
+struct KafkaProperty {
+    std::string name;
+    std::string value;
+    std::string source;
+};
+
+/*
+** Scheduling of the topics matching pattern (a topic name, or a regex
+** starting with ^), see KAFKA_TOPIC_ROUTES
+ */
+struct TopicRoute {
+    std::string pattern;
+    int weight;             // share of the messages while topics compete
+    int latency_ms;         // 0: none, else other topics are paused above it
+    std::string format;     // output format of the topic's handler
+};
+
+/*
+** Vetted presets of the fetch/queue settings, see KAFKA_PROFILE
+ */
+struct KafkaProfileSetting {
+    const char *profile;
+    const char *name;
+    const char *value;
+};
+
+static const KafkaProfileSetting kafka_profiles[] = {
+    // answer fetches as soon as there is a message, small batches
+    {"low-latency", "fetch.wait.max.ms", "10"},
+    {"low-latency", "fetch.min.bytes", "1"},
+    {"low-latency", "fetch.error.backoff.ms", "10"},
+    {"low-latency", "socket.nagle.disable", "true"},
+    {"low-latency", "queued.min.messages", "10000"},
+    // large fetches and a deep pre-fetch queue, at the cost of latency
+    {"high-throughput", "fetch.wait.max.ms", "500"},
+    {"high-throughput", "fetch.min.bytes", "1048576"},
+    {"high-throughput", "max.partition.fetch.bytes", "4194304"},
+    {"high-throughput", "fetch.max.bytes", "67108864"},
+    {"high-throughput", "queued.min.messages", "1000000"},
+    {"high-throughput", "queued.max.messages.kbytes", "1048576"},
+    {"high-throughput", "socket.receive.buffer.bytes", "4194304"},
+    // bounded pre-fetch queue and fetch sizes
+    {"low-memory", "max.partition.fetch.bytes", "262144"},
+    {"low-memory", "fetch.max.bytes", "4194304"},
+    {"low-memory", "queued.min.messages", "1000"},
+    {"low-memory", "queued.max.messages.kbytes", "8192"},
+    // backfill: the largest fetches, the default with KAFKA_REPLAY_FROM
+    {"replay", "fetch.wait.max.ms", "500"},
+    {"replay", "fetch.min.bytes", "4194304"},
+    {"replay", "max.partition.fetch.bytes", "16777216"},
+    {"replay", "fetch.max.bytes", "134217728"},
+    {"replay", "receive.message.max.bytes", "134218240"},
+    {"replay", "queued.min.messages", "1000000"},
+    {"replay", "queued.max.messages.kbytes", "2097151"},
+    {"replay", "socket.receive.buffer.bytes", "8388608"},
+};
+
+/*
+** librdkafka properties are passed through from env vars with this prefix
+** (KAFKA_RDKAFKA_FETCH_MIN_BYTES: fetch.min.bytes), all other KAFKA_* vars
+** are the consumer's own or not meant for it (e.g. Kubernetes service vars)
+ */
+static const char kafka_rdkafka_env_prefix[] = "KAFKA_RDKAFKA_";
+
+/*
+** librdkafka properties the consumer sets itself, from the env var (NULL:
+** always): passing them through would be silently overwritten
+ */
+struct KafkaOwnedProperty {
+    const char *name;
+    const char *env;
+};
+
+static const KafkaOwnedProperty kafka_owned_properties[] = {
+    {"metadata.broker.list", "KAFKA_BROKERS"},
+    {"bootstrap.servers", "KAFKA_BROKERS"},
+    {"group.id", "KAFKA_CONSUMER_GROUP"},
+    {"statistics.interval.ms", "KAFKA_STATISTICS_INTERVAL_MS"},
+    {"enable.partition.eof", NULL},
+};
+
 class KafkaConfig {
     private:
         std::string brokers;
@@ -11,36 +103,448 @@ class KafkaConfig {
         std::string statistics_interval_ms;
         bool do_config_dump;
         std::string topic;
+        std::vector<std::string> topics;
+        std::vector<TopicRoute> topic_routes;
+        int consumer_workers;
+        size_t consume_batch_size;
+        int consume_batch_linger_ms;
+        int commit_interval_ms;
+        long commit_msg_cnt;
+        std::string output_sink;
+        std::string output_path;
+        std::string output_format;
+        size_t output_buffer_kb;
+        size_t output_ring_mb;
+        int metrics_port;
+        std::string assignment_strategy;
+        bool exit_eof;
+        bool pipeline_queued;
+        std::string dedup_key;
+        int dedup_window_ms;
+        size_t dedup_memory_mb;
+        std::string spill_dir;
+        size_t spill_segment_mb;
+        int spill_segment_ms;
+        size_t spill_max_mb;
+        int spill_sync_ms;
+        size_t flow_high_mb;
+        size_t flow_low_mb;
+        long flow_high_msgs;
+        long flow_low_msgs;
+        int64_t replay_from_ms;
+        int64_t replay_to_ms;
+        int replay_progress_ms;
+        int64_t agg_window_ms;
+        int64_t agg_hop_ms;
+        std::string agg_field;
+        int64_t agg_grace_ms;
+        int64_t agg_idle_ms;
+        std::string profile;
+        std::string config_file;
+        std::vector<KafkaProperty> rdkafka_properties;
+
+        static std::string env_str(const char *name) {
+            const char *value = getenv(name);
+            return value ? value : "";
+        }
+
+        static std::string trim(const std::string &s) {
+            size_t begin = s.find_first_not_of(" \t\r");
+            if (begin == std::string::npos) {
+                return "";
+            }
+            return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+        }
+
+        static std::vector<std::string> split(const std::string &s, char sep) {
+            std::vector<std::string> parts;
+            size_t begin = 0;
+            while (true) {
+                size_t end = s.find(sep, begin);
+                parts.push_back(trim(s.substr(begin, end == std::string::npos ? end : end - begin)));
+                if (end == std::string::npos) {
+                    return parts;
+                }
+                begin = end + 1;
+            }
+        }
+
+        // <topic or ^regex>:<weight>[:<latency ms>[:<format>]],...
+        bool load_topic_routes(std::string &errstr) {
+            std::string routes = env_str("KAFKA_TOPIC_ROUTES");
+            if (routes.empty()) {
+                return true;
+            }
+            std::vector<std::string> entries = split(routes, ',');
+            for (size_t i = 0; i < entries.size(); i++) {
+                std::vector<std::string> fields = split(entries[i], ':');
+                TopicRoute route;
+                route.pattern = fields[0];
+                route.weight = fields.size() > 1 ? atoi(fields[1].c_str()) : 0;
+                route.latency_ms = fields.size() > 2 ? atoi(fields[2].c_str()) : 0;
+                route.format = fields.size() > 3 ? fields[3] : output_format;
+                if (route.pattern.empty() || route.weight < 1 || route.latency_ms < 0 ||
+                    fields.size() > 4 || (route.format != "raw" && route.format != "inspect")) {
+                    errstr = "invalid kafka topic routes config " + entries[i] +
+                             ", expected <topic>:<weight>[:<latency ms>[:raw|inspect]]";
+                    return false;
+                }
+                topic_routes.push_back(route);
+            }
+            if (consumer_workers > 0 || consume_batch_size > 1) {
+                errstr = "kafka topic routes config requires 0 consumer workers and batch size 1";
+                return false;
+            }
+            return true;
+        }
+
+        // a later setting of a property replaces the earlier one
+        void set_property(const std::string &name, const std::string &value,
+                          const std::string &source) {
+            for (size_t i = 0; i < rdkafka_properties.size(); i++) {
+                if (rdkafka_properties[i].name == name) {
+                    rdkafka_properties.erase(rdkafka_properties.begin() + i);
+                    break;
+                }
+            }
+            KafkaProperty prop = {name, value, source};
+            rdkafka_properties.push_back(prop);
+        }
+
+        bool load_profile(std::string &errstr) {
+            profile = env_str("KAFKA_PROFILE");
+            if (profile.empty() && replay_from_ms >= 0) {
+                profile = "replay";
+            }
+            if (profile.empty()) {
+                return true;
+            }
+            bool found = false;
+            for (size_t i = 0; i < sizeof(kafka_profiles) / sizeof(kafka_profiles[0]); i++) {
+                if (profile == kafka_profiles[i].profile) {
+                    set_property(kafka_profiles[i].name, kafka_profiles[i].value, "profile " + profile);
+                    found = true;
+                }
+            }
+            if (!found) {
+                errstr = "invalid kafka profile config " + profile +
+                         " (low-latency, high-throughput, low-memory or replay)";
+                return false;
+            }
+            return true;
+        }
+
+        // "name = value" lines of librdkafka properties, # starts a comment
+        bool load_config_file(std::string &errstr) {
+            config_file = env_str("KAFKA_CONFIG_FILE");
+            if (config_file.empty()) {
+                return true;
+            }
+            std::ifstream in(config_file.c_str());
+            if (!in) {
+                errstr = "failed to open kafka config file " + config_file + ": " + strerror(errno);
+                return false;
+            }
+            std::string line;
+            for (int lineno = 1; std::getline(in, line); lineno++) {
+                line = trim(line.substr(0, line.find('#')));
+                if (line.empty()) {
+                    continue;
+                }
+                size_t eq = line.find('=');
+                std::string name = eq == std::string::npos ? "" : trim(line.substr(0, eq));
+                if (name.empty()) {
+                    errstr = "invalid line in kafka config file " + config_file + ":" +
+                             std::to_string(lineno) + ", expected name = value";
+                    return false;
+                }
+                set_property(name, trim(line.substr(eq + 1)),
+                             config_file + ":" + std::to_string(lineno));
+            }
+            return true;
+        }
+
+        // KAFKA_RDKAFKA_FETCH_WAIT_MAX_MS=10: fetch.wait.max.ms=10
+        void load_env_properties() {
+            const size_t prefix_len = sizeof(kafka_rdkafka_env_prefix) - 1;
+            for (char **env = environ; *env; env++) {
+                const char *eq = strchr(*env, '=');
+                if (strncmp(*env, kafka_rdkafka_env_prefix, prefix_len) != 0 || !eq) {
+                    continue;
+                }
+                std::string var(*env, eq - *env);
+                std::string name = var.substr(prefix_len);
+                for (size_t i = 0; i < name.size(); i++) {
+                    name[i] = name[i] == '_' ? '.' : (char)tolower(name[i]);
+                }
+                set_property(name, eq + 1, var);
+            }
+        }
+
+        // a passed through property the consumer sets itself is an error
+        bool check_owned_properties(std::string &errstr) {
+            for (size_t i = 0; i < rdkafka_properties.size(); i++) {
+                const KafkaProperty &prop = rdkafka_properties[i];
+                const char *env = NULL;
+                bool owned = false;
+                for (size_t j = 0; !owned && j < sizeof(kafka_owned_properties) / sizeof(kafka_owned_properties[0]); j++) {
+                    owned = prop.name == kafka_owned_properties[j].name;
+                    env = kafka_owned_properties[j].env;
+                }
+                if (!owned && prop.name == "partition.assignment.strategy" &&
+                    !assignment_strategy.empty()) {
+                    owned = true;
+                    env = "KAFKA_ASSIGNMENT_STRATEGY";
+                }
+                // offsets are committed by the consumer
+                if (!owned && prop.name == "enable.auto.commit" &&
+                    (commit_interval_ms > 0 || replay_from_ms >= 0)) {
+                    owned = true;
+                    env = "KAFKA_COMMIT_INTERVAL_MS";
+                }
+                if (owned) {
+                    errstr = "kafka property " + prop.name + " from " + prop.source +
+                             " is set by the consumer" + (env ? std::string(", use ") + env : "");
+                    return false;
+                }
+            }
+            return true;
+        }
 
     public:
         bool load_kafka_config(std::string &errstr) {
-            brokers = getenv("KAFKA_BROKERS");
+            brokers = env_str("KAFKA_BROKERS");
             if (brokers.empty()) {
                 errstr = "failed to load kafka brokers config";
                 return false;
             }
-            consumer_group = getenv("KAFKA_CONSUMER_GROUP");
+            consumer_group = env_str("KAFKA_CONSUMER_GROUP");
             if (consumer_group.empty()) {
                 errstr = "failed to load kafka consumer group config";
                 return false;
             }
-            statistics_interval_ms = getenv("KAFKA_STATISTICS_INTERVAL_MS");
+            statistics_interval_ms = env_str("KAFKA_STATISTICS_INTERVAL_MS");
             if (statistics_interval_ms.empty()) {
                 errstr = "failed to load statistics interval ms config";
                 return false;
             }
-            std::string dump_config =  getenv("KAKFA_DO_CONFIG_DUMP");
+            std::string dump_config = env_str("KAKFA_DO_CONFIG_DUMP");
             if (dump_config.empty()) {
                 do_config_dump = false;
             } else {
                 do_config_dump = dump_config == "true" ? true : false;
             }
-            topic = getenv("KAFKA_TOPIC");
-            if (topic.empty()) {
-                errstr = "failed to load kafka topic config";
+            topic = env_str("KAFKA_TOPIC");
+            topics = split(topic, ',');
+            for (size_t i = 0; i < topics.size(); i++) {
+                if (topics[i].empty()) {
+                    errstr = "failed to load kafka topic config";
+                    return false;
+                }
+            }
+            const char *workers = getenv("KAFKA_CONSUMER_WORKERS");
+            consumer_workers = workers ? atoi(workers) : 0;
+            if (consumer_workers < 0) {
+                errstr = "invalid kafka consumer workers config";
                 return false;
             }
-            return true;
+            const char *batch_size = getenv("KAFKA_CONSUME_BATCH_SIZE");
+            int size = batch_size ? atoi(batch_size) : 1;
+            if (size < 1) {
+                errstr = "invalid kafka consume batch size config";
+                return false;
+            }
+            consume_batch_size = (size_t)size;
+            const char *batch_linger = getenv("KAFKA_CONSUME_BATCH_LINGER_MS");
+            consume_batch_linger_ms = batch_linger ? atoi(batch_linger) : 100;
+            if (consume_batch_linger_ms < 1) {
+                errstr = "invalid kafka consume batch linger ms config";
+                return false;
+            }
+            const char *commit_interval = getenv("KAFKA_COMMIT_INTERVAL_MS");
+            commit_interval_ms = commit_interval ? atoi(commit_interval) : 0;
+            if (commit_interval_ms < 0) {
+                errstr = "invalid kafka commit interval ms config";
+                return false;
+            }
+            const char *commit_cnt = getenv("KAFKA_COMMIT_MSG_CNT");
+            commit_msg_cnt = commit_cnt ? atol(commit_cnt) : 0;
+            if (commit_msg_cnt < 0) {
+                errstr = "invalid kafka commit msg cnt config";
+                return false;
+            }
+            const char *sink = getenv("KAFKA_OUTPUT_SINK");
+            output_sink = sink ? sink : "stdout";
+            const char *path = getenv("KAFKA_OUTPUT_PATH");
+            output_path = path ? path : "";
+            if (output_sink != "stdout" && output_path.empty()) {
+                errstr = "failed to load kafka output path config";
+                return false;
+            }
+            const char *format = getenv("KAFKA_OUTPUT_FORMAT");
+            output_format = format ? format : "raw";
+            if (output_format != "raw" && output_format != "inspect") {
+                errstr = "invalid kafka output format config";
+                return false;
+            }
+            const char *buffer_kb = getenv("KAFKA_OUTPUT_BUFFER_KB");
+            output_buffer_kb = buffer_kb ? strtoul(buffer_kb, NULL, 10) : 4096;
+            const char *ring_mb = getenv("KAFKA_OUTPUT_RING_MB");
+            output_ring_mb = ring_mb ? strtoul(ring_mb, NULL, 10) : 256;
+            if (output_ring_mb == 0) {
+                errstr = "invalid kafka output ring mb config";
+                return false;
+            }
+            const char *port = getenv("KAFKA_METRICS_PORT");
+            metrics_port = port ? atoi(port) : 0;
+            if (metrics_port < 0 || metrics_port > 65535) {
+                errstr = "invalid kafka metrics port config";
+                return false;
+            }
+            const char *strategy = getenv("KAFKA_ASSIGNMENT_STRATEGY");
+            // empty: librdkafka's default (eager), see the README for moving a group
+            // to cooperative-sticky
+            assignment_strategy = strategy ? strategy : "";
+            const char *eof = getenv("KAFKA_EXIT_EOF");
+            exit_eof = eof && std::string(eof) == "true";
+            const char *dedup = getenv("KAFKA_DEDUP_KEY");
+            dedup_key = dedup ? dedup : "";
+            if (!dedup_key.empty() && dedup_key != "offset" &&
+                (dedup_key.compare(0, 7, "header:") != 0 || dedup_key.size() == 7)) {
+                errstr = "invalid kafka dedup key config";
+                return false;
+            }
+            const char *dedup_window = getenv("KAFKA_DEDUP_WINDOW_MS");
+            dedup_window_ms = dedup_window ? atoi(dedup_window) : 600000;
+            if (dedup_window_ms < 1) {
+                errstr = "invalid kafka dedup window ms config";
+                return false;
+            }
+            const char *dedup_memory = getenv("KAFKA_DEDUP_MEMORY_MB");
+            dedup_memory_mb = dedup_memory ? strtoul(dedup_memory, NULL, 10) : 64;
+            if (dedup_memory_mb == 0) {
+                errstr = "invalid kafka dedup memory mb config";
+                return false;
+            }
+            const char *spill = getenv("KAFKA_SPILL_DIR");
+            spill_dir = spill ? spill : "";
+            const char *spill_segment = getenv("KAFKA_SPILL_SEGMENT_MB");
+            spill_segment_mb = spill_segment ? strtoul(spill_segment, NULL, 10) : 64;
+            if (spill_segment_mb == 0) {
+                errstr = "invalid kafka spill segment mb config";
+                return false;
+            }
+            const char *spill_age = getenv("KAFKA_SPILL_SEGMENT_MS");
+            spill_segment_ms = spill_age ? atoi(spill_age) : 10000;
+            if (spill_segment_ms < 1) {
+                errstr = "invalid kafka spill segment ms config";
+                return false;
+            }
+            const char *spill_max = getenv("KAFKA_SPILL_MAX_MB");
+            spill_max_mb = spill_max ? strtoul(spill_max, NULL, 10) : 1024;
+            if (spill_max_mb < spill_segment_mb) {
+                errstr = "kafka spill max mb config must be at least one segment";
+                return false;
+            }
+            const char *spill_sync = getenv("KAFKA_SPILL_SYNC_MS");
+            spill_sync_ms = spill_sync ? atoi(spill_sync) : 10;
+            if (spill_sync_ms < 1) {
+                errstr = "invalid kafka spill sync ms config";
+                return false;
+            }
+            const char *queued = getenv("KAFKA_PIPELINE_QUEUED");
+            pipeline_queued = queued && std::string(queued) == "true";
+            if (pipeline_queued && consumer_workers > 0) {
+                errstr = "kafka pipeline queued config requires 0 consumer workers";
+                return false;
+            }
+            const char *flow_high = getenv("KAFKA_FLOW_HIGH_MB");
+            flow_high_mb = flow_high ? strtoul(flow_high, NULL, 10) : 0;
+            const char *flow_low = getenv("KAFKA_FLOW_LOW_MB");
+            flow_low_mb = flow_low ? strtoul(flow_low, NULL, 10) : flow_high_mb / 2;
+            if (flow_high_mb > 0 && flow_low_mb >= flow_high_mb) {
+                errstr = "kafka flow low mb config must be below kafka flow high mb";
+                return false;
+            }
+            const char *flow_high_cnt = getenv("KAFKA_FLOW_HIGH_MSGS");
+            flow_high_msgs = flow_high_cnt ? atol(flow_high_cnt) : 0;
+            const char *flow_low_cnt = getenv("KAFKA_FLOW_LOW_MSGS");
+            flow_low_msgs = flow_low_cnt ? atol(flow_low_cnt) : flow_high_msgs / 2;
+            if (flow_high_msgs < 0 || flow_low_msgs < 0 ||
+                (flow_high_msgs > 0 && flow_low_msgs >= flow_high_msgs)) {
+                errstr = "invalid kafka flow msgs config, low must be below high";
+                return false;
+            }
+            if (!load_topic_routes(errstr)) {
+                return false;
+            }
+            // the topic scheduler pauses and resumes topics itself
+            if (!topic_routes.empty() && (flow_high_mb > 0 || flow_high_msgs > 0)) {
+                errstr = "kafka flow control config can not be combined with topic routes";
+                return false;
+            }
+            // ms since the epoch, the end is exclusive
+            const char *replay_from = getenv("KAFKA_REPLAY_FROM");
+            replay_from_ms = replay_from ? strtoll(replay_from, NULL, 10) : -1;
+            const char *replay_to = getenv("KAFKA_REPLAY_TO");
+            replay_to_ms = replay_to ? strtoll(replay_to, NULL, 10) : -1;
+            if ((replay_from && replay_from_ms < 0) ||
+                (replay_to && (replay_from_ms < 0 || replay_to_ms <= replay_from_ms))) {
+                errstr = "invalid kafka replay config, expected 0 <= from < to (ms timestamps)";
+                return false;
+            }
+            const char *replay_progress = getenv("KAFKA_REPLAY_PROGRESS_MS");
+            replay_progress_ms = replay_progress ? atoi(replay_progress) : 10000;
+            if (replay_progress_ms < 1) {
+                errstr = "invalid kafka replay progress ms config";
+                return false;
+            }
+            if (replay_from_ms >= 0) {
+                if (!topic_routes.empty()) {
+                    errstr = "kafka replay config can not be combined with topic routes";
+                    return false;
+                }
+                for (size_t i = 0; i < topics.size(); i++) {
+                    if (topics[i][0] == '^') {
+                        errstr = "kafka replay config requires topic names, not " + topics[i];
+                        return false;
+                    }
+                }
+            }
+            // event-time windows of the message timestamps, 0: no aggregation
+            const char *agg_window = getenv("KAFKA_AGG_WINDOW_MS");
+            agg_window_ms = agg_window ? strtoll(agg_window, NULL, 10) : 0;
+            const char *agg_hop = getenv("KAFKA_AGG_HOP_MS");
+            agg_hop_ms = agg_hop ? strtoll(agg_hop, NULL, 10) : agg_window_ms;
+            if (agg_window_ms < 0 ||
+                (agg_window_ms > 0 && (agg_hop_ms < 1 || agg_window_ms % agg_hop_ms != 0))) {
+                errstr = "invalid kafka agg window config, the hop ms must divide the window ms";
+                return false;
+            }
+            agg_field = env_str("KAFKA_AGG_FIELD");
+            const char *agg_grace = getenv("KAFKA_AGG_GRACE_MS");
+            agg_grace_ms = agg_grace ? strtoll(agg_grace, NULL, 10) : 0;
+            if (agg_grace_ms < 0) {
+                errstr = "invalid kafka agg grace ms config";
+                return false;
+            }
+            const char *agg_idle = getenv("KAFKA_AGG_IDLE_MS");
+            agg_idle_ms = agg_idle ? strtoll(agg_idle, NULL, 10) : agg_window_ms;
+            if (agg_idle_ms < 1 && agg_window_ms > 0) {
+                errstr = "invalid kafka agg idle ms config";
+                return false;
+            }
+            // offsets are committed with the emitted windows
+            if (agg_window_ms > 0 && commit_interval_ms == 0 && replay_from_ms < 0) {
+                errstr = "kafka agg window config requires kafka commit interval ms";
+                return false;
+            }
+            // librdkafka properties: profile < config file < env vars
+            if (!load_profile(errstr) || !load_config_file(errstr)) {
+                return false;
+            }
+            load_env_properties();
+            return check_owned_properties(errstr);
         }
 
         std::string get_brokers() {
@@ -62,4 +566,160 @@ class KafkaConfig {
         std::string get_topic() {
             return topic;
         }
+
+        std::vector<std::string> get_topics() {
+            return topics;
+        }
+
+        std::vector<TopicRoute> get_topic_routes() {
+            return topic_routes;
+        }
+
+        int get_consumer_workers() {
+            return consumer_workers;
+        }
+
+        size_t get_consume_batch_size() {
+            return consume_batch_size;
+        }
+
+        int get_consume_batch_linger_ms() {
+            return consume_batch_linger_ms;
+        }
+
+        int get_commit_interval_ms() {
+            return commit_interval_ms;
+        }
+
+        long get_commit_msg_cnt() {
+            return commit_msg_cnt;
+        }
+
+        std::string get_output_sink() {
+            return output_sink;
+        }
+
+        std::string get_output_path() {
+            return output_path;
+        }
+
+        std::string get_output_format() {
+            return output_format;
+        }
+
+        size_t get_output_buffer_kb() {
+            return output_buffer_kb;
+        }
+
+        size_t get_output_ring_mb() {
+            return output_ring_mb;
+        }
+
+        int get_metrics_port() {
+            return metrics_port;
+        }
+
+        std::string get_assignment_strategy() {
+            return assignment_strategy;
+        }
+
+        bool get_exit_eof() {
+            return exit_eof;
+        }
+
+        bool get_pipeline_queued() {
+            return pipeline_queued;
+        }
+
+        std::string get_dedup_key() {
+            return dedup_key;
+        }
+
+        int get_dedup_window_ms() {
+            return dedup_window_ms;
+        }
+
+        size_t get_dedup_memory_mb() {
+            return dedup_memory_mb;
+        }
+
+        std::string get_spill_dir() {
+            return spill_dir;
+        }
+
+        size_t get_spill_segment_mb() {
+            return spill_segment_mb;
+        }
+
+        int get_spill_segment_ms() {
+            return spill_segment_ms;
+        }
+
+        size_t get_spill_max_mb() {
+            return spill_max_mb;
+        }
+
+        int get_spill_sync_ms() {
+            return spill_sync_ms;
+        }
+
+        size_t get_flow_high_mb() {
+            return flow_high_mb;
+        }
+
+        size_t get_flow_low_mb() {
+            return flow_low_mb;
+        }
+
+        long get_flow_high_msgs() {
+            return flow_high_msgs;
+        }
+
+        long get_flow_low_msgs() {
+            return flow_low_msgs;
+        }
+
+        int64_t get_replay_from_ms() {
+            return replay_from_ms;
+        }
+
+        int64_t get_replay_to_ms() {
+            return replay_to_ms;
+        }
+
+        int get_replay_progress_ms() {
+            return replay_progress_ms;
+        }
+
+        int64_t get_agg_window_ms() {
+            return agg_window_ms;
+        }
+
+        int64_t get_agg_hop_ms() {
+            return agg_hop_ms;
+        }
+
+        std::string get_agg_field() {
+            return agg_field;
+        }
+
+        int64_t get_agg_grace_ms() {
+            return agg_grace_ms;
+        }
+
+        int64_t get_agg_idle_ms() {
+            return agg_idle_ms;
+        }
+
+        std::string get_profile() {
+            return profile;
+        }
+
+        std::string get_config_file() {
+            return config_file;
+        }
+
+        const std::vector<KafkaProperty> &get_rdkafka_properties() {
+            return rdkafka_properties;
+        }
 };
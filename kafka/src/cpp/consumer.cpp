@@ -1,89 +1,112 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <cstdio>
 #include <csignal>
 #include <cstring>
+#include <cinttypes>
 #include <err.h>
+#include <thread>
 #include <vector>
 
 #ifndef _WIN32
+#include <sys/resource.h>
 #include <sys/time.h>
 #else
-#include <windows.h> /* for GetLocalTime */
+#include <windows.h>
 #endif
 
 #include "./config.cpp"
 
 #include <librdkafka/rdkafkacpp.h>
 
+#include "../common/payload_inspect.c"
+#include "../common/stats_metrics.c"
+#include "./alloc_counter.cpp"
+#include "./async_log.cpp"
+#include "./batch_consume.cpp"
+#include "./dedup_cache.cpp"
+#include "./flow_control.cpp"
+#include "./latency_histogram.cpp"
+#include "./offset_manager.cpp"
+#include "./output_sink.cpp"
+#include "./partition_engine.cpp"
+#include "./partition_state.cpp"
+#include "./pipeline.cpp"
+#include "./replay.cpp"
+#include "./spill_log.cpp"
+#include "./topic_scheduler.cpp"
+#include "./window_agg.cpp"
 
 static volatile sig_atomic_t run = 1;
 static bool exit_eof             = false;
-static int eof_cnt               = 0;
-static int partition_cnt         = 0;
 static int verbosity             = 3;
-static long msg_cnt              = 0;
-static int64_t msg_bytes         = 0;
+static std::atomic<long> msg_cnt(0);
+static std::atomic<int64_t> msg_bytes(0);
+static OffsetManager *offset_manager = NULL;
+static OutputSink *output_sink       = NULL;
+static SpillLog *spill_log           = NULL;
+static DedupCache *dedup_cache       = NULL;
+static TopicScheduler *scheduler     = NULL;
+static FlowControl *flow_control     = NULL;
+static Replay *replay                = NULL;
+static WindowAggregator *aggregator  = NULL;
+static std::string dedup_header; /* empty: dedup on key and offset */
+static metrics_server_t *metrics_server = NULL;
+static LatencyStats latency_stats;
+static PartitionStateTable partition_states;
+static std::atomic<long> rebalance_cnt(0);
+static std::atomic<int64_t> rebalance_us(0);
+static std::atomic<int64_t> rebalance_max_us(0);
 static void sigterm(int sig) {
   run = 0;
 }
 
 
-/**
- * @brief format a string timestamp from the current time
- */
-static void print_time() {
-#ifndef _WIN32
-  struct timeval tv;
-  char buf[64];
-  gettimeofday(&tv, NULL);
-  strftime(buf, sizeof(buf) - 1, "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
-  fprintf(stderr, "%s.%03d: ", buf, (int)(tv.tv_usec / 1000));
-#else
-  SYSTEMTIME lt = {0};
-  GetLocalTime(&lt);
-  // %Y-%m-%d %H:%M:%S.xxx:
-  fprintf(stderr, "%04d-%02d-%02d %02d:%02d:%02d.%03d: ", lt.wYear, lt.wMonth,
-          lt.wDay, lt.wHour, lt.wMinute, lt.wSecond, lt.wMilliseconds);
-#endif
-}
-
-
 class EventCb : public RdKafka::EventCb {
  public:
   void event_cb(RdKafka::Event &event) {
-    print_time();
+    /* with a metrics endpoint the statistics are parsed, not dumped */
+    if (event.type() == RdKafka::Event::EVENT_STATS && metrics_server) {
+      std::string json = event.str();
+      latency_stats.snapshot_reset();
+      if (metrics_server_update_stats(metrics_server, json.c_str(),
+                                      json.size()) == -1)
+        ALOG_ERROR("Failed to parse statistics");
+      return;
+    }
 
     switch (event.type()) {
     case RdKafka::Event::EVENT_ERROR:
-      if (event.fatal()) {
-        std::cerr << "FATAL ";
+      if (event.fatal())
         run = 0;
-      }
-      std::cerr << "ERROR (" << RdKafka::err2str(event.err())
-                << "): " << event.str() << std::endl;
+      ALOG_ERROR("%sERROR (%s): %s", event.fatal() ? "FATAL " : "",
+                 RdKafka::err2str(event.err()).c_str(), event.str().c_str());
       break;
 
     case RdKafka::Event::EVENT_STATS:
+      /* the statistics are data, tens of KB: dumped as is, not logged */
       std::cerr << "\"STATS\": " << event.str() << std::endl;
+      std::cerr << "\"LATENCY\": " << latency_stats.snapshot_reset()
+                << std::endl;
       break;
 
     case RdKafka::Event::EVENT_LOG:
-      fprintf(stderr, "LOG-%i-%s: %s\n", event.severity(), event.fac().c_str(),
-              event.str().c_str());
+      ALOG(event.severity(), "LOG-%i-%s: %s", event.severity(),
+           event.fac().c_str(), event.str().c_str());
       break;
 
     case RdKafka::Event::EVENT_THROTTLE:
-      std::cerr << "THROTTLED: " << event.throttle_time() << "ms by "
-                << event.broker_name() << " id " << (int)event.broker_id()
-                << std::endl;
+      ALOG_WARNING("THROTTLED: %dms by %s id %d", event.throttle_time(),
+                   event.broker_name().c_str(), (int)event.broker_id());
       break;
 
     default:
-      std::cerr << "EVENT " << event.type() << " ("
-                << RdKafka::err2str(event.err()) << "): " << event.str()
-                << std::endl;
+      ALOG_INFO("EVENT %d (%s): %s", (int)event.type(),
+                RdKafka::err2str(event.err()).c_str(), event.str().c_str());
       break;
     }
   }
@@ -92,105 +115,804 @@ class EventCb : public RdKafka::EventCb {
 
 class RebalanceCb : public RdKafka::RebalanceCb {
  private:
-  static void part_list_print(
+  static std::string part_list_str(
       const std::vector<RdKafka::TopicPartition *> &partitions) {
+    std::string str;
     for (unsigned int i = 0; i < partitions.size(); i++)
-      std::cerr << partitions[i]->topic() << "[" << partitions[i]->partition()
-                << "], ";
-    std::cerr << "\n";
+      str += partitions[i]->topic() + "[" +
+             std::to_string(partitions[i]->partition()) + "], ";
+    return str;
   }
 
+  PartitionEngine *engine;
+  TopicScheduler *topic_scheduler;
+  int drain_timeout_ms;
+
  public:
+  RebalanceCb() : engine(NULL), topic_scheduler(NULL), drain_timeout_ms(10000) {
+  }
+
+  void set_engine(PartitionEngine *partition_engine) {
+    engine = partition_engine;
+  }
+
+  void set_scheduler(TopicScheduler *scheduler) {
+    topic_scheduler = scheduler;
+  }
+
+  /**
+   * @brief Only the partitions named in the callback are touched: with the
+   *        COOPERATIVE protocol all other partitions keep being processed
+   *        while the revoked ones are drained and committed.
+   */
   void rebalance_cb(RdKafka::KafkaConsumer *consumer,
                     RdKafka::ErrorCode err,
                     std::vector<RdKafka::TopicPartition *> &partitions) {
-    std::cerr << "RebalanceCb: " << RdKafka::err2str(err) << ": ";
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
 
-    part_list_print(partitions);
+    ALOG_INFO("RebalanceCb (%s): %s: %s", cooperative ? "incremental" : "eager",
+              RdKafka::err2str(err).c_str(), part_list_str(partitions).c_str());
 
     RdKafka::Error *error      = NULL;
     RdKafka::ErrorCode ret_err = RdKafka::ERR_NO_ERROR;
 
     if (err == RdKafka::ERR__ASSIGN_PARTITIONS) {
-      if (consumer->rebalance_protocol() == "COOPERATIVE")
+      /* the state exists before the first message can be fetched */
+      partition_states.assign(partitions);
+      if (cooperative)
         error = consumer->incremental_assign(partitions);
       else
         ret_err = consumer->assign(partitions);
-      partition_cnt += (int)partitions.size();
-    } else {
-      if (consumer->rebalance_protocol() == "COOPERATIVE") {
-        error = consumer->incremental_unassign(partitions);
-        partition_cnt -= (int)partitions.size();
+      if (!error && !ret_err) {
+        if (offset_manager)
+          offset_manager->assign(partitions);
+        if (engine)
+          engine->add_partitions(consumer, partitions);
+        if (topic_scheduler)
+          topic_scheduler->add_partitions(partitions);
+        if (aggregator)
+          for (size_t i = 0; i < partitions.size(); i++)
+            aggregator->assign_partition(partitions[i]->topic(),
+                                         partitions[i]->partition());
       } else {
-        ret_err       = consumer->unassign();
-        partition_cnt = 0;
+        partition_states.remove(partitions);
       }
+    } else {
+      /* stop routing, wait for in-flight messages, then commit */
+      if (engine)
+        engine->remove_partitions(partitions);
+      if (topic_scheduler)
+        topic_scheduler->remove_partitions(partitions);
+      if (flow_control)
+        flow_control->remove_partitions(partitions);
+      if (!partition_states.drain(partitions, drain_timeout_ms))
+        ALOG_WARNING("Revoked partition(s) still in flight after %dms, "
+                     "offsets of messages still in flight are not committed",
+                     drain_timeout_ms);
+      /* the windows the revoked partitions held back may close now */
+      if (aggregator)
+        for (size_t i = 0; i < partitions.size(); i++)
+          aggregator->revoke_partition(partitions[i]->topic(),
+                                       partitions[i]->partition());
+      /* deferred offsets of the revoked partitions are committed now */
+      if (spill_log)
+        spill_log->sync();
+      if (offset_manager)
+        offset_manager->revoke(partitions, consumer->assignment_lost());
+      long cnt = partition_states.remove(partitions);
+      ALOG_INFO("Revoked %zu partition(s) after %ld message(s)",
+                partitions.size(), cnt);
+      if (cooperative)
+        error = consumer->incremental_unassign(partitions);
+      else
+        ret_err = consumer->unassign();
     }
-    eof_cnt = 0; /* FIXME: Won't work with COOPERATIVE */
 
     if (error) {
-      std::cerr << "incremental assign failed: " << error->str() << "\n";
+      ALOG_ERROR("incremental assign failed: %s", error->str().c_str());
       delete error;
     } else if (ret_err)
-      std::cerr << "assign failed: " << RdKafka::err2str(ret_err) << "\n";
+      ALOG_ERROR("assign failed: %s", RdKafka::err2str(ret_err).c_str());
+
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    rebalance_cnt++;
+    rebalance_us += us;
+    int64_t max = rebalance_max_us.load();
+    while (us > max && !rebalance_max_us.compare_exchange_weak(max, us))
+      ;
+    ALOG_INFO("Rebalance took %.3fms, %zu partition(s) assigned", us / 1000.0,
+              partition_states.size());
+  }
+};
+
+
+/**
+ * @brief wall clock time in milliseconds, comparable to message timestamps
+ */
+static inline int64_t wall_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+
+/**
+ * @brief a replayed partition reached its end offset, it no longer holds
+ *        back the aggregator's windows
+ * @returns true once all partitions are done
+ */
+static bool replay_finish(PartitionState *ps) {
+  bool all_done = replay->finish(ps);
+  if (aggregator && ps->done)
+    aggregator->revoke_partition(ps->topic, ps->partition);
+  return all_done;
+}
+
+
+/**
+ * @brief first stage: handles events and errors, and acquires the partition
+ *        state of messages. Everything but messages of assigned partitions
+ *        (in a replay: before their end offset) is dropped.
+ */
+struct DecodeStage : Stage {
+  void operator()(Record &rec) {
+    switch (rec.err) {
+    case RdKafka::ERR__TIMED_OUT:
+      rec.dropped = true;
+      break;
+
+    case RdKafka::ERR_NO_ERROR:
+      /* Real message */
+      rec.partition_state = partition_states.acquire(rec.topic, rec.partition);
+      if (!rec.partition_state) {
+        /* revoked while queued: redelivered to the new owner */
+        ALOG_DEBUG("Skipping msg of revoked partition at offset %" PRId64,
+                   rec.offset);
+        rec.dropped = true;
+        break;
+      }
+      rec.partition_state->eof = false;
+      rec.partition_state->inflight_bytes += rec.len;
+      if (rec.offset >= rec.partition_state->end_offset) {
+        /* replay: fetched past the end offset */
+        rec.dropped = true;
+        break;
+      }
+      ALOG_DEBUG("Read msg at offset %" PRId64, rec.offset);
+      break;
+
+    case RdKafka::ERR__PARTITION_EOF: {
+      /* Last message */
+      PartitionState *ps = partition_states.acquire(rec.topic, rec.partition);
+      if (ps) {
+        ps->eof = true;
+        /* replay: the messages before the end offset were compacted,
+         * aborted or control records */
+        if (replay && rec.offset >= ps->end_offset && replay_finish(ps))
+          run = 0;
+        partition_states.release(ps);
+      }
+      if (exit_eof && partition_states.all_eof()) {
+        ALOG_INFO("EOF reached for all %zu partition(s)",
+                  partition_states.size());
+        run = 0;
+      }
+      rec.dropped = true;
+      break;
+    }
+
+    default:
+      /* Errors, including unknown topic or partition */
+      ALOG_ERROR("Consume failed: %s", rd_kafka_message_errstr(rec.message));
+      run = 0;
+      rec.dropped = true;
+    }
+  }
+};
+
+
+/**
+ * @brief format the "Timestamp: " line of rec into buf
+ * @returns its length, 0 if the message has no timestamp
+ */
+static size_t format_timestamp(const Record &rec, char *buf, size_t size) {
+  if (rec.timestamp.type ==
+      RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE)
+    return 0;
+  const char *tsname = "?";
+  if (rec.timestamp.type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_CREATE_TIME)
+    tsname = "create time";
+  else if (rec.timestamp.type ==
+           RdKafka::MessageTimestamp::MSG_TIMESTAMP_LOG_APPEND_TIME)
+    tsname = "log append time";
+  int n = snprintf(buf, size, "Timestamp: %s %" PRId64 "\n", tsname,
+                   rec.timestamp.timestamp);
+  return n < 0 ? 0 : std::min((size_t)n, size - 1);
+}
+
+
+/**
+ * @brief hand one output record to the spill log, or straight to the output
+ *        sink without one (or if the spill log failed to take it)
+ */
+static void emit(const struct iovec *iov, int iovcnt) {
+  if (!spill_log || !spill_log->append(iov, iovcnt))
+    output_sink->writev(iov, iovcnt);
+}
+
+
+/**
+ * @brief sink stage writing the messages to the output sink as they are.
+ *        Verbosity 1 writes the payload, 2 also the timestamp and key.
+ *
+ * The whole record is appended to the output sink at once, so records from
+ * different partition workers are never interleaved.
+ */
+template <int Verbosity>
+struct PrintSink : Stage {
+  void operator()(Record &rec) {
+    struct iovec iov[6];
+    int iovcnt = 0;
+    char tsline[64];
+
+    if (Verbosity >= 2) {
+      size_t n = format_timestamp(rec, tsline, sizeof(tsline));
+      if (n > 0) {
+        iov[iovcnt].iov_base  = tsline;
+        iov[iovcnt++].iov_len = n;
+      }
+    }
+    if (Verbosity >= 2 && rec.key) {
+      iov[iovcnt].iov_base  = (void *)"Key: ";
+      iov[iovcnt++].iov_len = 5;
+      iov[iovcnt].iov_base  = (void *)rec.key;
+      iov[iovcnt++].iov_len = rec.key_len;
+      iov[iovcnt].iov_base  = (void *)"\n";
+      iov[iovcnt++].iov_len = 1;
+    }
+    iov[iovcnt].iov_base  = (void *)rec.payload;
+    iov[iovcnt++].iov_len = rec.len;
+    iov[iovcnt].iov_base  = (void *)"\n";
+    iov[iovcnt++].iov_len = 1;
+    emit(iov, iovcnt);
   }
 };
 
 
-void msg_consume(RdKafka::Message *message, void *opaque) {
-  switch (message->err()) {
-  case RdKafka::ERR__TIMED_OUT:
-    break;
-
-  case RdKafka::ERR_NO_ERROR:
-    /* Real message */
-    msg_cnt++;
-    msg_bytes += message->len();
-    if (verbosity >= 3)
-      std::cerr << "Read msg at offset " << message->offset() << std::endl;
-    RdKafka::MessageTimestamp ts;
-    ts = message->timestamp();
-    if (verbosity >= 2 &&
-        ts.type != RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE) {
-      std::string tsname = "?";
-      if (ts.type == RdKafka::MessageTimestamp::MSG_TIMESTAMP_CREATE_TIME)
-        tsname = "create time";
-      else if (ts.type ==
-               RdKafka::MessageTimestamp::MSG_TIMESTAMP_LOG_APPEND_TIME)
-        tsname = "log append time";
-      std::cout << "Timestamp: " << tsname << " " << ts.timestamp << std::endl;
+/**
+ * @brief sink stage for inspecting topics with binary messages: text and
+ *        JSON payloads are written as they are, binary payloads as a hex
+ *        dump of their first dump_max bytes, binary keys in hex.
+ */
+template <int Verbosity>
+struct InspectSink : Stage {
+  static const size_t dump_max    = 1024;
+  static const size_t key_hex_max = 64;
+
+  void operator()(Record &rec) {
+    struct iovec iov[8];
+    int iovcnt = 0;
+    char tsline[64];
+    char keyline[32 + 2 * key_hex_max + 3];
+    char header[64];
+    char dump[dump_max / 16 * PAYLOAD_HEXDUMP_LINE];
+
+    if (Verbosity >= 2) {
+      size_t n = format_timestamp(rec, tsline, sizeof(tsline));
+      if (n > 0) {
+        iov[iovcnt].iov_base  = tsline;
+        iov[iovcnt++].iov_len = n;
+      }
     }
-    if (verbosity >= 2 && message->key()) {
-      std::cout << "Key: " << *message->key() << std::endl;
+    if (Verbosity >= 2 && rec.key) {
+      iov[iovcnt].iov_base  = (void *)"Key: ";
+      iov[iovcnt++].iov_len = 5;
+      if (payload_is_printable(rec.key, rec.key_len)) {
+        iov[iovcnt].iov_base  = (void *)rec.key;
+        iov[iovcnt++].iov_len = rec.key_len;
+      } else {
+        size_t n = rec.key_len < key_hex_max ? rec.key_len : key_hex_max;
+        int len  = snprintf(keyline, 32, "(%zu bytes) ", rec.key_len);
+        payload_hex(rec.key, n, keyline + len);
+        len += 2 * n;
+        if (n < rec.key_len) {
+          memcpy(keyline + len, "...", 3);
+          len += 3;
+        }
+        iov[iovcnt].iov_base  = keyline;
+        iov[iovcnt++].iov_len = len;
+      }
+      iov[iovcnt].iov_base  = (void *)"\n";
+      iov[iovcnt++].iov_len = 1;
     }
-    if (verbosity >= 1) {
-      printf("%.*s\n", static_cast<int>(message->len()),
-             static_cast<const char *>(message->payload()));
+
+    if (payload_classify(rec.payload, rec.len) == PAYLOAD_BINARY) {
+      int n = snprintf(header, sizeof(header), "(%zu bytes, %s)\n", rec.len,
+                       payload_class_name(PAYLOAD_BINARY));
+      iov[iovcnt].iov_base  = header;
+      iov[iovcnt++].iov_len = std::min((size_t)n, sizeof(header) - 1);
+      iov[iovcnt].iov_base  = dump;
+      iov[iovcnt++].iov_len =
+          payload_hexdump(rec.payload, rec.len, dump, sizeof(dump));
+    } else {
+      iov[iovcnt].iov_base  = (void *)rec.payload;
+      iov[iovcnt++].iov_len = rec.len;
+      iov[iovcnt].iov_base  = (void *)"\n";
+      iov[iovcnt++].iov_len = 1;
     }
-    break;
+    emit(iov, iovcnt);
+  }
+};
 
-  case RdKafka::ERR__PARTITION_EOF:
-    /* Last message */
-    if (exit_eof && ++eof_cnt == partition_cnt) {
-      std::cerr << "%% EOF reached for all " << partition_cnt << " partition(s)"
-                << std::endl;
+
+/**
+ * @brief last stage: marks the offset processed, records the counters and
+ *        latency, and releases the partition state; a replayed partition is
+ *        done once its last message is handled. Filtered messages are
+ *        only marked processed. With a spill log the offset is marked
+ *        processed once the output written before it is durable; when
+ *        aggregating, once no open window holds the message.
+ */
+struct AccountStage : Stage {
+  static const bool sees_dropped = true;
+
+  void operator()(Record &rec) {
+    PartitionState *ps = rec.partition_state;
+    if (!ps)
+      return;
+    if (aggregator)
+      ; /* committed with the windows */
+    else if (offset_manager && spill_log)
+      spill_log->defer_offset(ps->topic, rec.partition, rec.offset);
+    else if (offset_manager)
+      offset_manager->processed(ps->topic, rec.partition, rec.offset);
+    if (!rec.dropped) {
+      msg_cnt++;
+      msg_bytes += rec.len;
+      latency_stats.record(rec.topic, rec.partition, rec.timestamp,
+                           rec.poll_us, steady_us(), wall_ms());
+      ps->msg_cnt++;
+      ps->msg_bytes += rec.len;
+      ps->last_offset = rec.offset;
+    }
+    if (replay && rec.offset + 1 >= ps->end_offset && replay_finish(ps))
       run = 0;
+    ps->inflight_bytes -= rec.len;
+    rec.partition_state = NULL;
+    partition_states.release(ps);
+  }
+};
+
+
+/**
+ * @brief drops redelivered messages before they reach the sink.
+ *
+ * Messages are identified by topic, partition, offset and key, or by the
+ * value of the dedup_header header (e.g. a producer-assigned id, which also
+ * catches duplicates from producer retries); messages without the header
+ * fall back to their offset. Dropped duplicates are still committed.
+ */
+struct DedupStage : Stage {
+  void operator()(Record &rec) {
+    uint64_t h = 0;
+    bool found = false;
+    if (!dedup_header.empty() && rec.message) {
+      rd_kafka_headers_t *hdrs;
+      const void *value;
+      size_t size;
+      if (rd_kafka_message_headers(rec.message, &hdrs) ==
+              RD_KAFKA_RESP_ERR_NO_ERROR &&
+          rd_kafka_header_get_last(hdrs, dedup_header.c_str(), &value, &size) ==
+              RD_KAFKA_RESP_ERR_NO_ERROR &&
+          value) {
+        h     = DedupCache::hash(value, size, 0);
+        found = true;
+      }
+    }
+    if (!found) {
+      h = DedupCache::hash(rec.topic, strlen(rec.topic), 0);
+      h = DedupCache::hash(&rec.partition, sizeof(rec.partition), h);
+      h = DedupCache::hash(&rec.offset, sizeof(rec.offset), h);
+      if (rec.key)
+        h = DedupCache::hash(rec.key, rec.key_len, h);
+    }
+    if (dedup_cache->check_and_insert(DedupCache::finalize(h),
+                                      rec.poll_us / 1000)) {
+      ALOG_DEBUG("Skipping duplicate msg at offset %" PRId64, rec.offset);
+      rec.dropped = true;
+    }
+  }
+};
+
+
+/**
+ * @brief sink stage aggregating the messages into windows by key instead
+ *        of writing them; messages without a timestamp are aggregated at
+ *        the time they are consumed. Filtered messages are only tracked
+ *        for the offset commits.
+ */
+struct AggregateStage : Stage {
+  static const bool sees_dropped = true;
+
+  void operator()(Record &rec) {
+    if (!rec.partition_state)
+      return;
+    if (rec.dropped) {
+      aggregator->skipped(rec.topic, rec.partition, rec.offset);
+      return;
+    }
+    int64_t ts = rec.timestamp.type !=
+                             RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE &&
+                         rec.timestamp.timestamp >= 0
+                     ? rec.timestamp.timestamp
+                     : wall_ms();
+    aggregator->add(rec.topic, rec.partition, rec.offset, ts, rec.key,
+                    rec.key_len, rec.payload, rec.len);
+  }
+};
+
+
+/**
+ * @brief aggregator commit callback: the offsets before offset are in
+ *        emitted windows (or in none), committed once their output is
+ *        durable with a spill log
+ */
+static void aggregate_commit_cb(const std::string &topic,
+                                int32_t partition,
+                                int64_t offset) {
+  if (offset_manager && spill_log)
+    spill_log->defer_offset(topic, partition, offset - 1);
+  else if (offset_manager)
+    offset_manager->processed(topic, partition, offset - 1);
+}
+
+
+/**
+ * @brief the consumer's pipeline: decode -> Filter -> Sink -> account, with
+ *        the sink and account stages on their own thread if queued
+ */
+template <typename Filter, typename Sink>
+static PipelineHandle make_consumer_pipeline(bool queued) {
+  if (queued)
+    return make_pipeline_handle(
+        new Pipeline<DecodeStage, Filter,
+                     AsyncBoundary<Pipeline<Sink, AccountStage> > >());
+  return make_pipeline_handle(
+      new Pipeline<DecodeStage, Filter, Sink, AccountStage>());
+}
+
+/**
+ * @brief pick the sink for the verbosity (0: no output) and output format,
+ *        or the aggregate stage
+ */
+template <typename Filter>
+static PipelineHandle make_consumer_pipeline(bool inspect, bool queued) {
+  if (aggregator)
+    return make_consumer_pipeline<Filter, AggregateStage>(queued);
+  if (verbosity <= 0)
+    return make_consumer_pipeline<Filter, NullStage>(queued);
+  if (verbosity == 1)
+    return inspect ? make_consumer_pipeline<Filter, InspectSink<1> >(queued)
+                   : make_consumer_pipeline<Filter, PrintSink<1> >(queued);
+  return inspect ? make_consumer_pipeline<Filter, InspectSink<2> >(queued)
+                 : make_consumer_pipeline<Filter, PrintSink<2> >(queued);
+}
+
+
+/**
+ * @brief the consumer's pipeline for an output format, deduplicating if
+ *        a dedup cache is set up
+ */
+static PipelineHandle make_format_pipeline(bool inspect, bool queued) {
+  if (dedup_cache)
+    return make_consumer_pipeline<DedupStage>(inspect, queued);
+  return make_consumer_pipeline<NullStage>(inspect, queued);
+}
+
+
+/**
+ * @brief consumer metrics appended to the librdkafka statistics on /metrics
+ */
+static void app_metrics(metrics_buf_t *buf, void *opaque) {
+  metrics_buf_printf(buf,
+                     "# TYPE consumer_messages_total counter\n"
+                     "consumer_messages_total %ld\n"
+                     "# TYPE consumer_bytes_total counter\n"
+                     "consumer_bytes_total %" PRId64 "\n",
+                     msg_cnt.load(), msg_bytes.load());
+  if (alloc_count_enabled())
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_heap_allocations_total counter\n"
+                       "consumer_heap_allocations_total %" PRIu64 "\n",
+                       get_heap_alloc_cnt());
+
+  metrics_buf_printf(buf,
+                     "# TYPE consumer_rebalances_total counter\n"
+                     "consumer_rebalances_total %ld\n"
+                     "# TYPE consumer_rebalance_seconds_total counter\n"
+                     "consumer_rebalance_seconds_total %.6f\n"
+                     "# TYPE consumer_rebalance_max_seconds gauge\n"
+                     "consumer_rebalance_max_seconds %.6f\n",
+                     rebalance_cnt.load(), rebalance_us.load() / 1e6,
+                     rebalance_max_us.load() / 1e6);
+
+  /* assigned partitions */
+  metrics_buf_printf(buf,
+                     "# TYPE consumer_partition_messages_total counter\n");
+  partition_states.for_each([buf](const PartitionState &ps) {
+    metrics_buf_printf(buf,
+                       "consumer_partition_messages_total{topic=\"%s\","
+                       "partition=\"%d\"} %ld\n",
+                       ps.topic.c_str(), (int)ps.partition, ps.msg_cnt.load());
+  });
+  metrics_buf_printf(buf, "# TYPE consumer_partition_last_offset gauge\n");
+  partition_states.for_each([buf](const PartitionState &ps) {
+    metrics_buf_printf(buf,
+                       "consumer_partition_last_offset{topic=\"%s\","
+                       "partition=\"%d\"} %" PRId64 "\n",
+                       ps.topic.c_str(), (int)ps.partition,
+                       ps.last_offset.load());
+  });
+  metrics_buf_printf(buf, "# TYPE consumer_partition_eof gauge\n");
+  partition_states.for_each([buf](const PartitionState &ps) {
+    metrics_buf_printf(buf,
+                       "consumer_partition_eof{topic=\"%s\","
+                       "partition=\"%d\"} %d\n",
+                       ps.topic.c_str(), (int)ps.partition,
+                       ps.eof.load() ? 1 : 0);
+  });
+
+  if (dedup_cache)
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_dedup_lookups_total counter\n"
+                       "consumer_dedup_lookups_total %" PRIu64 "\n"
+                       "# TYPE consumer_dedup_duplicates_total counter\n"
+                       "consumer_dedup_duplicates_total %" PRIu64 "\n"
+                       "# TYPE consumer_dedup_rotations_total counter\n"
+                       "consumer_dedup_rotations_total %" PRIu64 "\n"
+                       "# TYPE consumer_dedup_entries gauge\n"
+                       "consumer_dedup_entries %zu\n"
+                       "# TYPE consumer_dedup_memory_bytes gauge\n"
+                       "consumer_dedup_memory_bytes %zu\n",
+                       dedup_cache->get_lookup_cnt(),
+                       dedup_cache->get_hit_cnt(),
+                       dedup_cache->get_rotation_cnt(), dedup_cache->size(),
+                       dedup_cache->get_memory_bytes());
+
+  if (spill_log)
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_spill_pending_bytes gauge\n"
+                       "consumer_spill_pending_bytes %" PRIu64 "\n"
+                       "# TYPE consumer_spill_unsynced_bytes gauge\n"
+                       "consumer_spill_unsynced_bytes %" PRIu64 "\n"
+                       "# TYPE consumer_spill_appended_bytes_total counter\n"
+                       "consumer_spill_appended_bytes_total %" PRIu64 "\n"
+                       "# TYPE consumer_spill_replayed_bytes_total counter\n"
+                       "consumer_spill_replayed_bytes_total %" PRIu64 "\n"
+                       "# TYPE consumer_spill_segments gauge\n"
+                       "consumer_spill_segments %zu\n"
+                       "# TYPE consumer_spill_backpressure_total counter\n"
+                       "consumer_spill_backpressure_total %ld\n",
+                       spill_log->get_pending_bytes(),
+                       spill_log->get_unsynced_bytes(),
+                       spill_log->get_appended_bytes(),
+                       spill_log->get_replayed_bytes(),
+                       spill_log->get_segment_cnt(),
+                       spill_log->get_backpressure_cnt());
+
+  if (flow_control) {
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_buffered_bytes gauge\n"
+                       "consumer_buffered_bytes %" PRId64 "\n"
+                       "# TYPE consumer_buffered_messages gauge\n"
+                       "consumer_buffered_messages %ld\n",
+                       flow_control->get_buffered_bytes(),
+                       flow_control->get_buffered_msgs());
+    if (flow_control->enabled())
+      metrics_buf_printf(buf,
+                         "# TYPE consumer_flow_paused_partitions gauge\n"
+                         "consumer_flow_paused_partitions %ld\n"
+                         "# TYPE consumer_flow_pauses_total counter\n"
+                         "consumer_flow_pauses_total %ld\n",
+                         flow_control->get_paused_cnt(),
+                         flow_control->get_pause_cnt());
+  }
+
+  if (replay) {
+    std::vector<Replay::Range> ranges = replay->get_ranges();
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_replay_partitions gauge\n"
+                       "consumer_replay_partitions %zu\n"
+                       "# TYPE consumer_replay_done_partitions gauge\n"
+                       "consumer_replay_done_partitions %zu\n",
+                       ranges.size(), replay->get_done_cnt());
+    metrics_buf_printf(buf, "# TYPE consumer_replay_start_offset gauge\n");
+    for (size_t i = 0; i < ranges.size(); i++)
+      metrics_buf_printf(buf,
+                         "consumer_replay_start_offset{topic=\"%s\","
+                         "partition=\"%d\"} %" PRId64 "\n",
+                         ranges[i].topic.c_str(), (int)ranges[i].partition,
+                         ranges[i].start);
+    metrics_buf_printf(buf, "# TYPE consumer_replay_end_offset gauge\n");
+    for (size_t i = 0; i < ranges.size(); i++)
+      metrics_buf_printf(buf,
+                         "consumer_replay_end_offset{topic=\"%s\","
+                         "partition=\"%d\"} %" PRId64 "\n",
+                         ranges[i].topic.c_str(), (int)ranges[i].partition,
+                         ranges[i].end);
+  }
+
+  if (aggregator)
+    metrics_buf_printf(buf,
+                       "# TYPE consumer_agg_messages_total counter\n"
+                       "consumer_agg_messages_total %" PRIu64 "\n"
+                       "# TYPE consumer_agg_late_messages_total counter\n"
+                       "consumer_agg_late_messages_total %" PRIu64 "\n"
+                       "# TYPE consumer_agg_no_value_messages_total counter\n"
+                       "consumer_agg_no_value_messages_total %" PRIu64 "\n"
+                       "# TYPE consumer_agg_windows_total counter\n"
+                       "consumer_agg_windows_total %" PRIu64 "\n"
+                       "# TYPE consumer_agg_rows_total counter\n"
+                       "consumer_agg_rows_total %" PRIu64 "\n"
+                       "# TYPE consumer_agg_emit_seconds_total counter\n"
+                       "consumer_agg_emit_seconds_total %.6f\n"
+                       "# TYPE consumer_agg_open_windows gauge\n"
+                       "consumer_agg_open_windows %zu\n"
+                       "# TYPE consumer_agg_open_keys gauge\n"
+                       "consumer_agg_open_keys %zu\n"
+                       "# TYPE consumer_agg_memory_bytes gauge\n"
+                       "consumer_agg_memory_bytes %zu\n",
+                       aggregator->get_msg_cnt(), aggregator->get_late_cnt(),
+                       aggregator->get_no_value_cnt(),
+                       aggregator->get_window_cnt(), aggregator->get_row_cnt(),
+                       aggregator->get_emit_us() / 1e6,
+                       aggregator->get_open_window_cnt(),
+                       aggregator->get_open_key_cnt(),
+                       aggregator->get_memory_bytes());
+
+  if (scheduler) {
+    std::vector<TopicScheduler::TopicStats> topic_stats =
+        scheduler->get_topic_stats();
+    metrics_buf_printf(buf, "# TYPE consumer_topic_messages_total counter\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_messages_total{topic=\"%s\"} %ld\n",
+                         topic_stats[i].topic.c_str(), topic_stats[i].msg_cnt);
+    metrics_buf_printf(buf, "# TYPE consumer_topic_weight gauge\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_weight{topic=\"%s\"} %d\n",
+                         topic_stats[i].topic.c_str(), topic_stats[i].weight);
+    metrics_buf_printf(buf, "# TYPE consumer_topic_latency_ms gauge\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_latency_ms{topic=\"%s\"} %" PRId64 "\n",
+                         topic_stats[i].topic.c_str(),
+                         topic_stats[i].latency_avg_ms);
+    metrics_buf_printf(buf, "# TYPE consumer_topic_latency_target_ms gauge\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_latency_target_ms{topic=\"%s\"} %d\n",
+                         topic_stats[i].topic.c_str(), topic_stats[i].latency_ms);
+    metrics_buf_printf(buf, "# TYPE consumer_topic_over_target_total counter\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_over_target_total{topic=\"%s\"} %ld\n",
+                         topic_stats[i].topic.c_str(), topic_stats[i].hot_cnt);
+    metrics_buf_printf(buf, "# TYPE consumer_topic_paused gauge\n");
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      metrics_buf_printf(buf, "consumer_topic_paused{topic=\"%s\"} %d\n",
+                         topic_stats[i].topic.c_str(), topic_stats[i].paused ? 1 : 0);
+  }
+
+  /* latency percentiles of the last statistics interval */
+  std::vector<LatencyStats::Summary> summaries =
+      latency_stats.get_last_summaries();
+  const char *names[2] = {"consumer_e2e_latency_us",
+                          "consumer_handler_latency_us"};
+  for (int k = 0; k < 2; k++) {
+    metrics_buf_printf(buf, "# TYPE %s summary\n", names[k]);
+    for (size_t i = 0; i < summaries.size(); i++) {
+      const LatencyStats::Summary &s = summaries[i];
+      const char *t = s.topic.c_str();
+      int p         = (int)s.partition;
+      metrics_buf_printf(
+          buf,
+          "%s{topic=\"%s\",partition=\"%d\",quantile=\"0.5\"} %" PRIu64 "\n"
+          "%s{topic=\"%s\",partition=\"%d\",quantile=\"0.99\"} %" PRIu64 "\n"
+          "%s{topic=\"%s\",partition=\"%d\",quantile=\"0.999\"} %" PRIu64 "\n"
+          "%s{topic=\"%s\",partition=\"%d\",quantile=\"1\"} %" PRIu64 "\n"
+          "%s_sum{topic=\"%s\",partition=\"%d\"} %" PRIu64 "\n"
+          "%s_count{topic=\"%s\",partition=\"%d\"} %" PRIu64 "\n",
+          names[k], t, p, s.p50[k], names[k], t, p, s.p99[k], names[k], t, p,
+          s.p999[k], names[k], t, p, s.max[k], names[k], t, p, s.sum[k],
+          names[k], t, p, s.cnt[k]);
     }
-    break;
+  }
+}
+
+
+/**
+ * @brief process CPU time (user + system) in microseconds
+ */
+static int64_t cpu_time_us() {
+#ifndef _WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == -1)
+    return 0;
+  return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+  return 0;
+#endif
+}
+
+
+/**
+ * @brief spill log durable callback: the output written before the offset
+ *        is on disk, the offset may be committed
+ */
+static void spill_durable_cb(const std::string &topic,
+                             int32_t partition,
+                             int64_t offset,
+                             void *opaque) {
+  if (offset_manager)
+    offset_manager->processed(topic, partition, offset);
+}
+
+/**
+ * @brief check the fetch settings against each other where librdkafka does
+ *        not. fetch.max.bytes against message.max.bytes and
+ *        receive.message.max.bytes is left to librdkafka, which raises
+ *        receive.message.max.bytes itself unless it is set.
+ */
+static bool validate_conf(RdKafka::Conf *conf, std::string &errstr) {
+  std::string v;
+  long fetch_wait_ms = 0, socket_timeout_ms = 0;
+  long fetch_min = 0, fetch_max = 0;
 
-  case RdKafka::ERR__UNKNOWN_TOPIC:
-  case RdKafka::ERR__UNKNOWN_PARTITION:
-    std::cerr << "Consume failed: " << message->errstr() << std::endl;
-    run = 0;
-    break;
+  if (conf->get("fetch.wait.max.ms", v) == RdKafka::Conf::CONF_OK)
+    fetch_wait_ms = atol(v.c_str());
+  if (conf->get("socket.timeout.ms", v) == RdKafka::Conf::CONF_OK)
+    socket_timeout_ms = atol(v.c_str());
+  if (conf->get("fetch.min.bytes", v) == RdKafka::Conf::CONF_OK)
+    fetch_min = atol(v.c_str());
+  if (conf->get("fetch.max.bytes", v) == RdKafka::Conf::CONF_OK)
+    fetch_max = atol(v.c_str());
 
-  default:
-    /* Errors */
-    std::cerr << "Consume failed: " << message->errstr() << std::endl;
-    run = 0;
+  if (fetch_wait_ms >= socket_timeout_ms) {
+    errstr = "fetch.wait.max.ms must be below socket.timeout.ms";
+    return false;
+  }
+  if (fetch_min > fetch_max) {
+    errstr = "fetch.min.bytes must be at most fetch.max.bytes";
+    return false;
   }
+  return true;
+}
+
+
+/**
+ * @brief print msg/s and CPU time per message for the consume run
+ */
+static void print_throughput(const std::string &mode,
+                             std::chrono::steady_clock::time_point start,
+                             int64_t cpu_start_us) {
+  double elapsed_s = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  int64_t cpu_us = cpu_time_us() - cpu_start_us;
+  long cnt       = msg_cnt.load();
+
+  fprintf(stderr,
+          "%% Throughput (%s): %ld msgs in %.3fs = %.0f msg/s, "
+          "%.2f MB/s, %.3f CPU us/msg\n",
+          mode.c_str(), cnt, elapsed_s,
+          elapsed_s > 0 ? cnt / elapsed_s : 0.0,
+          elapsed_s > 0 ? msg_bytes.load() / elapsed_s / (1024 * 1024) : 0.0,
+          cnt > 0 ? (double)cpu_us / cnt : 0.0);
 }
 
+
 int main(int argc, char **argv) {
   std::string errstr;
   std::string mode;
@@ -203,13 +925,17 @@ int main(int argc, char **argv) {
   };
 
 
+  /*
+   * Log records are written to stderr by a background flusher thread
+   */
+  app_log.set_level(verbosity >= 3 ? ALOG_LEVEL_DEBUG : ALOG_LEVEL_INFO);
+  app_log.start(STDERR_FILENO);
+
   std::string brokers = kafka_config.get_brokers();
   std::string consumer_group_id = kafka_config.get_consumer_group();
   std::string statistics_interval_ms = kafka_config.get_statistics_interval_ms();
   bool do_config_dump = kafka_config.get_do_config_dump();
-  std::string topic = kafka_config.get_topic();
-  std::vector<std::string> topics;
-  topics.push_back(topic);
+  std::vector<std::string> topics = kafka_config.get_topics();
 
   /*
    * Create configuration objects
@@ -219,6 +945,14 @@ int main(int argc, char **argv) {
   /*
    * Set configuration properties
    */
+  // passed through from the profile, config file and KAFKA_RDKAFKA_* env
+  // vars, none of them is one of the consumer's own settings below
+  const std::vector<KafkaProperty> &props = kafka_config.get_rdkafka_properties();
+  for (size_t i = 0; i < props.size(); i++) {
+    if (conf->set(props[i].name, props[i].value, errstr) != RdKafka::Conf::CONF_OK)
+      errx(1, "failed to set kafka config %s from %s: %s", props[i].name.c_str(),
+           props[i].source.c_str(), errstr.c_str());
+  }
   // brokers
   conf->set("metadata.broker.list", brokers, errstr);
   // rebalance callback
@@ -226,6 +960,12 @@ int main(int argc, char **argv) {
   conf->set("rebalance_cb", &ex_rebalance_cb, errstr);
 
   conf->set("enable.partition.eof", "true", errstr);
+  /* a replay must not move the group's committed offsets */
+  bool replaying = kafka_config.get_replay_from_ms() >= 0;
+  if ((replaying || kafka_config.get_commit_interval_ms() > 0) &&
+      conf->set("enable.auto.commit", "false", errstr) != RdKafka::Conf::CONF_OK) {
+    errx(1, "failed to set kafka config enable.auto.commit %s", errstr.c_str());
+  }
   if (conf->set("group.id", consumer_group_id, errstr) != RdKafka::Conf::CONF_OK) {
     errx(1, "failed to set kafka config group.id %s", errstr.c_str());
     exit(1);
@@ -236,18 +976,16 @@ int main(int argc, char **argv) {
 
 
 
-  if (exit_eof) {
-    std::string strategy;
-    if (conf->get("partition.assignment.strategy", strategy) ==
-            RdKafka::Conf::CONF_OK &&
-        strategy == "cooperative-sticky") {
-      std::cerr
-          << "Error: this example has not been modified to "
-          << "support -e (exit on EOF) when the partition.assignment.strategy "
-          << "is set to " << strategy << ": remove -e from the command line\n";
-      exit(1);
-    }
+  /* librdkafka's (eager) default unless set, EOF is tracked per partition so
+   * exit on EOF works with every strategy */
+  if (!kafka_config.get_assignment_strategy().empty() &&
+      conf->set("partition.assignment.strategy",
+                kafka_config.get_assignment_strategy(),
+                errstr) != RdKafka::Conf::CONF_OK) {
+    errx(1, "failed to set kafka config partition.assignment.strategy %s",
+         errstr.c_str());
   }
+  exit_eof = kafka_config.get_exit_eof();
 
     if (!debug.empty()) {
     if (conf->set("debug", debug, errstr) != RdKafka::Conf::CONF_OK) {
@@ -259,6 +997,16 @@ int main(int argc, char **argv) {
   EventCb ex_event_cb;
   conf->set("event_cb", &ex_event_cb, errstr);
 
+  if (!validate_conf(conf, errstr))
+    errx(1, "invalid kafka config: %s", errstr.c_str());
+
+  for (size_t i = 0; i < props.size(); i++) {
+    std::string value;
+    conf->get(props[i].name, value);
+    std::cout << "% Config " << props[i].name << " = " << value << " ("
+              << props[i].source << ")" << std::endl;
+  }
+
   if (do_config_dump) {
     std::list<std::string> *dump;
     dump = conf->dump();
@@ -277,6 +1025,58 @@ int main(int argc, char **argv) {
   signal(SIGINT, sigterm);
   signal(SIGTERM, sigterm);
 
+  /*
+   * Message output goes through a buffered sink with its own writer thread
+   */
+  output_sink = OutputSink::create(
+      kafka_config.get_output_sink(), kafka_config.get_output_path(),
+      kafka_config.get_output_buffer_kb() * 1024,
+      kafka_config.get_output_ring_mb() * 1024 * 1024, errstr);
+  if (!output_sink) {
+    std::cerr << "Failed to create output sink: " << errstr << std::endl;
+    exit(1);
+  }
+
+  /*
+   * With a spill directory output is appended to a memory-mapped log and
+   * replayed to the sink by its own thread, offsets are committed once
+   * their output is durable in the log
+   */
+  if (!kafka_config.get_spill_dir().empty()) {
+    spill_log = SpillLog::create(
+        kafka_config.get_spill_dir(),
+        kafka_config.get_spill_segment_mb() * 1024 * 1024,
+        kafka_config.get_spill_segment_ms(),
+        (uint64_t)kafka_config.get_spill_max_mb() * 1024 * 1024,
+        kafka_config.get_spill_sync_ms(), output_sink, spill_durable_cb, NULL,
+        errstr);
+    if (!spill_log) {
+      std::cerr << "Failed to create spill log: " << errstr << std::endl;
+      exit(1);
+    }
+    std::cout << "% Spilling output to " << kafka_config.get_spill_dir()
+              << ", " << spill_log->get_pending_bytes()
+              << " byte(s) left to replay" << std::endl;
+  }
+
+  /*
+   * Parsed statistics are served in Prometheus format on /metrics
+   */
+  if (kafka_config.get_metrics_port() > 0) {
+    char metrics_errstr[256];
+    metrics_server = metrics_server_start(kafka_config.get_metrics_port(),
+                                          metrics_errstr,
+                                          sizeof(metrics_errstr));
+    if (!metrics_server) {
+      std::cerr << "Failed to start metrics server: " << metrics_errstr
+                << std::endl;
+      exit(1);
+    }
+    metrics_server_set_extra_cb(metrics_server, app_metrics, NULL);
+    std::cout << "% Serving metrics on :" << kafka_config.get_metrics_port()
+              << "/metrics" << std::endl;
+  }
+
 
   /*
    * Consumer mode
@@ -296,24 +1096,248 @@ int main(int argc, char **argv) {
 
   std::cout << "% Created consumer " << consumer->name() << std::endl;
 
+  /*
+   * Manual offset commits: processed offsets are coalesced and committed
+   * asynchronously every KAFKA_COMMIT_INTERVAL_MS / KAFKA_COMMIT_MSG_CNT
+   */
+  if (kafka_config.get_commit_interval_ms() > 0 && !replaying)
+    offset_manager = new OffsetManager(consumer,
+                                       kafka_config.get_commit_interval_ms(),
+                                       kafka_config.get_commit_msg_cnt());
 
   /*
-   * Subscribe to topics
+   * Messages go through a pipeline of stages specialized at compile time
+   * for the dedup, verbosity and output format, optionally with the sink
+   * and account stages on their own thread behind an SPSC queue
    */
-  RdKafka::ErrorCode err = consumer->subscribe(topics);
-  if (err) {
-    std::cerr << "Failed to subscribe to " << topics.size()
-              << " topics: " << RdKafka::err2str(err) << std::endl;
-    exit(1);
+  bool queued  = kafka_config.get_pipeline_queued();
+  bool inspect = kafka_config.get_output_format() == "inspect";
+  if (inspect)
+    ALOG_INFO("Inspecting payloads with %s kernels", payload_simd_name());
+  if (!kafka_config.get_dedup_key().empty()) {
+    const std::string &key = kafka_config.get_dedup_key();
+    if (key.compare(0, 7, "header:") == 0)
+      dedup_header = key.substr(7);
+    dedup_cache = new DedupCache(kafka_config.get_dedup_memory_mb() * 1024 * 1024,
+                                 kafka_config.get_dedup_window_ms(),
+                                 steady_us() / 1000);
+    ALOG_INFO("Deduplicating on %s in %zuMB, window %dms", key.c_str(),
+              dedup_cache->get_memory_bytes() >> 20,
+              kafka_config.get_dedup_window_ms());
+  }
+
+  /*
+   * Windowed aggregation: the sink aggregates the messages by key and
+   * writes a row per key when a window closes, the offsets are committed
+   * in step with the closed windows
+   */
+  if (kafka_config.get_agg_window_ms() > 0) {
+    WindowAggregator::Options agg_opts;
+    agg_opts.size_ms  = kafka_config.get_agg_window_ms();
+    agg_opts.hop_ms   = kafka_config.get_agg_hop_ms();
+    agg_opts.grace_ms = kafka_config.get_agg_grace_ms();
+    agg_opts.idle_ms  = kafka_config.get_agg_idle_ms();
+    agg_opts.field    = kafka_config.get_agg_field();
+    aggregator = new WindowAggregator(agg_opts, emit, aggregate_commit_cb);
+    ALOG_INFO("Aggregating %s over %" PRId64 "ms windows every %" PRId64
+              "ms, grace %" PRId64 "ms",
+              agg_opts.field.empty() ? "counts" : agg_opts.field.c_str(),
+              agg_opts.size_ms, agg_opts.hop_ms, agg_opts.grace_ms);
+  }
+  PipelineHandle pipeline = make_format_pipeline(inspect, queued);
+
+  /*
+   * Topic routes: messages are handed out by a weighted fair scheduler over
+   * per-partition queues, each topic to the pipeline of its route's format
+   */
+  std::vector<TopicRoute> routes = kafka_config.get_topic_routes();
+  PipelineHandle other_pipeline; /* the other output format */
+  bool other_used = false;
+  if (!routes.empty()) {
+    scheduler = new TopicScheduler(consumer);
+    scheduler->set_default_route(pipeline.handler, pipeline.opaque);
+    for (size_t i = 0; i < routes.size(); i++) {
+      bool route_inspect = routes[i].format == "inspect";
+      if (route_inspect != inspect && !other_used) {
+        other_pipeline = make_format_pipeline(route_inspect, queued);
+        other_used     = true;
+      }
+      const PipelineHandle &p = route_inspect == inspect ? pipeline : other_pipeline;
+      TopicScheduler::Route route;
+      route.pattern    = routes[i].pattern;
+      route.weight     = routes[i].weight;
+      route.latency_ms = routes[i].latency_ms;
+      route.handler    = p.handler;
+      route.opaque     = p.opaque;
+      if (!scheduler->add_route(route, errstr))
+        errx(1, "failed to add topic route: %s", errstr.c_str());
+      ALOG_INFO("Topic route %s: weight %d, latency target %dms, %s output",
+                routes[i].pattern.c_str(), routes[i].weight,
+                routes[i].latency_ms, routes[i].format.c_str());
+    }
+    if (!scheduler->start(errstr))
+      errx(1, "failed to start topic scheduler: %s", errstr.c_str());
+    ex_rebalance_cb.set_scheduler(scheduler);
+  }
+
+  /*
+   * Replay: the start and end offsets of every partition are resolved from
+   * the time range, partitions are assigned manually (outside the group)
+   * and read by one worker per core unless KAFKA_CONSUMER_WORKERS is set
+   */
+  int workers = kafka_config.get_consumer_workers();
+  if (replaying) {
+    replay = new Replay(consumer, &partition_states,
+                        kafka_config.get_replay_from_ms(),
+                        kafka_config.get_replay_to_ms());
+    if (!replay->resolve(topics, 30000, errstr))
+      errx(1, "failed to start replay: %s", errstr.c_str());
+    if (workers == 0 && !queued)
+      workers = (int)std::min<size_t>(replay->get_partition_cnt(),
+                                      std::max(1u, std::thread::hardware_concurrency()));
+  }
+
+  /*
+   * Partition-parallel workers: each assigned partition queue is forwarded
+   * to one of the worker threads, the loop below then only serves
+   * rebalances, errors and events.
+   */
+  PartitionEngine *engine = NULL;
+  if (workers > 0) {
+    engine = new PartitionEngine(workers, pipeline.handler, pipeline.opaque);
+    if (kafka_config.get_consume_batch_size() > 1)
+      engine->set_batch_handler(pipeline.batch_handler,
+                                kafka_config.get_consume_batch_size(),
+                                kafka_config.get_consume_batch_linger_ms());
+    if (!engine->start(consumer, errstr)) {
+      std::cerr << "Failed to start partition engine: " << errstr << std::endl;
+      exit(1);
+    }
+    ex_rebalance_cb.set_engine(engine);
+    std::cout << "% Started " << workers << " partition worker(s)" << std::endl;
+  }
+
+
+  /*
+   * Buffered messages are measured (consumer_buffered_* metrics) and, with
+   * limits, the hottest partitions are paused above the high-water mark
+   */
+  FlowControl::Limits limits;
+  limits.high_bytes = (int64_t)kafka_config.get_flow_high_mb() * 1024 * 1024;
+  limits.low_bytes  = (int64_t)kafka_config.get_flow_low_mb() * 1024 * 1024;
+  limits.high_msgs  = kafka_config.get_flow_high_msgs();
+  limits.low_msgs   = kafka_config.get_flow_low_msgs();
+  flow_control = new FlowControl(consumer, &partition_states, limits,
+                                 limits.high_bytes > 0 || limits.high_msgs > 0
+                                     ? 10
+                                     : 1000);
+  flow_control->set_engine(engine);
+  flow_control->start();
+  if (flow_control->enabled())
+    ALOG_INFO("Flow control: pausing above %zuMB / %ld message(s), resuming "
+              "below %zuMB / %ld message(s)",
+              kafka_config.get_flow_high_mb(), limits.high_msgs,
+              kafka_config.get_flow_low_mb(), limits.low_msgs);
+
+  /*
+   * Subscribe to topics, or assign the replayed partitions: routed to the
+   * workers first, so none of their messages reach the consumer queue
+   */
+  if (replay) {
+    std::vector<RdKafka::TopicPartition *> parts = replay->get_partitions();
+    if (engine)
+      engine->add_partitions(consumer, parts);
+    if (!replay->assign(parts, errstr))
+      errx(1, "failed to start replay: %s", errstr.c_str());
+    RdKafka::TopicPartition::destroy(parts);
+    std::cout << "% Replaying " << replay->get_partition_cnt()
+              << " partition(s) from " << kafka_config.get_replay_from_ms()
+              << " to "
+              << (kafka_config.get_replay_to_ms() >= 0
+                      ? std::to_string(kafka_config.get_replay_to_ms())
+                      : std::string("the end"))
+              << std::endl;
+    if (replay->all_done())
+      run = 0;
+    replay->start(kafka_config.get_replay_progress_ms());
+  } else {
+    RdKafka::ErrorCode err = consumer->subscribe(topics);
+    if (err) {
+      std::cerr << "Failed to subscribe to " << topics.size()
+                << " topics: " << RdKafka::err2str(err) << std::endl;
+      exit(1);
+    }
   }
 
   /*
    * Consume messages
    */
-  while (run) {
-    RdKafka::Message *msg = consumer->consume(1000);
-    msg_consume(msg, NULL);
-    delete msg;
+  size_t batch_size = kafka_config.get_consume_batch_size();
+  std::string consume_mode =
+      engine ? "partition workers"
+             : scheduler ? "scheduled topics" : (batch_size > 1 ? "batch" : "single");
+  if (batch_size > 1)
+    consume_mode += " (batch " + std::to_string(batch_size) + ", linger " +
+                    std::to_string(kafka_config.get_consume_batch_linger_ms()) +
+                    "ms)";
+  if (kafka_config.get_pipeline_queued())
+    consume_mode += ", queued pipeline";
+  if (aggregator)
+    consume_mode += ", aggregating";
+  if (replay)
+    consume_mode = "replay, " + consume_mode;
+  std::chrono::steady_clock::time_point consume_start =
+      std::chrono::steady_clock::now();
+  int64_t cpu_start_us = cpu_time_us();
+  uint64_t alloc_start  = get_heap_alloc_cnt();
+  long msg_start        = msg_cnt.load();
+
+  if (scheduler) {
+    while (run) {
+      scheduler->poll(1000);
+      if (aggregator)
+        aggregator->tick();
+      if (offset_manager)
+        offset_manager->maybe_commit();
+    }
+  } else if (!engine && batch_size > 1) {
+    rd_kafka_queue_t *consumer_queue = rd_kafka_queue_get_consumer(consumer->c_ptr());
+    std::vector<rd_kafka_message_t *> batch(batch_size);
+    while (run) {
+      size_t cnt = consume_batch(consumer_queue, batch_size,
+                                 kafka_config.get_consume_batch_linger_ms(),
+                                 &batch[0]);
+      if (cnt > 0)
+        pipeline.batch_handler(&batch[0], cnt, pipeline.opaque);
+      release_batch(&batch[0], cnt);
+      if (aggregator)
+        aggregator->tick();
+      if (offset_manager)
+        offset_manager->maybe_commit();
+    }
+    rd_kafka_queue_destroy(consumer_queue);
+  } else {
+    /* the C API: consume() would allocate a Message per message */
+    while (run) {
+      rd_kafka_message_t *msg = rd_kafka_consumer_poll(consumer->c_ptr(), 1000);
+      if (msg) {
+        pipeline.handler(msg, pipeline.opaque);
+        rd_kafka_message_destroy(msg);
+      }
+      if (aggregator)
+        aggregator->tick();
+      if (offset_manager)
+        offset_manager->maybe_commit();
+    }
+  }
+
+  if (alloc_count_enabled()) {
+    uint64_t allocs = get_heap_alloc_cnt() - alloc_start;
+    long msgs       = msg_cnt.load() - msg_start;
+    fprintf(stderr,
+            "%% Heap allocations while consuming: %" PRIu64
+            " (%.4f per message)\n",
+            allocs, msgs > 0 ? (double)allocs / msgs : 0.0);
   }
 
 #ifndef _WIN32
@@ -323,11 +1347,129 @@ int main(int argc, char **argv) {
   /*
    * Stop consumer
    */
+  if (engine)
+    engine->stop();
+  if (scheduler)
+    scheduler->stop();
+  /* process the queued records before their offsets are committed */
+  pipeline.stop(pipeline.opaque);
+  if (replay)
+    replay->stop();
+  if (other_used)
+    other_pipeline.stop(other_pipeline.opaque);
+  /* the input was read to its end: emit the open windows, otherwise they
+   * are rebuilt from the committed offsets on the next run */
+  if (aggregator && (replay || (exit_eof && partition_states.all_eof())))
+    aggregator->flush();
+  if (spill_log)
+    spill_log->sync();
+  /* paused partitions are resumed, they are not committed on close */
+  flow_control->stop();
+  if (offset_manager) {
+    offset_manager->commit_all_sync();
+    std::cerr << "% Committed offsets " << offset_manager->get_async_commit_cnt()
+              << " time(s) async, " << offset_manager->get_sync_commit_cnt()
+              << " time(s) sync" << std::endl;
+  }
   consumer->close();
+  /* the metrics read the scheduler and offset manager deleted below */
+  if (metrics_server) {
+    metrics_server_stop(metrics_server);
+    metrics_server = NULL;
+  }
+  pipeline.destroy(pipeline.opaque);
+  if (other_used)
+    other_pipeline.destroy(other_pipeline.opaque);
+  delete engine;
+  if (scheduler) {
+    std::vector<TopicScheduler::TopicStats> topic_stats =
+        scheduler->get_topic_stats();
+    for (size_t i = 0; i < topic_stats.size(); i++)
+      std::cerr << "% Topic " << topic_stats[i].topic << ": "
+                << topic_stats[i].msg_cnt << " message(s), weight "
+                << topic_stats[i].weight << ", over its latency target "
+                << topic_stats[i].hot_cnt << " time(s)" << std::endl;
+    delete scheduler;
+    scheduler = NULL;
+  }
+  if (flow_control->enabled())
+    fprintf(stderr,
+            "%% Flow control: %ld partition pause(s), %ld resume(s), "
+            "%" PRId64 " byte(s) buffered at most\n",
+            flow_control->get_pause_cnt(), flow_control->get_resume_cnt(),
+            flow_control->get_max_buffered_bytes());
+  delete flow_control;
+  flow_control = NULL;
+  delete offset_manager;
+  offset_manager = NULL;
   delete consumer;
 
-  std::cerr << "% Consumed " << msg_cnt << " messages (" << msg_bytes
+  /* no more callbacks: write the pending log records */
+  app_log.stop();
+  if (app_log.get_drop_cnt() > 0)
+    std::cerr << "% Dropped " << app_log.get_drop_cnt() << " log record(s)"
+              << std::endl;
+
+  /* replay what fits in the shutdown budget, the rest on the next run */
+  if (spill_log) {
+    spill_log->close(5000);
+    fprintf(stderr,
+            "%% Spill log: %" PRIu64 " byte(s) appended, %" PRIu64
+            " replayed, %" PRIu64 " left for the next run, %ld segment(s) "
+            "recycled, %ld backpressure wait(s), %ld error(s)\n",
+            spill_log->get_appended_bytes(), spill_log->get_replayed_bytes(),
+            spill_log->get_pending_bytes(), spill_log->get_recycled_cnt(),
+            spill_log->get_backpressure_cnt(), spill_log->get_error_cnt());
+    delete spill_log;
+    spill_log = NULL;
+  }
+
+  /* flush buffered output */
+  output_sink->close();
+  std::cerr << "% Wrote " << output_sink->get_bytes_written()
+            << " output bytes in " << output_sink->get_flush_cnt()
+            << " flush(es), " << output_sink->get_write_errors()
+            << " write error(s)" << std::endl;
+  delete output_sink;
+  output_sink = NULL;
+
+  std::cerr << "% Consumed " << msg_cnt.load() << " messages (" << msg_bytes.load()
             << " bytes)" << std::endl;
+  std::cerr << "% " << rebalance_cnt.load() << " rebalance(s) took "
+            << rebalance_us.load() / 1000.0 << "ms in total, "
+            << rebalance_max_us.load() / 1000.0 << "ms max" << std::endl;
+  if (dedup_cache) {
+    fprintf(stderr,
+            "%% Dedup: %" PRIu64 " duplicate(s) in %" PRIu64
+            " lookup(s) (%.2f%% hit rate), %zu entries in %zuMB, %" PRIu64
+            " rotation(s)\n",
+            dedup_cache->get_hit_cnt(), dedup_cache->get_lookup_cnt(),
+            dedup_cache->get_hit_rate() * 100, dedup_cache->size(),
+            dedup_cache->get_memory_bytes() >> 20,
+            dedup_cache->get_rotation_cnt());
+    delete dedup_cache;
+    dedup_cache = NULL;
+  }
+  if (aggregator) {
+    fprintf(stderr,
+            "%% Aggregation: %" PRIu64 " message(s) into %" PRIu64
+            " window(s) of %" PRIu64 " row(s), %" PRIu64 " late, %" PRIu64
+            " without a value, %zu window(s) left open, %.1fms emitting\n",
+            aggregator->get_msg_cnt(), aggregator->get_window_cnt(),
+            aggregator->get_row_cnt(), aggregator->get_late_cnt(),
+            aggregator->get_no_value_cnt(), aggregator->get_open_window_cnt(),
+            aggregator->get_emit_us() / 1000.0);
+    delete aggregator;
+    aggregator = NULL;
+  }
+  std::cerr << "% Latency since last statistics: "
+            << latency_stats.snapshot_reset() << std::endl;
+  print_throughput(consume_mode, consume_start, cpu_start_us);
+  if (replay) {
+    replay->print_summary();
+    delete replay;
+    replay = NULL;
+  }
 
   /*
    * Wait for RdKafka to decommission.
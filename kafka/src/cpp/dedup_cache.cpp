@@ -0,0 +1,178 @@
+#ifndef DEDUP_CACHE_CPP
+#define DEDUP_CACHE_CPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+
+/**
+ * @brief memory-bounded, time-windowed set of 64-bit message fingerprints
+ *
+ * The cache is split into shards (by fingerprint) with their own lock. Each
+ * shard has two generations of an open-addressing table with linear probing:
+ * fingerprints are looked up in both and inserted into the current one.
+ * When the window has elapsed, or the current table is 3/4 full, the
+ * generations rotate: the previous table is cleared and becomes the current
+ * one. A fingerprint is therefore remembered for at least one window (less
+ * when the cache is too small for the message rate) and at most two.
+ *
+ * Fingerprints are 64-bit hashes: the chance of a false duplicate is about
+ * n / 2^64 for n remembered messages.
+ */
+class DedupCache {
+ private:
+  static const size_t shard_cnt = 64; /* power of two */
+
+  struct Shard {
+    std::mutex lock;
+    std::vector<uint64_t> tables[2];
+    int current;
+    size_t used;      /* slots used in the current table */
+    size_t prev_used; /* slots used in the previous table */
+    int64_t rotated_ms;
+  };
+
+  Shard *shards;
+  size_t slot_mask; /* per table */
+  int64_t window_ms;
+
+  std::atomic<uint64_t> lookup_cnt;
+  std::atomic<uint64_t> hit_cnt;
+  std::atomic<uint64_t> rotation_cnt;
+
+  static bool find(const std::vector<uint64_t> &table,
+                   size_t mask,
+                   uint64_t fp) {
+    for (size_t i = fp & mask;; i = (i + 1) & mask) {
+      if (table[i] == fp)
+        return true;
+      if (table[i] == 0)
+        return false;
+    }
+  }
+
+  void rotate(Shard &s, int64_t now_ms) {
+    s.current ^= 1;
+    std::vector<uint64_t> &table = s.tables[s.current];
+    memset(&table[0], 0, table.size() * sizeof(uint64_t));
+    s.prev_used  = s.used;
+    s.used       = 0;
+    s.rotated_ms = now_ms;
+    rotation_cnt.fetch_add(1, std::memory_order_relaxed);
+  }
+
+ public:
+  /**
+   * @param memory_bytes total size of the tables
+   * @param window       minimum time a fingerprint is remembered (ms)
+   */
+  DedupCache(size_t memory_bytes, int64_t window, int64_t now_ms)
+      : window_ms(window), lookup_cnt(0), hit_cnt(0), rotation_cnt(0) {
+    size_t slots = 64;
+    while (slots * 2 * 2 * shard_cnt * sizeof(uint64_t) <= memory_bytes)
+      slots *= 2;
+    slot_mask = slots - 1;
+
+    shards = new Shard[shard_cnt];
+    for (size_t i = 0; i < shard_cnt; i++) {
+      shards[i].tables[0].assign(slots, 0);
+      shards[i].tables[1].assign(slots, 0);
+      shards[i].current    = 0;
+      shards[i].used       = 0;
+      shards[i].prev_used  = 0;
+      shards[i].rotated_ms = now_ms;
+    }
+  }
+
+  ~DedupCache() {
+    delete[] shards;
+  }
+
+  /**
+   * @brief FNV-1a hash of len bytes, chained from seed (a previous hash).
+   *        The fingerprint is finalize()d from the last one.
+   */
+  static uint64_t hash(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h             = seed ^ 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+      h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+  }
+
+  /**
+   * @brief splitmix64 mixer, spreads the hash over all 64 bits
+   */
+  static uint64_t finalize(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h ? h : 1; /* 0 marks an empty slot */
+  }
+
+  /**
+   * @brief remember fingerprint fp (from finalize())
+   * @returns true if it was seen before, i.e. the message is a duplicate
+   */
+  bool check_and_insert(uint64_t fp, int64_t now_ms) {
+    Shard &s = shards[(fp >> 58) & (shard_cnt - 1)];
+    lookup_cnt.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (now_ms - s.rotated_ms >= window_ms || s.used >= slot_mask / 4 * 3)
+      rotate(s, now_ms);
+
+    std::vector<uint64_t> &cur = s.tables[s.current];
+    if (find(cur, slot_mask, fp) ||
+        find(s.tables[s.current ^ 1], slot_mask, fp)) {
+      hit_cnt.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    size_t i = fp & slot_mask;
+    while (cur[i] != 0)
+      i = (i + 1) & slot_mask;
+    cur[i] = fp;
+    s.used++;
+    return false;
+  }
+
+  uint64_t get_lookup_cnt() {
+    return lookup_cnt.load();
+  }
+
+  uint64_t get_hit_cnt() {
+    return hit_cnt.load();
+  }
+
+  uint64_t get_rotation_cnt() {
+    return rotation_cnt.load();
+  }
+
+  double get_hit_rate() {
+    uint64_t lookups = lookup_cnt.load();
+    return lookups ? (double)hit_cnt.load() / lookups : 0.0;
+  }
+
+  size_t get_memory_bytes() {
+    return shard_cnt * 2 * (slot_mask + 1) * sizeof(uint64_t);
+  }
+
+  /**
+   * @returns the number of remembered fingerprints
+   */
+  size_t size() {
+    size_t n = 0;
+    for (size_t i = 0; i < shard_cnt; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      n += shards[i].used + shards[i].prev_used;
+    }
+    return n;
+  }
+};
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef FLOW_CONTROL_CPP
+#define FLOW_CONTROL_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./async_log.cpp"
+#include "./partition_engine.cpp"
+#include "./partition_state.cpp"
+
+
+/**
+ * @brief Backpressure from the consumer's own processing to fetching
+ *
+ * The consumer buffers messages between the fetcher and the handler: in
+ * librdkafka's consumer queue (pre-fetched, not polled yet) and in flight
+ * (polled, not accounted yet: queued pipeline, batches, partition workers).
+ * Every interval_ms the buffered bytes and messages are summed up; above a
+ * high-water mark the hottest partitions (most bytes in flight plus
+ * consumed since the last check) are paused, more of them only while the
+ * buffered bytes keep growing, and all of them are resumed once both are
+ * below the low-water marks.
+ *
+ * Pausing a partition stops its fetches and drops what librdkafka had
+ * pre-fetched for it; on resume it is fetched again from the next message
+ * to be consumed, so nothing is skipped or redelivered.
+ *
+ * In-flight bytes are counted in the partition states (inflight_bytes) by
+ * the decode and account stages. Queued bytes are estimated from the
+ * length of the consumer queue and, with partition workers, of the worker
+ * queues the partition queues are forwarded to, and the average message size.
+ */
+class FlowControl {
+ public:
+  struct Limits {
+    int64_t high_bytes; /* 0: no byte limit */
+    int64_t low_bytes;
+    long high_msgs; /* 0: no message limit */
+    long low_msgs;
+  };
+
+ private:
+  typedef std::pair<std::string, int32_t> partition_key_t;
+
+  struct Load {
+    partition_key_t key;
+    int64_t score;
+  };
+
+  RdKafka::KafkaConsumer *consumer;
+  PartitionStateTable *states;
+  rd_kafka_queue_t *consumer_queue;
+  PartitionEngine *engine; /* NULL: no partition workers */
+  Limits limits;
+  int interval_ms;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool running;
+  std::thread thread;
+  std::map<partition_key_t, bool> paused;       /* under lock */
+  std::map<partition_key_t, int64_t> seen_bytes; /* flow thread only */
+  int64_t last_bytes;                            /* flow thread only */
+
+  std::atomic<int64_t> buffered_bytes;
+  std::atomic<long> buffered_msgs;
+  std::atomic<int64_t> max_buffered_bytes;
+  std::atomic<long> pause_cnt;
+  std::atomic<long> resume_cnt;
+  std::atomic<long> paused_cnt;
+
+  /* lock must be held */
+  void set_paused(const std::vector<partition_key_t> &keys, bool pause) {
+    std::vector<RdKafka::TopicPartition *> parts;
+    for (size_t i = 0; i < keys.size(); i++)
+      parts.push_back(
+          RdKafka::TopicPartition::create(keys[i].first, keys[i].second));
+    RdKafka::ErrorCode err =
+        pause ? consumer->pause(parts) : consumer->resume(parts);
+    if (err)
+      ALOG_ERROR("Failed to %s %zu partition(s): %s", pause ? "pause" : "resume",
+                 parts.size(), RdKafka::err2str(err).c_str());
+    RdKafka::TopicPartition::destroy(parts);
+  }
+
+  void check() {
+    int64_t inflight_bytes = 0, consumed_bytes = 0;
+    long inflight_msgs = 0, consumed_msgs = 0;
+    std::vector<Load> loads;
+    std::map<partition_key_t, int64_t> seen;
+    states->for_each([&](const PartitionState &ps) {
+      partition_key_t key(ps.topic, ps.partition);
+      int64_t bytes = ps.msg_bytes.load();
+      std::map<partition_key_t, int64_t>::iterator it = seen_bytes.find(key);
+      Load load;
+      load.key   = key;
+      load.score = ps.inflight_bytes.load() +
+                   (it != seen_bytes.end() ? bytes - it->second : bytes);
+      loads.push_back(load);
+      seen[key] = bytes;
+      inflight_bytes += ps.inflight_bytes.load();
+      inflight_msgs += ps.inflight.load();
+      consumed_bytes += bytes;
+      consumed_msgs += ps.msg_cnt.load();
+    });
+    seen_bytes.swap(seen);
+
+    long queued = (long)rd_kafka_queue_length(consumer_queue);
+    if (engine)
+      queued += (long)engine->get_queued_msgs();
+    int64_t avg    = consumed_msgs > 0 ? consumed_bytes / consumed_msgs : 0;
+    int64_t bytes  = inflight_bytes + queued * avg;
+    long msgs      = inflight_msgs + queued;
+    buffered_bytes = bytes;
+    buffered_msgs  = msgs;
+    if (bytes > max_buffered_bytes)
+      max_buffered_bytes = bytes;
+
+    bool over = (limits.high_bytes > 0 && bytes > limits.high_bytes) ||
+                (limits.high_msgs > 0 && msgs > limits.high_msgs);
+    bool under = (limits.high_bytes == 0 || bytes <= limits.low_bytes) &&
+                 (limits.high_msgs == 0 || msgs <= limits.low_msgs);
+    bool growing = bytes >= last_bytes;
+    last_bytes   = bytes;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (over && (paused.empty() || growing)) {
+      /* hottest first, until their share covers the excess */
+      std::sort(loads.begin(), loads.end(),
+                [](const Load &a, const Load &b) { return a.score > b.score; });
+      int64_t excess = limits.high_bytes > 0 ? bytes - limits.low_bytes : 0;
+      int64_t covered = 0;
+      std::vector<partition_key_t> keys;
+      for (size_t i = 0; i < loads.size(); i++) {
+        if (paused.count(loads[i].key))
+          continue;
+        keys.push_back(loads[i].key);
+        paused[loads[i].key] = true;
+        covered += loads[i].score;
+        if (covered >= excess)
+          break;
+      }
+      if (!keys.empty()) {
+        set_paused(keys, true);
+        pause_cnt += keys.size();
+        ALOG_INFO("Flow control: %" PRId64 " byte(s), %ld message(s) buffered, "
+                  "paused %zu partition(s), hottest %s[%d]",
+                  bytes, msgs, keys.size(), keys[0].first.c_str(),
+                  (int)keys[0].second);
+      }
+    } else if (under && !paused.empty()) {
+      std::vector<partition_key_t> keys;
+      for (std::map<partition_key_t, bool>::iterator it = paused.begin();
+           it != paused.end(); ++it)
+        keys.push_back(it->first);
+      set_paused(keys, false);
+      resume_cnt += keys.size();
+      paused.clear();
+      ALOG_INFO("Flow control: %" PRId64 " byte(s), %ld message(s) buffered, "
+                "resumed %zu partition(s)",
+                bytes, msgs, keys.size());
+    }
+    paused_cnt = (long)paused.size();
+  }
+
+  void flow_loop() {
+    std::unique_lock<std::mutex> ul(lock);
+    while (running) {
+      cv.wait_for(ul, std::chrono::milliseconds(interval_ms));
+      if (!running)
+        break;
+      ul.unlock();
+      check();
+      ul.lock();
+    }
+  }
+
+ public:
+  FlowControl(RdKafka::KafkaConsumer *consumer,
+              PartitionStateTable *states,
+              const Limits &limits,
+              int interval_ms)
+      : consumer(consumer),
+        states(states),
+        consumer_queue(NULL),
+        engine(NULL),
+        limits(limits),
+        interval_ms(interval_ms),
+        running(false),
+        last_bytes(0),
+        buffered_bytes(0),
+        buffered_msgs(0),
+        max_buffered_bytes(0),
+        pause_cnt(0),
+        resume_cnt(0),
+        paused_cnt(0) {
+  }
+
+  ~FlowControl() {
+    stop();
+  }
+
+  /**
+   * @brief count the messages pre-fetched into the partition workers' queues
+   *        as buffered too. Call before start().
+   */
+  void set_engine(PartitionEngine *partition_engine) {
+    engine = partition_engine;
+  }
+
+  /**
+   * @brief start checking the buffered messages. Without limits they are
+   *        only measured, for the metrics.
+   */
+  void start() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (running)
+      return;
+    consumer_queue = rd_kafka_queue_get_consumer(consumer->c_ptr());
+    running        = true;
+    thread         = std::thread(&FlowControl::flow_loop, this);
+  }
+
+  /**
+   * @brief join the flow thread and resume the paused partitions, before
+   *        consumer->close()
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!running)
+        return;
+      running = false;
+      cv.notify_all();
+    }
+    thread.join();
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<partition_key_t> keys;
+    for (std::map<partition_key_t, bool>::iterator it = paused.begin();
+         it != paused.end(); ++it)
+      keys.push_back(it->first);
+    if (!keys.empty())
+      set_paused(keys, false);
+    paused.clear();
+    paused_cnt = 0;
+    rd_kafka_queue_destroy(consumer_queue);
+    consumer_queue = NULL;
+  }
+
+  /**
+   * @brief resume the revoked partitions paused by flow control, a pause
+   *        outlives the assignment. Must be called from the rebalance
+   *        callback, before (incremental_)unassign().
+   */
+  void remove_partitions(const std::vector<RdKafka::TopicPartition *> &revoked) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<partition_key_t> keys;
+    for (size_t i = 0; i < revoked.size(); i++) {
+      partition_key_t key(revoked[i]->topic(), revoked[i]->partition());
+      if (paused.erase(key))
+        keys.push_back(key);
+    }
+    if (!keys.empty())
+      set_paused(keys, false);
+    paused_cnt = (long)paused.size();
+  }
+
+  bool enabled() const {
+    return limits.high_bytes > 0 || limits.high_msgs > 0;
+  }
+
+  int64_t get_buffered_bytes() const {
+    return buffered_bytes.load();
+  }
+
+  long get_buffered_msgs() const {
+    return buffered_msgs.load();
+  }
+
+  int64_t get_max_buffered_bytes() const {
+    return max_buffered_bytes.load();
+  }
+
+  long get_pause_cnt() const {
+    return pause_cnt.load();
+  }
+
+  long get_resume_cnt() const {
+    return resume_cnt.load();
+  }
+
+  long get_paused_cnt() const {
+    return paused_cnt.load();
+  }
+};
+
+#endif
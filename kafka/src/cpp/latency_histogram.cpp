@@ -0,0 +1,321 @@
+#ifndef LATENCY_HISTOGRAM_CPP
+#define LATENCY_HISTOGRAM_CPP
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+
+/**
+ * @brief HDR-style log-linear histogram of microsecond values
+ *
+ * Values below 32 have their own bucket, above that every power of two is
+ * split into 16 linear buckets (max. 6.25% relative error) up to 2^40us.
+ * record() is one relaxed atomic add per counter: no lock, no allocation,
+ * safe from any number of threads.
+ */
+class LatencyHistogram {
+ public:
+  static const int sub_bits    = 5;
+  static const int sub_cnt     = 1 << sub_bits; /* 32 */
+  static const int half_cnt    = sub_cnt / 2;   /* 16 */
+  static const int max_bits    = 40;
+  static const int bucket_cnt  = sub_cnt + (max_bits - sub_bits + 1) * half_cnt;
+
+  /**
+   * @brief point-in-time copy of a histogram
+   */
+  struct Snapshot {
+    uint64_t counts[bucket_cnt];
+    uint64_t cnt;
+    uint64_t sum;
+    uint64_t max;
+
+    /**
+     * @returns the value below which fraction q (0..1) of the values are,
+     *          as the upper bound of its bucket (capped by max)
+     */
+    uint64_t percentile(double q) const {
+      if (cnt == 0)
+        return 0;
+      uint64_t rank = (uint64_t)(q * (double)cnt + 0.5);
+      if (rank < 1)
+        rank = 1;
+      uint64_t seen = 0;
+      for (int i = 0; i < bucket_cnt; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+          uint64_t upper = bucket_upper(i);
+          return upper < max ? upper : max;
+        }
+      }
+      return max;
+    }
+  };
+
+ private:
+  std::atomic<uint64_t> counts[bucket_cnt];
+  std::atomic<uint64_t> cnt;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+
+  static int bucket_index(uint64_t v) {
+    if (v < (uint64_t)sub_cnt)
+      return (int)v;
+    if (v >= (uint64_t)1 << (max_bits + 1))
+      return bucket_cnt - 1;
+    int msb   = 63 - __builtin_clzll(v);
+    int shift = msb - (sub_bits - 1);
+    return sub_cnt + (shift - 1) * half_cnt + (int)((v >> shift) - half_cnt);
+  }
+
+  static uint64_t bucket_upper(int idx) {
+    if (idx < sub_cnt)
+      return (uint64_t)idx;
+    int shift    = (idx - sub_cnt) / half_cnt + 1;
+    uint64_t top = (uint64_t)((idx - sub_cnt) % half_cnt + half_cnt);
+    return ((top + 1) << shift) - 1;
+  }
+
+ public:
+  LatencyHistogram() : cnt(0), sum(0), max(0) {
+    for (int i = 0; i < bucket_cnt; i++)
+      counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t v) {
+    counts[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+    cnt.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+    uint64_t cur = max.load(std::memory_order_relaxed);
+    while (v > cur &&
+           !max.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+      ;
+  }
+
+  /**
+   * @brief copy the counters into snap and reset them.
+   *        Values recorded concurrently end up in this or the next snapshot.
+   */
+  void snapshot_reset(Snapshot &snap) {
+    snap.cnt = 0;
+    for (int i = 0; i < bucket_cnt; i++) {
+      snap.counts[i] = counts[i].exchange(0, std::memory_order_relaxed);
+      snap.cnt += snap.counts[i];
+    }
+    cnt.exchange(0, std::memory_order_relaxed);
+    snap.sum = sum.exchange(0, std::memory_order_relaxed);
+    snap.max = max.exchange(0, std::memory_order_relaxed);
+  }
+};
+
+
+/**
+ * @brief per-partition end-to-end and handler latency histograms
+ *
+ * e2e: now - message (create or log append) timestamp, i.e. producer,
+ * broker and fetch delay. handler: time from the message being returned
+ * by poll/consume until the handler has finished with it, including the
+ * wait behind earlier messages of the same batch.
+ *
+ * Partitions live in a fixed open-addressing table: lookups on the hot path
+ * are lock-free, a partition's entry is only allocated (under a lock) the
+ * first time it is seen and then kept for the lifetime of the consumer.
+ */
+class LatencyStats {
+ public:
+  struct PartitionLatency {
+    std::string topic;
+    int32_t partition;
+    uint32_t hash;
+    LatencyHistogram e2e;
+    LatencyHistogram handler;
+  };
+
+  /**
+   * @brief percentiles of one partition since the previous snapshot
+   */
+  struct Summary {
+    std::string topic;
+    int32_t partition;
+    uint64_t cnt[2];
+    uint64_t sum[2];
+    uint64_t p50[2];
+    uint64_t p99[2];
+    uint64_t p999[2];
+    uint64_t max[2];
+  };
+
+ private:
+  static const size_t slot_cnt = 4096;
+
+  std::atomic<PartitionLatency *> slots[slot_cnt];
+  std::mutex insert_lock;
+  PartitionLatency *overflow; /* used once the table is full */
+
+  std::mutex summary_lock;
+  std::vector<Summary> last_summaries;
+
+  static uint32_t hash_key(const char *topic, int32_t partition) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (const char *p = topic; *p; p++)
+      h = (h ^ (uint8_t)*p) * 16777619u;
+    return (h ^ (uint32_t)partition) * 16777619u;
+  }
+
+  PartitionLatency *get(const char *topic, int32_t partition) {
+    uint32_t h = hash_key(topic, partition);
+    for (size_t i = 0; i < slot_cnt; i++) {
+      size_t idx            = (h + i) & (slot_cnt - 1);
+      PartitionLatency *pl  = slots[idx].load(std::memory_order_acquire);
+      if (!pl)
+        return insert(topic, partition, h);
+      if (pl->hash == h && pl->partition == partition && pl->topic == topic)
+        return pl;
+    }
+    return overflow;
+  }
+
+  PartitionLatency *insert(const char *topic, int32_t partition, uint32_t h) {
+    std::lock_guard<std::mutex> guard(insert_lock);
+    for (size_t i = 0; i < slot_cnt; i++) {
+      size_t idx           = (h + i) & (slot_cnt - 1);
+      PartitionLatency *pl = slots[idx].load(std::memory_order_relaxed);
+      if (pl) {
+        if (pl->hash == h && pl->partition == partition && pl->topic == topic)
+          return pl; /* inserted concurrently */
+        continue;
+      }
+      pl            = new PartitionLatency();
+      pl->topic     = topic;
+      pl->partition = partition;
+      pl->hash      = h;
+      slots[idx].store(pl, std::memory_order_release);
+      return pl;
+    }
+    return overflow;
+  }
+
+  static void summarize(LatencyHistogram &h, Summary &s, int i) {
+    LatencyHistogram::Snapshot snap;
+    h.snapshot_reset(snap);
+    s.cnt[i]  = snap.cnt;
+    s.sum[i]  = snap.sum;
+    s.p50[i]  = snap.percentile(0.5);
+    s.p99[i]  = snap.percentile(0.99);
+    s.p999[i] = snap.percentile(0.999);
+    s.max[i]  = snap.max;
+  }
+
+ public:
+  LatencyStats() {
+    for (size_t i = 0; i < slot_cnt; i++)
+      slots[i].store(NULL, std::memory_order_relaxed);
+    overflow            = new PartitionLatency();
+    overflow->topic     = "";
+    overflow->partition = -1;
+    overflow->hash      = 0;
+  }
+
+  ~LatencyStats() {
+    for (size_t i = 0; i < slot_cnt; i++)
+      delete slots[i].load();
+    delete overflow;
+  }
+
+  /**
+   * @brief record a processed message
+   * @param poll_us steady clock time (us) the message was returned by poll
+   * @param done_us steady clock time (us) the handler finished
+   * @param now_ms  wall clock time (ms) for the end-to-end latency
+   */
+  void record(RdKafka::Message *message,
+              int64_t poll_us,
+              int64_t done_us,
+              int64_t now_ms) {
+    const rd_kafka_message_t *rkm = message->c_ptr();
+    record(rkm->rkt ? rd_kafka_topic_name(rkm->rkt) : "", rkm->partition,
+           message->timestamp(), poll_us, done_us, now_ms);
+  }
+
+  void record(const char *topic,
+              int32_t partition,
+              const RdKafka::MessageTimestamp &ts,
+              int64_t poll_us,
+              int64_t done_us,
+              int64_t now_ms) {
+    PartitionLatency *pl = get(topic, partition);
+    if (ts.type != RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE)
+      pl->e2e.record(now_ms > ts.timestamp
+                         ? (uint64_t)(now_ms - ts.timestamp) * 1000
+                         : 0);
+    pl->handler.record(done_us > poll_us ? (uint64_t)(done_us - poll_us) : 0);
+  }
+
+  /**
+   * @brief snapshot and reset all partitions, called on every statistics
+   *        event. The summaries are also kept for the metrics endpoint.
+   * @returns the partitions with values since the previous snapshot, as JSON
+   */
+  std::string snapshot_reset() {
+    std::vector<Summary> summaries;
+    for (size_t i = 0; i <= slot_cnt; i++) {
+      PartitionLatency *pl =
+          i < slot_cnt ? slots[i].load(std::memory_order_acquire) : overflow;
+      if (!pl)
+        continue;
+      Summary s;
+      s.topic     = pl->topic;
+      s.partition = pl->partition;
+      summarize(pl->e2e, s, 0);
+      summarize(pl->handler, s, 1);
+      if (s.cnt[0] || s.cnt[1] || pl != overflow)
+        summaries.push_back(s);
+    }
+
+    std::string json = "{";
+    char buf[512];
+    const char *names[2] = {"e2e_us", "handler_us"};
+    for (size_t i = 0; i < summaries.size(); i++) {
+      const Summary &s = summaries[i];
+      if (!s.cnt[0] && !s.cnt[1])
+        continue;
+      if (json.size() > 1)
+        json += ", ";
+      json += "\"" + s.topic + "[" + std::to_string(s.partition) + "]\": {";
+      for (int k = 0; k < 2; k++) {
+        snprintf(buf, sizeof(buf),
+                 "%s\"%s\": {\"cnt\": %" PRIu64 ", \"p50\": %" PRIu64
+                 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+                 ", \"max\": %" PRIu64 "}",
+                 k ? ", " : "", names[k], s.cnt[k], s.p50[k], s.p99[k],
+                 s.p999[k], s.max[k]);
+        json += buf;
+      }
+      json += "}";
+    }
+    json += "}";
+
+    std::lock_guard<std::mutex> guard(summary_lock);
+    last_summaries.swap(summaries);
+    return json;
+  }
+
+  /**
+   * @brief the summaries of the last snapshot
+   */
+  std::vector<Summary> get_last_summaries() {
+    std::lock_guard<std::mutex> guard(summary_lock);
+    return last_summaries;
+  }
+};
+
+#endif
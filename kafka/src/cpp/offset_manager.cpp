@@ -0,0 +1,211 @@
+#ifndef OFFSET_MANAGER_CPP
+#define OFFSET_MANAGER_CPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./async_log.cpp"
+
+
+/**
+ * @brief Coalescing offset commit manager
+ *
+ * Tracks the next offset to commit (last processed offset + 1) for each
+ * assigned partition and commits the coalesced offsets asynchronously once
+ * commit_interval_ms has elapsed or commit_msg_cnt messages have been
+ * processed since the last commit, whichever comes first.
+ *
+ * Revoked partitions (and all partitions on close) are committed
+ * synchronously, which gives at-least-once delivery with a bounded commit
+ * rate. Requires enable.auto.commit=false.
+ */
+class OffsetManager {
+ private:
+  struct PartitionOffset {
+    int64_t offset;
+    bool dirty;
+  };
+
+  typedef std::pair<std::string, int32_t> partition_key_t;
+
+  RdKafka::KafkaConsumer *consumer;
+  int commit_interval_ms;
+  long commit_msg_cnt;
+
+  std::mutex lock;
+  std::map<partition_key_t, PartitionOffset> offsets;
+  partition_key_t lookup_key; /* reused, a key per lookup would allocate */
+  long uncommitted_cnt;
+  std::chrono::steady_clock::time_point last_commit;
+
+  std::atomic<long> async_commit_cnt;
+  std::atomic<long> sync_commit_cnt;
+
+  /* lock must be held */
+  void collect_dirty(std::vector<RdKafka::TopicPartition *> &out) {
+    for (std::map<partition_key_t, PartitionOffset>::iterator it =
+             offsets.begin();
+         it != offsets.end(); ++it) {
+      if (!it->second.dirty)
+        continue;
+      out.push_back(RdKafka::TopicPartition::create(
+          it->first.first, it->first.second, it->second.offset));
+      it->second.dirty = false;
+    }
+    uncommitted_cnt = 0;
+    last_commit     = std::chrono::steady_clock::now();
+  }
+
+  void commit_async(std::vector<RdKafka::TopicPartition *> &to_commit) {
+    if (to_commit.empty())
+      return;
+    RdKafka::ErrorCode err = consumer->commitAsync(to_commit);
+    if (err)
+      ALOG_ERROR("async offset commit failed: %s",
+                 RdKafka::err2str(err).c_str());
+    else
+      async_commit_cnt++;
+    RdKafka::TopicPartition::destroy(to_commit);
+  }
+
+  void commit_sync(std::vector<RdKafka::TopicPartition *> &to_commit) {
+    if (to_commit.empty())
+      return;
+    RdKafka::ErrorCode err = consumer->commitSync(to_commit);
+    if (err)
+      ALOG_ERROR("sync offset commit failed: %s",
+                 RdKafka::err2str(err).c_str());
+    else
+      sync_commit_cnt++;
+    RdKafka::TopicPartition::destroy(to_commit);
+  }
+
+ public:
+  OffsetManager(RdKafka::KafkaConsumer *consumer,
+                int commit_interval_ms,
+                long commit_msg_cnt)
+      : consumer(consumer),
+        commit_interval_ms(commit_interval_ms),
+        commit_msg_cnt(commit_msg_cnt),
+        uncommitted_cnt(0),
+        last_commit(std::chrono::steady_clock::now()),
+        async_commit_cnt(0),
+        sync_commit_cnt(0) {
+  }
+
+  /**
+   * @brief start tracking newly assigned partitions
+   */
+  void assign(const std::vector<RdKafka::TopicPartition *> &partitions) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < partitions.size(); i++) {
+      partition_key_t key(partitions[i]->topic(), partitions[i]->partition());
+      if (offsets.find(key) != offsets.end())
+        continue;
+      PartitionOffset po;
+      po.offset    = RdKafka::OFFSET_INVALID;
+      po.dirty     = false;
+      offsets[key] = po;
+    }
+  }
+
+  /**
+   * @brief mark message as fully processed.
+   *
+   * Messages of partitions that are not (or no longer) assigned are ignored,
+   * they will be redelivered to the new owner.
+   */
+  void processed(const RdKafka::Message *message) {
+    processed(message->topic_name(), message->partition(), message->offset());
+  }
+
+  void processed(const std::string &topic, int32_t partition, int64_t offset) {
+    std::vector<RdKafka::TopicPartition *> to_commit;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      lookup_key.first.assign(topic);
+      lookup_key.second = partition;
+      std::map<partition_key_t, PartitionOffset>::iterator it =
+          offsets.find(lookup_key);
+      if (it == offsets.end() || offset < it->second.offset)
+        return;
+      it->second.offset = offset + 1;
+      it->second.dirty  = true;
+
+      if (commit_msg_cnt > 0 && ++uncommitted_cnt >= commit_msg_cnt)
+        collect_dirty(to_commit);
+    }
+    commit_async(to_commit);
+  }
+
+  /**
+   * @brief commit asynchronously if the commit interval has elapsed.
+   *        Called periodically from the poll loop.
+   */
+  void maybe_commit() {
+    std::vector<RdKafka::TopicPartition *> to_commit;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (std::chrono::steady_clock::now() - last_commit <
+          std::chrono::milliseconds(commit_interval_ms))
+        return;
+      collect_dirty(to_commit);
+    }
+    commit_async(to_commit);
+  }
+
+  /**
+   * @brief synchronously commit and stop tracking revoked partitions.
+   *        Called from the rebalance callback before (incremental_)unassign().
+   *
+   * @param lost true if the assignment was lost, the offsets are then
+   *        dropped without committing since the commit would fail anyway.
+   */
+  void revoke(const std::vector<RdKafka::TopicPartition *> &partitions,
+              bool lost) {
+    std::vector<RdKafka::TopicPartition *> to_commit;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (size_t i = 0; i < partitions.size(); i++) {
+        std::map<partition_key_t, PartitionOffset>::iterator it = offsets.find(
+            partition_key_t(partitions[i]->topic(), partitions[i]->partition()));
+        if (it == offsets.end())
+          continue;
+        if (it->second.dirty && !lost)
+          to_commit.push_back(RdKafka::TopicPartition::create(
+              it->first.first, it->first.second, it->second.offset));
+        offsets.erase(it);
+      }
+    }
+    commit_sync(to_commit);
+  }
+
+  /**
+   * @brief final synchronous commit of all tracked partitions, before close()
+   */
+  void commit_all_sync() {
+    std::vector<RdKafka::TopicPartition *> to_commit;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      collect_dirty(to_commit);
+    }
+    commit_sync(to_commit);
+  }
+
+  long get_async_commit_cnt() {
+    return async_commit_cnt;
+  }
+
+  long get_sync_commit_cnt() {
+    return sync_commit_cnt;
+  }
+};
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef OUTPUT_SINK_CPP
+#define OUTPUT_SINK_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+/**
+ * @brief destination of the output sink, only used from the writer thread
+ */
+class OutputBackend {
+ public:
+  virtual ~OutputBackend() {
+  }
+
+  /**
+   * @brief write all iovecs
+   * @returns false on error
+   */
+  virtual bool write(const struct iovec *iov, int iovcnt) = 0;
+};
+
+
+/**
+ * @brief writev() to a file descriptor, retrying short writes
+ */
+class FdBackend : public OutputBackend {
+ protected:
+  int fd;
+  bool owns_fd;
+
+ public:
+  FdBackend(int fd, bool owns_fd) : fd(fd), owns_fd(owns_fd) {
+  }
+
+  ~FdBackend() {
+    if (owns_fd && fd != -1)
+      ::close(fd);
+  }
+
+  bool write(const struct iovec *iov, int iovcnt) {
+    std::vector<struct iovec> pending(iov, iov + iovcnt);
+    size_t idx = 0;
+
+    while (idx < pending.size()) {
+      int cnt   = (int)std::min(pending.size() - idx, (size_t)IOV_MAX);
+      ssize_t r = ::writev(fd, &pending[idx], cnt);
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      /* skip fully written iovecs, adjust the partially written one */
+      while (r > 0 && idx < pending.size()) {
+        if ((size_t)r >= pending[idx].iov_len) {
+          r -= pending[idx].iov_len;
+          idx++;
+        } else {
+          pending[idx].iov_base = (char *)pending[idx].iov_base + r;
+          pending[idx].iov_len -= r;
+          r = 0;
+        }
+      }
+    }
+    return true;
+  }
+
+  static FdBackend *create_stdout() {
+    return new FdBackend(STDOUT_FILENO, false);
+  }
+
+  static FdBackend *create_file(const std::string &path, std::string &errstr) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+      errstr = "failed to open " + path + ": " + strerror(errno);
+      return NULL;
+    }
+    return new FdBackend(fd, true);
+  }
+};
+
+
+/**
+ * @brief pre-allocated memory-mapped ring file
+ *
+ * The file starts with a header page holding the current write position
+ * and the number of times the ring has wrapped, followed by the ring data.
+ * Once the ring is full the oldest data is overwritten.
+ */
+class MmapRingBackend : public OutputBackend {
+ private:
+  struct Header {
+    uint64_t write_pos;
+    uint64_t wrap_cnt;
+    uint64_t data_size;
+  };
+
+  static const size_t header_size = 4096;
+
+  int fd;
+  char *map;
+  size_t map_size;
+  Header *header;
+  char *data;
+  size_t data_size;
+
+  MmapRingBackend() : fd(-1), map(NULL), map_size(0), header(NULL), data(NULL), data_size(0) {
+  }
+
+ public:
+  ~MmapRingBackend() {
+    if (map) {
+      msync(map, map_size, MS_ASYNC);
+      munmap(map, map_size);
+    }
+    if (fd != -1)
+      ::close(fd);
+  }
+
+  bool write(const struct iovec *iov, int iovcnt) {
+    size_t pos = header->write_pos;
+    for (int i = 0; i < iovcnt; i++) {
+      const char *src = (const char *)iov[i].iov_base;
+      size_t len      = iov[i].iov_len;
+      while (len > 0) {
+        size_t n = std::min(len, data_size - pos);
+        memcpy(data + pos, src, n);
+        src += n;
+        len -= n;
+        pos += n;
+        if (pos == data_size) {
+          pos = 0;
+          header->wrap_cnt++;
+        }
+      }
+    }
+    header->write_pos = pos;
+    return true;
+  }
+
+  static MmapRingBackend *create(const std::string &path,
+                                 size_t size,
+                                 std::string &errstr) {
+    MmapRingBackend *ring = new MmapRingBackend();
+    ring->fd              = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (ring->fd == -1) {
+      errstr = "failed to open " + path + ": " + strerror(errno);
+      delete ring;
+      return NULL;
+    }
+
+    ring->map_size = header_size + size;
+    int err        = posix_fallocate(ring->fd, 0, (off_t)ring->map_size);
+    if (err) {
+      errstr = "failed to allocate " + path + ": " + strerror(err);
+      delete ring;
+      return NULL;
+    }
+
+    void *map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring->fd, 0);
+    if (map == MAP_FAILED) {
+      errstr = "failed to mmap " + path + ": " + strerror(errno);
+      delete ring;
+      return NULL;
+    }
+    ring->map       = (char *)map;
+    ring->header    = (Header *)map;
+    ring->data      = ring->map + header_size;
+    ring->data_size = size;
+
+    /* continue where a previous run stopped if the ring has the same size */
+    if (ring->header->data_size != size || ring->header->write_pos >= size) {
+      ring->header->write_pos = 0;
+      ring->header->wrap_cnt  = 0;
+      ring->header->data_size = size;
+    }
+    return ring;
+  }
+};
+
+
+/**
+ * @brief Buffered output sink with a dedicated writer thread
+ *
+ * Callers append records into fixed size chunks; full chunks are handed to
+ * the writer thread, which writes all pending chunks with one vectored write.
+ * Partially filled chunks are flushed every flush_interval_ms. Callers never
+ * perform I/O, they only wait if all buffer memory is in flight.
+ */
+class OutputSink {
+ private:
+  struct Chunk {
+    char *buf;
+    size_t len;
+  };
+
+  static const size_t chunk_size = 64 * 1024;
+
+  OutputBackend *backend;
+  size_t max_chunks;
+  int flush_interval_ms;
+
+  std::mutex append_lock; /* serializes records, held while waiting for a chunk */
+  std::mutex lock;        /* protects the chunk lists, shared with the writer */
+  std::condition_variable writer_cv;
+  std::condition_variable free_cv;
+  Chunk *current;
+  std::deque<Chunk *> full;
+  std::vector<Chunk *> free_chunks;
+  size_t allocated_chunks;
+  bool running;
+  std::thread writer;
+
+  std::atomic<int64_t> bytes_appended;
+  std::atomic<int64_t> bytes_flushed; /* written or failed */
+  std::atomic<int64_t> bytes_written;
+  std::atomic<long> flush_cnt;
+  std::atomic<long> write_errors;
+
+  /* lock must be held, may wait for the writer to return a chunk */
+  Chunk *get_chunk(std::unique_lock<std::mutex> &ul) {
+    while (free_chunks.empty() && allocated_chunks >= max_chunks)
+      free_cv.wait(ul);
+    if (!free_chunks.empty()) {
+      Chunk *c = free_chunks.back();
+      free_chunks.pop_back();
+      return c;
+    }
+    allocated_chunks++;
+    Chunk *c = new Chunk();
+    c->buf   = new char[chunk_size];
+    c->len   = 0;
+    return c;
+  }
+
+  /* lock must be held */
+  void append_locked(std::unique_lock<std::mutex> &ul,
+                     const char *data,
+                     size_t len) {
+    bytes_appended += len;
+    while (len > 0) {
+      if (!current)
+        current = get_chunk(ul);
+      size_t n = std::min(len, chunk_size - current->len);
+      memcpy(current->buf + current->len, data, n);
+      current->len += n;
+      data += n;
+      len -= n;
+      if (current->len == chunk_size) {
+        full.push_back(current);
+        current = NULL;
+        writer_cv.notify_one();
+      }
+    }
+  }
+
+  void writer_loop() {
+    std::vector<Chunk *> batch;
+    std::vector<struct iovec> iov;
+    std::unique_lock<std::mutex> ul(lock);
+
+    while (true) {
+      if (full.empty() && running)
+        writer_cv.wait_for(ul, std::chrono::milliseconds(flush_interval_ms));
+
+      /* timer (or shutdown): also flush the partially filled chunk */
+      if (full.empty() && current && current->len > 0) {
+        full.push_back(current);
+        current = NULL;
+      }
+
+      if (full.empty()) {
+        if (!running)
+          break;
+        continue;
+      }
+
+      batch.assign(full.begin(), full.end());
+      full.clear();
+      ul.unlock();
+
+      iov.resize(batch.size());
+      size_t bytes = 0;
+      for (size_t i = 0; i < batch.size(); i++) {
+        iov[i].iov_base = batch[i]->buf;
+        iov[i].iov_len  = batch[i]->len;
+        bytes += batch[i]->len;
+      }
+      if (backend->write(&iov[0], (int)iov.size())) {
+        bytes_written += bytes;
+        flush_cnt++;
+      } else {
+        write_errors++;
+      }
+      bytes_flushed += bytes;
+
+      ul.lock();
+      for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->len = 0;
+        free_chunks.push_back(batch[i]);
+      }
+      free_cv.notify_all();
+    }
+  }
+
+ public:
+  /**
+   * @param backend owned by the sink
+   * @param buffer_bytes max memory used for buffering
+   */
+  OutputSink(OutputBackend *backend, size_t buffer_bytes, int flush_interval_ms)
+      : backend(backend),
+        max_chunks(std::max(buffer_bytes / chunk_size, (size_t)2)),
+        flush_interval_ms(flush_interval_ms),
+        current(NULL),
+        allocated_chunks(0),
+        running(true),
+        bytes_appended(0),
+        bytes_flushed(0),
+        bytes_written(0),
+        flush_cnt(0),
+        write_errors(0) {
+    writer = std::thread(&OutputSink::writer_loop, this);
+  }
+
+  ~OutputSink() {
+    close();
+
+    if (current)
+      free_chunks.push_back(current);
+    for (size_t i = 0; i < free_chunks.size(); i++) {
+      delete[] free_chunks[i]->buf;
+      delete free_chunks[i];
+    }
+    delete backend;
+  }
+
+  /**
+   * @brief flush all buffered data and stop the writer thread.
+   *        Nothing may be written to the sink afterwards.
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!running)
+        return;
+      running = false;
+    }
+    writer_cv.notify_one();
+    writer.join();
+  }
+
+  void write(const char *data, size_t len) {
+    std::lock_guard<std::mutex> record_guard(append_lock);
+    std::unique_lock<std::mutex> ul(lock);
+    append_locked(ul, data, len);
+  }
+
+  /**
+   * @brief append all iovecs as one record, records from concurrent callers
+   *        are never interleaved
+   */
+  void writev(const struct iovec *iov, int iovcnt) {
+    std::lock_guard<std::mutex> record_guard(append_lock);
+    std::unique_lock<std::mutex> ul(lock);
+    for (int i = 0; i < iovcnt; i++)
+      append_locked(ul, (const char *)iov[i].iov_base, iov[i].iov_len);
+  }
+
+  /**
+   * @brief bytes handed to the sink so far. Once get_bytes_flushed() has
+   *        reached this count, they are out of the sink's buffer.
+   */
+  int64_t get_bytes_appended() {
+    return bytes_appended;
+  }
+
+  int64_t get_bytes_flushed() {
+    return bytes_flushed;
+  }
+
+  int64_t get_bytes_written() {
+    return bytes_written;
+  }
+
+  long get_flush_cnt() {
+    return flush_cnt;
+  }
+
+  long get_write_errors() {
+    return write_errors;
+  }
+
+  /**
+   * @brief create a sink from its config name: stdout, file or mmap
+   */
+  static OutputSink *create(const std::string &type,
+                            const std::string &path,
+                            size_t buffer_bytes,
+                            size_t ring_bytes,
+                            std::string &errstr) {
+    OutputBackend *backend = NULL;
+    if (type == "stdout") {
+      backend = FdBackend::create_stdout();
+    } else if (type == "file") {
+      backend = FdBackend::create_file(path, errstr);
+    } else if (type == "mmap") {
+      backend = MmapRingBackend::create(path, ring_bytes, errstr);
+    } else {
+      errstr = "unknown output sink " + type;
+    }
+    if (!backend)
+      return NULL;
+    return new OutputSink(backend, buffer_bytes, 100);
+  }
+};
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef PARTITION_ENGINE_CPP
+#define PARTITION_ENGINE_CPP
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./batch_consume.cpp"
+
+/**
+ * @brief message handler, the message is owned (and destroyed) by the caller
+ */
+typedef void (*message_handler_t)(rd_kafka_message_t *message, void *opaque);
+
+
+/**
+ * @brief Partition-parallel consume engine
+ *
+ * Every assigned partition gets its own queue (rd_kafka_queue_get_partition()) which
+ * is forwarded to exactly one worker queue. A partition is therefore only
+ * ever handled by one worker thread, which keeps per-partition ordering,
+ * while different partitions are handled in parallel.
+ *
+ * The consumer queue itself is still served by the caller's poll loop
+ * (rd_kafka_consumer_poll()), which then only sees rebalances, errors and
+ * events.
+ */
+class PartitionEngine {
+ private:
+  struct Worker {
+    rd_kafka_queue_t *queue;
+    std::thread thread;
+    int partition_cnt;
+  };
+
+  struct PartitionQueue {
+    rd_kafka_queue_t *queue;
+    size_t worker;
+  };
+
+  typedef std::pair<std::string, int32_t> partition_key_t;
+
+  int worker_cnt;
+  int consume_timeout_ms;
+  message_handler_t handler;
+  batch_handler_t batch_handler;
+  size_t batch_size;
+  int batch_linger_ms;
+  void *opaque;
+
+  std::vector<Worker *> workers;
+  std::map<partition_key_t, PartitionQueue> partitions;
+  std::mutex lock;
+  std::atomic<bool> running;
+
+  void worker_loop(Worker *worker) {
+    if (batch_handler) {
+      std::vector<rd_kafka_message_t *> batch(batch_size);
+      while (running) {
+        size_t cnt =
+            consume_batch(worker->queue, batch_size, batch_linger_ms, &batch[0]);
+        if (cnt > 0)
+          batch_handler(&batch[0], cnt, opaque);
+        release_batch(&batch[0], cnt);
+      }
+      return;
+    }
+
+    while (running) {
+      rd_kafka_message_t *msg =
+          rd_kafka_consume_queue(worker->queue, consume_timeout_ms);
+      if (!msg)
+        continue;
+      handler(msg, opaque);
+      rd_kafka_message_destroy(msg);
+    }
+  }
+
+  /* lock must be held */
+  size_t least_loaded_worker() {
+    size_t idx = 0;
+    for (size_t i = 1; i < workers.size(); i++)
+      if (workers[i]->partition_cnt < workers[idx]->partition_cnt)
+        idx = i;
+    return idx;
+  }
+
+  /* lock must be held */
+  void release_partition(std::map<partition_key_t, PartitionQueue>::iterator it) {
+    rd_kafka_queue_forward(it->second.queue, NULL);
+    rd_kafka_queue_destroy(it->second.queue);
+    workers[it->second.worker]->partition_cnt--;
+    partitions.erase(it);
+  }
+
+ public:
+  PartitionEngine(int worker_cnt, message_handler_t handler, void *opaque)
+      : worker_cnt(worker_cnt),
+        consume_timeout_ms(500),
+        handler(handler),
+        batch_handler(NULL),
+        batch_size(1),
+        batch_linger_ms(0),
+        opaque(opaque),
+        running(false) {
+  }
+
+  ~PartitionEngine() {
+    stop();
+
+    std::lock_guard<std::mutex> guard(lock);
+    while (!partitions.empty())
+      release_partition(partitions.begin());
+    for (size_t i = 0; i < workers.size(); i++) {
+      rd_kafka_queue_destroy(workers[i]->queue);
+      delete workers[i];
+    }
+    workers.clear();
+  }
+
+  /**
+   * @brief hand messages to the workers in batches of up to batch_size
+   *        messages or linger_ms, instead of one by one. Call before start().
+   */
+  void set_batch_handler(batch_handler_t handler, size_t size, int linger_ms) {
+    batch_handler   = handler;
+    batch_size      = size;
+    batch_linger_ms = linger_ms;
+  }
+
+  /**
+   * @brief create the worker queues and start the worker threads
+   */
+  bool start(RdKafka::KafkaConsumer *consumer, std::string &errstr) {
+    if (worker_cnt <= 0) {
+      errstr = "worker count must be > 0";
+      return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    running = true;
+    for (int i = 0; i < worker_cnt; i++) {
+      Worker *worker = new Worker();
+      worker->queue  = rd_kafka_queue_new(consumer->c_ptr());
+      if (!worker->queue) {
+        delete worker;
+        errstr = "failed to create worker queue";
+        return false;
+      }
+      worker->partition_cnt = 0;
+      workers.push_back(worker);
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i]->thread = std::thread(&PartitionEngine::worker_loop, this,
+                                       workers[i]);
+    return true;
+  }
+
+  /**
+   * @brief stop and join the worker threads.
+   *
+   * Partition queues stay forwarded until they are revoked (or the engine is
+   * destroyed), so this must be called before consumer->close().
+   */
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    for (size_t i = 0; i < workers.size(); i++)
+      if (workers[i]->thread.joinable())
+        workers[i]->thread.join();
+  }
+
+  /**
+   * @brief route newly assigned partitions to the least loaded workers.
+   *        Must be called from the rebalance callback, after (incremental_)assign().
+   */
+  void add_partitions(RdKafka::KafkaConsumer *consumer,
+                      const std::vector<RdKafka::TopicPartition *> &assigned) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (workers.empty())
+      return;
+
+    for (size_t i = 0; i < assigned.size(); i++) {
+      partition_key_t key(assigned[i]->topic(), assigned[i]->partition());
+      if (partitions.find(key) != partitions.end())
+        continue;
+
+      rd_kafka_queue_t *queue = rd_kafka_queue_get_partition(
+          consumer->c_ptr(), key.first.c_str(), key.second);
+      if (!queue) {
+        std::cerr << "Failed to get queue for " << key.first << "["
+                  << key.second << "]" << std::endl;
+        continue;
+      }
+
+      PartitionQueue pq;
+      pq.queue  = queue;
+      pq.worker = least_loaded_worker();
+
+      rd_kafka_queue_forward(queue, workers[pq.worker]->queue);
+      workers[pq.worker]->partition_cnt++;
+      partitions[key] = pq;
+    }
+  }
+
+  /**
+   * @brief stop routing revoked partitions to the workers.
+   *        Must be called from the rebalance callback, before (incremental_)unassign().
+   */
+  void remove_partitions(const std::vector<RdKafka::TopicPartition *> &revoked) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < revoked.size(); i++) {
+      std::map<partition_key_t, PartitionQueue>::iterator it = partitions.find(
+          partition_key_t(revoked[i]->topic(), revoked[i]->partition()));
+      if (it != partitions.end())
+        release_partition(it);
+    }
+  }
+
+  /**
+   * @brief messages pre-fetched into the worker queues, not consumed yet
+   */
+  size_t get_queued_msgs() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t queued = 0;
+    for (size_t i = 0; i < workers.size(); i++)
+      queued += rd_kafka_queue_length(workers[i]->queue);
+    return queued;
+  }
+
+  void remove_all_partitions() {
+    std::lock_guard<std::mutex> guard(lock);
+    while (!partitions.empty())
+      release_partition(partitions.begin());
+  }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef PARTITION_STATE_CPP
+#define PARTITION_STATE_CPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <librdkafka/rdkafkacpp.h>
+
+
+/**
+ * @brief state of one assigned partition, lives from its assign until its
+ *        revoke has drained it
+ */
+struct PartitionState {
+  std::string topic;
+  int32_t partition;
+  uint32_t hash;
+  std::chrono::steady_clock::time_point assigned_at;
+
+  std::atomic<bool> revoking;   /* set under the table lock */
+  std::atomic<int> inflight;    /* messages being handled */
+  std::atomic<int64_t> inflight_bytes;
+  std::atomic<bool> eof;        /* at the end of the partition */
+  std::atomic<int64_t> last_offset;
+  std::atomic<long> msg_cnt;
+  std::atomic<int64_t> msg_bytes;
+  std::atomic<int64_t> end_offset; /* replay: first offset not to consume */
+  std::atomic<bool> done;          /* replay: end offset reached */
+};
+
+
+/**
+ * @brief per-partition state of the current assignment
+ *
+ * States are only created and destroyed for the partitions named in an
+ * (incremental) assign or revoke, the others are not touched.
+ *
+ * Message handlers acquire() the state of the message's partition and
+ * release() it when done. A revoke first stops new acquires for the revoked
+ * partitions, then waits until their in-flight messages are done, so that
+ * their offsets can be committed while all other partitions keep being
+ * processed. Messages of partitions that are being (or have been) revoked
+ * are not acquired: they are redelivered to the new owner.
+ */
+class PartitionStateTable {
+ private:
+  typedef std::multimap<uint32_t, PartitionState *> state_map_t;
+
+  std::mutex lock;
+  std::condition_variable drained_cv;
+  state_map_t states;
+  std::vector<PartitionState *> abandoned; /* revoke timed out while in flight */
+
+  static uint32_t hash_key(const char *topic, int32_t partition) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (const char *p = topic; *p; p++)
+      h = (h ^ (uint8_t)*p) * 16777619u;
+    return (h ^ (uint32_t)partition) * 16777619u;
+  }
+
+  /* lock must be held */
+  state_map_t::iterator find(const char *topic, int32_t partition) {
+    uint32_t h = hash_key(topic, partition);
+    std::pair<state_map_t::iterator, state_map_t::iterator> range =
+        states.equal_range(h);
+    for (state_map_t::iterator it = range.first; it != range.second; ++it)
+      if (it->second->partition == partition && it->second->topic == topic)
+        return it;
+    return states.end();
+  }
+
+ public:
+  ~PartitionStateTable() {
+    for (state_map_t::iterator it = states.begin(); it != states.end(); ++it)
+      delete it->second;
+    for (size_t i = 0; i < abandoned.size(); i++)
+      delete abandoned[i];
+  }
+
+  /**
+   * @brief create the state of newly assigned partitions
+   */
+  void assign(const std::vector<RdKafka::TopicPartition *> &partitions) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < partitions.size(); i++) {
+      const std::string &topic = partitions[i]->topic();
+      int32_t partition        = partitions[i]->partition();
+      if (find(topic.c_str(), partition) != states.end())
+        continue;
+
+      PartitionState *ps = new PartitionState();
+      ps->topic          = topic;
+      ps->partition      = partition;
+      ps->hash           = hash_key(topic.c_str(), partition);
+      ps->assigned_at    = std::chrono::steady_clock::now();
+      ps->revoking       = false;
+      ps->inflight       = 0;
+      ps->inflight_bytes = 0;
+      ps->eof            = false;
+      ps->last_offset    = RdKafka::OFFSET_INVALID;
+      ps->msg_cnt        = 0;
+      ps->msg_bytes      = 0;
+      ps->end_offset     = INT64_MAX;
+      ps->done           = false;
+      states.insert(std::make_pair(ps->hash, ps));
+    }
+  }
+
+  /**
+   * @returns the state of the partition, NULL if the partition is
+   *          not assigned or being revoked. Must be release()d.
+   */
+  PartitionState *acquire(const char *topic, int32_t partition) {
+    std::lock_guard<std::mutex> guard(lock);
+    state_map_t::iterator it = find(topic, partition);
+    if (it == states.end() || it->second->revoking)
+      return NULL;
+    it->second->inflight++;
+    return it->second;
+  }
+
+  void release(PartitionState *ps) {
+    if (--ps->inflight == 0 && ps->revoking) {
+      std::lock_guard<std::mutex> guard(lock);
+      drained_cv.notify_all();
+    }
+  }
+
+  /**
+   * @brief stop handing out the revoked partitions and wait (at most
+   *        timeout_ms) until their in-flight messages are done.
+   *        Called from the rebalance callback before committing them.
+   * @returns false if the wait timed out
+   */
+  bool drain(const std::vector<RdKafka::TopicPartition *> &partitions,
+             int timeout_ms) {
+    std::vector<PartitionState *> revoked;
+    std::unique_lock<std::mutex> ul(lock);
+    for (size_t i = 0; i < partitions.size(); i++) {
+      state_map_t::iterator it = find(partitions[i]->topic().c_str(),
+                                      partitions[i]->partition());
+      if (it == states.end())
+        continue;
+      it->second->revoking = true;
+      revoked.push_back(it->second);
+    }
+
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(timeout_ms);
+    for (size_t i = 0; i < revoked.size(); i++) {
+      PartitionState *ps = revoked[i];
+      if (!drained_cv.wait_until(ul, deadline,
+                                 [ps] { return ps->inflight == 0; }))
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief destroy the state of revoked partitions, after drain().
+   *        States still in flight are kept until the table is destroyed.
+   * @returns the removed states' message counts, for reporting
+   */
+  long remove(const std::vector<RdKafka::TopicPartition *> &partitions) {
+    long cnt = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < partitions.size(); i++) {
+      state_map_t::iterator it = find(partitions[i]->topic().c_str(),
+                                      partitions[i]->partition());
+      if (it == states.end())
+        continue;
+      PartitionState *ps = it->second;
+      states.erase(it);
+      cnt += ps->msg_cnt;
+      if (ps->inflight > 0)
+        abandoned.push_back(ps);
+      else
+        delete ps;
+    }
+    return cnt;
+  }
+
+  /**
+   * @returns true if partitions are assigned and all of them are at EOF
+   */
+  bool all_eof() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (states.empty())
+      return false;
+    for (state_map_t::iterator it = states.begin(); it != states.end(); ++it)
+      if (!it->second->eof)
+        return false;
+    return true;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return states.size();
+  }
+
+  /**
+   * @brief call f(const PartitionState &) for every assigned partition
+   */
+  template <typename F>
+  void for_each(F f) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (state_map_t::iterator it = states.begin(); it != states.end(); ++it)
+      f(*it->second);
+  }
+};
+
+#endif
@@ -0,0 +1,503 @@
+#ifndef PIPELINE_CPP
+#define PIPELINE_CPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./arena.cpp"
+#include "./batch_consume.cpp"
+#include "./partition_engine.cpp"
+#include "./partition_state.cpp"
+
+
+/**
+ * @brief steady clock time in microseconds
+ */
+static inline int64_t steady_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+
+/**
+ * @brief one consumed message (or event) travelling through the pipeline
+ *
+ * topic, key and payload are views into the message until own() copies
+ * them into an arena, which is needed before the record leaves the thread
+ * that polled the message (the message is destroyed once the handler
+ * returns). Records themselves never allocate.
+ */
+struct Record {
+  rd_kafka_message_t *message; /* NULL once owned */
+  RdKafka::ErrorCode err;
+  const char *topic;
+  int32_t partition;
+  int64_t offset;
+  RdKafka::MessageTimestamp timestamp;
+  const char *key; /* NULL: no key */
+  size_t key_len;
+  const char *payload;
+  size_t len;
+  int64_t poll_us; /* steady_us() the message was returned by poll */
+
+  PartitionState *partition_state; /* set by the decode stage */
+  bool dropped;                    /* filtered out, or not a message */
+
+  Record()
+      : message(NULL),
+        err(RdKafka::ERR_NO_ERROR),
+        topic(""),
+        partition(RD_KAFKA_PARTITION_UA),
+        offset(RdKafka::OFFSET_INVALID),
+        key(NULL),
+        key_len(0),
+        payload(NULL),
+        len(0),
+        poll_us(0),
+        partition_state(NULL),
+        dropped(false) {
+    timestamp.type      = RdKafka::MessageTimestamp::MSG_TIMESTAMP_NOT_AVAILABLE;
+    timestamp.timestamp = 0;
+  }
+
+  Record(rd_kafka_message_t *message, int64_t poll_us)
+      : message(message),
+        err((RdKafka::ErrorCode)message->err),
+        topic(message->rkt ? rd_kafka_topic_name(message->rkt) : ""),
+        partition(message->partition),
+        offset(message->offset),
+        key((const char *)message->key),
+        key_len(message->key_len),
+        payload((const char *)message->payload),
+        len(message->len),
+        poll_us(poll_us),
+        partition_state(NULL),
+        dropped(false) {
+    rd_kafka_timestamp_type_t tstype;
+    timestamp.timestamp = rd_kafka_message_timestamp(message, &tstype);
+    /* the C++ timestamp types have the C types' values */
+    timestamp.type = (RdKafka::MessageTimestamp::MessageTimestampType)tstype;
+  }
+
+  /**
+   * @brief copy the views into arena, detaching the record from the
+   *        message. The copies live until the arena is reset.
+   */
+  void own(Arena &arena) {
+    if (!message)
+      return;
+    size_t topic_len = strlen(topic);
+    char *p = (char *)arena.alloc(topic_len + 1 + key_len + len);
+    memcpy(p, topic, topic_len + 1);
+    topic = p;
+    p += topic_len + 1;
+    if (key) {
+      memcpy(p, key, key_len);
+      key = p;
+      p += key_len;
+    }
+    if (payload)
+      memcpy(p, payload, len);
+    payload = p;
+    message = NULL;
+  }
+};
+
+
+/**
+ * @brief base of all stages: stages are plain classes with a
+ *        void operator()(Record &) the compiler can inline.
+ *
+ * A stage marks a record dropped to filter it out; the following stages
+ * are skipped unless they set sees_dropped (e.g. to release resources or
+ * commit the offset of filtered messages). start(), stop() and end_batch()
+ * (after the last record of a batch) are called with the pipeline's.
+ */
+struct Stage {
+  static const bool sees_dropped = false;
+
+  void start() {
+  }
+
+  void stop() {
+  }
+
+  void end_batch() {
+  }
+};
+
+
+/**
+ * @brief stages composed at compile time, run in order on the caller's thread
+ */
+template <typename... Stages>
+class Pipeline {
+ private:
+  typedef std::tuple<Stages...> stages_t;
+  stages_t stages;
+
+  template <size_t I>
+  typename std::enable_if<I == sizeof...(Stages)>::type run(Record &) {
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I < sizeof...(Stages))>::type run(Record &rec) {
+    typedef typename std::tuple_element<I, stages_t>::type stage_t;
+    if (!rec.dropped || stage_t::sees_dropped)
+      std::get<I>(stages)(rec);
+    run<I + 1>(rec);
+  }
+
+  template <size_t I>
+  typename std::enable_if<I == sizeof...(Stages)>::type start_stages() {
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I < sizeof...(Stages))>::type start_stages() {
+    std::get<I>(stages).start();
+    start_stages<I + 1>();
+  }
+
+  template <size_t I>
+  typename std::enable_if<I == sizeof...(Stages)>::type stop_stages() {
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I < sizeof...(Stages))>::type stop_stages() {
+    std::get<I>(stages).stop();
+    stop_stages<I + 1>();
+  }
+
+  template <size_t I>
+  typename std::enable_if<I == sizeof...(Stages)>::type end_batch_stages() {
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I < sizeof...(Stages))>::type end_batch_stages() {
+    std::get<I>(stages).end_batch();
+    end_batch_stages<I + 1>();
+  }
+
+ public:
+  /**
+   * @brief access stage I, e.g. to configure it before start()
+   */
+  template <size_t I>
+  typename std::tuple_element<I, stages_t>::type &stage() {
+    return std::get<I>(stages);
+  }
+
+  void start() {
+    start_stages<0>();
+  }
+
+  /**
+   * @brief stop the stages in order: asynchronous stages drain their queue
+   */
+  void stop() {
+    stop_stages<0>();
+  }
+
+  /**
+   * @brief the last record of a batch was processed
+   */
+  void end_batch() {
+    end_batch_stages<0>();
+  }
+
+  void process(Record &rec) {
+    run<0>(rec);
+  }
+
+  void process(rd_kafka_message_t *message, int64_t poll_us) {
+    Record rec(message, poll_us);
+    run<0>(rec);
+  }
+};
+
+
+/**
+ * @brief stage that does nothing, fills an unused slot of a pipeline
+ *        template and is compiled away
+ */
+struct NullStage : Stage {
+  void operator()(Record &) {
+  }
+};
+
+
+/**
+ * @brief keeps records for which Pred()(const Record &) is true
+ */
+template <typename Pred>
+struct FilterStage : Stage {
+  Pred pred;
+
+  void operator()(Record &rec) {
+    if (!pred(rec))
+      rec.dropped = true;
+  }
+};
+
+
+/**
+ * @brief applies Fn()(Record &), e.g. to replace the payload view
+ */
+template <typename Fn>
+struct TransformStage : Stage {
+  Fn fn;
+
+  void operator()(Record &rec) {
+    fn(rec);
+  }
+};
+
+
+/**
+ * @brief bounded lock-free single-producer single-consumer queue
+ */
+template <typename T>
+class SpscQueue {
+ private:
+  std::vector<T> slots;
+  size_t mask;
+  /* head and tail on their own cache lines; padded rather than alignas'd
+   * so the queue can be new'ed without C++17 aligned new */
+  char pad0[64];
+  std::atomic<size_t> head; /* next to pop, consumer */
+  char pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail; /* next to push, producer */
+  char pad2[64 - sizeof(std::atomic<size_t>)];
+
+ public:
+  explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  bool try_push(T &&item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask)
+      return false;
+    slots[t & mask] = std::move(item);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+      return false;
+    item = std::move(slots[h & mask]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+
+/**
+ * @brief hands records over an SPSC queue to the Downstream pipeline, which
+ *        runs on its own thread (core). Must be the last stage, and the
+ *        pipeline must only be driven from one thread.
+ *
+ * Records are own()ed into an arena before they are queued. Arenas come
+ * from a fixed pool: the current one is sealed at the end of a batch (or
+ * once it holds arena_bytes), and handed back reset once downstream has
+ * processed its records, so no record allocates once the pool has grown to
+ * what a batch needs. Dropped records are only handed over if they hold a
+ * partition state, for downstream to release it.
+ *
+ * A full queue (or no free arena) blocks the producer (backpressure); an
+ * empty queue makes the downstream thread spin briefly, then sleep.
+ */
+template <typename Downstream, size_t Capacity = 4096>
+class AsyncBoundary : public Stage {
+ private:
+  static const size_t arena_cnt   = 16;
+  static const size_t arena_bytes = 256 * 1024;
+
+  struct Item {
+    Record rec;
+    Arena *release; /* set: not a record, the arena's records are done */
+
+    Item() : release(NULL) {
+    }
+  };
+
+  SpscQueue<Item> queue;
+  SpscQueue<Arena *> free_arenas; /* downstream to producer */
+  std::vector<Arena *> arenas;
+  Arena *arena; /* producer's current arena, NULL if none */
+  Downstream downstream;
+  std::atomic<bool> running;
+  std::thread thread;
+
+  void push(Item &item) {
+    while (!queue.try_push(std::move(item)))
+      std::this_thread::yield();
+  }
+
+  /* the records in the current arena are all queued */
+  void seal() {
+    Item item;
+    item.release = arena;
+    push(item);
+    arena = NULL;
+  }
+
+  void handle(Item &item) {
+    if (item.release) {
+      item.release->reset();
+      free_arenas.try_push(std::move(item.release)); /* room for all */
+    } else {
+      downstream.process(item.rec);
+    }
+  }
+
+  void downstream_loop() {
+    Item item;
+    int idle = 0;
+    while (true) {
+      if (queue.try_pop(item)) {
+        handle(item);
+        idle = 0;
+      } else if (!running.load(std::memory_order_acquire)) {
+        if (!queue.try_pop(item))
+          break; /* drained */
+        handle(item);
+      } else if (++idle < 1000) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+  }
+
+ public:
+  static const bool sees_dropped = true;
+
+  AsyncBoundary()
+      : queue(Capacity), free_arenas(arena_cnt), arena(NULL), running(false) {
+    for (size_t i = 0; i < arena_cnt; i++) {
+      Arena *a = new Arena();
+      arenas.push_back(a);
+      free_arenas.try_push(std::move(a));
+    }
+  }
+
+  ~AsyncBoundary() {
+    stop();
+    for (size_t i = 0; i < arenas.size(); i++)
+      delete arenas[i];
+  }
+
+  void start() {
+    if (running.exchange(true))
+      return;
+    downstream.start();
+    thread = std::thread(&AsyncBoundary::downstream_loop, this);
+  }
+
+  /**
+   * @brief process all queued records and join the downstream thread
+   */
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    thread.join();
+    downstream.stop();
+  }
+
+  Downstream &get_downstream() {
+    return downstream;
+  }
+
+  void operator()(Record &rec) {
+    if (rec.dropped && !rec.partition_state)
+      return;
+    while (!arena && !free_arenas.try_pop(arena))
+      std::this_thread::yield();
+    rec.own(*arena);
+    Item item;
+    item.rec = rec;
+    push(item);
+    if (arena->get_bytes() >= arena_bytes)
+      seal();
+  }
+
+  void end_batch() {
+    if (arena && arena->get_bytes() > 0)
+      seal();
+  }
+};
+
+
+/**
+ * @brief type-erased pipeline for the consume loops and PartitionEngine:
+ *        one indirect call per message (or batch), the stages themselves
+ *        are inlined into process()
+ */
+struct PipelineHandle {
+  message_handler_t handler;
+  batch_handler_t batch_handler;
+  void *opaque;
+  void (*stop)(void *opaque);
+  void (*destroy)(void *opaque);
+};
+
+template <typename P>
+static void pipeline_consume(rd_kafka_message_t *message, void *opaque) {
+  static_cast<P *>(opaque)->process(message, steady_us());
+}
+
+template <typename P>
+static void pipeline_consume_batch(rd_kafka_message_t **messages,
+                                   size_t cnt,
+                                   void *opaque) {
+  int64_t poll_us = steady_us();
+  P *pipeline     = static_cast<P *>(opaque);
+  for (size_t i = 0; i < cnt; i++)
+    pipeline->process(messages[i], poll_us);
+  pipeline->end_batch();
+}
+
+template <typename P>
+static void pipeline_stop(void *opaque) {
+  static_cast<P *>(opaque)->stop();
+}
+
+template <typename P>
+static void pipeline_destroy(void *opaque) {
+  delete static_cast<P *>(opaque);
+}
+
+/**
+ * @brief start pipeline and wrap it, the handle owns it
+ */
+template <typename P>
+static PipelineHandle make_pipeline_handle(P *pipeline) {
+  PipelineHandle handle;
+  handle.handler       = pipeline_consume<P>;
+  handle.batch_handler = pipeline_consume_batch<P>;
+  handle.opaque        = pipeline;
+  handle.stop          = pipeline_stop<P>;
+  handle.destroy       = pipeline_destroy<P>;
+  pipeline->start();
+  return handle;
+}
+
+#endif
@@ -0,0 +1,400 @@
+#ifndef REPLAY_CPP
+#define REPLAY_CPP
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./async_log.cpp"
+#include "./partition_state.cpp"
+
+
+/**
+ * @brief Replay of a time range of topics, outside the consumer group
+ *
+ * The start offset of every partition is the first message at or after
+ * from_ms, the end offset the first message at or after to_ms (exclusive),
+ * both resolved with offsetsForTimes(); without to_ms, or if no message is
+ * that late, the end is the partition's high watermark at resolve time.
+ * All partitions are then assigned manually at their start offsets, so the
+ * group is neither joined nor are its offsets committed.
+ *
+ * The consume path stops each partition exactly at its end offset: messages
+ * at or past it are dropped (fetches may overshoot), and once the message
+ * before it has been handled (or the partition ends before it) the
+ * partition is done and paused. Progress and MB/s are logged per
+ * partition every interval_ms.
+ */
+class Replay {
+ public:
+  struct Range {
+    std::string topic;
+    int32_t partition;
+    int64_t start;  /* first offset to consume */
+    int64_t end;    /* first offset not to consume */
+    int64_t done_us; /* steady clock time it was done, 0: not done */
+  };
+
+ private:
+  typedef std::pair<std::string, int32_t> partition_key_t;
+
+  struct Progress {
+    int64_t position;
+    long msg_cnt;
+    int64_t msg_bytes;
+  };
+
+  RdKafka::KafkaConsumer *consumer;
+  PartitionStateTable *states;
+  int64_t from_ms;
+  int64_t to_ms; /* -1: up to the high watermarks */
+  int64_t start_us;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool running;
+  std::thread thread;
+  std::map<partition_key_t, Range> ranges; /* under lock once assigned */
+  std::map<partition_key_t, int64_t> seen_bytes; /* report thread only */
+  int64_t last_report_us;                        /* report thread only */
+  std::atomic<size_t> done_cnt;
+  size_t empty_cnt; /* partitions without messages in the range */
+
+  static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /* position, messages and bytes of every assigned partition */
+  std::map<partition_key_t, Progress> progress() {
+    std::map<partition_key_t, Progress> out;
+    states->for_each([&](const PartitionState &ps) {
+      Progress p;
+      p.position  = ps.last_offset.load();
+      p.msg_cnt   = ps.msg_cnt.load();
+      p.msg_bytes = ps.msg_bytes.load();
+      out[partition_key_t(ps.topic, ps.partition)] = p;
+    });
+    return out;
+  }
+
+  void report() {
+    std::map<partition_key_t, Progress> prog = progress();
+    int64_t now     = now_us();
+    double interval = (now - last_report_us) / 1e6;
+    last_report_us  = now;
+
+    int64_t total_bytes = 0, interval_bytes = 0, todo = 0, consumed = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<partition_key_t, Range>::iterator it = ranges.begin();
+         it != ranges.end(); ++it) {
+      const Range &r = it->second;
+      std::map<partition_key_t, Progress>::iterator p = prog.find(it->first);
+      if (p == prog.end())
+        continue;
+      int64_t pos = p->second.position >= r.start ? p->second.position + 1
+                                                  : r.start;
+      if (r.done_us || pos > r.end)
+        pos = r.end;
+      int64_t bytes = p->second.msg_bytes - seen_bytes[it->first];
+      seen_bytes[it->first] = p->second.msg_bytes;
+      total_bytes += p->second.msg_bytes;
+      interval_bytes += bytes;
+      todo += r.end - r.start;
+      consumed += pos - r.start;
+      if (r.done_us && bytes == 0)
+        continue;
+      ALOG_INFO("Replay %s[%d]: offset %" PRId64 " of %" PRId64 "..%" PRId64
+                " (%.1f%%), %ld message(s), %.1fMB, %.2fMB/s%s",
+                r.topic.c_str(), (int)r.partition, pos, r.start, r.end,
+                100.0 * (pos - r.start) / (r.end - r.start),
+                p->second.msg_cnt, p->second.msg_bytes / (1024.0 * 1024),
+                interval > 0 ? bytes / interval / (1024 * 1024) : 0.0,
+                r.done_us ? ", done" : "");
+    }
+    ALOG_INFO("Replay: %zu of %zu partition(s) done, %.1f%% of %" PRId64
+              " offset(s), %.1fMB, %.2fMB/s",
+              done_cnt.load(), ranges.size(),
+              todo > 0 ? 100.0 * consumed / todo : 100.0, todo,
+              total_bytes / (1024.0 * 1024),
+              interval > 0 ? interval_bytes / interval / (1024 * 1024) : 0.0);
+  }
+
+  void report_loop(int interval_ms) {
+    std::unique_lock<std::mutex> ul(lock);
+    while (running) {
+      cv.wait_for(ul, std::chrono::milliseconds(interval_ms));
+      if (!running)
+        break;
+      ul.unlock();
+      report();
+      ul.lock();
+    }
+  }
+
+ public:
+  Replay(RdKafka::KafkaConsumer *consumer,
+         PartitionStateTable *states,
+         int64_t from_ms,
+         int64_t to_ms)
+      : consumer(consumer),
+        states(states),
+        from_ms(from_ms),
+        to_ms(to_ms),
+        start_us(0),
+        running(false),
+        last_report_us(0),
+        done_cnt(0),
+        empty_cnt(0) {
+  }
+
+  ~Replay() {
+    stop();
+  }
+
+  /**
+   * @brief resolve the start and end offsets of all partitions of topics
+   *        (names, not patterns)
+   */
+  bool resolve(const std::vector<std::string> &topics,
+               int timeout_ms,
+               std::string &errstr) {
+    std::vector<RdKafka::TopicPartition *> starts, ends;
+    for (size_t i = 0; i < topics.size(); i++) {
+      rd_kafka_topic_t *rkt =
+          rd_kafka_topic_new(consumer->c_ptr(), topics[i].c_str(), NULL);
+      const struct rd_kafka_metadata *md = NULL;
+      rd_kafka_resp_err_t err =
+          rd_kafka_metadata(consumer->c_ptr(), 0, rkt, &md, timeout_ms);
+      rd_kafka_topic_destroy(rkt);
+      if (!err && (md->topic_cnt != 1 || md->topics[0].err))
+        err = md->topic_cnt != 1 ? RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC
+                                 : md->topics[0].err;
+      if (err) {
+        if (md)
+          rd_kafka_metadata_destroy(md);
+        RdKafka::TopicPartition::destroy(starts);
+        RdKafka::TopicPartition::destroy(ends);
+        errstr = "failed to get partitions of " + topics[i] + ": " +
+                 rd_kafka_err2str(err);
+        return false;
+      }
+      for (int p = 0; p < md->topics[0].partition_cnt; p++) {
+        int32_t partition = md->topics[0].partitions[p].id;
+        starts.push_back(
+            RdKafka::TopicPartition::create(topics[i], partition, from_ms));
+        ends.push_back(RdKafka::TopicPartition::create(
+            topics[i], partition, to_ms >= 0 ? to_ms : RdKafka::OFFSET_END));
+      }
+      rd_kafka_metadata_destroy(md);
+    }
+
+    RdKafka::ErrorCode err = consumer->offsetsForTimes(starts, timeout_ms);
+    if (!err && to_ms >= 0)
+      err = consumer->offsetsForTimes(ends, timeout_ms);
+    for (size_t i = 0; !err && i < starts.size(); i++) {
+      RdKafka::TopicPartition *tp = starts[i];
+      err = tp->err() ? tp->err() : ends[i]->err();
+      if (err)
+        break;
+      /* -1: no message that late, up to the end of the partition */
+      int64_t start = tp->offset(), end = to_ms >= 0 ? ends[i]->offset() : -1;
+      if (start < 0 || end < 0) {
+        int64_t low = 0, high = 0;
+        err = consumer->query_watermark_offsets(tp->topic(), tp->partition(),
+                                                &low, &high, timeout_ms);
+        if (start < 0)
+          start = high;
+        if (end < 0)
+          end = high;
+      }
+      Range r;
+      r.topic     = tp->topic();
+      r.partition = tp->partition();
+      r.start     = start;
+      r.end       = end > start ? end : start;
+      r.done_us   = 0;
+      ranges[partition_key_t(r.topic, r.partition)] = r;
+    }
+    RdKafka::TopicPartition::destroy(starts);
+    RdKafka::TopicPartition::destroy(ends);
+    if (err) {
+      errstr = "failed to resolve replay offsets: " + RdKafka::err2str(err);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @returns the partitions with messages in the range, at their start
+   *          offsets. Must be destroyed by the caller.
+   */
+  std::vector<RdKafka::TopicPartition *> get_partitions() {
+    std::vector<RdKafka::TopicPartition *> parts;
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<partition_key_t, Range>::iterator it = ranges.begin();
+         it != ranges.end(); ++it)
+      if (it->second.end > it->second.start)
+        parts.push_back(RdKafka::TopicPartition::create(
+            it->second.topic, it->second.partition, it->second.start));
+    return parts;
+  }
+
+  /**
+   * @brief create the partition states with their end offsets and assign
+   *        parts (from get_partitions()). Empty partitions are done.
+   */
+  bool assign(const std::vector<RdKafka::TopicPartition *> &parts,
+              std::string &errstr) {
+    states->assign(parts);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      start_us       = now_us();
+      last_report_us = start_us;
+      for (std::map<partition_key_t, Range>::iterator it = ranges.begin();
+           it != ranges.end(); ++it) {
+        if (it->second.end > it->second.start)
+          continue;
+        it->second.done_us = start_us;
+        empty_cnt++;
+        done_cnt++;
+      }
+    }
+    for (size_t i = 0; i < parts.size(); i++) {
+      PartitionState *ps =
+          states->acquire(parts[i]->topic().c_str(), parts[i]->partition());
+      if (!ps)
+        continue;
+      std::lock_guard<std::mutex> guard(lock);
+      std::map<partition_key_t, Range>::iterator it =
+          ranges.find(partition_key_t(ps->topic, ps->partition));
+      if (it != ranges.end())
+        ps->end_offset = it->second.end;
+      states->release(ps);
+    }
+    RdKafka::ErrorCode err = consumer->assign(parts);
+    if (err) {
+      errstr = "failed to assign replay partitions: " + RdKafka::err2str(err);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief the partition reached its end offset: it is paused, its
+   *        remaining pre-fetched messages are dropped
+   * @returns true once all partitions are done
+   */
+  bool finish(PartitionState *ps) {
+    if (ps->done.exchange(true))
+      return false;
+    std::vector<RdKafka::TopicPartition *> parts;
+    parts.push_back(RdKafka::TopicPartition::create(ps->topic, ps->partition));
+    RdKafka::ErrorCode err = consumer->pause(parts);
+    if (err)
+      ALOG_ERROR("Failed to pause replayed partition %s[%d]: %s",
+                 ps->topic.c_str(), (int)ps->partition,
+                 RdKafka::err2str(err).c_str());
+    RdKafka::TopicPartition::destroy(parts);
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<partition_key_t, Range>::iterator it =
+        ranges.find(partition_key_t(ps->topic, ps->partition));
+    if (it != ranges.end())
+      it->second.done_us = now_us();
+    ALOG_INFO("Replay %s[%d] done at offset %" PRId64, ps->topic.c_str(),
+              (int)ps->partition, ps->end_offset.load());
+    return ++done_cnt == ranges.size();
+  }
+
+  /* the ranges are not changed after resolve() */
+  bool all_done() const {
+    return done_cnt.load() == ranges.size();
+  }
+
+  /**
+   * @brief log the progress every interval_ms
+   */
+  void start(int interval_ms) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (running)
+      return;
+    running = true;
+    thread  = std::thread(&Replay::report_loop, this, interval_ms);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!running)
+        return;
+      running = false;
+      cv.notify_all();
+    }
+    thread.join();
+  }
+
+  /**
+   * @brief write every partition's messages, bytes and average MB/s (from
+   *        the assign until it was done) to stderr
+   */
+  void print_summary() {
+    std::map<partition_key_t, Progress> prog = progress();
+    int64_t now = now_us();
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<partition_key_t, Range>::iterator it = ranges.begin();
+         it != ranges.end(); ++it) {
+      const Range &r = it->second;
+      if (r.end == r.start)
+        continue;
+      Progress p = {RdKafka::OFFSET_INVALID, 0, 0};
+      if (prog.count(it->first))
+        p = prog[it->first];
+      double secs = ((r.done_us ? r.done_us : now) - start_us) / 1e6;
+      fprintf(stderr,
+              "%% Replay %s[%d]: %" PRId64 "..%" PRId64 ", %ld message(s), "
+              "%.1fMB in %.3fs, %.2fMB/s%s\n",
+              r.topic.c_str(), (int)r.partition, r.start, r.end, p.msg_cnt,
+              p.msg_bytes / (1024.0 * 1024), secs,
+              secs > 0 ? p.msg_bytes / secs / (1024 * 1024) : 0.0,
+              r.done_us ? "" : ", incomplete");
+    }
+    fprintf(stderr,
+            "%% Replay: %zu of %zu partition(s) done (%zu without messages "
+            "in the range)\n",
+            done_cnt.load(), ranges.size(), empty_cnt);
+  }
+
+  std::vector<Range> get_ranges() {
+    std::vector<Range> out;
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::map<partition_key_t, Range>::iterator it = ranges.begin();
+         it != ranges.end(); ++it)
+      out.push_back(it->second);
+    return out;
+  }
+
+  size_t get_partition_cnt() {
+    std::lock_guard<std::mutex> guard(lock);
+    return ranges.size();
+  }
+
+  size_t get_done_cnt() const {
+    return done_cnt.load();
+  }
+};
+
+#endif
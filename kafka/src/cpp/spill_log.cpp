@@ -0,0 +1,744 @@
+#ifndef SPILL_LOG_CPP
+#define SPILL_LOG_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "./output_sink.cpp"
+
+
+/**
+ * @brief durable local buffer in front of a slow output sink
+ *
+ * Records are appended to an append-only log of memory-mapped, pre-allocated
+ * segment files, at memory speed. A sync thread msync()s the appended data
+ * every sync_ms, a replay thread drains the log to the output sink.
+ *
+ * Offsets handed to defer_offset() are passed to the durable callback (i.e.
+ * may be committed) once everything appended before them is on disk, not
+ * when the sink has written them: a stalled sink does not hold back commits.
+ * A crash loses no committed record: a segment's replay position is only
+ * advanced once the sink has flushed the replayed records, the next run
+ * replays the segments from there (records may be written twice).
+ *
+ * A segment is rolled once it is full or older than segment_ms, and
+ * recycled (kept as a spare file, or deleted) once it is flushed and
+ * durable. Flushed pages are dropped from the mapping, so memory use
+ * does not grow with the backlog. Appends block once max_bytes have not
+ * been replayed yet.
+ *
+ * Segment file "<dir>/<base position>.spill": a header page, then records
+ * of [u32 len][u32 check][data] padded to 8 bytes. The check covers the
+ * data and the record's position, so data left from a recycled segment's
+ * previous use never passes as a record.
+ */
+class SpillLog {
+ public:
+  typedef void(durable_cb_t)(const std::string &topic,
+                             int32_t partition,
+                             int64_t offset,
+                             void *opaque);
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint64_t base_pos;
+    uint64_t data_size;
+    uint64_t replayed; /* flushed replay position in the data */
+  };
+
+  struct Segment {
+    std::string path;
+    int fd;
+    char *map;
+    size_t map_size;
+    Header *header;
+    char *data;
+    size_t data_size;
+    uint64_t base_pos;
+    std::chrono::steady_clock::time_point created;
+    std::atomic<size_t> written; /* published by the writer */
+    std::atomic<size_t> synced;
+    std::atomic<bool> sealed;
+    size_t replayed; /* handed to the sink */
+    size_t flushed;  /* flushed by the sink, persisted in the header */
+    size_t released; /* flushed pages dropped from the mapping */
+  };
+
+  /* seg is flushed up to off once the sink has flushed sink_bytes */
+  struct FlushMark {
+    int64_t sink_bytes;
+    Segment *seg;
+    size_t off;
+  };
+
+  /* topic is an index into topics */
+  struct PendingOffset {
+    uint64_t pos;
+    uint32_t topic;
+    int32_t partition;
+    int64_t offset;
+  };
+
+  static const uint64_t magic       = 0x31474f4c4c495053ull; /* "SPILLOG1" */
+  static const size_t header_size   = 4096;
+  static const size_t record_header = 8;
+  static const size_t spare_max     = 2;
+  static const size_t pending_init  = 4096;
+
+  std::string dir;
+  size_t segment_bytes;
+  int segment_ms;
+  uint64_t max_bytes;
+  int sync_ms;
+  OutputSink *sink;
+  durable_cb_t *durable_cb;
+  void *durable_opaque;
+  size_t page_size;
+
+  std::mutex append_lock; /* the writer, held while waiting for space */
+  std::condition_variable space_cv;
+  std::mutex segments_lock; /* the segment list and spares */
+  std::deque<Segment *> segments;
+  std::vector<std::string> spares;
+  Segment *active;
+  std::mutex sync_lock;
+  std::vector<PendingOffset> ready; /* sync_lock */
+  std::mutex pending_lock;          /* the pending ring and topics */
+  std::vector<PendingOffset> pending;
+  size_t pending_head;
+  size_t pending_cnt;
+  std::deque<std::string> topics; /* interned, never shrinks */
+  uint32_t last_topic;
+
+  std::atomic<uint64_t> end_pos;
+  std::atomic<uint64_t> durable_pos;
+  std::atomic<uint64_t> replay_pos;
+  std::atomic<uint64_t> flushed_pos;
+  std::deque<FlushMark> flush_marks; /* replay thread only */
+
+  std::atomic<bool> running;
+  std::mutex replay_wait_lock;
+  std::condition_variable replay_cv;
+  std::thread sync_thread;
+  std::thread replay_thread;
+
+  std::atomic<uint64_t> appended_bytes;
+  std::atomic<uint64_t> replayed_bytes;
+  std::atomic<long> backpressure_cnt;
+  std::atomic<long> error_cnt;
+  std::atomic<long> recycled_cnt;
+
+  static uint32_t check(const char *p, size_t len, uint64_t pos) {
+    uint32_t h = 2166136261u ^ (uint32_t)pos ^ (uint32_t)(pos >> 32); /* FNV-1a */
+    h          = (h ^ (uint32_t)len) * 16777619u;
+    for (size_t i = 0; i < len; i++)
+      h = (h ^ (uint8_t)p[i]) * 16777619u;
+    return h;
+  }
+
+  static size_t padded(size_t len) {
+    return (record_header + len + 7) & ~(size_t)7;
+  }
+
+  std::string segment_path(uint64_t base_pos) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.spill", (unsigned long long)base_pos);
+    return dir + "/" + name;
+  }
+
+  /* length of the valid records at the start of seg's data */
+  static size_t scan(const Segment *seg) {
+    size_t off = 0;
+    while (off + record_header <= seg->data_size) {
+      uint32_t len, chk;
+      memcpy(&len, seg->data + off, 4);
+      memcpy(&chk, seg->data + off + 4, 4);
+      if (len == 0 || off + padded(len) > seg->data_size ||
+          check(seg->data + off + record_header, len, seg->base_pos + off) != chk)
+        break;
+      off += padded(len);
+    }
+    return off;
+  }
+
+  static void unmap(Segment *seg) {
+    if (seg->map)
+      munmap(seg->map, seg->map_size);
+    if (seg->fd != -1)
+      ::close(seg->fd);
+    delete seg;
+  }
+
+  Segment *map_segment(const std::string &path,
+                       int fd,
+                       size_t data_size,
+                       std::string &errstr) {
+    size_t map_size = header_size + data_size;
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      errstr = "failed to mmap " + path + ": " + strerror(errno);
+      ::close(fd);
+      return NULL;
+    }
+    Segment *seg   = new Segment();
+    seg->path      = path;
+    seg->fd        = fd;
+    seg->map       = (char *)map;
+    seg->map_size  = map_size;
+    seg->header    = (Header *)map;
+    seg->data      = seg->map + header_size;
+    seg->data_size = data_size;
+    seg->base_pos  = 0;
+    seg->created   = std::chrono::steady_clock::now();
+    seg->written   = 0;
+    seg->synced    = 0;
+    seg->sealed    = false;
+    seg->replayed  = 0;
+    seg->flushed   = 0;
+    seg->released  = 0;
+    return seg;
+  }
+
+  /* a new segment for at least min_size bytes of records, from a spare file
+   * if one fits. segments_lock must be held. */
+  Segment *open_segment(uint64_t base_pos, size_t min_size, std::string &errstr) {
+    std::string path = segment_path(base_pos);
+    size_t size      = std::max(segment_bytes, min_size);
+    int fd           = -1;
+
+    if (size == segment_bytes && !spares.empty()) {
+      if (rename(spares.back().c_str(), path.c_str()) == 0)
+        fd = ::open(path.c_str(), O_RDWR);
+      spares.pop_back();
+    }
+    if (fd == -1) {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1) {
+        errstr = "failed to open " + path + ": " + strerror(errno);
+        return NULL;
+      }
+      int err = posix_fallocate(fd, 0, (off_t)(header_size + size));
+      if (err) {
+        errstr = "failed to allocate " + path + ": " + strerror(err);
+        ::close(fd);
+        unlink(path.c_str());
+        return NULL;
+      }
+    }
+
+    Segment *seg = map_segment(path, fd, size, errstr);
+    if (!seg)
+      return NULL;
+    seg->base_pos             = base_pos;
+    seg->header->base_pos     = base_pos;
+    seg->header->data_size    = size;
+    seg->header->replayed     = 0;
+    memset(seg->data, 0, record_header);
+    seg->header->magic        = magic;
+    msync(seg->map, page_size, MS_SYNC);
+    return seg;
+  }
+
+  /* replayed and durable: keep the file as a spare or delete it.
+   * segments_lock must be held. */
+  void recycle(Segment *seg) {
+    std::string path = seg->path;
+    bool spare       = seg->data_size == segment_bytes && spares.size() < spare_max;
+    seg->header->magic = 0;
+    unmap(seg);
+    if (spare) {
+      std::string spare_path = path.substr(0, path.size() - 6) + ".spare";
+      if (rename(path.c_str(), spare_path.c_str()) == 0) {
+        spares.push_back(spare_path);
+        recycled_cnt++;
+        return;
+      }
+    }
+    unlink(path.c_str());
+    recycled_cnt++;
+  }
+
+  /**
+   * @brief map the segments of a previous run, they are replayed first
+   */
+  bool recover(std::string &errstr) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+      errstr = "failed to open spill dir " + dir + ": " + strerror(errno);
+      return false;
+    }
+    std::vector<std::string> names;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+      std::string name = ent->d_name;
+      if (name.size() > 6 && name.compare(name.size() - 6, 6, ".spill") == 0)
+        names.push_back(name);
+      else if (name.size() > 6 && name.compare(name.size() - 6, 6, ".spare") == 0)
+        spares.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end()); /* zero-padded base positions */
+
+    uint64_t next_pos = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+      std::string path = dir + "/" + names[i];
+      int fd           = ::open(path.c_str(), O_RDWR);
+      struct stat st;
+      if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size <= header_size) {
+        if (fd != -1)
+          ::close(fd);
+        unlink(path.c_str());
+        continue;
+      }
+      Segment *seg = map_segment(path, fd, (size_t)st.st_size - header_size, errstr);
+      if (!seg)
+        return false;
+      if (seg->header->magic != magic ||
+          seg->header->data_size != seg->data_size) {
+        unmap(seg);
+        unlink(path.c_str());
+        continue;
+      }
+      seg->base_pos = seg->header->base_pos;
+      seg->written  = scan(seg);
+      seg->synced   = seg->written.load();
+      seg->sealed   = true;
+      if (seg->header->replayed >= seg->written) {
+        recycle(seg);
+        continue;
+      }
+      seg->replayed = seg->header->replayed;
+      seg->flushed  = seg->replayed;
+      next_pos = seg->base_pos + seg->written;
+      segments.push_back(seg);
+    }
+
+    /* spares of another segment size are of no use */
+    for (size_t i = 0; i < spares.size();) {
+      struct stat st;
+      if (spares.size() > spare_max || stat(spares[i].c_str(), &st) == -1 ||
+          (size_t)st.st_size != header_size + segment_bytes) {
+        unlink(spares[i].c_str());
+        spares.erase(spares.begin() + i);
+      } else {
+        i++;
+      }
+    }
+
+    active = open_segment(next_pos, 0, errstr);
+    if (!active)
+      return false;
+    segments.push_back(active);
+
+    Segment *first = segments.front();
+    replay_pos     = first->base_pos + first->flushed;
+    flushed_pos    = replay_pos.load();
+    end_pos        = next_pos;
+    durable_pos    = next_pos;
+    return true;
+  }
+
+  /**
+   * @brief msync the appended data, then hand the offsets appended before
+   *        it to the durable callback
+   */
+  void sync_once() {
+    std::lock_guard<std::mutex> sync_guard(sync_lock);
+    uint64_t durable = durable_pos.load();
+    {
+      std::lock_guard<std::mutex> guard(segments_lock);
+      for (size_t i = 0; i < segments.size(); i++) {
+        Segment *seg  = segments[i];
+        bool sealed   = seg->sealed.load(std::memory_order_acquire);
+        size_t w      = seg->written.load(std::memory_order_acquire);
+        size_t synced = seg->synced.load();
+        if (synced < w) {
+          /* with the end marker, old data of a spare never passes a scan */
+          size_t start = (size_t)(seg->data - seg->map + synced) & ~(page_size - 1);
+          size_t end   = std::min(w + record_header, seg->data_size);
+          if (msync(seg->map + start, header_size + end - start, MS_SYNC) == -1) {
+            error_cnt++;
+            break;
+          }
+          seg->synced = w;
+        }
+        durable = seg->base_pos + w;
+        if (!sealed)
+          break;
+      }
+    }
+    durable_pos = durable;
+
+    ready.clear();
+    {
+      std::lock_guard<std::mutex> guard(pending_lock);
+      while (pending_cnt > 0 && pending[pending_head].pos <= durable) {
+        ready.push_back(pending[pending_head]);
+        pending_head = (pending_head + 1) & (pending.size() - 1);
+        pending_cnt--;
+      }
+    }
+    /* topics is a deque, its strings stay put while new ones are interned */
+    for (size_t i = 0; i < ready.size(); i++)
+      durable_cb(topics[ready[i].topic], ready[i].partition, ready[i].offset,
+                 durable_opaque);
+  }
+
+  /* pending_lock must be held */
+  uint32_t intern_topic(const std::string &topic) {
+    if (last_topic < topics.size() && topics[last_topic] == topic)
+      return last_topic;
+    for (last_topic = 0; last_topic < topics.size(); last_topic++)
+      if (topics[last_topic] == topic)
+        return last_topic;
+    topics.push_back(topic);
+    return last_topic;
+  }
+
+  /* pending_lock must be held, doubles the ring (power of two) once full */
+  void grow_pending() {
+    std::vector<PendingOffset> grown(pending.size() * 2);
+    for (size_t i = 0; i < pending_cnt; i++)
+      grown[i] = pending[(pending_head + i) & (pending.size() - 1)];
+    pending.swap(grown);
+    pending_head = 0;
+  }
+
+  void sync_loop() {
+    while (running.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(sync_ms));
+      sync_once();
+    }
+  }
+
+  /* write the records of seg from off up to end to the sink */
+  size_t replay_records(Segment *seg, size_t off, size_t end) {
+    while (off < end) {
+      uint32_t len, chk;
+      memcpy(&len, seg->data + off, 4);
+      memcpy(&chk, seg->data + off + 4, 4);
+      const char *p = seg->data + off + record_header;
+      if (len == 0 || off + padded(len) > end ||
+          check(p, len, seg->base_pos + off) != chk) {
+        /* can not happen for appended data: skip the rest */
+        error_cnt++;
+        return end;
+      }
+      sink->write(p, len);
+      replayed_bytes += len;
+      off += padded(len);
+    }
+    return off;
+  }
+
+  /* persist the replay positions the sink has flushed since */
+  void persist_flushed() {
+    int64_t flushed = sink->get_bytes_flushed();
+    while (!flush_marks.empty() && flush_marks.front().sink_bytes <= flushed) {
+      FlushMark &m          = flush_marks.front();
+      m.seg->flushed        = m.off;
+      m.seg->header->replayed = m.off;
+      flushed_pos           = m.seg->base_pos + m.off;
+
+      /* flushed and durable pages are not needed in memory anymore */
+      size_t release = std::min(m.off, m.seg->synced.load()) & ~(page_size - 1);
+      if (release > m.seg->released) {
+        madvise(m.seg->data + m.seg->released, release - m.seg->released,
+                MADV_DONTNEED);
+        m.seg->released = release;
+      }
+      flush_marks.pop_front();
+    }
+  }
+
+  void replay_loop() {
+    while (true) {
+      persist_flushed();
+
+      Segment *seg = NULL;
+      size_t w     = 0;
+      {
+        std::lock_guard<std::mutex> guard(segments_lock);
+        Segment *front = segments.front();
+        if (segments.size() > 1 &&
+            front->sealed.load(std::memory_order_acquire) &&
+            front->flushed == front->written.load() &&
+            front->synced.load() == front->flushed) {
+          segments.pop_front();
+          recycle(front);
+          continue;
+        }
+        for (size_t i = 0; i < segments.size(); i++) {
+          bool sealed = segments[i]->sealed.load(std::memory_order_acquire);
+          w           = segments[i]->written.load(std::memory_order_acquire);
+          if (segments[i]->replayed < w) {
+            seg = segments[i];
+            break;
+          }
+          if (!sealed)
+            break;
+        }
+      }
+
+      if (seg) {
+        seg->replayed = replay_records(seg, seg->replayed, w);
+        replay_pos    = seg->base_pos + seg->replayed;
+        FlushMark m;
+        m.sink_bytes = sink->get_bytes_appended();
+        m.seg        = seg;
+        m.off        = seg->replayed;
+        flush_marks.push_back(m);
+        {
+          std::lock_guard<std::mutex> guard(append_lock);
+          space_cv.notify_all();
+        }
+        continue;
+      }
+
+      if (!running.load())
+        break;
+      std::unique_lock<std::mutex> ul(replay_wait_lock);
+      replay_cv.wait_for(ul, std::chrono::milliseconds(10));
+    }
+  }
+
+  SpillLog()
+      : active(NULL),
+        end_pos(0),
+        durable_pos(0),
+        replay_pos(0),
+        flushed_pos(0),
+        running(false),
+        appended_bytes(0),
+        replayed_bytes(0),
+        backpressure_cnt(0),
+        error_cnt(0),
+        recycled_cnt(0) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+
+ public:
+  ~SpillLog() {
+    close(0);
+    for (size_t i = 0; i < segments.size(); i++)
+      unmap(segments[i]);
+  }
+
+  /**
+   * @brief open the spill log in dir (created if missing) in front of sink.
+   *        Segments of a previous run are replayed first.
+   * @param durable_cb called from the sync thread with the deferred offsets
+   */
+  static SpillLog *create(const std::string &dir,
+                          size_t segment_bytes,
+                          int segment_ms,
+                          uint64_t max_bytes,
+                          int sync_ms,
+                          OutputSink *sink,
+                          durable_cb_t *durable_cb,
+                          void *durable_opaque,
+                          std::string &errstr) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      errstr = "failed to create spill dir " + dir + ": " + strerror(errno);
+      return NULL;
+    }
+    SpillLog *log       = new SpillLog();
+    log->dir            = dir;
+    log->segment_bytes  = (segment_bytes + 7) & ~(size_t)7;
+    log->segment_ms     = segment_ms;
+    log->max_bytes      = max_bytes;
+    log->sync_ms        = sync_ms;
+    log->sink           = sink;
+    log->durable_cb     = durable_cb;
+    log->durable_opaque = durable_opaque;
+    log->pending.resize(pending_init);
+    log->ready.reserve(pending_init);
+    log->pending_head = 0;
+    log->pending_cnt  = 0;
+    log->last_topic   = 0;
+    if (!log->recover(errstr)) {
+      delete log;
+      return NULL;
+    }
+    log->running       = true;
+    log->sync_thread   = std::thread(&SpillLog::sync_loop, log);
+    log->replay_thread = std::thread(&SpillLog::replay_loop, log);
+    return log;
+  }
+
+  /**
+   * @brief append all iovecs as one record, blocks while max_bytes are
+   *        waiting for replay
+   * @returns false if no segment could be opened (record not spilled)
+   */
+  bool append(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+      len += iov[i].iov_len;
+    if (len == 0)
+      return true;
+    size_t rec = padded(len);
+
+    std::unique_lock<std::mutex> ul(append_lock);
+    if (end_pos.load() - replay_pos.load() + rec > max_bytes) {
+      backpressure_cnt++;
+      while (end_pos.load() - replay_pos.load() + rec > max_bytes &&
+             replay_pos.load() < end_pos.load() && running.load())
+        space_cv.wait_for(ul, std::chrono::milliseconds(100));
+    }
+
+    size_t off = active->written.load(std::memory_order_relaxed);
+    if (off + rec > active->data_size ||
+        (off > 0 && std::chrono::steady_clock::now() - active->created >=
+                        std::chrono::milliseconds(segment_ms))) {
+      std::string errstr;
+      std::lock_guard<std::mutex> guard(segments_lock);
+      Segment *next = open_segment(active->base_pos + off, rec, errstr);
+      if (!next) {
+        error_cnt++;
+        return false;
+      }
+      active->sealed.store(true, std::memory_order_release);
+      segments.push_back(next);
+      active = next;
+      off    = 0;
+    }
+
+    char *p      = active->data + off;
+    uint32_t len32 = (uint32_t)len;
+    char *d      = p + record_header;
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(d, iov[i].iov_base, iov[i].iov_len);
+      d += iov[i].iov_len;
+    }
+    uint32_t chk = check(p + record_header, len, active->base_pos + off);
+    memcpy(p, &len32, 4);
+    memcpy(p + 4, &chk, 4);
+    if (off + rec + record_header <= active->data_size)
+      memset(p + rec, 0, record_header); /* end marker */
+    active->written.store(off + rec, std::memory_order_release);
+    end_pos = active->base_pos + off + rec;
+    appended_bytes += len;
+    ul.unlock();
+
+    replay_cv.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief pass offset to the durable callback once everything appended
+   *        so far is durable.
+   *
+   * Does not allocate in steady state: topics are interned once and the
+   * entries live in a preallocated ring that only grows when it is full.
+   */
+  void defer_offset(const std::string &topic, int32_t partition, int64_t offset) {
+    uint64_t pos = end_pos.load();
+    if (pos <= durable_pos.load()) {
+      durable_cb(topic, partition, offset, durable_opaque);
+      return;
+    }
+    std::lock_guard<std::mutex> guard(pending_lock);
+    if (pending_cnt == pending.size())
+      grow_pending();
+    PendingOffset &po = pending[(pending_head + pending_cnt) & (pending.size() - 1)];
+    po.pos       = pos;
+    po.topic     = intern_topic(topic);
+    po.partition = partition;
+    po.offset    = offset;
+    pending_cnt++;
+  }
+
+  /**
+   * @brief make everything appended durable now and run the durable
+   *        callback for all deferred offsets, e.g. before a commit
+   */
+  void sync() {
+    sync_once();
+  }
+
+  /**
+   * @brief sync, wait (at most drain_timeout_ms) for the replay to be
+   *        flushed by the sink and stop the threads. Data not flushed yet
+   *        stays on disk for the next run.
+   */
+  void close(int drain_timeout_ms) {
+    if (!running.load())
+      return;
+    sync_once();
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(drain_timeout_ms);
+    while (flushed_pos.load() < end_pos.load() &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    running = false;
+    replay_cv.notify_one();
+    {
+      std::lock_guard<std::mutex> guard(append_lock);
+      space_cv.notify_all();
+    }
+    sync_thread.join();
+    replay_thread.join();
+    sync_once();
+  }
+
+  /**
+   * @returns bytes not flushed by the sink yet, replayed again after a crash
+   */
+  uint64_t get_pending_bytes() {
+    return end_pos.load() - flushed_pos.load();
+  }
+
+  uint64_t get_unsynced_bytes() {
+    return end_pos.load() - durable_pos.load();
+  }
+
+  uint64_t get_appended_bytes() {
+    return appended_bytes.load();
+  }
+
+  uint64_t get_replayed_bytes() {
+    return replayed_bytes.load();
+  }
+
+  size_t get_segment_cnt() {
+    std::lock_guard<std::mutex> guard(segments_lock);
+    return segments.size();
+  }
+
+  long get_recycled_cnt() {
+    return recycled_cnt.load();
+  }
+
+  long get_backpressure_cnt() {
+    return backpressure_cnt.load();
+  }
+
+  long get_error_cnt() {
+    return error_cnt.load();
+  }
+};
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef TOPIC_SCHEDULER_CPP
+#define TOPIC_SCHEDULER_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafkacpp.h>
+
+#include "./async_log.cpp"
+#include "./partition_engine.cpp"
+
+
+/**
+ * @brief Weighted fair scheduling of the topics of one consumer
+ *
+ * Every assigned partition keeps its messages in its own queue (not
+ * forwarded to the consumer queue), so nothing is handed to a handler before
+ * the scheduler picks it. Each round, every topic gets weight * quantum
+ * messages of credit (deficit round robin) and is served round robin over
+ * its partitions until the credit is used or its queues are empty: while
+ * topics compete, they get messages in proportion to their weight, an idle
+ * topic gives its share to the others.
+ *
+ * Topics with a latency target (message timestamp to handler) are served
+ * first in a round once their latency is above the target. Then fetching is
+ * paused for all topics without a target, so a backfill neither competes for
+ * the handler nor for fetch requests and the pre-fetch queue, until the
+ * latency is back below half the target, or the topic had no messages for
+ * as long as its target (it caught up). A target below what one fetch round
+ * trip takes keeps the backfill paused.
+ *
+ * Messages of each topic go to the handler of the first route matching it
+ * (a topic name, or a regex starting with ^), or the default route.
+ *
+ * poll() and the add/remove calls (from the rebalance callback, which is
+ * served by poll()) must be called from the same thread.
+ */
+class TopicScheduler {
+ public:
+  struct Route {
+    std::string pattern;
+    int weight;
+    int latency_ms; /* 0: none */
+    message_handler_t handler;
+    void *opaque;
+  };
+
+  struct TopicStats {
+    std::string topic;
+    int weight;
+    int latency_ms;
+    int64_t latency_avg_ms; /* moving average */
+    long msg_cnt;
+    long hot_cnt;           /* times the latency went above the target */
+    bool paused;
+  };
+
+ private:
+  struct RouteEntry {
+    Route route;
+    bool is_regex;
+    std::regex re;
+  };
+
+  struct Partition {
+    RdKafka::TopicPartition *tp;
+    rd_kafka_queue_t *queue;
+  };
+
+  struct Topic {
+    std::string name;
+    const Route *route;
+    std::vector<Partition> partitions;
+    size_t next;  /* round robin position */
+    long deficit; /* messages left in this round */
+    bool hot;     /* latency above the target */
+    int64_t last_msg_ms;
+    std::atomic<int64_t> latency_avg_ms;
+    std::atomic<long> msg_cnt;
+    std::atomic<long> hot_cnt;
+    std::atomic<bool> paused;
+  };
+
+  static const int quantum = 8; /* messages per unit of weight and round */
+
+  RdKafka::KafkaConsumer *consumer;
+  std::vector<RouteEntry> routes;
+  Route default_route;
+  std::vector<Topic *> topics;
+  std::mutex lock; /* topics, for get_topic_stats() */
+  int wake_fds[2];
+  rd_kafka_queue_t *consumer_queue;
+  bool throttled;
+  std::vector<Topic *> order;
+
+  static int64_t wall_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  const Route *match(const std::string &topic) {
+    for (size_t i = 0; i < routes.size(); i++) {
+      if (routes[i].is_regex ? std::regex_search(topic, routes[i].re)
+                             : topic == routes[i].route.pattern)
+        return &routes[i].route;
+    }
+    return &default_route;
+  }
+
+  Topic *get_topic(const std::string &name) {
+    for (size_t i = 0; i < topics.size(); i++)
+      if (topics[i]->name == name)
+        return topics[i];
+
+    Topic *t   = new Topic();
+    t->name    = name;
+    t->route   = match(name);
+    t->next    = 0;
+    t->deficit = 0;
+    t->hot     = false;
+    t->last_msg_ms    = 0;
+    t->latency_avg_ms = 0;
+    t->msg_cnt        = 0;
+    t->hot_cnt        = 0;
+    t->paused         = false;
+    std::lock_guard<std::mutex> guard(lock);
+    topics.push_back(t);
+    return t;
+  }
+
+  /**
+   * @brief hand msg to the route's handler
+   * @returns its latency (now - message timestamp), -1 if it has none
+   */
+  static int64_t handle(const Route *route, rd_kafka_message_t *msg, int64_t now_ms) {
+    int64_t latency = -1;
+    if (!msg->err) {
+      rd_kafka_timestamp_type_t tstype;
+      int64_t ts = rd_kafka_message_timestamp(msg, &tstype);
+      if (tstype != RD_KAFKA_TIMESTAMP_NOT_AVAILABLE)
+        latency = now_ms > ts ? now_ms - ts : 0;
+    }
+    route->handler(msg, route->opaque);
+    return latency;
+  }
+
+  /**
+   * @brief hand messages of t to its handler until its credit is used or
+   *        all its partition queues are empty
+   * @returns the number of messages handed
+   */
+  long serve(Topic *t, int64_t now_ms) {
+    size_t cnt = t->partitions.size();
+    size_t empty = 0;
+    long served  = 0;
+
+    while (t->deficit > 0 && empty < cnt) {
+      Partition &p = t->partitions[t->next];
+      t->next      = (t->next + 1) % cnt;
+      rd_kafka_message_t *msg = rd_kafka_consume_queue(p.queue, 0);
+      if (!msg) {
+        empty++;
+        continue;
+      }
+      empty           = 0;
+      int64_t latency = handle(t->route, msg, now_ms);
+      rd_kafka_message_destroy(msg);
+      if (latency >= 0) {
+        int64_t avg       = t->latency_avg_ms.load();
+        t->latency_avg_ms = avg + (latency - avg) / 8;
+      }
+      t->msg_cnt++;
+      t->deficit--;
+      served++;
+    }
+
+    if (served > 0)
+      t->last_msg_ms = now_ms;
+    if (empty >= cnt) {
+      /* idle: no credit is saved up, and once idle for its latency target
+       * (nothing waiting, fetches answered) the topic is caught up */
+      t->deficit = 0;
+      if (now_ms - t->last_msg_ms >= std::max(t->route->latency_ms, 10))
+        t->latency_avg_ms = 0;
+    }
+    return served;
+  }
+
+  /* pause (or resume) fetching the topics without a latency target */
+  void throttle(bool on) {
+    std::vector<RdKafka::TopicPartition *> parts;
+    for (size_t i = 0; i < topics.size(); i++) {
+      if (topics[i]->route->latency_ms > 0)
+        continue;
+      topics[i]->paused = on;
+      for (size_t j = 0; j < topics[i]->partitions.size(); j++)
+        parts.push_back(topics[i]->partitions[j].tp);
+    }
+    throttled = on;
+    if (parts.empty())
+      return;
+    RdKafka::ErrorCode err = on ? consumer->pause(parts) : consumer->resume(parts);
+    if (err)
+      ALOG_ERROR("Failed to %s %zu partition(s): %s", on ? "pause" : "resume",
+                 parts.size(), RdKafka::err2str(err).c_str());
+    else
+      ALOG_INFO("%s %zu partition(s) of topics without a latency target",
+                on ? "Paused" : "Resumed", parts.size());
+  }
+
+  void wait(int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd     = wake_fds[0];
+    pfd.events = POLLIN;
+    if (::poll(&pfd, 1, timeout_ms) > 0) {
+      char buf[64];
+      while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+  }
+
+ public:
+  TopicScheduler(RdKafka::KafkaConsumer *consumer)
+      : consumer(consumer),
+        consumer_queue(NULL),
+        throttled(false) {
+    wake_fds[0] = wake_fds[1] = -1;
+    default_route.weight     = 1;
+    default_route.latency_ms = 0;
+    default_route.handler    = NULL;
+    default_route.opaque     = NULL;
+  }
+
+  ~TopicScheduler() {
+    stop();
+    for (size_t i = 0; i < topics.size(); i++) {
+      for (size_t j = 0; j < topics[i]->partitions.size(); j++) {
+        rd_kafka_queue_destroy(topics[i]->partitions[j].queue);
+        delete topics[i]->partitions[j].tp;
+      }
+      delete topics[i];
+    }
+  }
+
+  /**
+   * @brief route the topics matching route.pattern, first match wins.
+   *        Call before start().
+   */
+  bool add_route(const Route &route, std::string &errstr) {
+    RouteEntry entry;
+    entry.route    = route;
+    entry.is_regex = !route.pattern.empty() && route.pattern[0] == '^';
+    if (entry.is_regex) {
+      try {
+        entry.re = std::regex(route.pattern, std::regex::extended);
+      } catch (const std::regex_error &e) {
+        errstr = "invalid topic regex " + route.pattern + ": " + e.what();
+        return false;
+      }
+    }
+    routes.push_back(entry);
+    return true;
+  }
+
+  /**
+   * @brief handler of the topics without a route, and of consumer errors
+   */
+  void set_default_route(message_handler_t handler, void *opaque) {
+    default_route.handler = handler;
+    default_route.opaque  = opaque;
+  }
+
+  bool start(std::string &errstr) {
+    if (pipe(wake_fds) == -1) {
+      errstr = std::string("failed to create wake pipe: ") + strerror(errno);
+      return false;
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    /* rebalances and errors wake the loop as well */
+    consumer_queue = rd_kafka_queue_get_consumer(consumer->c_ptr());
+    rd_kafka_queue_io_event_enable(consumer_queue, wake_fds[1], "1", 1);
+    return true;
+  }
+
+  /**
+   * @brief stop waking the loop, must be called before consumer->close()
+   */
+  void stop() {
+    if (consumer_queue) {
+      rd_kafka_queue_io_event_enable(consumer_queue, -1, NULL, 0);
+      rd_kafka_queue_destroy(consumer_queue);
+      consumer_queue = NULL;
+    }
+    for (size_t i = 0; i < topics.size(); i++)
+      for (size_t j = 0; j < topics[i]->partitions.size(); j++)
+        rd_kafka_queue_io_event_enable(topics[i]->partitions[j].queue, -1, NULL, 0);
+    if (wake_fds[0] != -1) {
+      close(wake_fds[0]);
+      close(wake_fds[1]);
+      wake_fds[0] = wake_fds[1] = -1;
+    }
+  }
+
+  /**
+   * @brief take the queues of newly assigned partitions off the consumer
+   *        queue. Must be called from the rebalance callback, after
+   *        (incremental_)assign().
+   */
+  void add_partitions(const std::vector<RdKafka::TopicPartition *> &assigned) {
+    std::vector<RdKafka::TopicPartition *> paused;
+    for (size_t i = 0; i < assigned.size(); i++) {
+      Topic *t = get_topic(assigned[i]->topic());
+      rd_kafka_queue_t *queue = rd_kafka_queue_get_partition(
+          consumer->c_ptr(), t->name.c_str(), assigned[i]->partition());
+      if (!queue) {
+        ALOG_ERROR("Failed to get queue for %s[%d]", t->name.c_str(),
+                   (int)assigned[i]->partition());
+        continue;
+      }
+      rd_kafka_queue_forward(queue, NULL);
+      rd_kafka_queue_io_event_enable(queue, wake_fds[1], "1", 1);
+      Partition p;
+      p.tp    = RdKafka::TopicPartition::create(t->name, assigned[i]->partition());
+      p.queue = queue;
+      t->partitions.push_back(p);
+      if (throttled && t->route->latency_ms == 0)
+        paused.push_back(p.tp);
+    }
+    if (!paused.empty())
+      consumer->pause(paused);
+  }
+
+  /**
+   * @brief forget revoked partitions, their queued messages are dropped
+   *        (redelivered to the new owner). Must be called from the rebalance
+   *        callback, before (incremental_)unassign().
+   */
+  void remove_partitions(const std::vector<RdKafka::TopicPartition *> &revoked) {
+    for (size_t i = 0; i < revoked.size(); i++) {
+      for (size_t k = 0; k < topics.size(); k++) {
+        Topic *t = topics[k];
+        if (t->name != revoked[i]->topic())
+          continue;
+        for (size_t j = 0; j < t->partitions.size(); j++) {
+          if (t->partitions[j].tp->partition() != revoked[i]->partition())
+            continue;
+          rd_kafka_queue_io_event_enable(t->partitions[j].queue, -1, NULL, 0);
+          rd_kafka_queue_destroy(t->partitions[j].queue);
+          delete t->partitions[j].tp;
+          t->partitions.erase(t->partitions.begin() + j);
+          t->next = 0;
+          break;
+        }
+      }
+    }
+  }
+
+  /**
+   * @brief serve rebalances and errors, then one scheduling round; waits up
+   *        to timeout_ms for messages if there were none
+   * @returns the number of messages handed to the handlers
+   */
+  long poll(int timeout_ms) {
+    /* rebalances (served inside the poll), errors, and messages fetched
+     * before their partition queue was taken off the consumer queue */
+    rd_kafka_message_t *msg = rd_kafka_consumer_poll(consumer->c_ptr(), 0);
+    if (msg) {
+      handle(msg->rkt ? get_topic(rd_kafka_topic_name(msg->rkt))->route
+                      : &default_route,
+             msg, wall_ms());
+      rd_kafka_message_destroy(msg);
+    }
+
+    int64_t now_ms = wall_ms();
+    bool any_hot   = false;
+    order.clear();
+    for (size_t i = 0; i < topics.size(); i++) {
+      Topic *t       = topics[i];
+      int target     = t->route->latency_ms;
+      int64_t avg_ms = t->latency_avg_ms.load();
+      if (target > 0 && !t->hot && avg_ms > target) {
+        t->hot = true;
+        t->hot_cnt++;
+      } else if (t->hot && avg_ms <= target / 2) {
+        t->hot = false;
+      }
+      any_hot |= t->hot;
+      if (t->hot)
+        order.push_back(t);
+    }
+    for (size_t i = 0; i < topics.size(); i++)
+      if (!topics[i]->hot)
+        order.push_back(topics[i]);
+
+    long served = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+      if (order[i]->partitions.empty())
+        continue;
+      order[i]->deficit += (long)order[i]->route->weight * quantum;
+      served += serve(order[i], now_ms);
+    }
+
+    if (any_hot != throttled)
+      throttle(any_hot);
+    if (served == 0)
+      wait(timeout_ms);
+    return served;
+  }
+
+  std::vector<TopicStats> get_topic_stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<TopicStats> stats;
+    for (size_t i = 0; i < topics.size(); i++) {
+      TopicStats s;
+      s.topic          = topics[i]->name;
+      s.weight         = topics[i]->route->weight;
+      s.latency_ms     = topics[i]->route->latency_ms;
+      s.latency_avg_ms = topics[i]->latency_avg_ms.load();
+      s.msg_cnt        = topics[i]->msg_cnt.load();
+      s.hot_cnt        = topics[i]->hot_cnt.load();
+      s.paused         = topics[i]->paused.load();
+      stats.push_back(s);
+    }
+    return stats;
+  }
+};
+
+#endif
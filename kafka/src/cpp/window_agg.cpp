@@ -0,0 +1,793 @@
+#ifndef WINDOW_AGG_CPP
+#define WINDOW_AGG_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "../common/payload_inspect.c"
+
+
+/**
+ * @brief Count, sum, min and max per message key over tumbling or hopping
+ *        event-time windows
+ *
+ * A message (by its timestamp) belongs to size_ms / hop_ms windows, starting
+ * at multiples of hop_ms (hop_ms == size_ms: tumbling windows). Each window
+ * is a set of open-addressing tables with linear probing, one per shard of
+ * the key hash, each behind its own lock. Keys are hashed once per message:
+ * a slot is 8 bytes, 32 bits of the hash and the key's offset in a byte
+ * array, so probing compares the hash bits of 8 slots per cache line and
+ * only reads the key on a match. Keys are numbered in the order of
+ * insertion and the accumulators are dense arrays by key number (a struct
+ * of arrays, empty slots cost no accumulators): counting only touches the
+ * counts, and the sum/min/max array (a key's three values, 24 bytes,
+ * are updated together) only exists if a value field is configured.
+ * Closing a window reads the keys and accumulators in order. Tables of
+ * closed windows are kept for reuse.
+ *
+ * Every partition has a watermark, the highest timestamp aggregated from
+ * it. A window is closed once the lowest watermark of the partitions is
+ * grace_ms past its end: a partition behind in event time holds the
+ * windows open rather than having its messages counted as late. Revoked
+ * partitions and partitions without messages for idle_ms are left out
+ * (without any messages, time moves on from the highest timestamp seen).
+ * The rows of a closed window are emitted as JSON lines, later messages
+ * for it are counted as late and not aggregated.
+ *
+ * Offsets are committed in step with the emitted windows: for every
+ * partition, the offset handed to commit_cb after a close is the first
+ * offset aggregated into a window that is still open (or the one after the
+ * last aggregated message). Open windows are not emitted on stop, the next
+ * run rebuilds them from the committed offsets.
+ *
+ * With hopping windows that is at-least-once: a message is in several
+ * windows, so the committed offset is also inside windows that were
+ * already emitted. The next run reads those messages again and emits
+ * those windows a second time, with only the part of their messages from
+ * the committed offset on. Tumbling windows do not overlap and are
+ * emitted once.
+ */
+class WindowAggregator {
+ public:
+  struct Options {
+    int64_t size_ms;
+    int64_t hop_ms;   /* == size_ms: tumbling */
+    int64_t grace_ms; /* wait for late messages after a window's end */
+    int64_t idle_ms;  /* partitions without messages stop holding back */
+    std::string field; /* JSON field of the value, empty: count only */
+  };
+
+  /* rows of closed windows, whole JSON lines */
+  typedef void (*emit_cb_t)(const struct iovec *iov, int iovcnt);
+  /* offset: the next offset to commit for the partition */
+  typedef void (*commit_cb_t)(const std::string &topic,
+                              int32_t partition,
+                              int64_t offset);
+
+ private:
+  static const size_t shard_cnt = 16; /* power of two */
+
+  /* a key's tag (32 bits of its hash, 0: empty) and where it is */
+  struct Slot {
+    uint32_t tag;
+    uint32_t key_off;
+  };
+
+  /* sum, min and max of a key, updated together: 24 bytes, adjacent */
+  struct Values {
+    double sum;
+    double min;
+    double max;
+  };
+
+  /* one window of one shard, keys are numbered in the order of insertion */
+  struct Table {
+    int64_t start;
+    size_t mask;
+    bool has_value;
+    std::vector<Slot> slots;
+    std::vector<char> keys; /* per key: id, length, bytes */
+    std::vector<int64_t> counts; /* by key id */
+    std::vector<Values> values;  /* by key id, with a value field */
+
+    Table(bool has_value) : start(0), mask(0), has_value(has_value) {
+      init_slots(1024);
+    }
+
+    void init_slots(size_t n) {
+      Slot empty = {0, 0};
+      mask       = n - 1;
+      slots.assign(n, empty);
+    }
+
+    size_t size() const {
+      return counts.size();
+    }
+
+    void clear() {
+      memset(&slots[0], 0, slots.size() * sizeof(Slot));
+      keys.clear();
+      counts.clear();
+      values.clear();
+    }
+
+    static uint32_t tag(uint64_t h) {
+      return (uint32_t)(h >> 32) | 1;
+    }
+
+    /* double the slots, the keys are rehashed in the order of insertion */
+    void grow() {
+      init_slots(slots.size() * 2);
+      for (size_t off = 0; off < keys.size();) {
+        uint32_t len;
+        memcpy(&len, &keys[off + 4], 4);
+        uint64_t h = hash(&keys[off + 8], len);
+        size_t i   = h & mask;
+        while (slots[i].tag)
+          i = (i + 1) & mask;
+        slots[i].tag     = tag(h);
+        slots[i].key_off = (uint32_t)off;
+        off += 8 + len;
+      }
+    }
+
+    /* @returns the id of the key, inserted if missing */
+    uint32_t upsert(uint64_t h, const char *key, uint32_t len) {
+      if (counts.size() >= mask / 4 * 3)
+        grow();
+      uint32_t t = tag(h);
+      for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const Slot &s = slots[i];
+        if (s.tag == t) {
+          const char *e = &keys[s.key_off];
+          uint32_t id, elen;
+          memcpy(&id, e, 4);
+          memcpy(&elen, e + 4, 4);
+          if (elen == len && !memcmp(e + 8, key, len))
+            return id;
+          continue;
+        }
+        if (s.tag)
+          continue;
+        uint32_t id      = (uint32_t)counts.size();
+        slots[i].tag     = t;
+        slots[i].key_off = (uint32_t)keys.size();
+        keys.insert(keys.end(), (const char *)&id, (const char *)&id + 4);
+        keys.insert(keys.end(), (const char *)&len, (const char *)&len + 4);
+        keys.insert(keys.end(), key, key + len);
+        counts.push_back(0);
+        if (has_value) {
+          Values v = {0, std::numeric_limits<double>::infinity(),
+                      -std::numeric_limits<double>::infinity()};
+          values.push_back(v);
+        }
+        return id;
+      }
+    }
+
+    size_t memory_bytes() const {
+      return slots.capacity() * sizeof(Slot) + keys.capacity() +
+             counts.capacity() * sizeof(int64_t) +
+             values.capacity() * sizeof(Values);
+    }
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::vector<Table *> open; /* by start */
+    std::vector<Table *> spare;
+  };
+
+  /* aggregated offsets and event time of a partition */
+  struct Track {
+    int64_t last_offset; /* -1: no message yet */
+    int64_t committed;
+    int64_t watermark; /* highest timestamp aggregated, min(): none yet */
+    uint64_t msg_cnt;  /* aggregated, tick() marks it idle once unchanged */
+    uint64_t tick_msg_cnt;
+    int64_t active_ms; /* tick(): msg_cnt last changed */
+    bool idle;         /* not holding back the watermark */
+    std::map<int64_t, int64_t> first_offsets; /* open window start: offset */
+  };
+
+  typedef std::pair<std::string, int32_t> partition_key_t;
+
+  Options opts;
+  std::string field_quoted; /* "field" */
+  emit_cb_t emit_cb;
+  commit_cb_t commit_cb;
+  Shard *shards;
+
+  std::atomic<int64_t> watermark;     /* lowest of the partitions' watermarks */
+  std::atomic<int64_t> max_timestamp; /* highest timestamp seen */
+  std::atomic<int64_t> closed_until;  /* windows ending at or before: closed */
+  std::atomic<int64_t> next_end;      /* end of the oldest open window */
+  std::mutex close_lock;
+  uint64_t idle_msg_cnt; /* tick(): msg_cnt at idle_since_ms */
+  int64_t idle_since_ms;
+  int64_t idle_check_ms; /* tick(): partitions last checked for idleness */
+
+  std::mutex track_lock;
+  std::map<partition_key_t, Track> tracks;
+  partition_key_t lookup_key; /* reused, a key per lookup would allocate */
+  std::map<partition_key_t, Track>::iterator last_track; /* tracks.end(): none */
+
+  std::atomic<uint64_t> msg_cnt;
+  std::atomic<uint64_t> late_cnt;
+  std::atomic<uint64_t> no_value_cnt;
+  std::atomic<uint64_t> window_cnt;
+  std::atomic<uint64_t> row_cnt;
+  std::atomic<int64_t> emit_us;
+
+  static int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /* lock must be held */
+  Table *window_table(Shard &s, int64_t start) {
+    std::vector<Table *>::iterator it = s.open.begin();
+    for (; it != s.open.end() && (*it)->start <= start; ++it)
+      if ((*it)->start == start)
+        return *it;
+    Table *t;
+    if (!s.spare.empty()) {
+      t = s.spare.back();
+      s.spare.pop_back();
+    } else {
+      t = new Table(!opts.field.empty());
+    }
+    t->start = start;
+    s.open.insert(it, t);
+    lower_next_end(start + opts.size_ms);
+    return t;
+  }
+
+  void lower_next_end(int64_t end) {
+    int64_t cur = next_end.load();
+    while (end < cur && !next_end.compare_exchange_weak(cur, end))
+      ;
+  }
+
+  /* the value of the configured field of a JSON payload */
+  bool parse_value(const char *payload, size_t len, double *value) const {
+    const char *end = payload + len;
+    const char *p   = payload;
+    size_t flen     = field_quoted.size();
+    while (true) {
+      p = (const char *)memchr(p, '"', end - p);
+      if (!p || (size_t)(end - p) < flen)
+        return false;
+      if (memcmp(p, field_quoted.data(), flen)) {
+        p++;
+        continue;
+      }
+      p += flen;
+      while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+      if (p < end && *p == ':')
+        break;
+    }
+    for (p++; p < end && (*p == ' ' || *p == '\t' || *p == '"'); p++)
+      ;
+    char buf[64];
+    size_t n = std::min((size_t)(end - p), sizeof(buf) - 1);
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    char *num_end;
+    *value = strtod(buf, &num_end);
+    return num_end != buf && std::isfinite(*value);
+  }
+
+  /* valid UTF-8 is kept, control characters are escaped and invalid
+   * bytes replaced by U+FFFD */
+  static void append_json_string(std::string &out, const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    out += '"';
+    for (size_t i = 0; i < len;) {
+      unsigned char c = u[i];
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += (char)c;
+        i++;
+      } else if (c < 0x20 || c == 0x7f) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        out += esc;
+        i++;
+      } else if (c < 0x80) {
+        out += (char)c;
+        i++;
+      } else {
+        size_t n = utf8_seq_len(u + i, len - i);
+        if (n)
+          out.append(s + i, n);
+        else
+          out += "\\ufffd";
+        i += n ? n : 1;
+      }
+    }
+    out += '"';
+  }
+
+  void flush_rows(std::string &out) {
+    if (out.empty())
+      return;
+    struct iovec iov;
+    iov.iov_base = (void *)out.data();
+    iov.iov_len  = out.size();
+    emit_cb(&iov, 1);
+    out.clear();
+  }
+
+  void emit(Table *t, std::string &out) {
+    char prefix[96], num[160];
+    int prefix_len = snprintf(prefix, sizeof(prefix),
+                              "{\"window_start\":%lld,\"window_end\":%lld,\"key\":",
+                              (long long)t->start,
+                              (long long)(t->start + opts.size_ms));
+    for (size_t off = 0, id = 0; off < t->keys.size(); id++) {
+      uint32_t len;
+      int n;
+      memcpy(&len, &t->keys[off + 4], 4);
+      out.append(prefix, prefix_len);
+      append_json_string(out, &t->keys[off + 8], len);
+      off += 8 + len;
+      if (t->has_value && t->values[id].min <= t->values[id].max)
+        n = snprintf(num, sizeof(num),
+                     ",\"count\":%lld,\"sum\":%.17g,\"min\":%.17g,\"max\":%.17g}\n",
+                     (long long)t->counts[id], t->values[id].sum,
+                     t->values[id].min, t->values[id].max);
+      else
+        n = snprintf(num, sizeof(num), ",\"count\":%lld}\n",
+                     (long long)t->counts[id]);
+      out.append(num, n);
+      if (out.size() >= 64 * 1024)
+        flush_rows(out);
+    }
+    row_cnt.fetch_add(t->size(), std::memory_order_relaxed);
+  }
+
+  /* close the windows ending at or before until */
+  void close(int64_t until) {
+    std::lock_guard<std::mutex> guard(close_lock);
+    if (until <= closed_until.load())
+      return;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    closed_until = until;
+
+    /* all shards' tables of a window are emitted together */
+    std::map<int64_t, std::vector<std::pair<size_t, Table *> > > closing;
+    next_end = std::numeric_limits<int64_t>::max();
+    for (size_t i = 0; i < shard_cnt; i++) {
+      std::lock_guard<std::mutex> sguard(shards[i].lock);
+      std::vector<Table *> &open = shards[i].open;
+      size_t n = 0;
+      for (; n < open.size() && open[n]->start + opts.size_ms <= until; n++)
+        closing[open[n]->start].push_back(std::make_pair(i, open[n]));
+      open.erase(open.begin(), open.begin() + n);
+      if (!open.empty())
+        lower_next_end(open[0]->start + opts.size_ms);
+    }
+
+    std::string out;
+    for (std::map<int64_t, std::vector<std::pair<size_t, Table *> > >::iterator
+             it = closing.begin();
+         it != closing.end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); i++)
+        emit(it->second[i].second, out);
+      window_cnt++;
+    }
+    flush_rows(out);
+    for (std::map<int64_t, std::vector<std::pair<size_t, Table *> > >::iterator
+             it = closing.begin();
+         it != closing.end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); i++) {
+        Table *t = it->second[i].second;
+        t->clear();
+        Shard &s = shards[it->second[i].first];
+        std::lock_guard<std::mutex> sguard(s.lock);
+        s.spare.push_back(t);
+      }
+    }
+
+    /* commit what is in no open window anymore */
+    std::vector<std::pair<partition_key_t, int64_t> > commits;
+    {
+      std::lock_guard<std::mutex> tguard(track_lock);
+      for (std::map<partition_key_t, Track>::iterator it = tracks.begin();
+           it != tracks.end(); ++it) {
+        Track &tr = it->second;
+        if (tr.last_offset < 0)
+          continue;
+        while (!tr.first_offsets.empty() &&
+               tr.first_offsets.begin()->first + opts.size_ms <= until)
+          tr.first_offsets.erase(tr.first_offsets.begin());
+        int64_t offset = tr.last_offset + 1;
+        for (std::map<int64_t, int64_t>::iterator w = tr.first_offsets.begin();
+             w != tr.first_offsets.end(); ++w)
+          offset = std::min(offset, w->second);
+        if (offset > tr.committed) {
+          tr.committed = offset;
+          commits.push_back(std::make_pair(it->first, offset));
+        }
+      }
+    }
+    if (commit_cb)
+      for (size_t i = 0; i < commits.size(); i++)
+        commit_cb(commits[i].first.first, commits[i].first.second,
+                  commits[i].second);
+
+    emit_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  }
+
+  static Track new_track(int64_t last_offset) {
+    Track tr;
+    tr.last_offset  = last_offset;
+    tr.committed    = -1;
+    tr.watermark    = std::numeric_limits<int64_t>::min();
+    tr.msg_cnt      = 0;
+    tr.tick_msg_cnt = 0;
+    tr.active_ms    = steady_ms();
+    tr.idle         = false;
+    return tr;
+  }
+
+  /* track_lock must be held: raise the watermark to the lowest one of the
+   * partitions that are not idle. @returns the watermark */
+  int64_t update_watermark() {
+    int64_t low = std::numeric_limits<int64_t>::max();
+    for (std::map<partition_key_t, Track>::iterator it = tracks.begin();
+         it != tracks.end(); ++it)
+      if (!it->second.idle)
+        low = std::min(low, it->second.watermark);
+    int64_t wm = watermark.load();
+    /* all idle: tick() moves time on */
+    if (low != std::numeric_limits<int64_t>::max() && low > wm) {
+      watermark = low;
+      wm        = low;
+    }
+    return wm;
+  }
+
+  /* close the windows the watermark wm is grace_ms past */
+  void maybe_close(int64_t wm) {
+    if (wm != std::numeric_limits<int64_t>::min() &&
+        wm - opts.grace_ms >= next_end.load(std::memory_order_relaxed))
+      close(wm - opts.grace_ms);
+  }
+
+  /* the message at offset (timestamp_ms, min(): not aggregated) is
+   * aggregated into the windows first..last (none: first < 0).
+   * @returns the watermark */
+  int64_t track(const char *topic,
+                int32_t partition,
+                int64_t offset,
+                int64_t timestamp_ms,
+                int64_t first,
+                int64_t last) {
+    std::lock_guard<std::mutex> guard(track_lock);
+    std::map<partition_key_t, Track>::iterator it = last_track;
+    if (it != tracks.end() && it->first.second == partition &&
+        it->first.first == topic) {
+      /* the same partition as the last message, most of the time */
+    } else {
+      lookup_key.first.assign(topic);
+      lookup_key.second = partition;
+      it = tracks.find(lookup_key);
+    }
+    if (it == tracks.end())
+      it = tracks.insert(std::make_pair(lookup_key, new_track(offset - 1))).first;
+    last_track             = it;
+    it->second.last_offset = offset;
+    /* closed meanwhile: emitted with the message in it */
+    int64_t closed = closed_until.load();
+    std::map<int64_t, int64_t> &first_offsets = it->second.first_offsets;
+    for (int64_t start = first; first >= 0 && start <= last;
+         start += opts.hop_ms) {
+      if (start + opts.size_ms <= closed)
+        continue;
+      /* insert(pair) may allocate a node before finding the window */
+      std::map<int64_t, int64_t>::iterator w = first_offsets.lower_bound(start);
+      if (w == first_offsets.end() || w->first != start)
+        first_offsets.insert(w, std::make_pair(start, offset));
+    }
+
+    Track &tr = it->second;
+    if (timestamp_ms == std::numeric_limits<int64_t>::min())
+      return watermark.load();
+    tr.msg_cnt++;
+    tr.idle = false;
+    if (timestamp_ms <= tr.watermark)
+      return watermark.load();
+    /* only the partitions at the lowest watermark can raise it */
+    bool lowest  = tr.watermark <= watermark.load();
+    tr.watermark = timestamp_ms;
+    return lowest ? update_watermark() : watermark.load();
+  }
+
+ public:
+  WindowAggregator(const Options &options, emit_cb_t emit_cb,
+                   commit_cb_t commit_cb)
+      : opts(options),
+        field_quoted("\"" + options.field + "\""),
+        emit_cb(emit_cb),
+        commit_cb(commit_cb),
+        watermark(std::numeric_limits<int64_t>::min()),
+        max_timestamp(std::numeric_limits<int64_t>::min()),
+        closed_until(std::numeric_limits<int64_t>::min()),
+        next_end(std::numeric_limits<int64_t>::max()),
+        idle_msg_cnt(0),
+        idle_since_ms(steady_ms()),
+        idle_check_ms(idle_since_ms),
+        msg_cnt(0),
+        late_cnt(0),
+        no_value_cnt(0),
+        window_cnt(0),
+        row_cnt(0),
+        emit_us(0) {
+    shards     = new Shard[shard_cnt];
+    last_track = tracks.end();
+  }
+
+  ~WindowAggregator() {
+    for (size_t i = 0; i < shard_cnt; i++) {
+      for (size_t j = 0; j < shards[i].open.size(); j++)
+        delete shards[i].open[j];
+      for (size_t j = 0; j < shards[i].spare.size(); j++)
+        delete shards[i].spare[j];
+    }
+    delete[] shards;
+  }
+
+  /**
+   * @brief 64-bit hash of a key, 8 bytes per step, never 0 (an empty slot)
+   */
+  static uint64_t hash(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h             = 0x9e3779b97f4a7c15ull ^ (len * 0xff51afd7ed558ccdull);
+    for (; len >= 8; p += 8, len -= 8) {
+      uint64_t k;
+      memcpy(&k, p, 8);
+      k *= 0x87c37b91114253d5ull;
+      k = (k << 31) | (k >> 33);
+      h = ((h ^ k) << 27 | (h ^ k) >> 37) * 5 + 0x52dce729;
+    }
+    uint64_t k = 0;
+    for (size_t i = 0; i < len; i++)
+      k |= (uint64_t)p[i] << (8 * i);
+    h ^= k * 0x4cf5ad432745937full;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h ? h : 1;
+  }
+
+  /**
+   * @brief aggregate a message into the windows of its timestamp_ms.
+   *        Thread-safe, the messages of a partition must come in order
+   *        from one thread.
+   */
+  void add(const char *topic,
+           int32_t partition,
+           int64_t offset,
+           int64_t timestamp_ms,
+           const char *key,
+           size_t key_len,
+           const char *payload,
+           size_t len) {
+    uint64_t h     = hash(key, key_len);
+    double value   = 0;
+    bool has_value = !opts.field.empty() && payload &&
+                     parse_value(payload, len, &value);
+    if (!opts.field.empty() && !has_value)
+      no_value_cnt.fetch_add(1, std::memory_order_relaxed);
+    msg_cnt.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t last  = timestamp_ms - timestamp_ms % opts.hop_ms;
+    int64_t first = std::max((int64_t)0, last - opts.size_ms + opts.hop_ms);
+    int64_t added_first = -1, added_last = -1;
+    {
+      Shard &s = shards[h >> 60];
+      std::lock_guard<std::mutex> guard(s.lock);
+      int64_t closed = closed_until.load();
+      for (int64_t start = first; start <= last; start += opts.hop_ms) {
+        if (start + opts.size_ms <= closed)
+          continue;
+        Table *t = window_table(s, start);
+        uint32_t id = t->upsert(h, key, (uint32_t)key_len);
+        t->counts[id]++;
+        if (has_value) {
+          Values &v = t->values[id];
+          v.sum += value;
+          v.min = std::min(v.min, value);
+          v.max = std::max(v.max, value);
+        }
+        if (added_first < 0)
+          added_first = start;
+        added_last = start;
+      }
+    }
+    if (added_first < 0)
+      late_cnt.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t wm = track(topic, partition, offset, timestamp_ms, added_first,
+                       added_last);
+
+    int64_t max = max_timestamp.load(std::memory_order_relaxed);
+    while (timestamp_ms > max &&
+           !max_timestamp.compare_exchange_weak(max, timestamp_ms))
+      ;
+    maybe_close(wm);
+  }
+
+  /**
+   * @brief a message not aggregated (filtered out): its offset may be
+   *        committed with the next closed window
+   */
+  void skipped(const char *topic, int32_t partition, int64_t offset) {
+    track(topic, partition, offset, std::numeric_limits<int64_t>::min(), -1,
+          -1);
+  }
+
+  /**
+   * @brief an assigned partition holds back the watermark from now on,
+   *        until its first message or until it is idle for idle_ms.
+   *        Partitions are also tracked from their first message without.
+   */
+  void assign_partition(const std::string &topic, int32_t partition) {
+    std::lock_guard<std::mutex> guard(track_lock);
+    partition_key_t key(topic, partition);
+    if (tracks.find(key) == tracks.end())
+      tracks.insert(std::make_pair(key, new_track(-1)));
+  }
+
+  /**
+   * @brief a revoked partition no longer holds back the watermark, its
+   *        messages in open windows are emitted but not committed here
+   */
+  void revoke_partition(const std::string &topic, int32_t partition) {
+    int64_t wm;
+    {
+      std::lock_guard<std::mutex> guard(track_lock);
+      std::map<partition_key_t, Track>::iterator it =
+          tracks.find(partition_key_t(topic, partition));
+      if (it == tracks.end())
+        return;
+      if (last_track == it)
+        last_track = tracks.end();
+      tracks.erase(it);
+      wm = update_watermark();
+    }
+    maybe_close(wm);
+  }
+
+  /**
+   * @brief close the windows that are due without messages (idle_ms):
+   *        partitions without messages for idle_ms no longer hold back the
+   *        others, without any messages time moves on from the highest
+   *        timestamp seen. Called periodically from the poll loop (one
+   *        thread).
+   */
+  void tick() {
+    int64_t now = steady_ms();
+    if (now - idle_check_ms >= std::max(opts.idle_ms / 10, (int64_t)1)) {
+      idle_check_ms = now;
+      int64_t wm;
+      {
+        std::lock_guard<std::mutex> guard(track_lock);
+        for (std::map<partition_key_t, Track>::iterator it = tracks.begin();
+             it != tracks.end(); ++it) {
+          Track &tr = it->second;
+          if (tr.msg_cnt != tr.tick_msg_cnt) {
+            tr.tick_msg_cnt = tr.msg_cnt;
+            tr.active_ms    = now;
+          } else if (now - tr.active_ms >= opts.idle_ms) {
+            tr.idle = true;
+          }
+        }
+        wm = update_watermark();
+      }
+      maybe_close(wm);
+    }
+
+    if (msg_cnt.load() != idle_msg_cnt) {
+      idle_msg_cnt  = msg_cnt.load();
+      idle_since_ms = now;
+      return;
+    }
+    int64_t idle = now - idle_since_ms;
+    int64_t max  = max_timestamp.load();
+    if (idle >= opts.idle_ms && max != std::numeric_limits<int64_t>::min() &&
+        max + idle - opts.grace_ms >= next_end.load())
+      close(max + idle - opts.grace_ms);
+  }
+
+  /**
+   * @brief close and emit all open windows, e.g. at the end of a replay
+   */
+  void flush() {
+    close(std::numeric_limits<int64_t>::max());
+  }
+
+  size_t get_open_window_cnt() {
+    std::map<int64_t, bool> starts;
+    for (size_t i = 0; i < shard_cnt; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (size_t j = 0; j < shards[i].open.size(); j++)
+        starts[shards[i].open[j]->start] = true;
+    }
+    return starts.size();
+  }
+
+  /**
+   * @returns the keys in open windows (a key counted once per window)
+   */
+  size_t get_open_key_cnt() {
+    size_t n = 0;
+    for (size_t i = 0; i < shard_cnt; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (size_t j = 0; j < shards[i].open.size(); j++)
+        n += shards[i].open[j]->size();
+    }
+    return n;
+  }
+
+  size_t get_memory_bytes() {
+    size_t n = 0;
+    for (size_t i = 0; i < shard_cnt; i++) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (size_t j = 0; j < shards[i].open.size(); j++)
+        n += shards[i].open[j]->memory_bytes();
+      for (size_t j = 0; j < shards[i].spare.size(); j++)
+        n += shards[i].spare[j]->memory_bytes();
+    }
+    return n;
+  }
+
+  uint64_t get_msg_cnt() const {
+    return msg_cnt.load();
+  }
+
+  uint64_t get_late_cnt() const {
+    return late_cnt.load();
+  }
+
+  uint64_t get_no_value_cnt() const {
+    return no_value_cnt.load();
+  }
+
+  uint64_t get_window_cnt() const {
+    return window_cnt.load();
+  }
+
+  uint64_t get_row_cnt() const {
+    return row_cnt.load();
+  }
+
+  int64_t get_emit_us() const {
+    return emit_us.load();
+  }
+};
+
+#endif